@@ -4,6 +4,7 @@
 #include <fstream>
 #include <sstream>
 
+#include <Lang/Bytecode.h>
 #include <Lang/Compiler.h>
 #include <Lang/VM.h>
 
@@ -23,6 +24,44 @@ int main(int argc, char* argv[])
 
         std::string filepath(argv[1]);
 
+        // Anything after the file is an option, -O0 to -O3 picks how much the bytecode gets optimized
+        // --diagnostics prints what the compiler did, eg. which calls it inlined
+        // --no-cache always compiles from source and leaves the compiled copy (the file with a c on the end) alone
+        script::OptimizationLevel level = script::DefaultOptimizationLevel;
+        bool diagnostics = false;
+        bool cache = true;
+
+        for (int i = 2; i < argc; i++)
+        {
+            std::string arg(argv[i]);
+
+            if (arg.size() == 3 && arg.compare(0, 2, "-O") == 0 && arg[2] >= '0' && arg[2] <= '3')
+                level = (script::OptimizationLevel)(arg[2] - '0');
+            else if (arg == "--diagnostics")
+                diagnostics = true;
+            else if (arg == "--no-cache")
+                cache = false;
+        }
+
+        script::DefaultIOInterface io;
+
+        // A compiled script on its own runs straight out of the file
+        if (filepath.size() > 6 && filepath.compare(filepath.size() - 6, 6, ".langc") == 0)
+        {
+            // Functions are made in the heap of the VM that runs them
+            script::VM vm;
+
+            script::ObjFunction* function = script::LoadPrecompiledScript(&io, filepath);
+
+            if (function == nullptr)
+            {
+                printf("Failed to load compiled script: %s\n", filepath.c_str());
+                return 1;
+            }
+
+            return vm.Interpret(function) == script::INTERPRET_RUNTIME_ERROR ? 1 : 0;
+        }
+
         std::ifstream file(filepath);
 
         if (!file.is_open())
@@ -42,7 +81,13 @@ int main(int argc, char* argv[])
             return 1;
         }
 
-        script::ObjFunction* compiledFunction = script::CompileScript(src);
+        script::VMCreateInfo createInfo{};
+
+        script::VM vm(createInfo);
+
+        script::ObjFunction* compiledFunction = cache ?
+            script::LoadOrCompileScript(&io, filepath + "c", src, level, diagnostics) :
+            script::CompileScript(src, level, diagnostics);
 
         if (compiledFunction == nullptr)
         {
@@ -50,10 +95,6 @@ int main(int argc, char* argv[])
             return 1;
         }
 
-        script::VMCreateInfo createInfo{};
-
-        script::VM vm(createInfo);
-        
         script::InterpretResult result = vm.Interpret(compiledFunction);
 
         if (result == script::INTERPRET_RUNTIME_ERROR)
@@ -0,0 +1,249 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+// A tiny x86-64 assembler shared by the baseline JIT and the trace compiler
+// Only the instructions they use are here
+
+namespace script
+{
+	namespace x64
+	{
+		// offsetof isn't allowed on classes with virtual functions so work it out from a member pointer
+		template<typename Class, typename Member>
+		int32_t MemberOffset(Member Class::* member)
+		{
+			alignas(Class) static char storage[sizeof(Class)];
+
+			Class* object = reinterpret_cast<Class*>(storage);
+			return (int32_t)(reinterpret_cast<char*>(&(object->*member)) - storage);
+		}
+
+		// Copies finished code into its own pages and makes them executable, returns nullptr if that fails
+		uint8_t* MapExecutable(const std::vector<uint8_t>& code, size_t* size);
+		void UnmapExecutable(uint8_t* code, size_t size);
+
+		enum Register : uint8_t
+		{
+			RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+			R8, R9, R10, R11, R12, R13, R14, R15
+		};
+
+		// Condition codes used by jcc and setcc
+		enum Condition : uint8_t
+		{
+			CC_B = 0x2,
+			CC_AE = 0x3,
+			CC_E = 0x4,
+			CC_NE = 0x5,
+			CC_BE = 0x6,
+			CC_A = 0x7,
+			CC_P = 0xA,
+			CC_NP = 0xB,
+			CC_LE = 0xE
+		};
+
+		// Just enough of an x86-64 assembler for the JIT
+		class Assembler
+		{
+		public:
+
+			std::vector<uint8_t> code;
+
+			int NewLabel()
+			{
+				m_Labels.push_back(-1);
+				return (int)m_Labels.size() - 1;
+			}
+
+			void Bind(int label) { m_Labels[label] = (int32_t)code.size(); }
+			int32_t GetLabel(int label) const { return m_Labels[label]; }
+
+			void Byte(uint8_t b) { code.push_back(b); }
+
+			void Int32(int32_t v)
+			{
+				for (int i = 0; i < 4; i++)
+					Byte((uint8_t)((uint32_t)v >> (i * 8)));
+			}
+
+			void Int64(uint64_t v)
+			{
+				for (int i = 0; i < 8; i++)
+					Byte((uint8_t)(v >> (i * 8)));
+			}
+
+			// mov reg, imm
+			void MovImm(Register reg, uint64_t imm)
+			{
+				if (imm <= UINT32_MAX)
+				{
+					// The 32 bit move zero extends and is half the size
+					if (reg & 8)
+						Byte(0x41);
+
+					Byte(0xB8 + (reg & 7));
+					Int32((int32_t)imm);
+					return;
+				}
+
+				Rex(true, 0, reg);
+				Byte(0xB8 + (reg & 7));
+				Int64(imm);
+			}
+
+			// mov dst, [base + disp]
+			void Load(Register dst, Register base, int32_t disp) { Rex(true, dst, base); Byte(0x8B); Mem(dst, base, disp); }
+			// mov [base + disp], src
+			void Store(Register base, int32_t disp, Register src) { Rex(true, src, base); Byte(0x89); Mem(src, base, disp); }
+			// lea dst, [base + disp]
+			void Lea(Register dst, Register base, int32_t disp) { Rex(true, dst, base); Byte(0x8D); Mem(dst, base, disp); }
+
+			void Mov(Register dst, Register src) { Rex(true, src, dst); Byte(0x89); Direct(src, dst); }
+			void Add(Register dst, Register src) { Rex(true, src, dst); Byte(0x01); Direct(src, dst); }
+			void Sub(Register dst, Register src) { Rex(true, src, dst); Byte(0x29); Direct(src, dst); }
+			void And(Register dst, Register src) { Rex(true, src, dst); Byte(0x21); Direct(src, dst); }
+			void Cmp(Register a, Register b) { Rex(true, b, a); Byte(0x39); Direct(b, a); }
+			void Test(Register a, Register b) { Rex(true, b, a); Byte(0x85); Direct(b, a); }
+
+			void AddImm(Register reg, int32_t imm) { Rex(true, 0, reg); Byte(0x81); Direct(0, reg); Int32(imm); }
+			void CmpImm(Register reg, int32_t imm) { Rex(true, 0, reg); Byte(0x81); Direct(7, reg); Int32(imm); }
+			void CmpImm8(Register reg, int8_t imm) { Rex(true, 0, reg); Byte(0x83); Direct(7, reg); Byte((uint8_t)imm); }
+			void OrImm8(Register reg, int8_t imm) { Rex(true, 0, reg); Byte(0x83); Direct(1, reg); Byte((uint8_t)imm); }
+			void XorImm8(Register reg, int8_t imm) { Rex(true, 0, reg); Byte(0x83); Direct(6, reg); Byte((uint8_t)imm); }
+			void ImulImm8(Register dst, Register src, int8_t imm) { Rex(true, dst, src); Byte(0x6B); Direct(dst, src); Byte((uint8_t)imm); }
+
+			// add dst, [base + disp] and cmp reg, [base + disp]
+			void AddMem(Register dst, Register base, int32_t disp) { Rex(true, dst, base); Byte(0x03); Mem(dst, base, disp); }
+			void CmpMem(Register reg, Register base, int32_t disp) { Rex(true, reg, base); Byte(0x3B); Mem(reg, base, disp); }
+
+			// mov dst, [base + index * 8] and mov [base + index * 8], src
+			void LoadIndexed(Register dst, Register base, Register index) { RexIndexed(dst, base, index); Byte(0x8B); Indexed(dst, base, index); }
+			void StoreIndexed(Register base, Register index, Register src) { RexIndexed(src, base, index); Byte(0x89); Indexed(src, base, index); }
+
+			// cmp dword [base + disp], imm8 and add dword [base + disp], imm8
+			void CmpMem32Imm8(Register base, int32_t disp, int8_t imm) { Rex(false, 0, base); Byte(0x83); Mem(7, base, disp); Byte((uint8_t)imm); }
+			void AddMem32Imm8(Register base, int32_t disp, int8_t imm) { Rex(false, 0, base); Byte(0x83); Mem(0, base, disp); Byte((uint8_t)imm); }
+
+			// cmp qword [base + disp], imm8
+			void CmpMemImm8(Register base, int32_t disp, int8_t imm) { Rex(true, 0, base); Byte(0x83); Mem(7, base, disp); Byte((uint8_t)imm); }
+
+			// cmp eax, imm8
+			void CmpEaxImm8(int8_t imm) { Byte(0x83); Direct(7, RAX); Byte((uint8_t)imm); }
+
+			// Flips a bit, used to negate doubles
+			void BtcImm(Register reg, uint8_t bit) { Rex(true, 0, reg); Byte(0x0F); Byte(0xBA); Direct(7, reg); Byte(bit); }
+
+			// movq xmm, reg and movq reg, xmm
+			void MovqToXmm(uint8_t xmm, Register src) { Byte(0x66); Rex(true, xmm, src); Byte(0x0F); Byte(0x6E); Direct(xmm, src); }
+			void MovqFromXmm(Register dst, uint8_t xmm) { Byte(0x66); Rex(true, xmm, dst); Byte(0x0F); Byte(0x7E); Direct(xmm, dst); }
+
+			// Scalar double ops, addsd is 0x58, mulsd 0x59, subsd 0x5C and divsd 0x5E
+			void Sse(uint8_t op, uint8_t dst, uint8_t src) { Byte(0xF2); Rex(false, dst, src); Byte(0x0F); Byte(op); Direct(dst, src); }
+			void Ucomisd(uint8_t a, uint8_t b) { Byte(0x66); Rex(false, a, b); Byte(0x0F); Byte(0x2E); Direct(a, b); }
+			void Movaps(uint8_t dst, uint8_t src) { Rex(false, dst, src); Byte(0x0F); Byte(0x28); Direct(dst, src); }
+
+			// Truncating double to integer and back
+			void Cvttsd2si(Register dst, uint8_t xmm) { Byte(0xF2); Rex(true, dst, xmm); Byte(0x0F); Byte(0x2C); Direct(dst, xmm); }
+			void Cvtsi2sd(uint8_t xmm, Register src) { Byte(0xF2); Rex(true, xmm, src); Byte(0x0F); Byte(0x2A); Direct(xmm, src); }
+
+			// movq xmm, [base + disp] and movq [base + disp], xmm
+			void LoadXmm(uint8_t xmm, Register base, int32_t disp) { Byte(0xF3); Rex(false, xmm, base); Byte(0x0F); Byte(0x7E); Mem(xmm, base, disp); }
+			void StoreXmm(Register base, int32_t disp, uint8_t xmm) { Byte(0x66); Rex(false, xmm, base); Byte(0x0F); Byte(0xD6); Mem(xmm, base, disp); }
+
+			// These only work with the low byte registers al, cl, dl and bl
+			void Setcc(Condition cc, Register reg) { Byte(0x0F); Byte(0x90 | cc); Direct(0, reg); }
+			void And8(Register dst, Register src) { Byte(0x20); Direct(src, dst); }
+			void Or8(Register dst, Register src) { Byte(0x08); Direct(src, dst); }
+			void Movzx8(Register dst, Register src) { Byte(0x0F); Byte(0xB6); Direct(dst, src); }
+
+			void Push(Register reg) { if (reg & 8) Byte(0x41); Byte(0x50 + (reg & 7)); }
+			void Pop(Register reg) { if (reg & 8) Byte(0x41); Byte(0x58 + (reg & 7)); }
+			void Ret() { Byte(0xC3); }
+
+			void CallReg(Register reg) { if (reg & 8) Byte(0x41); Byte(0xFF); Direct(2, reg); }
+			void JmpReg(Register reg) { if (reg & 8) Byte(0x41); Byte(0xFF); Direct(4, reg); }
+
+			void Jmp(int label)
+			{
+				Byte(0xE9);
+				Fixup(label);
+			}
+
+			void Jcc(Condition cc, int label)
+			{
+				Byte(0x0F);
+				Byte(0x80 | cc);
+				Fixup(label);
+			}
+
+
+			// Fills in all of the jumps, returns false if one of them goes to a label that was never bound
+			bool Link()
+			{
+				for (auto& [position, label] : m_Fixups)
+				{
+					if (m_Labels[label] < 0)
+						return false;
+
+					int32_t rel = m_Labels[label] - (int32_t)(position + 4);
+					memcpy(&code[position], &rel, sizeof(rel));
+				}
+
+				return true;
+			}
+
+		private:
+
+			void Rex(bool wide, uint8_t reg, uint8_t rm)
+			{
+				uint8_t rex = 0x40 | (wide ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) | ((rm & 8) ? 0x01 : 0);
+
+				if (rex != 0x40)
+					Byte(rex);
+			}
+
+			void Direct(uint8_t reg, uint8_t rm) { Byte(0xC0 | ((reg & 7) << 3) | (rm & 7)); }
+
+			void RexIndexed(uint8_t reg, uint8_t base, uint8_t index)
+			{
+				Byte(0x48 | ((reg & 8) ? 0x04 : 0) | ((index & 8) ? 0x02 : 0) | ((base & 8) ? 0x01 : 0));
+			}
+
+			// Always uses an 8 bit displacement so rbp and r13 work as the base
+			void Indexed(uint8_t reg, uint8_t base, uint8_t index)
+			{
+				Byte(0x44 | ((reg & 7) << 3));
+				Byte(0xC0 | ((index & 7) << 3) | (base & 7));
+				Byte(0);
+			}
+
+			void Mem(uint8_t reg, uint8_t base, int32_t disp)
+			{
+				bool shortDisp = disp >= INT8_MIN && disp <= INT8_MAX;
+
+				Byte((shortDisp ? 0x40 : 0x80) | ((reg & 7) << 3) | (base & 7));
+
+				// rsp and r12 need a SIB byte
+				if ((base & 7) == RSP)
+					Byte(0x24);
+
+				if (shortDisp)
+					Byte((uint8_t)disp);
+				else
+					Int32(disp);
+			}
+
+			void Fixup(int label)
+			{
+				m_Fixups.push_back({ code.size(), label });
+				Int32(0);
+			}
+
+			std::vector<int32_t> m_Labels;
+			std::vector<std::pair<size_t, int>> m_Fixups;
+		};
+	}
+}
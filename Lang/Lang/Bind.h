@@ -0,0 +1,200 @@
+#pragma once
+#include "VM.h"
+
+#include <string>
+#include <type_traits>
+#include <utility>
+
+// Binds plain C++ functions as natives
+// The signature is worked out at compile time and every function gets its own thunk which checks the
+// arguments, unboxes them, makes the call and boxes the result. Nothing is allocated per function and
+// the thunk is an ordinary NativeFn so calling it costs the same as a hand written native.
+//
+//     NativeBinder maths(vm, mdl);
+//     maths.Bind<&Hypot>("hypot");
+
+namespace script
+{
+	// How a C++ type gets in and out of a Value
+	// Check is the type guard, Unbox is only called once it has passed
+	template<typename T, typename = void>
+	struct NativeType;
+
+	template<typename T>
+	struct NativeType<T, std::enable_if_t<std::is_arithmetic_v<T>>>
+	{
+		static constexpr const char* name = "a number";
+
+		static bool Check(Value value) { return value.IsNumber(); }
+		static T Unbox(Value value) { return (T)value.ToNumber(); }
+		static Value Box(T value) { return Value((double)value); }
+	};
+
+	template<>
+	struct NativeType<bool>
+	{
+		static constexpr const char* name = "a bool";
+
+		static bool Check(Value value) { return value.IsBool(); }
+		static bool Unbox(Value value) { return value.AsBool(); }
+		static Value Box(bool value) { return Value(value); }
+	};
+
+	template<>
+	struct NativeType<Value>
+	{
+		static constexpr const char* name = "a value";
+
+		static bool Check(Value value) { return true; }
+		static Value Unbox(Value value) { return value; }
+		static Value Box(Value value) { return value; }
+	};
+
+	template<>
+	struct NativeType<ObjString*>
+	{
+		static constexpr const char* name = "a string";
+
+		static bool Check(Value value) { return value.IsObjType(OBJ_STRING); }
+		static ObjString* Unbox(Value value) { return (ObjString*)value.ToObject(); }
+		static Value Box(ObjString* value) { return Value((Object*)value); }
+	};
+
+	template<>
+	struct NativeType<const char*>
+	{
+		static constexpr const char* name = "a string";
+
+		static bool Check(Value value) { return value.IsObjType(OBJ_STRING); }
+		static const char* Unbox(Value value) { return ((ObjString*)value.ToObject())->str; }
+		static Value Box(const char* value) { return Value(CurrentHeap().AllocateString(value)); }
+	};
+
+	template<>
+	struct NativeType<std::string>
+	{
+		static constexpr const char* name = "a string";
+
+		static bool Check(Value value) { return value.IsObjType(OBJ_STRING); }
+		static std::string Unbox(Value value) { return ((ObjString*)value.ToObject())->str; }
+		static Value Box(const std::string& value) { return Value(CurrentHeap().AllocateString(value)); }
+	};
+
+	template<>
+	struct NativeType<ObjArray*>
+	{
+		static constexpr const char* name = "a list";
+
+		static bool Check(Value value) { return value.IsObjType(OBJ_ARRAY); }
+		static ObjArray* Unbox(Value value) { return (ObjArray*)value.ToObject(); }
+		static Value Box(ObjArray* value) { return Value((Object*)value); }
+	};
+
+	template<>
+	struct NativeType<ObjFunction*>
+	{
+		static constexpr const char* name = "a function";
+
+		static bool Check(Value value) { return value.IsObjType(OBJ_FUNCTION); }
+		static ObjFunction* Unbox(Value value) { return (ObjFunction*)value.ToObject(); }
+		static Value Box(ObjFunction* value) { return Value((Object*)value); }
+	};
+
+	// Parameters like const std::string& use the plain type
+	template<typename T>
+	using NativeTypeOf = NativeType<std::remove_cv_t<std::remove_reference_t<T>>>;
+
+	template<auto Function>
+	struct NativeThunk;
+
+	template<typename R, typename... Args, R(*Function)(Args...)>
+	struct NativeThunk<Function>
+	{
+		static constexpr int arity = (int)sizeof...(Args);
+
+		// The context is the VM, it is only needed to report a bad call
+		static Value Call(void* context, int argCount, Value* args)
+		{
+			return Call(context, argCount, args, std::index_sequence_for<Args...>{});
+		}
+
+	private:
+
+		template<size_t... I>
+		static Value Call(void* context, int argCount, Value* args, std::index_sequence<I...>)
+		{
+			if (argCount != arity || !(NativeTypeOf<Args>::Check(args[I]) && ...))
+				return BadCall(context, argCount, args);
+
+			if constexpr (std::is_void_v<R>)
+			{
+				Function(NativeTypeOf<Args>::Unbox(args[I])...);
+				return Value();
+			}
+			else
+			{
+				return NativeTypeOf<R>::Box(Function(NativeTypeOf<Args>::Unbox(args[I])...));
+			}
+		}
+
+		// Only runs once a guard has failed so it can take its time working out what was wrong
+		static Value BadCall(void* context, int argCount, Value* args)
+		{
+			VM* vm = (VM*)context;
+
+			if (argCount != arity)
+			{
+				vm->NativeError("Expected " + std::to_string(arity) + " arguments but got " + std::to_string(argCount));
+				return Value();
+			}
+
+			if constexpr (arity > 0)
+			{
+				const char* names[] = { NativeTypeOf<Args>::name... };
+				bool (*checks[])(Value) = { &NativeTypeOf<Args>::Check... };
+
+				for (int i = 0; i < arity; i++)
+				{
+					if (!checks[i](args[i]))
+					{
+						vm->NativeError("Expected argument " + std::to_string(i + 1) + " to be " + names[i]);
+						break;
+					}
+				}
+			}
+
+			return Value();
+		}
+	};
+
+	// Registers natives into a module, or straight into the VM's globals when there isn't one
+	// so a library can be loaded either way without listing everything twice
+	class NativeBinder
+	{
+	public:
+
+		NativeBinder(VM* vm, ObjModule* module = nullptr) : m_VM(vm), m_Module(module) {}
+
+		template<auto Function>
+		NativeBinder& Bind(const std::string& name)
+		{
+			return Add(name, &NativeThunk<Function>::Call, NativeThunk<Function>::arity, m_VM);
+		}
+
+		// For natives that work on the raw arguments
+		NativeBinder& Add(const std::string& name, NativeFn function, int arity, void* context = nullptr)
+		{
+			if (m_Module)
+				m_Module->AddNativeFunction(name, function, arity, context);
+			else
+				m_VM->AddNativeFunction(name, function, arity, context);
+
+			return *this;
+		}
+
+	private:
+
+		VM* m_VM = nullptr;
+		ObjModule* m_Module = nullptr;
+	};
+}
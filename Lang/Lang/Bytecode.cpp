@@ -0,0 +1,843 @@
+#include "Bytecode.h"
+#include "Compiler.h"
+#include "Memory.h"
+
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace script
+{
+#define OPCODE(name, operands) + 1
+
+	constexpr uint32_t OpCodeCount = 0
+#include "OpCodes.h"
+		;
+
+#undef OPCODE
+
+	constexpr char BytecodeMagic[] = { 'L', 'A', 'N', 'G', 'C' };
+
+	// Magic, version, instruction set, level, source hash and payload hash
+	constexpr size_t HeaderSize = sizeof(BytecodeMagic) + 4 + 8 + 1 + 8 + 8;
+
+	enum ConstantTag
+	{
+		CONSTANT_NIL,
+		CONSTANT_FALSE,
+		CONSTANT_TRUE,
+		CONSTANT_NUMBER,
+		CONSTANT_STRING,
+		CONSTANT_FUNCTION
+	};
+
+	constexpr uint32_t NoName = UINT32_MAX;
+
+	// FNV-1a
+	static uint64_t Hash(const uint8_t* data, size_t size, uint64_t hash = 14695981039346656037ull)
+	{
+		for (size_t i = 0; i < size; i++)
+		{
+			hash ^= data[i];
+			hash *= 1099511628211ull;
+		}
+
+		return hash;
+	}
+
+	// Any change to the opcodes or their operands changes this, so old images just stop loading
+	static uint64_t InstructionSetHash()
+	{
+		static const uint64_t hash = []()
+		{
+			uint64_t hash = Hash(nullptr, 0);
+
+			for (uint32_t op = 0; op < OpCodeCount; op++)
+			{
+				const char* name = GetOpCodeName((uint8_t)op);
+				uint8_t length = (uint8_t)GetInstructionLength((uint8_t)op);
+
+				hash = Hash((const uint8_t*)name, strlen(name), hash);
+				hash = Hash(&length, 1, hash);
+			}
+
+			return hash;
+		}();
+
+		return hash;
+	}
+
+	uint64_t HashSource(const std::string& source)
+	{
+		return Hash((const uint8_t*)source.data(), source.size());
+	}
+
+	static void WriteU8(std::string& out, uint8_t value)
+	{
+		out.push_back((char)value);
+	}
+
+	static void WriteU32(std::string& out, uint32_t value)
+	{
+		for (int i = 0; i < 4; i++)
+			out.push_back((char)(value >> (i * 8)));
+	}
+
+	static void WriteU64(std::string& out, uint64_t value)
+	{
+		for (int i = 0; i < 8; i++)
+			out.push_back((char)(value >> (i * 8)));
+	}
+
+	class BytecodeWriter
+	{
+	public:
+
+		bool Write(ObjFunction* script)
+		{
+			AddFunction(script);
+
+			// Functions found in the constants get added on the end as we go
+			for (size_t i = 0; i < m_Functions.size(); i++)
+			{
+				ObjFunction* function = m_Functions[i];
+
+				if (function->globals)
+					return false;
+
+				m_FunctionOffsets.push_back((uint32_t)m_FunctionData.size());
+
+				Chunk& chunk = function->chunk;
+
+				WriteU32(m_FunctionData, function->name ? AddString(function->name) : NoName);
+				WriteU32(m_FunctionData, (uint32_t)function->arity);
+				WriteU32(m_FunctionData, (uint32_t)chunk.code.size());
+				WriteU32(m_FunctionData, (uint32_t)chunk.propertyCaches.size());
+				WriteU32(m_FunctionData, (uint32_t)chunk.constants.size());
+
+				m_FunctionData.append((const char*)chunk.code.data(), chunk.code.size());
+
+				for (Value& constant : chunk.constants)
+				{
+					if (!WriteConstant(m_FunctionData, constant))
+						return false;
+				}
+			}
+
+			return true;
+		}
+
+		// Tables, strings then functions
+		bool WritePayload(std::string& out)
+		{
+			uint64_t tables = 8 + 4 * ((uint64_t)m_StringOffsets.size() + m_FunctionOffsets.size());
+			uint64_t end = HeaderSize + tables + m_StringData.size() + m_FunctionData.size();
+
+			// Offsets are only 32 bits
+			if (end > UINT32_MAX)
+				return false;
+
+			uint32_t strings = (uint32_t)(HeaderSize + tables);
+			uint32_t functions = strings + (uint32_t)m_StringData.size();
+
+			WriteU32(out, (uint32_t)m_StringOffsets.size());
+			WriteU32(out, (uint32_t)m_FunctionOffsets.size());
+
+			for (uint32_t offset : m_StringOffsets)
+				WriteU32(out, strings + offset);
+
+			for (uint32_t offset : m_FunctionOffsets)
+				WriteU32(out, functions + offset);
+
+			out += m_StringData;
+			out += m_FunctionData;
+
+			return true;
+		}
+
+	private:
+
+		bool WriteConstant(std::string& out, Value& constant)
+		{
+			if (constant.IsNumber())
+			{
+				double number = constant.ToNumber();
+				uint64_t bits;
+				memcpy(&bits, &number, sizeof(bits));
+
+				WriteU8(out, CONSTANT_NUMBER);
+				WriteU64(out, bits);
+			}
+			else if (constant.IsNil())
+			{
+				WriteU8(out, CONSTANT_NIL);
+			}
+			else if (constant.IsBool())
+			{
+				WriteU8(out, constant.AsBool() ? CONSTANT_TRUE : CONSTANT_FALSE);
+			}
+			else if (constant.IsObjType(OBJ_STRING))
+			{
+				WriteU8(out, CONSTANT_STRING);
+				WriteU32(out, AddString((ObjString*)constant.ToObject()));
+			}
+			else if (constant.IsObjType(OBJ_FUNCTION))
+			{
+				WriteU8(out, CONSTANT_FUNCTION);
+				WriteU32(out, AddFunction((ObjFunction*)constant.ToObject()));
+			}
+			else
+			{
+				// Nothing else comes out of the compiler
+				return false;
+			}
+
+			return true;
+		}
+
+		// Inlined functions show up in the constants of the script and every function that calls them,
+		// they have to come back as the same object for INLINE_GUARD to still match
+		uint32_t AddFunction(ObjFunction* function)
+		{
+			auto it = m_FunctionIndices.find(function);
+			if (it != m_FunctionIndices.end())
+				return it->second;
+
+			uint32_t index = (uint32_t)m_Functions.size();
+			m_FunctionIndices[function] = index;
+			m_Functions.push_back(function);
+
+			return index;
+		}
+
+		uint32_t AddString(ObjString* string)
+		{
+			auto it = m_StringIndices.find(string);
+			if (it != m_StringIndices.end())
+				return it->second;
+
+			uint32_t index = (uint32_t)m_StringOffsets.size();
+			m_StringIndices[string] = index;
+			m_StringOffsets.push_back((uint32_t)m_StringData.size());
+
+			// The length of a string counts the terminator, it gets added back when the string is allocated again
+			size_t length = string->length ? string->length - 1 : 0;
+
+			WriteU32(m_StringData, (uint32_t)length);
+			m_StringData.append(string->str, length);
+
+			return index;
+		}
+
+		std::vector<ObjFunction*> m_Functions;
+		std::unordered_map<ObjFunction*, uint32_t> m_FunctionIndices;
+		std::unordered_map<ObjString*, uint32_t> m_StringIndices;
+
+		// Offsets from the start of their section
+		std::vector<uint32_t> m_StringOffsets;
+		std::vector<uint32_t> m_FunctionOffsets;
+
+		std::string m_StringData;
+		std::string m_FunctionData;
+	};
+
+	bool WriteBytecode(ObjFunction* function, uint64_t sourceHash, OptimizationLevel level, std::string& image)
+	{
+		BytecodeWriter writer;
+
+		std::string payload;
+		if (!writer.Write(function) || !writer.WritePayload(payload))
+			return false;
+
+		image.clear();
+		image.reserve(HeaderSize + payload.size());
+
+		image.append(BytecodeMagic, sizeof(BytecodeMagic));
+		WriteU32(image, BytecodeVersion);
+		WriteU64(image, InstructionSetHash());
+		WriteU8(image, (uint8_t)level);
+		WriteU64(image, sourceHash);
+		WriteU64(image, Hash((const uint8_t*)payload.data(), payload.size()));
+
+		image += payload;
+
+		return true;
+	}
+
+	// Every read checks it stays inside the image, once anything fails the rest just return 0
+	class BytecodeReader
+	{
+	public:
+
+		BytecodeReader(const uint8_t* data, size_t size, size_t offset = 0)
+			: m_Data(data), m_Size(size), m_Offset(offset), m_Failed(offset > size)
+		{
+		}
+
+		uint8_t ReadU8()
+		{
+			if (!Has(1))
+				return 0;
+
+			return m_Data[m_Offset++];
+		}
+
+		uint32_t ReadU32()
+		{
+			if (!Has(4))
+				return 0;
+
+			uint32_t value = 0;
+			for (int i = 0; i < 4; i++)
+				value |= (uint32_t)m_Data[m_Offset++] << (i * 8);
+
+			return value;
+		}
+
+		uint64_t ReadU64()
+		{
+			if (!Has(8))
+				return 0;
+
+			uint64_t value = 0;
+			for (int i = 0; i < 8; i++)
+				value |= (uint64_t)m_Data[m_Offset++] << (i * 8);
+
+			return value;
+		}
+
+		const uint8_t* ReadBytes(size_t count)
+		{
+			if (!Has(count))
+				return nullptr;
+
+			const uint8_t* bytes = m_Data + m_Offset;
+			m_Offset += count;
+
+			return bytes;
+		}
+
+		bool Failed() const { return m_Failed; }
+
+	private:
+
+		bool Has(size_t count)
+		{
+			if (m_Failed || m_Size - m_Offset < count)
+			{
+				m_Failed = true;
+				return false;
+			}
+
+			return true;
+		}
+
+		const uint8_t* m_Data;
+		size_t m_Size;
+		size_t m_Offset;
+		bool m_Failed;
+	};
+
+	// Walks the instructions so a damaged image can't send the VM off the end of the code
+	// Compiled code never has quickened instructions, those could deoptimize by writing to a mapping
+	static bool ValidCode(const CodeBuffer& code)
+	{
+		size_t offset = 0;
+
+		while (offset < code.size())
+		{
+			if (code[offset] >= OpCodeCount || IsQuickened(code[offset]))
+				return false;
+
+			offset += GetInstructionLength(code[offset]);
+		}
+
+		return offset == code.size();
+	}
+
+
+	BytecodeImage::BytecodeImage(std::shared_ptr<MappedFile> file)
+		: m_File(std::move(file)), m_Data(m_File->Data()), m_Size(m_File->Size())
+	{
+	}
+
+	BytecodeImage::BytecodeImage(std::string bytes)
+		: m_Bytes(std::move(bytes)), m_Data((const uint8_t*)m_Bytes.data()), m_Size(m_Bytes.size())
+	{
+	}
+
+	BytecodeImage::BytecodeImage(const uint8_t* data, size_t size)
+		: m_Data(data), m_Size(size)
+	{
+	}
+
+	bool BytecodeImage::Open(const uint64_t* sourceHash, OptimizationLevel level)
+	{
+		if (m_Size < HeaderSize || memcmp(m_Data, BytecodeMagic, sizeof(BytecodeMagic)) != 0)
+			return false;
+
+		BytecodeReader reader(m_Data, m_Size, sizeof(BytecodeMagic));
+
+		if (reader.ReadU32() != BytecodeVersion || reader.ReadU64() != InstructionSetHash())
+			return false;
+
+		uint8_t imageLevel = reader.ReadU8();
+		uint64_t imageSource = reader.ReadU64();
+
+		if (sourceHash && (imageLevel != (uint8_t)level || imageSource != *sourceHash))
+			return false;
+
+		uint64_t payloadHash = reader.ReadU64();
+
+		// Mapped images too, functions only get read on their first call and by then there's no going back to the source
+		// Reading the pages doesn't stop them being shared
+		if (payloadHash != Hash(m_Data + HeaderSize, m_Size - HeaderSize))
+			return false;
+
+		m_StringCount = reader.ReadU32();
+		m_FunctionCount = reader.ReadU32();
+
+		if (reader.Failed() || m_FunctionCount == 0)
+			return false;
+
+		// Both tables have to fit, each entry gets checked when it's used
+		return (uint64_t)HeaderSize + 8 + 4 * ((uint64_t)m_StringCount + m_FunctionCount) <= m_Size;
+	}
+
+	size_t BytecodeImage::StringOffset(uint32_t index) const
+	{
+		BytecodeReader reader(m_Data, m_Size, HeaderSize + 8 + 4 * (size_t)index);
+		return index < m_StringCount ? reader.ReadU32() : m_Size + 1;
+	}
+
+	size_t BytecodeImage::FunctionOffset(uint32_t index) const
+	{
+		BytecodeReader reader(m_Data, m_Size, HeaderSize + 8 + 4 * ((size_t)m_StringCount + index));
+		return index < m_FunctionCount ? reader.ReadU32() : m_Size + 1;
+	}
+
+	LoadedImage::LoadedImage(std::shared_ptr<const BytecodeImage> image, bool runInPlace)
+		: m_Image(std::move(image)), m_RunInPlace(runInPlace && m_Image->File())
+	{
+		m_Functions.assign(m_Image->FunctionCount(), nullptr);
+	}
+
+	ObjString* LoadedImage::GetString(uint32_t index)
+	{
+		BytecodeReader reader(m_Image->Data(), m_Image->Size(), m_Image->StringOffset(index));
+
+		uint32_t length = reader.ReadU32();
+		const uint8_t* bytes = reader.ReadBytes(length);
+
+		if (!bytes)
+			return nullptr;
+
+		return CurrentHeap().AllocateString(std::string((const char*)bytes, length));
+	}
+
+	ObjFunction* LoadedImage::GetFunction(uint32_t index)
+	{
+		if (index >= m_Functions.size())
+			return nullptr;
+
+		if (m_Functions[index])
+			return m_Functions[index];
+
+		BytecodeReader reader(m_Image->Data(), m_Image->Size(), m_Image->FunctionOffset(index));
+
+		uint32_t name = reader.ReadU32();
+		uint32_t arity = reader.ReadU32();
+		uint32_t codeLength = reader.ReadU32();
+
+		// Property caches and constants, those wait for the first call
+		reader.ReadU32();
+		reader.ReadU32();
+
+		const uint8_t* code = reader.ReadBytes(codeLength);
+
+		if (!code)
+			return nullptr;
+
+		ObjString* nameString = nullptr;
+
+		if (name != NoName && !(nameString = GetString(name)))
+			return nullptr;
+
+		ObjFunction* function = NewFunction();
+		function->name = nameString;
+		function->arity = (int)arity;
+
+		function->image = shared_from_this();
+		function->imageIndex = index;
+		function->lazy = true;
+
+		m_Functions[index] = function;
+
+		return function;
+	}
+
+	bool LoadedImage::Load(ObjFunction* function)
+	{
+		if (!function->lazy)
+			return true;
+
+		Chunk& chunk = function->chunk;
+
+		BytecodeReader reader(m_Image->Data(), m_Image->Size(), m_Image->FunctionOffset(function->imageIndex));
+
+		// Name and arity were read when the function was made
+		reader.ReadU32();
+		reader.ReadU32();
+		uint32_t codeLength = reader.ReadU32();
+
+		uint32_t propertyCaches = reader.ReadU32();
+		uint32_t constantCount = reader.ReadU32();
+
+		const uint8_t* code = reader.ReadBytes(codeLength);
+
+		if (!code)
+			return false;
+
+		if (m_RunInPlace)
+			chunk.code.View(code, codeLength);
+		else
+			chunk.code = std::vector<uint8_t>(code, code + codeLength);
+
+		if (!ValidCode(chunk.code))
+			return false;
+
+		// Worked out again rather than stored, a damaged image can't make the stack too small
+		function->maxStack = (uint32_t)FindMaxStack(chunk.code, function->arity + 1);
+
+		std::vector<Value> constants;
+		constants.reserve(constantCount);
+
+		for (uint32_t i = 0; i < constantCount; i++)
+		{
+			switch (reader.ReadU8())
+			{
+			case CONSTANT_NIL:
+				constants.push_back(Value());
+				break;
+			case CONSTANT_FALSE:
+				constants.push_back(Value(false));
+				break;
+			case CONSTANT_TRUE:
+				constants.push_back(Value(true));
+				break;
+			case CONSTANT_NUMBER:
+			{
+				uint64_t bits = reader.ReadU64();
+				double number;
+				memcpy(&number, &bits, sizeof(number));
+
+				constants.push_back(Value(number));
+				break;
+			}
+			case CONSTANT_STRING:
+			{
+				ObjString* string = GetString(reader.ReadU32());
+				if (!string)
+					return false;
+
+				constants.push_back(Value(string));
+				break;
+			}
+			case CONSTANT_FUNCTION:
+			{
+				ObjFunction* nested = GetFunction(reader.ReadU32());
+				if (!nested)
+					return false;
+
+				constants.push_back(Value(nested));
+				break;
+			}
+			default:
+				return false;
+			}
+
+			if (reader.Failed())
+				return false;
+		}
+
+		chunk.constants = std::move(constants);
+		chunk.propertyCaches.resize(propertyCaches);
+
+		function->lazy = false;
+
+		// Linking got put off until now, the names weren't there yet
+		GlobalTable* globals = function->globals;
+		function->globals = nullptr;
+
+		if (globals)
+			LinkFunction(function, globals);
+
+		return true;
+	}
+
+	void LoadedImage::Forget(ObjFunction* function)
+	{
+		if (function->imageIndex < m_Functions.size() && m_Functions[function->imageIndex] == function)
+			m_Functions[function->imageIndex] = nullptr;
+	}
+
+	ObjFunction* InstantiateImage(std::shared_ptr<const BytecodeImage> image)
+	{
+		if (!image)
+			return nullptr;
+
+		return std::make_shared<LoadedImage>(std::move(image), false)->GetFunction(0);
+	}
+
+	// A nullptr hash takes images made from any source at any level
+	static ObjFunction* ReadImage(const uint8_t* data, size_t size, const uint64_t* sourceHash, OptimizationLevel level)
+	{
+		// Only has to last while everything gets loaded
+		std::shared_ptr<BytecodeImage> image = std::make_shared<BytecodeImage>(data, size);
+
+		if (!image->Open(sourceHash, level))
+			return nullptr;
+
+		std::shared_ptr<LoadedImage> loaded = std::make_shared<LoadedImage>(image, false);
+		std::vector<ObjFunction*> functions(image->FunctionCount());
+
+		for (uint32_t i = 0; i < image->FunctionCount(); i++)
+		{
+			functions[i] = loaded->GetFunction(i);
+
+			if (!functions[i] || !loaded->Load(functions[i]))
+				return nullptr;
+		}
+
+		// Everything got copied out, so they don't need the image anymore
+		for (ObjFunction* function : functions)
+			function->image.reset();
+
+		return functions[0];
+	}
+
+	static ObjFunction* MapImage(std::shared_ptr<MappedFile> file, const uint64_t* sourceHash, OptimizationLevel level)
+	{
+		if (!file)
+			return nullptr;
+
+		std::shared_ptr<BytecodeImage> image = std::make_shared<BytecodeImage>(std::move(file));
+
+		if (!image->Open(sourceHash, level))
+			return nullptr;
+
+		// Nothing else has this mapping so the code can run in place
+		// The script keeps the image alive, and the image the mapping
+		return std::make_shared<LoadedImage>(std::move(image), true)->GetFunction(0);
+	}
+
+	ObjFunction* ReadBytecode(const uint8_t* data, size_t size, uint64_t sourceHash, OptimizationLevel level)
+	{
+		return ReadImage(data, size, &sourceHash, level);
+	}
+
+	ObjFunction* MapBytecode(std::shared_ptr<MappedFile> file, uint64_t sourceHash, OptimizationLevel level)
+	{
+		return MapImage(std::move(file), &sourceHash, level);
+	}
+
+	ObjFunction* LoadOrCompileScript(IOInterface* io, const std::string& cachePath, const std::string& source,
+		OptimizationLevel level, bool diagnostics)
+	{
+		uint64_t sourceHash = HashSource(source);
+
+		if (!diagnostics)
+		{
+			ObjFunction* function = nullptr;
+
+			if (std::shared_ptr<MappedFile> file = io->MapFile(cachePath))
+			{
+				function = MapBytecode(std::move(file), sourceHash, level);
+			}
+			else
+			{
+				std::string image = io->ReadBinaryFile(cachePath);
+				function = ReadBytecode((const uint8_t*)image.data(), image.size(), sourceHash, level);
+			}
+
+			if (function)
+				return function;
+		}
+
+		ObjFunction* function = CompileScript(source, level, diagnostics);
+
+		if (!function)
+			return nullptr;
+
+		// Not being able to write the cache just means compiling again next time
+		std::string image;
+		if (WriteBytecode(function, sourceHash, level, image))
+			io->WriteBinaryFile(cachePath, image);
+
+		return function;
+	}
+
+	ObjFunction* LoadPrecompiledScript(IOInterface* io, const std::string& path)
+	{
+		if (std::shared_ptr<MappedFile> file = io->MapFile(path))
+			return MapImage(std::move(file), nullptr, DefaultOptimizationLevel);
+
+		std::string data = io->ReadBinaryFile(path);
+
+		return ReadImage((const uint8_t*)data.data(), data.size(), nullptr, DefaultOptimizationLevel);
+	}
+
+	std::shared_ptr<BytecodeImage> CompileImage(const std::string& source, OptimizationLevel level)
+	{
+		std::string bytes;
+		bool written = false;
+
+		{
+			// The functions are only needed to write the image, a heap of their own keeps them out of any VM
+			MemoryManager scratch;
+			MemoryManager* previous = SetCurrentHeap(&scratch);
+
+			ObjFunction* function = CompileScript(source, level);
+			written = function && WriteBytecode(function, HashSource(source), level, bytes);
+
+			SetCurrentHeap(previous);
+		}
+
+		if (!written)
+			return nullptr;
+
+		std::shared_ptr<BytecodeImage> image = std::make_shared<BytecodeImage>(std::move(bytes));
+
+		if (!image->Open(nullptr, level))
+			return nullptr;
+
+		return image;
+	}
+
+	std::shared_ptr<const BytecodeImage> ImageCache::Get(IOInterface* io, const std::string& cachePath, const std::string& source,
+		OptimizationLevel level)
+	{
+		uint64_t sourceHash = HashSource(source);
+
+		std::lock_guard<std::mutex> lock(m_Mutex);
+
+		Entry& entry = m_Images[cachePath];
+
+		if (entry.image && entry.sourceHash == sourceHash && entry.level == level)
+			return entry.image;
+
+		std::shared_ptr<BytecodeImage> image;
+
+		// Every VM makes its own copy of the code it runs, so the mapping is never written to
+		if (std::shared_ptr<MappedFile> file = io->MapFile(cachePath))
+			image = std::make_shared<BytecodeImage>(std::move(file));
+		else
+			image = std::make_shared<BytecodeImage>(io->ReadBinaryFile(cachePath));
+
+		if (!image->Open(&sourceHash, level))
+		{
+			std::shared_ptr<BytecodeImage> compiled = CompileImage(source, level);
+
+			if (!compiled)
+				return nullptr;
+
+			io->WriteBinaryFile(cachePath, std::string((const char*)compiled->Data(), compiled->Size()));
+
+			image = std::move(compiled);
+		}
+
+		entry.image = image;
+		entry.sourceHash = sourceHash;
+		entry.level = level;
+
+		return image;
+	}
+
+#ifdef _WIN32
+
+	std::shared_ptr<MappedFile> MappedFile::Map(const std::string& filepath)
+	{
+		HANDLE file = CreateFileA(filepath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return nullptr;
+
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+		{
+			CloseHandle(file);
+			return nullptr;
+		}
+
+		HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		CloseHandle(file);
+
+		if (!mapping)
+			return nullptr;
+
+		void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle(mapping);
+
+		if (!data)
+			return nullptr;
+
+		std::shared_ptr<MappedFile> mapped(new MappedFile);
+		mapped->m_Data = (uint8_t*)data;
+		mapped->m_Size = (size_t)size.QuadPart;
+
+		return mapped;
+	}
+
+	MappedFile::~MappedFile()
+	{
+		if (m_Data)
+			UnmapViewOfFile(m_Data);
+	}
+
+#else
+
+	std::shared_ptr<MappedFile> MappedFile::Map(const std::string& filepath)
+	{
+		int file = open(filepath.c_str(), O_RDONLY);
+		if (file < 0)
+			return nullptr;
+
+		struct stat info;
+		if (fstat(file, &info) != 0 || info.st_size == 0)
+		{
+			close(file);
+			return nullptr;
+		}
+
+		// Read only, so every page stays shared with the other processes mapping the file
+		void* data = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+		close(file);
+
+		if (data == MAP_FAILED)
+			return nullptr;
+
+		std::shared_ptr<MappedFile> mapped(new MappedFile);
+		mapped->m_Data = (uint8_t*)data;
+		mapped->m_Size = (size_t)info.st_size;
+
+		return mapped;
+	}
+
+	MappedFile::~MappedFile()
+	{
+		if (m_Data)
+			munmap(m_Data, m_Size);
+	}
+
+#endif
+}
@@ -0,0 +1,154 @@
+#pragma once
+#include "Interface.h"
+#include "Object.h"
+#include "Optimizer.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Compiled scripts written out in a binary form (.langc) so they can be loaded again without compiling
+// An image holds the script function and every function it reaches through its constants, along with the strings they use.
+// Images have to be made straight from the compiler, the VM links and quickens the bytecode once it runs.
+//
+// Everything is little endian
+//   header     "LANGC", format version u32, instruction set hash u64, optimization level u8, source hash u64,
+//              hash of everything after the header u64
+//   tables     string count u32, function count u32, then the offset of every string and every function from the start
+//              of the image as u32s, so anything in the image can be found without reading what comes before it
+//   strings    length u32 and the bytes, string constants and names refer to these by index
+//   functions  name u32, arity u32, code length u32, property cache count u32, constant count u32, the code and then
+//              the constants. The script is always the first function
+//   constants  tag u8 followed by the number as f64 or the index of a string or function, nil, true and false are just the tag
+
+namespace script
+{
+	// Bump this when the layout changes, changes to the instructions are picked up from OpCodes.h
+	constexpr uint32_t BytecodeVersion = 2;
+
+	uint64_t HashSource(const std::string& source);
+
+	// Fails if any of the functions has been linked already
+	bool WriteBytecode(ObjFunction* function, uint64_t sourceHash, OptimizationLevel level, std::string& image);
+
+	// Reads everything in, nullptr if the image is damaged or was made by another version, from other source or at another level
+	ObjFunction* ReadBytecode(const uint8_t* data, size_t size, uint64_t sourceHash, OptimizationLevel level);
+
+	// A checked image in memory, the prototype functions get made from
+	// Nothing in it changes once it's open, so any number of VMs on any number of threads can make functions from the same one
+	class BytecodeImage
+	{
+	public:
+
+		explicit BytecodeImage(std::shared_ptr<MappedFile> file);
+		explicit BytecodeImage(std::string bytes);
+
+		// The data has to outlive the image
+		BytecodeImage(const uint8_t* data, size_t size);
+
+		// Checks the header and the hash of the rest, a nullptr hash takes images made from any source at any level
+		bool Open(const uint64_t* sourceHash, OptimizationLevel level);
+
+		const uint8_t* Data() const { return m_Data; }
+		size_t Size() const { return m_Size; }
+
+		// nullptr unless the image is mapped
+		MappedFile* File() const { return m_File.get(); }
+
+		uint32_t FunctionCount() const { return m_FunctionCount; }
+
+		// Past the end of the image if the index is out of range
+		size_t StringOffset(uint32_t index) const;
+		size_t FunctionOffset(uint32_t index) const;
+
+	private:
+
+		std::shared_ptr<MappedFile> m_File;
+		std::string m_Bytes;
+
+		const uint8_t* m_Data;
+		size_t m_Size;
+
+		uint32_t m_StringCount = 0;
+		uint32_t m_FunctionCount = 0;
+	};
+
+	// The functions one VM has made from an image
+	// Functions are only made once something reaches them and only get their constants on the first call.
+	// When the image is a mapping nothing else runs from the code stays in it: linking puts the global slots in a side
+	// table on the function and the VM leaves the instructions unquickened, so nothing ever writes to the shared pages.
+	class LoadedImage : public std::enable_shared_from_this<LoadedImage>
+	{
+	public:
+
+		LoadedImage(std::shared_ptr<const BytecodeImage> image, bool runInPlace);
+
+		// Makes the function if it hasn't been already, nothing but its name and arity gets read
+		ObjFunction* GetFunction(uint32_t index);
+
+		// Loads the constants of a lazy function and links it if it's been given its globals
+		// False if the image is damaged, the function stays lazy
+		bool Load(ObjFunction* function);
+
+		// The function got collected
+		void Forget(ObjFunction* function);
+
+	private:
+
+		ObjString* GetString(uint32_t index);
+
+		std::shared_ptr<const BytecodeImage> m_Image;
+		bool m_RunInPlace;
+
+		// By index, nullptr until something reaches it
+		std::vector<ObjFunction*> m_Functions;
+	};
+
+	// Compiles the source straight into an image without touching the current heap, nullptr on a compile error
+	std::shared_ptr<BytecodeImage> CompileImage(const std::string& source, OptimizationLevel level = DefaultOptimizationLevel);
+
+	// Makes the script function of an image for the current heap, each VM that runs the image needs its own
+	ObjFunction* InstantiateImage(std::shared_ptr<const BytecodeImage> image);
+
+	// Images shared between VMs, give every VM in a pool the same cache and each module only gets compiled once
+	class ImageCache
+	{
+	public:
+
+		// The image for the source, loaded from the cache file or compiled the first time it's asked for
+		std::shared_ptr<const BytecodeImage> Get(IOInterface* io, const std::string& cachePath, const std::string& source,
+			OptimizationLevel level = DefaultOptimizationLevel);
+
+	private:
+
+		struct Entry
+		{
+			std::shared_ptr<const BytecodeImage> image;
+			uint64_t sourceHash = 0;
+			OptimizationLevel level = DefaultOptimizationLevel;
+		};
+
+		std::mutex m_Mutex;
+		std::unordered_map<std::string, Entry> m_Images;
+	};
+
+	// Anything that runs a function has to call this first, true straight away for functions that aren't lazy
+	inline bool LoadFunction(ObjFunction* function)
+	{
+		return !function->lazy || (function->image && function->image->Load(function));
+	}
+
+	// Runs the image straight out of the mapping, nullptr for the same reasons as ReadBytecode
+	// Every call maps the file again, so code nothing writes to can run in place
+	ObjFunction* MapBytecode(std::shared_ptr<MappedFile> file, uint64_t sourceHash, OptimizationLevel level);
+
+	// Loads the script from the cache if it was compiled from the same source, otherwise compiles it and updates the cache
+	// Diagnostics always compile, they're printed while compiling
+	ObjFunction* LoadOrCompileScript(IOInterface* io, const std::string& cachePath, const std::string& source,
+		OptimizationLevel level = DefaultOptimizationLevel, bool diagnostics = false);
+
+	// Loads an image shipped without its source, whatever source and level it was made from
+	ObjFunction* LoadPrecompiledScript(IOInterface* io, const std::string& path);
+}
@@ -3,8 +3,380 @@
 #include "Value.h"
 #include "Memory.h"
 
+#include <algorithm>
+#include <cstring>
+
 namespace script
 {
+#define OPCODE(name, operands) 1 + operands,
+
+	static const uint8_t s_InstructionLengths[] =
+	{
+#include "OpCodes.h"
+	};
+
+#undef OPCODE
+
+#define OPCODE(name, operands) "OP_" #name,
+
+	static const char* s_OpCodeNames[] =
+	{
+#include "OpCodes.h"
+	};
+
+#undef OPCODE
+
+	size_t GetInstructionLength(uint8_t instruction)
+	{
+		return s_InstructionLengths[instruction];
+	}
+
+	const char* GetOpCodeName(uint8_t instruction)
+	{
+		if (instruction >= sizeof(s_OpCodeNames) / sizeof(s_OpCodeNames[0]))
+			return "OP_UNKNOWN";
+
+		return s_OpCodeNames[instruction];
+	}
+
+	bool IsForwardJump(uint8_t instruction)
+	{
+		switch (instruction)
+		{
+		case OP_JUMP:
+		case OP_JUMP_IF_FALSE:
+		case OP_JUMP_IF_NOT_LESS:
+		case OP_JUMP_IF_NOT_GREATER:
+		case OP_JUMP_IF_NOT_LESS_EQUAL:
+		case OP_JUMP_IF_NOT_GREATER_EQUAL:
+		case OP_JUMP_IF_NOT_EQUAL:
+		case OP_JUMP_IF_EQUAL:
+		case OP_ITER:
+		case OP_INLINE_GUARD:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	bool IsJump(uint8_t instruction)
+	{
+		return instruction == OP_LOOP || IsForwardJump(instruction);
+	}
+
+	bool IsQuickened(uint8_t instruction)
+	{
+		switch (instruction)
+		{
+		case OP_ADD_NUM_NUM:
+		case OP_ADD_STR:
+		case OP_SUBTRACT_NUM_NUM:
+		case OP_MULTIPLY_NUM_NUM:
+		case OP_DIVIDE_NUM_NUM:
+		case OP_LESS_NUM:
+		case OP_GREATER_NUM:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	bool DecodeInstructions(const CodeBuffer& code, std::vector<DecodedInstruction>& instructions)
+	{
+		std::vector<int> indices(code.size() + 1, -1);
+
+		instructions.clear();
+
+		for (size_t offset = 0; offset < code.size(); offset += GetInstructionLength(code[offset]))
+		{
+			size_t length = GetInstructionLength(code[offset]);
+
+			if (offset + length > code.size())
+				return false;
+
+			DecodedInstruction instruction;
+			instruction.op = code[offset];
+			memcpy(instruction.operands, &code[offset + 1], length - 1);
+
+			indices[offset] = (int)instructions.size();
+			instructions.push_back(instruction);
+		}
+
+		indices[code.size()] = (int)instructions.size();
+
+		size_t offset = 0;
+
+		for (DecodedInstruction& instruction : instructions)
+		{
+			size_t next = offset + GetInstructionLength(instruction.op);
+
+			if (IsJump(instruction.op))
+			{
+				size_t distance = ((size_t)instruction.operands[0] << 8) | instruction.operands[1];
+				size_t target = instruction.op == OP_LOOP ? next - distance : next + distance;
+
+				if (target > code.size() || indices[target] < 0)
+					return false;
+
+				instruction.target = indices[target];
+			}
+
+			offset = next;
+		}
+
+		return true;
+	}
+
+	bool EncodeInstructions(const std::vector<DecodedInstruction>& instructions, std::vector<uint8_t>& code)
+	{
+		// A removed instruction gets the offset of the next one that is still there
+		std::vector<size_t> offsets(instructions.size() + 1);
+		size_t size = 0;
+
+		for (size_t i = 0; i < instructions.size(); i++)
+		{
+			offsets[i] = size;
+
+			if (!instructions[i].removed)
+				size += GetInstructionLength(instructions[i].op);
+		}
+
+		offsets[instructions.size()] = size;
+
+		std::vector<uint8_t> output;
+		output.reserve(size);
+
+		for (size_t i = 0; i < instructions.size(); i++)
+		{
+			const DecodedInstruction& instruction = instructions[i];
+
+			if (instruction.removed)
+				continue;
+
+			size_t length = GetInstructionLength(instruction.op);
+
+			output.push_back(instruction.op);
+
+			if (IsJump(instruction.op))
+			{
+				size_t next = offsets[i] + length;
+				size_t target = offsets[instruction.target];
+
+				int64_t distance = instruction.op == OP_LOOP ? (int64_t)next - (int64_t)target : (int64_t)target - (int64_t)next;
+
+				if (distance < 0 || distance > UINT16_MAX)
+					return false;
+
+				output.push_back((uint8_t)(distance >> 8));
+				output.push_back((uint8_t)(distance & 0xFF));
+
+				// INLINE_GUARD has more after the jump
+				output.insert(output.end(), instruction.operands + 2, instruction.operands + length - 1);
+				continue;
+			}
+
+			output.insert(output.end(), instruction.operands, instruction.operands + length - 1);
+		}
+
+		code = std::move(output);
+		return true;
+	}
+
+	bool GetStackEffect(const DecodedInstruction& instruction, int* pops, int* pushes)
+	{
+		uint8_t op = instruction.op;
+
+		*pops = 0;
+		*pushes = 0;
+
+		if (op >= OP_CALL_0 && op <= OP_CALL_16)
+		{
+			*pops = op - OP_CALL_0 + 1;
+			*pushes = 1;
+			return true;
+		}
+
+		if (op >= OP_MATH_SQRT && op <= OP_MATH_ATAN2)
+		{
+			*pops = MathsIntrinsicArity(op) + 1;
+			*pushes = 1;
+			return true;
+		}
+
+		switch (op)
+		{
+		case OP_RETURN:
+		case OP_POP:
+		case OP_DEFINE_GLOBAL:
+		case OP_EXPORT_GLOBAL:
+		case OP_METHOD:
+			*pops = 1;
+			return true;
+		case OP_POP_N:
+			*pops = instruction.operands[0];
+			return true;
+		case OP_CONSTANT:
+		case OP_CONSTANT_LONG:
+		case OP_TRUE:
+		case OP_FALSE:
+		case OP_NIL:
+		case OP_GET_GLOBAL:
+		case OP_CLASS:
+		case OP_GET_LOCAL:
+		case OP_GET_LOCAL_0:
+		case OP_GET_LOCAL_1:
+		case OP_GET_LOCAL_2:
+		case OP_GET_LOCAL_3:
+			*pushes = 1;
+			return true;
+		case OP_NEGATE:
+		case OP_NOT:
+		case OP_GET_PROPERTY:
+		case OP_ADD_CONSTANT:
+		case OP_SUBTRACT_CONSTANT:
+			*pops = 1;
+			*pushes = 1;
+			return true;
+		case OP_ADD:
+		case OP_SUBTRACT:
+		case OP_MULTIPLY:
+		case OP_DIVIDE:
+		case OP_POWER:
+		case OP_MODULO:
+		case OP_EQUAL:
+		case OP_NOT_EQUAL:
+		case OP_LESS:
+		case OP_GREATER:
+		case OP_LESS_EQUAL:
+		case OP_GREATER_EQUAL:
+		case OP_SUBSCRIPT_READ:
+		case OP_CREATE_RANGE:
+		case OP_SET_PROPERTY:
+			*pops = 2;
+			*pushes = 1;
+			return true;
+		case OP_SUBSCRIPT_WRITE:
+		case OP_SLICE_ARRAY:
+			*pops = 3;
+			*pushes = 1;
+			return true;
+		case OP_JUMP_IF_NOT_LESS:
+		case OP_JUMP_IF_NOT_GREATER:
+		case OP_JUMP_IF_NOT_LESS_EQUAL:
+		case OP_JUMP_IF_NOT_GREATER_EQUAL:
+		case OP_JUMP_IF_NOT_EQUAL:
+		case OP_JUMP_IF_EQUAL:
+			*pops = 2;
+			return true;
+		case OP_CREATE_LIST:
+			*pops = (instruction.operands[0] << 8) | instruction.operands[1];
+			*pushes = 1;
+			return true;
+		case OP_STRING_INTERP:
+			*pops = instruction.operands[0];
+			*pushes = 1;
+			return true;
+		case OP_INVOKE:
+			*pops = instruction.operands[2] + 1;
+			*pushes = 1;
+			return true;
+		// SET_LOCAL and SET_GLOBAL leave the value where it is, ITER writes over the loop variable and the iterator
+		// Imports run the module on its own fiber and THROW doesn't do anything yet
+		case OP_SET_LOCAL:
+		case OP_SET_GLOBAL:
+		case OP_JUMP:
+		case OP_JUMP_IF_FALSE:
+		case OP_LOOP:
+		case OP_ITER:
+		case OP_TAIL_CALL:
+		case OP_INLINE_GUARD:
+		case OP_IMPORT_MODULE:
+		case OP_IMPORT_MODULE_AS:
+		case OP_THROW:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	size_t FindMaxStack(const CodeBuffer& code, size_t entry)
+	{
+		// Nothing pushes more than one value, so this is as high as it can go if the walk below gives up
+		size_t bound = entry;
+
+		for (size_t offset = 0; offset < code.size(); offset += GetInstructionLength(code[offset]))
+			bound++;
+
+		std::vector<DecodedInstruction> instructions;
+
+		if (!DecodeInstructions(code, instructions) || instructions.empty())
+			return bound;
+
+		std::vector<int> heights(instructions.size(), -1);
+		std::vector<int> work = { 0 };
+
+		int maxHeight = (int)entry;
+		heights[0] = (int)entry;
+
+		while (!work.empty())
+		{
+			int i = work.back();
+			work.pop_back();
+
+			const DecodedInstruction& instruction = instructions[i];
+			int pops, pushes;
+
+			if (!GetStackEffect(instruction, &pops, &pushes))
+			{
+				// Quickening only swaps the op, it still pops two and pushes one
+				switch (instruction.op)
+				{
+				case OP_ADD_NUM_NUM:
+				case OP_ADD_STR:
+				case OP_SUBTRACT_NUM_NUM:
+				case OP_MULTIPLY_NUM_NUM:
+				case OP_DIVIDE_NUM_NUM:
+				case OP_LESS_NUM:
+				case OP_GREATER_NUM:
+					pops = 2;
+					pushes = 1;
+					break;
+				default:
+					return bound;
+				}
+			}
+
+			if (pops > heights[i])
+				return bound;
+
+			int height = heights[i] + pushes - pops;
+			maxHeight = std::max(maxHeight, height);
+
+			auto flow = [&](int target) {
+
+				if (target >= (int)instructions.size())
+					return false;
+
+				if (heights[target] < 0)
+				{
+					heights[target] = height;
+					work.push_back(target);
+					return true;
+				}
+
+				return heights[target] == height;
+			};
+
+			if (IsJump(instruction.op) && !flow(instruction.target))
+				return bound;
+
+			if (instruction.op != OP_JUMP && instruction.op != OP_LOOP && instruction.op != OP_RETURN && !flow(i + 1))
+				return bound;
+		}
+
+		return (size_t)maxHeight;
+	}
+
 	Chunk::~Chunk()
 	{
 	}
@@ -19,6 +391,15 @@ namespace script
 
 		size_t idx = AddConstant(value);
 
+		// Past the first 256 the index needs two bytes
+		if (idx > UINT8_MAX)
+		{
+			WriteByte(OP_CONSTANT_LONG);
+			WriteByte((uint8_t)(idx >> 8));
+			WriteByte((uint8_t)(idx & 0xFF));
+
+			return idx;
+		}
 
 		WriteByte(OP_CONSTANT);
 		WriteByte((uint8_t)idx);
@@ -26,27 +407,30 @@ namespace script
 		return idx;
 	}
 
+	// Only adds the value, names for the other instructions go through here too so this can't write any code
 	size_t Chunk::AddConstant(Value value)
 	{
 		constants.push_back(value);
 
 		size_t idx = constants.size() - 1;
 
-		if (idx > 255 && idx <= 65536)
+		if (idx > UINT16_MAX)
 		{
-			WriteByte(OP_CONSTANT_LONG);
+			assert(false && "Constant numbers have hit the max per chunk");
+		}
 
-			uint8_t higher = uint8_t(idx >> 8);
-			uint8_t lower = uint8_t(idx & 0xFF);
+		return idx;
+	}
 
-			WriteByte(higher);
-			WriteByte(lower);
+	size_t Chunk::AddPropertyCache()
+	{
+		propertyCaches.push_back(PropertyCache());
 
-			return idx;
-		}
-		else if (idx > 65536)
+		size_t idx = propertyCaches.size() - 1;
+
+		if (idx > UINT16_MAX)
 		{
-			assert(false && "Constant numbers have hit the max per chunk");
+			assert(false && "Property caches have hit the max per chunk");
 		}
 
 		return idx;
@@ -161,16 +545,16 @@ namespace script
 				simpleInstruction("OP_POP");
 				break;
 			case OP_DEFINE_GLOBAL:
-				constantInstructionLong("OP_DEFINE_GLOBAL");
+				byteInstructionLong("OP_DEFINE_GLOBAL");
 				break;
 			case OP_GET_GLOBAL:
-				constantInstructionLong("OP_GET_GLOBAL");
+				byteInstructionLong("OP_GET_GLOBAL");
 				break;
 			case OP_SET_GLOBAL:
-				constantInstructionLong("OP_SET_GLOBAL");
+				byteInstructionLong("OP_SET_GLOBAL");
 				break;
 			case OP_EXPORT_GLOBAL:
-				constantInstructionLong("OP_EXPORT_GLOBAL");
+				byteInstructionLong("OP_EXPORT_GLOBAL");
 				break;
 			case OP_GET_LOCAL:
 				byteInstructionLong("OP_GET_LOCAL");
@@ -269,6 +653,21 @@ namespace script
 				//offset += 2;
 			};
 
+		auto propertyInstruction = [&](const char* name)
+			{
+				uint8_t higher = chunk->code[offset + 1];
+				uint8_t lower = chunk->code[offset + 2];
+
+				uint16_t constant = higher << 8;
+				constant = constant | lower;
+
+				uint16_t cache = (chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+
+				printf("%s %d -> ", name, constant);
+				chunk->constants[constant].Print();
+				printf(" cache: %d\n", cache);
+			};
+
 		auto invokeInstruction = [&](const char* name)
 			{
 				uint8_t higher = chunk->code[offset + 1];
@@ -278,8 +677,11 @@ namespace script
 				uint16_t constant = higher << 8;
 				constant = constant | lower;
 
-				printf("%s %d -> args: %d\n", name, constant, argCount);
-				//offset += 3;
+				uint16_t cache = (chunk->code[offset + 4] << 8) | chunk->code[offset + 5];
+
+				printf("%s %d -> ", name, constant);
+				chunk->constants[constant].Print();
+				printf(" args: %d cache: %d\n", argCount, cache);
 			};
 
 		
@@ -336,17 +738,18 @@ namespace script
 		case OP_POP:
 			simpleInstruction("OP_POP");
 			break;
+		// Global operands are slots once the function has been linked
 		case OP_DEFINE_GLOBAL:
-			constantInstructionLong("OP_DEFINE_GLOBAL");
+			byteInstructionLong("OP_DEFINE_GLOBAL");
 			break;
 		case OP_GET_GLOBAL:
-			constantInstructionLong("OP_GET_GLOBAL");
+			byteInstructionLong("OP_GET_GLOBAL");
 			break;
 		case OP_SET_GLOBAL:
-			constantInstructionLong("OP_SET_GLOBAL");
+			byteInstructionLong("OP_SET_GLOBAL");
 			break;
 		case OP_EXPORT_GLOBAL:
-			constantInstructionLong("OP_EXPORT_GLOBAL");
+			byteInstructionLong("OP_EXPORT_GLOBAL");
 			break;
 		case OP_GET_LOCAL:
 			byteInstructionLong("OP_GET_LOCAL");
@@ -366,6 +769,19 @@ namespace script
 		case OP_CALL_0:
 			byteInstruction("OP_CALL_)");
 			break;
+		case OP_TAIL_CALL:
+			simpleInstruction("OP_TAIL_CALL");
+			break;
+		case OP_INLINE_GUARD:
+		{
+			uint16_t jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+			uint16_t constant = (chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+
+			printf("OP_INLINE_GUARD %d -> ", jump);
+			chunk->constants[constant].Print();
+			printf(" args: %d\n", chunk->code[offset + 5]);
+			break;
+		}
 		case OP_POWER:
 			simpleInstruction("OP_POWER");
 			break;
@@ -388,10 +804,13 @@ namespace script
 			byteInstructionLong("OP_CLASS");
 			break;
 		case OP_SET_PROPERTY:
-			byteInstructionLong("OP_SET_PROPERTY");
+			propertyInstruction("OP_SET_PROPERTY");
 			break;
 		case OP_GET_PROPERTY:
-			byteInstructionLong("OP_GET_PROPERTY");
+			propertyInstruction("OP_GET_PROPERTY");
+			break;
+		case OP_INVOKE:
+			invokeInstruction("OP_INVOKE");
 			break;
 		case OP_METHOD:
 			constantInstructionLong("OP_METHOD");
@@ -413,6 +832,99 @@ namespace script
 		case OP_CREATE_RANGE:
 			printf("OP_CREATE_RANGE\n");
 			break;
+		case OP_NOT_EQUAL:
+			simpleInstruction("OP_NOT_EQUAL");
+			break;
+		case OP_LESS_EQUAL:
+			simpleInstruction("OP_LESS_EQUAL");
+			break;
+		case OP_GREATER_EQUAL:
+			simpleInstruction("OP_GREATER_EQUAL");
+			break;
+		case OP_GET_LOCAL_0:
+			simpleInstruction("OP_GET_LOCAL_0");
+			break;
+		case OP_GET_LOCAL_1:
+			simpleInstruction("OP_GET_LOCAL_1");
+			break;
+		case OP_GET_LOCAL_2:
+			simpleInstruction("OP_GET_LOCAL_2");
+			break;
+		case OP_GET_LOCAL_3:
+			simpleInstruction("OP_GET_LOCAL_3");
+			break;
+		case OP_ADD_CONSTANT:
+			constantInstruction("OP_ADD_CONSTANT");
+			break;
+		case OP_SUBTRACT_CONSTANT:
+			constantInstruction("OP_SUBTRACT_CONSTANT");
+			break;
+		case OP_POP_N:
+			byteInstruction("OP_POP_N");
+			break;
+		case OP_JUMP_IF_NOT_LESS:
+			byteInstructionLong("OP_JUMP_IF_NOT_LESS");
+			break;
+		case OP_JUMP_IF_NOT_GREATER:
+			byteInstructionLong("OP_JUMP_IF_NOT_GREATER");
+			break;
+		case OP_JUMP_IF_NOT_LESS_EQUAL:
+			byteInstructionLong("OP_JUMP_IF_NOT_LESS_EQUAL");
+			break;
+		case OP_JUMP_IF_NOT_GREATER_EQUAL:
+			byteInstructionLong("OP_JUMP_IF_NOT_GREATER_EQUAL");
+			break;
+		case OP_JUMP_IF_NOT_EQUAL:
+			byteInstructionLong("OP_JUMP_IF_NOT_EQUAL");
+			break;
+		case OP_JUMP_IF_EQUAL:
+			byteInstructionLong("OP_JUMP_IF_EQUAL");
+			break;
+		case OP_MATH_SQRT:
+			propertyInstruction("OP_MATH_SQRT");
+			break;
+		case OP_MATH_SIN:
+			propertyInstruction("OP_MATH_SIN");
+			break;
+		case OP_MATH_COS:
+			propertyInstruction("OP_MATH_COS");
+			break;
+		case OP_MATH_ABS:
+			propertyInstruction("OP_MATH_ABS");
+			break;
+		case OP_MATH_FLOOR:
+			propertyInstruction("OP_MATH_FLOOR");
+			break;
+		case OP_MATH_MIN:
+			propertyInstruction("OP_MATH_MIN");
+			break;
+		case OP_MATH_MAX:
+			propertyInstruction("OP_MATH_MAX");
+			break;
+		case OP_MATH_ATAN2:
+			propertyInstruction("OP_MATH_ATAN2");
+			break;
+		case OP_ADD_NUM_NUM:
+			simpleInstruction("OP_ADD_NUM_NUM");
+			break;
+		case OP_ADD_STR:
+			simpleInstruction("OP_ADD_STR");
+			break;
+		case OP_SUBTRACT_NUM_NUM:
+			simpleInstruction("OP_SUBTRACT_NUM_NUM");
+			break;
+		case OP_MULTIPLY_NUM_NUM:
+			simpleInstruction("OP_MULTIPLY_NUM_NUM");
+			break;
+		case OP_DIVIDE_NUM_NUM:
+			simpleInstruction("OP_DIVIDE_NUM_NUM");
+			break;
+		case OP_LESS_NUM:
+			simpleInstruction("OP_LESS_NUM");
+			break;
+		case OP_GREATER_NUM:
+			simpleInstruction("OP_GREATER_NUM");
+			break;
 		default:
 			printf("Unknown OpCode -> %d\n", instruction);
 			offset++;
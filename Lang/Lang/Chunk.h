@@ -2,11 +2,13 @@
 #pragma once
 
 #include <cstdint>
+#include <cstddef>
+#include <utility>
 #include <vector>
 
 namespace script
 {
-#define OPCODE(name) OP_##name,
+#define OPCODE(name, operands) OP_##name,
 
 	enum OpCodes
 	{
@@ -15,16 +17,161 @@ namespace script
 
 #undef OPCODE 
 
+	// Returns the size of an instruction including its operands
+	// Used to walk over bytecode without decoding each instruction
+	size_t GetInstructionLength(uint8_t instruction);
+
+	// Returns the name of the opcode, eg. "OP_ADD"
+	const char* GetOpCodeName(uint8_t instruction);
+
+	// The jumps that go forwards, LOOP is the only one that goes back
+	bool IsForwardJump(uint8_t instruction);
+	bool IsJump(uint8_t instruction);
+
+	// The versions the VM swaps generic instructions for once it has seen their operands, never in compiled code
+	bool IsQuickened(uint8_t instruction);
+
+	// Arguments an OP_MATH_ instruction takes
+	constexpr int MathsIntrinsicArity(uint8_t instruction)
+	{
+		return instruction >= OP_MATH_MIN ? 2 : 1;
+	}
+
+	// INVOKE has the most operands
+	constexpr size_t MaxOperandBytes = 5;
+
+	// The bytecode of a chunk, normally owned but chunks loaded from a mapped image can point straight into the mapping
+	// Mappings are read only, so nothing writes to a view: linking fills a side table instead and the VM doesn't quicken it.
+	// Anything that changes the code has to go through Bytes, which copies a view out first
+	class CodeBuffer
+	{
+	public:
+
+		CodeBuffer() = default;
+		CodeBuffer(std::vector<uint8_t>&& bytes) : m_Bytes(std::move(bytes)) {}
+
+		CodeBuffer& operator=(std::vector<uint8_t>&& bytes)
+		{
+			m_View = nullptr;
+			m_ViewSize = 0;
+			m_Bytes = std::move(bytes);
+			return *this;
+		}
+
+		// The code has to outlive the chunk and is never written through
+		void View(const uint8_t* code, size_t size)
+		{
+			m_View = const_cast<uint8_t*>(code);
+			m_ViewSize = size;
+			m_Bytes.clear();
+		}
+
+		bool IsView() const { return m_View != nullptr; }
+
+		// The owned bytes, a view gets copied out
+		std::vector<uint8_t>& Bytes()
+		{
+			if (m_View)
+			{
+				m_Bytes.assign(m_View, m_View + m_ViewSize);
+				m_View = nullptr;
+				m_ViewSize = 0;
+			}
+
+			return m_Bytes;
+		}
+
+		uint8_t* data() { return m_View ? m_View : m_Bytes.data(); }
+		const uint8_t* data() const { return m_View ? m_View : m_Bytes.data(); }
+
+		size_t size() const { return m_View ? m_ViewSize : m_Bytes.size(); }
+		bool empty() const { return size() == 0; }
+
+		uint8_t& operator[](size_t offset) { return data()[offset]; }
+		const uint8_t& operator[](size_t offset) const { return data()[offset]; }
+
+		void push_back(uint8_t byte) { Bytes().push_back(byte); }
+		void pop_back() { Bytes().pop_back(); }
+
+	private:
+
+		std::vector<uint8_t> m_Bytes;
+
+		uint8_t* m_View = nullptr;
+		size_t m_ViewSize = 0;
+	};
+
+	// An instruction taken out of the bytecode so passes can move code around
+	// Jumps point at the instruction they go to rather than an offset, the offsets are worked out again when it's written back
+	struct DecodedInstruction
+	{
+		uint8_t op = 0;
+		uint8_t operands[MaxOperandBytes] = {};
+
+		int target = -1;
+
+		bool removed = false;
+
+		// Something jumps here
+		bool jumpTarget = false;
+	};
+
+	// Fails if a jump lands in the middle of an instruction
+	bool DecodeInstructions(const CodeBuffer& code, std::vector<DecodedInstruction>& instructions);
+
+	// Removed instructions are left out, fails if a jump doesn't fit in its operand anymore
+	bool EncodeInstructions(const std::vector<DecodedInstruction>& instructions, std::vector<uint8_t>& code);
+
+	// How many values the instruction pops and pushes
+	// False for the quickened instructions, those only show up once the code has run
+	bool GetStackEffect(const DecodedInstruction& instruction, int* pops, int* pushes);
+
+	// The most values the code can have on the stack at once, entry is how many are there when it starts
+	// Code that can't be followed gets a bound that's too big rather than too small
+	size_t FindMaxStack(const CodeBuffer& code, size_t entry);
+
 	class Value;
 	class Object;
+	class ObjClass;
+	class Shape;
 
-	
+	// How many receivers a single property cache can remember before it gives up 
+	// A site that sees more than this is megamorphic and just uses the slow lookup
+	constexpr uint32_t PropertyCacheSize = 4;
+
+	struct PropertyCacheEntry
+	{
+		// Entries are keyed on the class and the shape of the receiver 
+		// Shape is nullptr for receivers that aren't instances
+		ObjClass* klass = nullptr;
+		Shape* shape = nullptr;
+
+		// If the property resolved to a method on the class this is it
+		// Otherwise the property is a field on the instance
+		Object* method = nullptr;
+
+		// The slot the field lives in for this shape
+		uint32_t slot = 0;
+
+		// SET_PROPERTY only, when the field is new this is the shape the instance moves to
+		Shape* transition = nullptr;
+	};
+
+	// Inline cache for a single GET_PROPERTY / SET_PROPERTY site
+	// Entry 0 is the monomorphic case, the rest fill up as new shapes are seen
+	struct PropertyCache
+	{
+		PropertyCacheEntry entries[PropertyCacheSize];
+		uint32_t count = 0;
+	};
 
 	struct Chunk
 	{
-		std::vector<uint8_t> code;
+		CodeBuffer code;
 		std::vector<Value> constants;
 
+		std::vector<PropertyCache> propertyCaches;
+
 		~Chunk();
 
 
@@ -34,6 +181,8 @@ namespace script
 
 		size_t AddConstant(Value value);
 
+		size_t AddPropertyCache();
+
 		void Dissassemble(const char* name);
 	};
 
@@ -1,54 +1,40 @@
 
 #include "Compiler.h"
+#include "Inliner.h"
 #include "Memory.h"
 #include "String.h"
 
 namespace script
 {
-	static ParseRule rules[TOKEN_COUNT];
-
-	Parser parser;
-
-	// Forward declare parser functions 
-	// This is written in a more C way 
-	// But only because these used to exist in the compiler and I moved them out
-	// And to make life easier I didn't move them into a parser class 
-	void Advance();
-	void Consume(TokenType type, const std::string& msg);
-	bool Check(TokenType type);
-	bool Match(TokenType type);
-	bool Peek(size_t offset, TokenType type);
-	Token GetNextToken();
-
-	void ErrorAt(Token tk, const std::string& msg)
+	void Parser::ErrorAt(Token tk, const std::string& msg)
 	{
-		if (parser.panicMode)
+		if (panicMode)
 			return;
 
 		printf("[line: %d, Column: %d] -> \"%s\" -> %s\n", tk.line, tk.index, tk.value.c_str(), msg.c_str());
-		parser.hadError = true;
-		parser.panicMode = true;
+		hadError = true;
+		panicMode = true;
 
 	}
 
-	void Error(const std::string& msg)
+	void Parser::Error(const std::string& msg)
 	{
-		if (parser.panicMode)
+		if (panicMode)
 			return;
 
 		printf("Compile Error: %s", msg.c_str());
 
-		parser.hadError = true;
-		parser.panicMode = true;
+		hadError = true;
+		panicMode = true;
 	}
 
-	void Synchronise()
+	void Parser::Synchronise()
 	{
-		parser.panicMode = false;
+		panicMode = false;
 
-		while (parser.current.type != TK_EOF) {
-			if (parser.previous.type == TK_SEMICOLON) return;
-			switch (parser.current.type) {
+		while (current.type != TK_EOF) {
+			if (previous.type == TK_SEMICOLON) return;
+			switch (current.type) {
 			case TK_FUNCTION:
 			case TK_FOR:
 			case TK_IF:
@@ -64,39 +50,39 @@ namespace script
 		}
 	}
 
-	void Advance()
+	void Parser::Advance()
 	{
-		if (parser.current.type == TK_EOF)
+		if (current.type == TK_EOF)
 			return;
 
-		parser.previous = parser.current;
+		previous = current;
 
 		for (;;)
 		{
-			parser.current = GetNextToken();
+			current = GetNextToken();
 
-			if (parser.current.type != TK_ERROR) break;
+			if (current.type != TK_ERROR) break;
 
-			ErrorAt(parser.current, "");
+			ErrorAt(current, "");
 		}
 	}
 
-	void Consume(TokenType type, const std::string& msg)
+	void Parser::Consume(TokenType type, const std::string& msg)
 	{
-		if (parser.current.type == type) {
+		if (current.type == type) {
 			Advance();
 			return;
 		}
 
-		ErrorAt(parser.current, msg);
+		ErrorAt(current, msg);
 	}
 
-	bool Check(TokenType type)
+	bool Parser::Check(TokenType type)
 	{
-		return (parser.current.type == type);
+		return (current.type == type);
 	}
 
-	bool Match(TokenType type)
+	bool Parser::Match(TokenType type)
 	{
 		if (!Check(type)) return false;
 
@@ -104,30 +90,30 @@ namespace script
 		return true;
 	}
 
-	bool Peek(size_t offset, TokenType type)
+	bool Parser::Peek(size_t offset, TokenType type)
 	{
-		if (offset > parser.tokens.size())
+		if (offset > tokens.size())
 			return false;
 
-		return (parser.tokens[parser.tokenOffset + offset].type == type);
+		return (tokens[tokenOffset + offset].type == type);
 	}
 
-	Token GetNextToken()
+	Token Parser::GetNextToken()
 	{
 
-		Token tk = parser.tokens[parser.tokenOffset];
-		parser.tokenOffset++;
+		Token tk = tokens[tokenOffset];
+		tokenOffset++;
 		return tk;
 	}
 	
-	ObjFunction* CompileScript(const std::string& source)
+	ObjFunction* CompileScript(const std::string& source, OptimizationLevel level, bool diagnostics)
 	{
-		// Init the parser
-		parser = Parser();
+		// Everything the compile needs lives here so any number of scripts can be compiled at once
+		Parser parser;
 
 		// Create the lexer and stuff
 		Lexer lexer;
-		Compiler compiler;
+		Compiler compiler(parser);
 		
 		// idk why i added some trailing whitespace
 		// But i'm scared to remove it now
@@ -137,7 +123,7 @@ namespace script
 
 		parser.tokens = lexer.GetTokens();
 
-		ObjFunction* func = compiler.Compile(TYPE_SCRIPT);
+		ObjFunction* func = compiler.Compile(TYPE_SCRIPT, level, diagnostics);
 
 		return func;
 	}
@@ -148,8 +134,10 @@ namespace script
 			delete[] m_Locals;
 	}
 
-	ObjFunction* Compiler::Compile(FunctionType type)
+	ObjFunction* Compiler::Compile(FunctionType type, OptimizationLevel level, bool diagnostics)
 	{
+		m_OptimizationLevel = level;
+		m_Diagnostics = diagnostics;
 	
 		InitCompiler(nullptr, type);
 
@@ -164,7 +152,7 @@ namespace script
 
 		
 
-		if (parser.hadError)
+		if (m_Parser->hadError)
 			return nullptr;
 
 		return EndCompiler();
@@ -176,14 +164,41 @@ namespace script
 
 		EmitReturn();
 
+		if (m_OptimizationLevel >= OPT_FULL)
+		{
+			// The functions that can be inlined live on the script's compiler
+			Compiler* script = this;
+			while (script->m_Enclosing)
+				script = script->m_Enclosing;
+
+			std::vector<ObjFunction*> inlined;
+			InlineCalls(m_Function, script->m_InlineFunctions, inlined);
+
+			if (m_Diagnostics)
+			{
+				for (ObjFunction* callee : inlined)
+					printf("Inlined call to %s in %s\n", callee->name->str, m_FunctionType == TYPE_SCRIPT ? "script" : m_Function->name->str);
+			}
+		}
+
+		OptimizeFunction(m_Function, m_FunctionType, m_OptimizationLevel);
+
+		// Calls make room for this much, a big list literal can need more than a frame normally gets
+		m_Function->maxStack = (uint32_t)FindMaxStack(m_Function->chunk.code, m_Function->arity + 1);
+
 		return m_Function; 
 	}
 
 	void Compiler::InitCompiler(Compiler* enclosing, FunctionType type)
 	{
-		SetRules();
 		m_Enclosing = enclosing;
 
+		if (enclosing)
+		{
+			m_OptimizationLevel = enclosing->m_OptimizationLevel;
+			m_Diagnostics = enclosing->m_Diagnostics;
+		}
+
 		//m_Chunk = chunk;
 
 		m_Function = nullptr;
@@ -195,7 +210,7 @@ namespace script
 		// If its not a script we want to assign a name to the function
 		if (type != TYPE_SCRIPT)
 		{
-			m_Function->name = memoryManager.AllocateString(parser.previous.value);
+			m_Function->name = CurrentHeap().AllocateString(m_Parser->previous.value);
 		}
 
 		m_Locals = new Local[UINT8_MAX];
@@ -211,120 +226,54 @@ namespace script
 
 	}
 
-	void Compiler::SetRules()
-	{
-		// TODO: These parse rules get reassigned every time we compile anything...
-		// Move this to a first time kind of thing and only do it once 
-
-		auto GroupingFunc = [&](bool canAssign) {
-			this->Grouping(canAssign);
-			};
-
-		auto UnaryFunc = [&](bool canAssign) {
-			this->Unary(canAssign);
-			};
-
-		auto BinaryFunc = [&](bool canAssign) {
-			this->Binary(canAssign);
-			};
-
-		auto NumberFunc = [&](bool canAssign) {
-			this->Number(canAssign);
-			};
-
-		auto LiteralFunc = [&](bool canAssign) {
-			this->Literal(canAssign);
-			};
-
-		auto StringFunc = [&](bool canAssign) {
-			this->String(canAssign);
-			};
-
-		auto VariableFunc = [&](bool canAssign) {
-			this->Variable(canAssign);
-			};
-
-		auto AndFunc = [&](bool canAssign) {
-			this->And(canAssign);
-			};
-
-		auto OrFunc = [&](bool canAssign) {
-			this->Or(canAssign);
-			};
-
-		auto CallFunc = [&](bool canAssign) {
-			this->Call(canAssign);
-			};
-
-		auto ArrayFunc = [&](bool canAssign) {
-			this->Array(canAssign);
-		};
-
-		auto ArrayAccess = [&](bool canAssign) {
-			this->ArrayAccess(canAssign);
-		};
-
-		auto DotFunc = [&](bool canAssign) {
-			this->Dot(canAssign);
-		};
-
-		auto SelfFunc = [&](bool canAssign) {
-			this->Self(canAssign);
-		};
-
-		auto IncrementFunc = [&](bool canAssign) {
-			//this->Increment(canAssign);
-		};
-
-		auto RangeFunc = [&](bool canAssign)
-			{
-				this->Range(canAssign);
-			};
-
-		rules[TK_OPEN_BRACE] = { GroupingFunc, CallFunc,   PREC_CALL },
-			rules[TK_CLOSE_BRACE] = { NULL,     NULL,   PREC_NONE },
-			rules[TK_OPEN_CURLY] = { NULL,     NULL,   PREC_NONE },
-			rules[TK_CLOSE_CURLY] = { NULL,     NULL,   PREC_NONE },
-			rules[TK_OPEN_SQUARE] = { ArrayFunc, ArrayAccess,  PREC_INDEX },
-			rules[TK_CLOSE_SQUARE] = { NULL,     NULL,   PREC_NONE },
-			rules[TK_COMMA] = { NULL,     NULL,   PREC_NONE },
-			rules[TK_DOT] = { NULL,     DotFunc,   PREC_CALL },
-			rules[TK_MINUS] = { UnaryFunc,    BinaryFunc, PREC_TERM },
-			rules[TK_PLUS] = { NULL,     BinaryFunc, PREC_TERM },
-			rules[TK_SLASH] = { NULL,     BinaryFunc, PREC_FACTOR },
-			rules[TK_STAR] = { NULL,     BinaryFunc, PREC_FACTOR },
-			rules[TK_BANG] = { UnaryFunc,     NULL,   PREC_NONE },
-			rules[TK_BANG_EQUALS] = { NULL,     BinaryFunc,   PREC_EQUALITY },
-			rules[TK_ASSIGN] = { NULL,     NULL,   PREC_NONE },
-			rules[TK_EQUALS] = { NULL,     BinaryFunc,   PREC_EQUALITY },
-			rules[TK_GREATER_THAN] = { NULL,     BinaryFunc,   PREC_COMPARISON },
-			rules[TK_GREATER_EQUALS] = { NULL,     BinaryFunc,   PREC_COMPARISON },
-			rules[TK_LESS_THAN] = { NULL,     BinaryFunc,   PREC_COMPARISON },
-			rules[TK_LESS_EQUALS] = { NULL,     BinaryFunc,   PREC_COMPARISON },
-			rules[TK_IDENTIFIER] = { VariableFunc,     NULL,   PREC_NONE },
-			rules[TK_STRING] = { StringFunc,     NULL,   PREC_NONE },
-			rules[TK_NUMBER] = { NumberFunc,   NULL,   PREC_NONE },
-			rules[TK_AND] = { NULL,     AndFunc,   PREC_AND },
-			rules[TK_ELSE] = { NULL,     NULL,   PREC_NONE },
-			rules[TK_FALSE] = { LiteralFunc,     NULL,   PREC_NONE },
-			rules[TK_FOR] = { NULL,     NULL,   PREC_NONE },
-			rules[TK_FUNCTION] = { NULL,     NULL,   PREC_NONE },
-			rules[TK_IF] = { NULL,     NULL,   PREC_NONE },
-			rules[TK_NIL] = { LiteralFunc,     NULL,   PREC_NONE },
-			rules[TK_OR] = { NULL,     OrFunc,   PREC_OR },
-			rules[TK_RETURN] = { NULL,     NULL,   PREC_NONE },
-			rules[TK_TRUE] = { LiteralFunc,     NULL,   PREC_NONE },
-			rules[TK_WHILE] = { NULL,     NULL,   PREC_NONE },
-			rules[TK_ERROR] = { NULL,     NULL,   PREC_NONE },
-			rules[TK_EOF] = { NULL,     NULL,   PREC_NONE };
-			rules[TK_SELF] = { SelfFunc,     NULL,   PREC_NONE };
-			rules[TK_POW] = { NULL,     BinaryFunc,   PREC_POWER };
-			rules[TK_MODULO] = { NULL,     BinaryFunc,   PREC_FACTOR };
-			rules[TK_COLON] = { NULL,     NULL,   PREC_NONE };
-			rules[TK_PLUS_PLUS] = { NULL,     IncrementFunc,   PREC_CALL };
-			rules[TK_DOT_DOT] = { NULL,     BinaryFunc,   PREC_POWER };
-
-
+	std::array<ParseRule, TOKEN_COUNT> Compiler::MakeRules()
+	{
+		std::array<ParseRule, TOKEN_COUNT> rules{};
+
+		rules[TK_OPEN_BRACE] = { &Compiler::Grouping, &Compiler::Call, PREC_CALL };
+		rules[TK_CLOSE_BRACE] = { NULL, NULL, PREC_NONE };
+		rules[TK_OPEN_CURLY] = { NULL, NULL, PREC_NONE };
+		rules[TK_CLOSE_CURLY] = { NULL, NULL, PREC_NONE };
+		rules[TK_OPEN_SQUARE] = { &Compiler::Array, &Compiler::ArrayAccess, PREC_INDEX };
+		rules[TK_CLOSE_SQUARE] = { NULL, NULL, PREC_NONE };
+		rules[TK_COMMA] = { NULL, NULL, PREC_NONE };
+		rules[TK_DOT] = { NULL, &Compiler::Dot, PREC_CALL };
+		rules[TK_MINUS] = { &Compiler::Unary, &Compiler::Binary, PREC_TERM };
+		rules[TK_PLUS] = { NULL, &Compiler::Binary, PREC_TERM };
+		rules[TK_SLASH] = { NULL, &Compiler::Binary, PREC_FACTOR };
+		rules[TK_STAR] = { NULL, &Compiler::Binary, PREC_FACTOR };
+		rules[TK_BANG] = { &Compiler::Unary, NULL, PREC_NONE };
+		rules[TK_BANG_EQUALS] = { NULL, &Compiler::Binary, PREC_EQUALITY };
+		rules[TK_ASSIGN] = { NULL, NULL, PREC_NONE };
+		rules[TK_EQUALS] = { NULL, &Compiler::Binary, PREC_EQUALITY };
+		rules[TK_GREATER_THAN] = { NULL, &Compiler::Binary, PREC_COMPARISON };
+		rules[TK_GREATER_EQUALS] = { NULL, &Compiler::Binary, PREC_COMPARISON };
+		rules[TK_LESS_THAN] = { NULL, &Compiler::Binary, PREC_COMPARISON };
+		rules[TK_LESS_EQUALS] = { NULL, &Compiler::Binary, PREC_COMPARISON };
+		rules[TK_IDENTIFIER] = { &Compiler::Variable, NULL, PREC_NONE };
+		rules[TK_STRING] = { &Compiler::String, NULL, PREC_NONE };
+		rules[TK_NUMBER] = { &Compiler::Number, NULL, PREC_NONE };
+		rules[TK_AND] = { NULL, &Compiler::And, PREC_AND };
+		rules[TK_ELSE] = { NULL, NULL, PREC_NONE };
+		rules[TK_FALSE] = { &Compiler::Literal, NULL, PREC_NONE };
+		rules[TK_FOR] = { NULL, NULL, PREC_NONE };
+		rules[TK_FUNCTION] = { NULL, NULL, PREC_NONE };
+		rules[TK_IF] = { NULL, NULL, PREC_NONE };
+		rules[TK_NIL] = { &Compiler::Literal, NULL, PREC_NONE };
+		rules[TK_OR] = { NULL, &Compiler::Or, PREC_OR };
+		rules[TK_RETURN] = { NULL, NULL, PREC_NONE };
+		rules[TK_TRUE] = { &Compiler::Literal, NULL, PREC_NONE };
+		rules[TK_WHILE] = { NULL, NULL, PREC_NONE };
+		rules[TK_ERROR] = { NULL, NULL, PREC_NONE };
+		rules[TK_EOF] = { NULL, NULL, PREC_NONE };
+		rules[TK_SELF] = { &Compiler::Self, NULL, PREC_NONE };
+		rules[TK_POW] = { NULL, &Compiler::Binary, PREC_POWER };
+		rules[TK_MODULO] = { NULL, &Compiler::Binary, PREC_FACTOR };
+		rules[TK_COLON] = { NULL, NULL, PREC_NONE };
+		rules[TK_PLUS_PLUS] = { NULL, NULL, PREC_CALL };
+		rules[TK_DOT_DOT] = { NULL, &Compiler::Binary, PREC_POWER };
+
+		return rules;
 	}
 
 	void Compiler::MarkInitialised()
@@ -343,8 +292,7 @@ namespace script
 	{
 		if (m_FunctionType == TYPE_INITIALIZER)
 		{
-			EmitByte(OP_GET_LOCAL);
-			EmitBytes(0, 0);
+			EmitByte(OP_GET_LOCAL_0);
 		}
 		else
 		{
@@ -353,6 +301,24 @@ namespace script
 		EmitByte(OP_RETURN);
 	}
 
+	void Compiler::EmitValueReturn()
+	{
+		std::vector<uint8_t>& code = GetCurrentChunk()->code.Bytes();
+
+		// Nothing can jump in between the call and the return, otherwise the return isn't only for the call
+		bool tail = m_FunctionType == TYPE_FUNCTION || m_FunctionType == TYPE_METHOD;
+		tail = tail && m_LastCall >= 0 && (size_t)m_LastCall + 1 == code.size() && m_LastJumpTarget <= m_LastCall;
+
+		if (tail)
+		{
+			// TAIL_CALL goes in front of the call, the VM can still fall back to the call and the return after it
+			code.insert(code.begin() + m_LastCall, (uint8_t)OP_TAIL_CALL);
+			m_LastCall = -1;
+		}
+
+		EmitByte(OP_RETURN);
+	}
+
 	void Compiler::EmitBytes(uint8_t byte1, uint8_t byte2)
 	{
 		EmitByte(byte1);
@@ -383,7 +349,7 @@ namespace script
 
 	void Compiler::Unary(bool canAssign)
 	{
-		TokenType operatorType = parser.previous.type;
+		TokenType operatorType = m_Parser->previous.type;
 
 		Expression();
 
@@ -396,14 +362,22 @@ namespace script
 
 	void Compiler::Binary(bool canAssign)
 	{
-		TokenType operatorType = parser.previous.type;
+		TokenType operatorType = m_Parser->previous.type;
 
-		ParseRule* rule = GetRule(operatorType);
+		const ParseRule* rule = GetRule(operatorType);
+
+		size_t operandStart = GetCurrentChunk()->code.size();
 		ParsePrecedence((Precedence)(rule->precedence + 1));
 
 		switch (operatorType) {
-		case TK_PLUS:          EmitByte(OP_ADD); break;
-		case TK_MINUS:         EmitByte(OP_SUBTRACT); break;
+		case TK_PLUS:
+			if (!FuseConstantOperand(operandStart, OP_ADD_CONSTANT))
+				EmitByte(OP_ADD);
+			break;
+		case TK_MINUS:
+			if (!FuseConstantOperand(operandStart, OP_SUBTRACT_CONSTANT))
+				EmitByte(OP_SUBTRACT);
+			break;
 		case TK_STAR:          EmitByte(OP_MULTIPLY); break;
 		case TK_SLASH:         EmitByte(OP_DIVIDE); break;
 		case TK_POW:			EmitByte(OP_POWER); break;
@@ -411,20 +385,49 @@ namespace script
 
 		case TK_DOT_DOT: EmitByte(OP_CREATE_RANGE); break;
 
-		case TK_BANG_EQUALS:    EmitBytes(OP_EQUAL, OP_NOT); break;
+		case TK_BANG_EQUALS:    EmitByte(OP_NOT_EQUAL); break;
 		case TK_EQUALS:   EmitByte(OP_EQUAL); break;
 		case TK_GREATER_THAN:       EmitByte(OP_GREATER); break;
-		case TK_GREATER_EQUALS: EmitBytes(OP_LESS, OP_NOT); break;
+		case TK_GREATER_EQUALS: EmitByte(OP_GREATER_EQUAL); break;
 		case TK_LESS_THAN:          EmitByte(OP_LESS); break;
-		case TK_LESS_EQUALS:    EmitBytes(OP_GREATER, OP_NOT); break;
+		case TK_LESS_EQUALS:    EmitByte(OP_LESS_EQUAL); break;
 
 		default: return; // Unreachable.
 		}
+
+		switch (operatorType) {
+		case TK_BANG_EQUALS:
+		case TK_EQUALS:
+		case TK_GREATER_THAN:
+		case TK_GREATER_EQUALS:
+		case TK_LESS_THAN:
+		case TK_LESS_EQUALS:
+			m_LastComparison = (int)GetCurrentChunk()->code.size() - 1;
+			break;
+		default:
+			break;
+		}
+	}
+
+	bool Compiler::FuseConstantOperand(size_t operandStart, uint8_t fused)
+	{
+		Chunk* chunk = GetCurrentChunk();
+
+		// The operand has to be nothing but a single number constant
+		if (chunk->code.size() != operandStart + 2 || chunk->code[operandStart] != OP_CONSTANT)
+			return false;
+
+		if (!chunk->constants[chunk->code[operandStart + 1]].IsNumber())
+			return false;
+
+		// Both take the constant index as a byte so just swap the opcode
+		chunk->code[operandStart] = fused;
+		return true;
 	}
 
 	void Compiler::Literal(bool canAssign)
 	{
-		switch (parser.previous.type) {
+		switch (m_Parser->previous.type) {
 		case TK_FALSE: EmitByte(OP_FALSE); break;
 		case TK_NIL: EmitByte(OP_NIL); break;
 		case TK_TRUE: EmitByte(OP_TRUE); break;
@@ -437,7 +440,7 @@ namespace script
 		// We want to see if we can interpolate this string
 		// If we do we want to add the OpCodes for that 
 
-		std::string str = parser.previous.value.substr(1, parser.previous.value.length() - 2);
+		std::string str = m_Parser->previous.value.substr(1, m_Parser->previous.value.length() - 2);
 		StringScanner scanner(str);
 
 		std::vector<StringToken> tokens = scanner.GetTokens();
@@ -445,7 +448,7 @@ namespace script
 		if (tokens.size() == 1)
 		{
 			// If its a size of 1 its just a plain ol' basic string
-			EmitConstant(Value(memoryManager.AllocateString(str)));
+			EmitConstant(Value(CurrentHeap().AllocateString(str)));
 		}
 		else
 		{
@@ -454,7 +457,7 @@ namespace script
 			// So add the new strings to the constant table and then push everything onto the stack
 			if (tokens.size() >= UINT8_MAX)
 			{
-				ErrorAt(parser.current, "String has too many interpolated values");
+				ErrorAt(m_Parser->current, "String has too many interpolated values");
 			}
 
 			for (size_t i = 0; i < tokens.size(); i++)
@@ -464,12 +467,12 @@ namespace script
 				{
 				case STRTK_SUBSTRING:
 				{
-					EmitConstant(Value(memoryManager.AllocateString(tk.str)));
+					EmitConstant(Value(CurrentHeap().AllocateString(tk.str)));
 					break;
 				}
 				case STRTK_VARIABLE:
 				{
-					Token token = parser.current;
+					Token token = m_Parser->current;
 					token.type = TK_IDENTIFIER;
 					token.value = tk.str;
 					NamedVariable(token, false);
@@ -523,7 +526,7 @@ namespace script
 		if (canAssign && Match(TK_ASSIGN))
 		{
 			if (slice)
-				ErrorAt(parser.current, "Cannot assign to an array that is being sliced");
+				ErrorAt(m_Parser->current, "Cannot assign to an array that is being sliced");
 
 			Expression();
 
@@ -599,7 +602,7 @@ namespace script
 	{
 		Statement();
 
-		if (parser.panicMode)
+		if (m_Parser->panicMode)
 			Synchronise();
 	}
 
@@ -615,7 +618,7 @@ namespace script
 
 		size_t global = ParseVariable("Expected a variable name.");
 
-		if (parser.current.type == TK_ASSIGN)
+		if (m_Parser->current.type == TK_ASSIGN)
 		{
 			Advance();
 			Expression();
@@ -639,7 +642,7 @@ namespace script
 
 	void Compiler::Variable(bool canAssign)
 	{
-		NamedVariable(parser.previous, canAssign);
+		NamedVariable(m_Parser->previous, canAssign);
 	}
 
 	void Compiler::Block()
@@ -661,13 +664,19 @@ namespace script
 	{
 		m_ScopeDepth--;
 
+		uint8_t popCount = 0;
+
 		while (m_LocalCount > 0 &&
 			m_Locals[m_LocalCount - 1].depth > m_ScopeDepth)
 		{
-			// TODO: Emit an OP_POPN with a number of pops
-			EmitByte(OP_POP);
+			popCount++;
 			m_LocalCount--;
 		}
+
+		if (popCount == 1)
+			EmitByte(OP_POP);
+		else if (popCount > 1)
+			EmitBytes(OP_POP_N, popCount);
 	}
 
 	void Compiler::NamedVariable(Token name, bool canAssign)
@@ -680,7 +689,7 @@ namespace script
 			setOp = OP_SET_LOCAL;
 		}
 		else {
-			arg = (int)GetCurrentChunk()->AddConstant(Value(memoryManager.AllocateString(name.value)));
+			arg = (int)GetCurrentChunk()->AddConstant(Value(CurrentHeap().AllocateString(name.value)));
 			getOp = OP_GET_GLOBAL;
 			setOp = OP_SET_GLOBAL;
 		}
@@ -689,7 +698,7 @@ namespace script
 
 
 
-		if (canAssign && parser.current.type == TK_ASSIGN)
+		if (canAssign && m_Parser->current.type == TK_ASSIGN)
 		{
 			Advance();
 			Expression();
@@ -698,7 +707,13 @@ namespace script
 			EmitByte(setOp);
 			EmitShort((uint16_t)arg);
 		}
+		else if (getOp == OP_GET_LOCAL && arg <= 3) {
+			EmitByte(OP_GET_LOCAL_0 + arg);
+		}
 		else {
+			if (getOp == OP_GET_GLOBAL)
+				m_LastGlobalGet = (int)GetCurrentChunk()->code.size();
+
 			EmitByte(getOp);
 
 
@@ -732,7 +747,7 @@ namespace script
 		DeclareVariable();
 		if (m_ScopeDepth > 0) return 0;
 
-		return GetCurrentChunk()->AddConstant(Value(memoryManager.AllocateString(parser.previous.value)));
+		return GetCurrentChunk()->AddConstant(Value(CurrentHeap().AllocateString(m_Parser->previous.value)));
 	}
 
 	void Compiler::DefineVariable(uint16_t global, bool exportVar)
@@ -761,7 +776,7 @@ namespace script
 			return;
 		}
 
-		Token* name = &parser.previous;
+		Token* name = &m_Parser->previous;
 
 		for (int i = m_LocalCount - 1; i >= 0; i--)
 		{
@@ -823,19 +838,29 @@ namespace script
 		Expression();
 		Consume(TK_CLOSE_BRACE, "Expected ')' after if condition");
 
-		int thenJump = EmitJump(OP_JUMP_IF_FALSE);
+		bool fused = false;
+		int thenJump = EmitConditionJump(&fused);
 
-		EmitByte(OP_POP);
+		if (!fused)
+			EmitByte(OP_POP);
 
 		Statement();
 
+		// Nothing to pop and nothing to jump over
+		if (fused && !Check(TK_ELSE))
+		{
+			PatchJump(thenJump);
+			return;
+		}
+
 		int elseJump = EmitJump(OP_JUMP);
 
 		//EmitByte(OP_POP);
 
 		PatchJump(thenJump);
 
-		EmitByte(OP_POP);
+		if (!fused)
+			EmitByte(OP_POP);
 
 		if (Match(TK_ELSE))
 			Statement();
@@ -851,15 +876,20 @@ namespace script
 		Expression();
 		Consume(TK_CLOSE_BRACE, "Expected ')' after while condition");
 
-		int exitJump = EmitJump(OP_JUMP_IF_FALSE);
-		EmitByte(OP_POP);
+		bool fused = false;
+		int exitJump = EmitConditionJump(&fused);
+
+		if (!fused)
+			EmitByte(OP_POP);
 
 		Statement();
 
 		EmitLoop(loopStart);
 
 		PatchJump(exitJump);
-		EmitByte(OP_POP);
+
+		if (!fused)
+			EmitByte(OP_POP);
 	}
 
 	void Compiler::ForStatement()
@@ -880,7 +910,7 @@ namespace script
 				// Define a new variable 
 				VariableDeclaration(false, false);
 
-				NamedVariable(parser.previous, false);
+				NamedVariable(m_Parser->previous, false);
 				
 				EmitByte(OP_POP);
 
@@ -917,6 +947,7 @@ namespace script
 
 				GetCurrentChunk()->code[patch] = (exit >> 8) & 0xFF;
 				GetCurrentChunk()->code[size_t(patch + 1)] = exit & 0xFF;
+				m_LastJumpTarget = (int)GetCurrentChunk()->code.size();
 				
 				EmitByte(OP_POP);
 				EndScope();
@@ -935,14 +966,17 @@ namespace script
 		int loopStart = (int)GetCurrentChunk()->code.size();
 		
 		int exitJump = -1;
+		bool fused = false;
 
 		if (!Match(TK_SEMICOLON))
 		{
 			Expression();
 			Consume(TK_SEMICOLON, "Expected ';' after loop condition");
 
-			exitJump = EmitJump(OP_JUMP_IF_FALSE);
-			EmitByte(OP_POP);
+			exitJump = EmitConditionJump(&fused);
+
+			if (!fused)
+				EmitByte(OP_POP);
 		}
 		
 		if (!Match(TK_CLOSE_BRACE))
@@ -966,7 +1000,9 @@ namespace script
 		if (exitJump != -1)
 		{
 			PatchJump(exitJump);
-			EmitByte(OP_POP);
+
+			if (!fused)
+				EmitByte(OP_POP);
 		}
 
 		EndScope();
@@ -978,7 +1014,11 @@ namespace script
 
 		MarkInitialised();
 
-		Function(TYPE_FUNCTION, async);
+		ObjFunction* function = Function(TYPE_FUNCTION, async);
+
+		// Calls after this can have the body copied in, the global gets checked before each one in case it changed
+		if (m_FunctionType == TYPE_SCRIPT && m_ScopeDepth == 0 && m_OptimizationLevel >= OPT_FULL && CanInline(function))
+			m_InlineFunctions.push_back(function);
 
 		DefineVariable((uint16_t)global, false);
 	}
@@ -987,9 +1027,9 @@ namespace script
 	{
 		Consume(TK_IDENTIFIER, "Expected class name");
 
-		Token className = parser.previous;
+		Token className = m_Parser->previous;
 
-		uint16_t nameConstant = (uint16_t)GetCurrentChunk()->AddConstant(Value(memoryManager.AllocateString(parser.previous.value)));
+		uint16_t nameConstant = (uint16_t)GetCurrentChunk()->AddConstant(Value(CurrentHeap().AllocateString(m_Parser->previous.value)));
 		DeclareVariable();
 
 
@@ -1012,9 +1052,9 @@ namespace script
 		EmitByte(OP_POP);
 	}
 
-	void Compiler::Function(FunctionType type, bool async)
+	ObjFunction* Compiler::Function(FunctionType type, bool async)
 	{
-		Compiler compiler;
+		Compiler compiler(*m_Parser);
 		compiler.InitCompiler(this, type);
 		
 		compiler.BeginScope();
@@ -1025,10 +1065,10 @@ namespace script
 		{
 			do {
 
-				m_Function->arity++;
-				if (m_Function->arity > 255)
+				compiler.m_Function->arity++;
+				if (compiler.m_Function->arity > 255)
 				{
-					ErrorAt(parser.current, "Exceeded parameter limit for function");
+					ErrorAt(m_Parser->current, "Exceeded parameter limit for function");
 				}
 
 				uint16_t constant = (uint16_t)compiler.ParseVariable("Expected parameter name");
@@ -1039,14 +1079,16 @@ namespace script
 
 		Consume(TK_CLOSE_BRACE, "Expected ')' after function arguments");
 
+		ObjFunction* func = nullptr;
+
 		if (Match(TK_EQUALS_ARROW))
 		{
 			compiler.Expression();
 			Consume(TK_SEMICOLON, "Expected ';' after expression.");
 
-			compiler.EmitByte(OP_RETURN);
+			compiler.EmitValueReturn();
 
-			ObjFunction* func = compiler.EndCompiler();
+			func = compiler.EndCompiler();
 
 			EmitConstant(Value(func));
 		}
@@ -1056,14 +1098,12 @@ namespace script
 
 			compiler.Block();
 
-			ObjFunction* func = compiler.EndCompiler();
+			func = compiler.EndCompiler();
 
 			EmitConstant(Value(func));
 		}
 
-		// After we leave and come back to this compiler we need to reset the rules because its still set for the higher scoped compiler
-		SetRules();
-
+		return func;
 	}
 
 	void Compiler::ReturnStatement()
@@ -1081,7 +1121,7 @@ namespace script
 
 			Expression();
 			Consume(TK_SEMICOLON, "Expected ';' after return value.");
-			EmitByte(OP_RETURN);
+			EmitValueReturn();
 		}
 	}
 
@@ -1089,30 +1129,57 @@ namespace script
 	{
 		Consume(TK_IDENTIFIER, "Expected Identifier before '.'.");
 
-		uint16_t name = (uint16_t)GetCurrentChunk()->AddConstant(Value(memoryManager.AllocateString(parser.previous.value)));
+		std::string property = m_Parser->previous.value;
+		uint16_t name = (uint16_t)GetCurrentChunk()->AddConstant(Value(CurrentHeap().AllocateString(property)));
+
+		// Each property access gets its own inline cache in the chunk
+		uint16_t cache = (uint16_t)GetCurrentChunk()->AddPropertyCache();
+
+		ObjString* receiver = LastGlobal();
 
 		if (canAssign && Match(TK_ASSIGN)) {
 			Expression();
 			EmitByte(OP_SET_PROPERTY);
 			EmitShort(name);
+			EmitShort(cache);
 		}
-		// TODO: Get invokes working for optimisation 
-		/*else if (Match(TK_OPEN_BRACE))
+		else if (Match(TK_OPEN_BRACE))
 		{
+			// A method call gets fused into a single invoke
+			// This means the VM can call the method directly without creating a bound method first
 			uint8_t argCount = ArgumentList();
+
+			if (argCount > 16)
+			{
+				ErrorAt(m_Parser->current, "Too many arguments in method call. Max 16 arguments.");
+			}
+
+			// Calls to std:maths through the module it was imported as
+			uint8_t intrinsic = receiver && IsMathsImport(receiver->str) ? MathsIntrinsic(property.c_str(), argCount) : 0;
+
+			if (intrinsic)
+			{
+				EmitByte(intrinsic);
+				EmitShort(name);
+				EmitShort(cache);
+				return;
+			}
+
 			EmitByte(OP_INVOKE);
-			EmitBytes((name >> 8) & 0xFF, name & 0xFF);
+			EmitShort(name);
 			EmitByte(argCount);
-		}*/
+			EmitShort(cache);
+		}
 		else {
 			EmitByte(OP_GET_PROPERTY);
 			EmitShort(name);
+			EmitShort(cache);
 		}
 	}
 
 	void Compiler::Increment(bool canAssign)
 	{
-		TokenType type = parser.previous.type;
+		TokenType type = m_Parser->previous.type;
 
 	}
 
@@ -1122,24 +1189,24 @@ namespace script
 	{
 		FunctionType type = TYPE_METHOD;
 
-		if (Check(TK_IDENTIFIER) && parser.current.value == "construct")
+		if (Check(TK_IDENTIFIER) && m_Parser->current.value == "construct")
 		{
 			type = TYPE_INITIALIZER;
 		}
 		else
 		{
-			if (parser.current.value == "constructor")
+			if (m_Parser->current.value == "constructor")
 			{
 				// Might of meant construct
 
-				ErrorAt(parser.current, "constructor is not a valid method without a func declaration. Did you mean construct?");
+				ErrorAt(m_Parser->current, "constructor is not a valid method without a func declaration. Did you mean construct?");
 			}
 
 			Consume(TK_FUNCTION, "Methods must begin with a function declaration.");
 		}
 		Consume(TK_IDENTIFIER, "Expected method name");
 
-		uint16_t name = (uint16_t)GetCurrentChunk()->AddConstant(Value(memoryManager.AllocateString(parser.previous.value)));
+		uint16_t name = (uint16_t)GetCurrentChunk()->AddConstant(Value(CurrentHeap().AllocateString(m_Parser->previous.value)));
 
 		
 		Function(type);
@@ -1151,7 +1218,7 @@ namespace script
 	void Compiler::Self(bool canAssign)
 	{
 		if (m_FunctionType != TYPE_METHOD && m_FunctionType != TYPE_INITIALIZER)
-			ErrorAt(parser.current, "Cannot use self within non-class method");
+			ErrorAt(m_Parser->current, "Cannot use self within non-class method");
 
 		Variable(false);
 	}
@@ -1162,15 +1229,20 @@ namespace script
 
 		Consume(TK_STRING, "Expected module name string. ");
 
-		uint16_t moduleName = (uint16_t)GetCurrentChunk()->AddConstant(Value(memoryManager.AllocateString(parser.previous.value.substr(1, parser.previous.value.length() - 2))));
+		uint16_t moduleName = (uint16_t)GetCurrentChunk()->AddConstant(Value(CurrentHeap().AllocateString(m_Parser->previous.value.substr(1, m_Parser->previous.value.length() - 2))));
 		
 
+		bool maths = m_Parser->previous.value == "\"std:maths\"";
+
 		if (Match(TK_AS))
 		{
 			// Check if there is an 'as'
 			Consume(TK_IDENTIFIER, "Expected name to import module as.");
 
-			uint16_t asName = (uint16_t)GetCurrentChunk()->AddConstant(Value(memoryManager.AllocateString(parser.previous.value)));
+			if (maths)
+				m_MathsImports.push_back(m_Parser->previous.value);
+
+			uint16_t asName = (uint16_t)GetCurrentChunk()->AddConstant(Value(CurrentHeap().AllocateString(m_Parser->previous.value)));
 
 			EmitByte(OP_IMPORT_MODULE_AS);
 			EmitShort(moduleName);
@@ -1178,6 +1250,9 @@ namespace script
 		}
 		else
 		{
+			if (maths)
+				m_MathsImports.push_back("");
+
 			EmitByte(OP_IMPORT_MODULE);
 			EmitShort(moduleName);
 		}
@@ -1186,6 +1261,59 @@ namespace script
 
 	}
 
+	bool Compiler::IsMathsImport(const std::string& name)
+	{
+		// Functions see the imports of the scripts they are in
+		for (Compiler* compiler = this; compiler; compiler = compiler->m_Enclosing)
+		{
+			for (const std::string& import : compiler->m_MathsImports)
+			{
+				if (import == name)
+					return true;
+			}
+		}
+
+		return false;
+	}
+
+	ObjString* Compiler::LastGlobal(uint16_t* constant)
+	{
+		Chunk* chunk = GetCurrentChunk();
+
+		if (m_LastGlobalGet < 0 || (size_t)m_LastGlobalGet + 3 != chunk->code.size())
+			return nullptr;
+
+		uint16_t index = (uint16_t)((chunk->code[m_LastGlobalGet + 1] << 8) | chunk->code[m_LastGlobalGet + 2]);
+
+		if (constant)
+			*constant = index;
+
+		return (ObjString*)chunk->constants[index].ToObject();
+	}
+
+	// Same order as the OP_MATH_ instructions
+	static const struct { const char* name; uint8_t arity; } mathsIntrinsics[] = {
+		{ "sqrt", 1 },
+		{ "sin", 1 },
+		{ "cos", 1 },
+		{ "abs", 1 },
+		{ "floor", 1 },
+		{ "min", 2 },
+		{ "max", 2 },
+		{ "atan2", 2 }
+	};
+
+	uint8_t Compiler::MathsIntrinsic(const char* name, uint8_t argCount)
+	{
+		for (uint8_t i = 0; i < sizeof(mathsIntrinsics) / sizeof(mathsIntrinsics[0]); i++)
+		{
+			if (strcmp(mathsIntrinsics[i].name, name) == 0)
+				return mathsIntrinsics[i].arity == argCount ? OP_MATH_SQRT + i : 0;
+		}
+
+		return 0;
+	}
+
 	void Compiler::AwaitStatement()
 	{
 	}
@@ -1193,16 +1321,31 @@ namespace script
 
 	void Compiler::Call(bool canAssign)
 	{
+		uint16_t calleeConstant = 0;
+		ObjString* callee = LastGlobal(&calleeConstant);
+
 		uint8_t argCount = ArgumentList();
 
 		if (argCount > 16)
 		{
-			ErrorAt(parser.current, "Too many arguments in function call. Max 16 arguments.");
+			ErrorAt(m_Parser->current, "Too many arguments in function call. Max 16 arguments.");
+		}
+
+		// std:maths functions imported straight into the globals
+		uint8_t intrinsic = callee && IsMathsImport("") ? MathsIntrinsic(callee->str, argCount) : 0;
+
+		if (intrinsic)
+		{
+			EmitByte(intrinsic);
+			EmitShort(calleeConstant);
+			EmitShort((uint16_t)GetCurrentChunk()->AddPropertyCache());
+			return;
 		}
 
 		// By using this of having a different op code for each argument we save a byte per function call
 		// Which for big projects can add up
 		// Also saves a read in the VM 
+		m_LastCall = (int)GetCurrentChunk()->code.size();
 		EmitByte(OP_CALL_0 + argCount);
 	}
 
@@ -1228,6 +1371,38 @@ namespace script
 		return (int)GetCurrentChunk()->code.size() - 2;
 	}
 
+	int Compiler::EmitConditionJump(bool* fused)
+	{
+		Chunk* chunk = GetCurrentChunk();
+		int last = (int)chunk->code.size() - 1;
+
+		*fused = false;
+
+		// Can't fuse if something jumps to just after the comparison, it would skip the jump
+		if (m_LastComparison != last || m_LastJumpTarget > last)
+			return EmitJump(OP_JUMP_IF_FALSE);
+
+		uint8_t jump = 0;
+
+		switch (chunk->code[last])
+		{
+		case OP_LESS:			jump = OP_JUMP_IF_NOT_LESS; break;
+		case OP_GREATER:		jump = OP_JUMP_IF_NOT_GREATER; break;
+		case OP_LESS_EQUAL:		jump = OP_JUMP_IF_NOT_LESS_EQUAL; break;
+		case OP_GREATER_EQUAL:	jump = OP_JUMP_IF_NOT_GREATER_EQUAL; break;
+		case OP_EQUAL:			jump = OP_JUMP_IF_NOT_EQUAL; break;
+		case OP_NOT_EQUAL:		jump = OP_JUMP_IF_EQUAL; break;
+		default:
+			return EmitJump(OP_JUMP_IF_FALSE);
+		}
+
+		chunk->code.pop_back();
+		m_LastComparison = -1;
+
+		*fused = true;
+		return EmitJump(jump);
+	}
+
 	void Compiler::EmitLoop(int loopStart, bool iter)
 	{
 		EmitByte(iter ? OP_ITER : OP_LOOP);
@@ -1251,6 +1426,8 @@ namespace script
 
 		GetCurrentChunk()->code[offset] = (jump >> 8) & 0xFF;
 		GetCurrentChunk()->code[size_t(offset + 1)] = jump & 0xFF;
+
+		m_LastJumpTarget = (int)GetCurrentChunk()->code.size();
 	}
 
 	void Compiler::And(bool canAssign)
@@ -1279,26 +1456,26 @@ namespace script
 	void Compiler::ParsePrecedence(Precedence precedence)
 	{
 		Advance();
-		std::function<void(bool)> prefixRule = GetRule(parser.previous.type)->prefix;
+		ParseFn prefixRule = GetRule(m_Parser->previous.type)->prefix;
 
 		if (prefixRule == NULL) {
-			ErrorAt(parser.previous, "Expect expression.");
+			ErrorAt(m_Parser->previous, "Expect expression.");
 			return;
 		}
 
 		bool canAssign = precedence <= PREC_ASSIGNMENT;
-		prefixRule(canAssign);
+		(this->*prefixRule)(canAssign);
 
-		while (precedence <= GetRule(parser.current.type)->precedence) 
+		while (precedence <= GetRule(m_Parser->current.type)->precedence) 
 		{
 			Advance();
-			std::function<void(bool)> infixRule = GetRule(parser.previous.type)->infix;
+			ParseFn infixRule = GetRule(m_Parser->previous.type)->infix;
  			if (infixRule)
-				infixRule(canAssign);
+				(this->*infixRule)(canAssign);
 		}
 
 		if (canAssign && Match(TK_ASSIGN)) {
-			ErrorAt(parser.current, "Invalid Assignment target");
+			ErrorAt(m_Parser->current, "Invalid Assignment target");
 
 		}
 
@@ -1306,12 +1483,15 @@ namespace script
 
 	void Compiler::Number(bool canAssign)
 	{
-		Value val(std::stod(parser.previous.value));
+		Value val(std::stod(m_Parser->previous.value));
 		EmitConstant(val);
 	}
 
-	ParseRule* Compiler::GetRule(TokenType type)
+	const ParseRule* Compiler::GetRule(TokenType type)
 	{
+		// Only ever read so every compiler on every thread shares the one table
+		static const std::array<ParseRule, TOKEN_COUNT> rules = MakeRules();
+
 		return &rules[type];
 	}
 }
\ No newline at end of file
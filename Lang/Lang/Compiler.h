@@ -4,6 +4,8 @@
 #include "Value.h"
 #include "Chunk.h"
 #include "Lexer.h"
+#include "Optimizer.h"
+#include <array>
 #include <functional>
 
 namespace script
@@ -27,10 +29,14 @@ namespace script
 	};
 
 
+	class Compiler;
+
+	using ParseFn = void (Compiler::*)(bool canAssign);
+
 	struct ParseRule
 	{
-		std::function<void(bool)> prefix;
-		std::function<void(bool)> infix;
+		ParseFn prefix = nullptr;
+		ParseFn infix = nullptr;
 		Precedence precedence = PREC_NONE;
 	};
 
@@ -40,8 +46,20 @@ namespace script
 		uint32_t depth = 0;
 	};
 
+	// One per script being compiled, the compilers for the functions inside it share their script's
 	struct Parser
 	{
+		void Advance();
+		void Consume(TokenType type, const std::string& msg);
+		bool Check(TokenType type);
+		bool Match(TokenType type);
+		bool Peek(size_t offset, TokenType type);
+		Token GetNextToken();
+
+		void ErrorAt(Token tk, const std::string& msg);
+		void Error(const std::string& msg);
+		void Synchronise();
+
 		std::vector<Token> tokens;
 		size_t tokenOffset = 0;
 
@@ -54,45 +72,91 @@ namespace script
 
 	// This function takes an input source string, compiles it and outputs a ObjFunction pointer
 	// containing the compiled bytecode 
-	ObjFunction* CompileScript(const std::string& source);
+	// With diagnostics on the compiler prints what it did to the code, eg. which calls got inlined
+	ObjFunction* CompileScript(const std::string& source, OptimizationLevel level = DefaultOptimizationLevel, bool diagnostics = false);
 
 	class Compiler
 	{
 	public:
 
+		explicit Compiler(Parser& parser) : m_Parser(&parser) {}
+
 		~Compiler();
 
 		void InitCompiler(Compiler* enclosing, FunctionType type);
 
 		ObjFunction* EndCompiler();
 
-		ObjFunction* Compile(FunctionType type);
+		ObjFunction* Compile(FunctionType type, OptimizationLevel level = DefaultOptimizationLevel, bool diagnostics = false);
 
 	private:
 
-		void SetRules();
+		static std::array<ParseRule, TOKEN_COUNT> MakeRules();
 
 		Chunk* GetCurrentChunk()
 		{
 			return &m_Function->chunk;
 		}
 
+		// The parser is shared with the enclosing compilers
+		void Advance() { m_Parser->Advance(); }
+		void Consume(TokenType type, const std::string& msg) { m_Parser->Consume(type, msg); }
+		bool Check(TokenType type) { return m_Parser->Check(type); }
+		bool Match(TokenType type) { return m_Parser->Match(type); }
+		bool Peek(size_t offset, TokenType type) { return m_Parser->Peek(offset, type); }
+		void ErrorAt(Token tk, const std::string& msg) { m_Parser->ErrorAt(tk, msg); }
+		void Error(const std::string& msg) { m_Parser->Error(msg); }
+		void Synchronise() { m_Parser->Synchronise(); }
+
+		Parser* m_Parser;
+
 
 		Compiler* m_Enclosing = nullptr;
 
 		ObjFunction* m_Function = nullptr;
 		FunctionType m_FunctionType = TYPE_SCRIPT;
 
+		// Functions inside this one get the same level
+		OptimizationLevel m_OptimizationLevel = DefaultOptimizationLevel;
+		bool m_Diagnostics = false;
+
+		// Script only, functions declared at the top that are small enough to inline into the code after them
+		std::vector<ObjFunction*> m_InlineFunctions;
+
 		uint32_t m_LocalCount = 0;
 		uint32_t m_ScopeDepth = 0;
 		Local* m_Locals = nullptr;
 
+		// Used to decide when it is safe to fuse instructions
+		// A comparison can only be fused with the jump after it if nothing jumps in between them
+		int m_LastComparison = -1;
+		int m_LastJumpTarget = -1;
+
+		// Where the last GET_GLOBAL starts, a call right after it knows what it is calling
+		int m_LastGlobalGet = -1;
+
+		// Where the last CALL is, a return right after it turns it into a tail call
+		int m_LastCall = -1;
+
+		// Names std:maths has been imported as, an empty name means it was imported into the globals
+		std::vector<std::string> m_MathsImports;
+
+		bool IsMathsImport(const std::string& name);
+
+		// The name of the global the last instruction got or nullptr if it wasn't a global
+		ObjString* LastGlobal(uint16_t* constant = nullptr);
+
+		// Returns the OP_MATH_ instruction for a std:maths call or 0 if there isn't one
+		uint8_t MathsIntrinsic(const char* name, uint8_t argCount);
+
 		void MarkInitialised();
 
 		// Byte code function 
 
 		void EmitByte(uint8_t byte);
 		void EmitReturn();
+		// Returns the value on top of the stack, if it came straight from a call the call becomes a tail call
+		void EmitValueReturn();
 		void EmitBytes(uint8_t byte1, uint8_t byte2);
 		void EmitConstant(Value value);
 		void EmitShort(uint16_t s);
@@ -126,7 +190,7 @@ namespace script
 		void Range(bool canAssign);
 		void AwaitStatement();
 
-		void Function(FunctionType type, bool async = false);
+		ObjFunction* Function(FunctionType type, bool async = false);
 
 		void Method();
 
@@ -136,6 +200,14 @@ namespace script
 		void Or(bool canAssign);
 
 		int EmitJump(uint8_t instruction);
+
+		// Emits the jump that skips the body of an if or loop when the condition is false
+		// If the condition ends in a comparison it gets fused into a compare and branch 
+		// which leaves nothing on the stack, fused is set so the caller can skip popping the condition
+		int EmitConditionJump(bool* fused);
+
+		// Rewrites a number constant operand into a single instruction that uses it, eg. ADD_CONSTANT 
+		bool FuseConstantOperand(size_t operandStart, uint8_t fused);
 		void EmitLoop(int loopStart, bool iter = false);
 
 		void PatchJump(int offset);
@@ -160,7 +232,7 @@ namespace script
 
 		size_t ParseVariable(const std::string& message);
 
-		ParseRule* GetRule(TokenType type);
+		const ParseRule* GetRule(TokenType type);
 
 		void ParsePrecedence(Precedence precedence);
 	};
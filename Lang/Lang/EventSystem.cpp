@@ -1,36 +1,252 @@
-
 #include "EventSystem.h"
+#include "VM.h"
 
-namespace script
-{
-	EventManager eventManager;
+#include <algorithm>
 
 #ifdef _WIN32
 
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
 
+#elif defined(__linux__)
+
+#include <cerrno>
+#include <ctime>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#else
+#error Only Windows and Linux are supported.
+#endif
+
+namespace script
+{
+#ifdef _WIN32
+
+	// Thread timers only get an id back, this finds the Timer that set them
+	// They only fire on the thread that set them so each thread only needs to know about its own
+	static thread_local std::map<UINT_PTR, Timer*> threadTimers;
+
 	static void CALLBACK TimerCallback(HWND _hWnd, UINT _msg, UINT_PTR _idTimer, DWORD _dwTime)
 	{
-		// Timer is done
+		auto it = threadTimers.find(_idTimer);
+		if (it == threadTimers.end())
+		{
+			KillTimer(_hWnd, _idTimer);
+			return;
+		}
+
+		it->second->Tick();
+	}
+
+	static uint64_t NowTick()
+	{
+		return GetTickCount64();
+	}
+
+	// Tick counts are already whole milliseconds
+	static uint64_t ExpiryTick(uint64_t durationMs)
+	{
+		return GetTickCount64() + durationMs;
+	}
 
-		std::function<void()> callback = Timer::GetInstance().GetCallbackForID(_idTimer);
+#elif defined(__linux__)
 
-		if (callback)
-			callback();
+	static uint64_t MonotonicNow()
+	{
+		timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+	}
+
+	static uint64_t NowTick()
+	{
+		return MonotonicNow() / 1000000ull;
+	}
 
-		KillTimer(_hWnd, _idTimer);
-		Timer::GetInstance().Remove(_idTimer);
+	// Rounded up so a timer never goes off before its time
+	static uint64_t ExpiryTick(uint64_t durationMs)
+	{
+		return (MonotonicNow() + durationMs * 1000000ull + 999999ull) / 1000000ull;
 	}
 
+#endif
 
+	static uint32_t ctz64(uint64_t value)
+	{
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward64(&index, value);
+		return (uint32_t)index;
 #else
-#error Only Windows is supported. 
+		return (uint32_t)__builtin_ctzll(value);
 #endif
+	}
+
+	EventManager::~EventManager()
+	{
+#ifdef _WIN32
+		if (m_Wakeup != -1)
+			CloseHandle((HANDLE)m_Wakeup);
+#elif defined(__linux__)
+		if (m_Wakeup != -1)
+			close((int)m_Wakeup);
+
+		if (m_Poller != -1)
+			close((int)m_Poller);
+#endif
+	}
+
+	bool EventManager::Open()
+	{
+		std::call_once(m_Opened, [this]()
+		{
+#ifdef _WIN32
+			m_Wakeup = (intptr_t)CreateEvent(NULL, FALSE, FALSE, NULL);
+#elif defined(__linux__)
+			m_Poller = epoll_create1(EPOLL_CLOEXEC);
+			m_Wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+			if (m_Poller == -1 || m_Wakeup == -1)
+				return;
+
+			// Tagged with its own descriptor like the watches, it just never gets a callback
+			epoll_event event{};
+			event.events = EPOLLIN;
+			event.data.fd = (int)m_Wakeup;
+			epoll_ctl((int)m_Poller, EPOLL_CTL_ADD, (int)m_Wakeup, &event);
+#endif
+		});
+
+#ifdef _WIN32
+		return m_Wakeup != (intptr_t)NULL;
+#else
+		return m_Poller != -1 && m_Wakeup != -1;
+#endif
+	}
 
 	void EventManager::TranslateMessages()
 	{
+		Dispatch(0);
+	}
+
+	void EventManager::Poll()
+	{
+		pollCountdown = SafepointsPerPoll;
+
+#ifdef __linux__
+		// The timers watch their descriptor as well, so with nothing watched there's nothing to find
+		if (m_Watches.empty() && m_PostedCount.load(std::memory_order_acquire) == 0)
+			return;
+#endif
+
+		uint64_t now = NowTick();
+
+		if (now < m_NextPoll)
+			return;
+
+		m_NextPoll = now + 1;
+		TranslateMessages();
+	}
+
+	void EventManager::Wait(int timeoutMs)
+	{
+		Dispatch(timeoutMs);
+	}
+
+	void EventManager::Post(std::function<void()> callback)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_PostMutex);
+			m_Posted.push_back(std::move(callback));
+		}
+
+		m_PostedCount.fetch_add(1, std::memory_order_release);
+
+		Wake();
+	}
+
+	void EventManager::Wake()
+	{
+		if (!Open())
+			return;
+
 #ifdef _WIN32
+		SetEvent((HANDLE)m_Wakeup);
+#elif defined(__linux__)
+		uint64_t one = 1;
+		ssize_t written = write((int)m_Wakeup, &one, sizeof(one));
+		(void)written;
+#endif
+	}
+
+	bool EventManager::Watch(int fd, uint32_t events, WatchCallback callback, bool keepAlive)
+	{
+#ifdef __linux__
+		if (!Open() || m_Watches.find(fd) != m_Watches.end())
+			return false;
+
+		epoll_event event{};
+		event.events = events;
+		event.data.fd = fd;
+
+		if (epoll_ctl((int)m_Poller, EPOLL_CTL_ADD, fd, &event) != 0)
+			return false;
+
+		auto entry = std::make_shared<WatchEntry>();
+		entry->callback = std::move(callback);
+		entry->keepAlive = keepAlive;
+
+		m_Watches[fd] = std::move(entry);
+
+		if (keepAlive)
+			m_KeepAlive++;
+
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	void EventManager::Unwatch(int fd)
+	{
+#ifdef __linux__
+		auto it = m_Watches.find(fd);
+		if (it == m_Watches.end())
+			return;
+
+		if (it->second->keepAlive)
+			m_KeepAlive--;
+
+		m_Watches.erase(it);
+		epoll_ctl((int)m_Poller, EPOLL_CTL_DEL, fd, nullptr);
+#endif
+	}
+
+	void EventManager::RunPosted()
+	{
+		std::vector<std::function<void()>> posted;
+
+		{
+			std::lock_guard<std::mutex> lock(m_PostMutex);
+			posted.swap(m_Posted);
+		}
+
+		for (std::function<void()>& callback : posted)
+		{
+			callback();
+			m_PostedCount.fetch_sub(1, std::memory_order_release);
+		}
+	}
+
+	void EventManager::Dispatch(int timeoutMs)
+	{
+#ifdef _WIN32
+		if (timeoutMs != 0 && Open())
+			MsgWaitForMultipleObjectsEx(1, (HANDLE*)&m_Wakeup, timeoutMs < 0 ? INFINITE : (DWORD)timeoutMs, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+
 		MSG msg;
 
 		while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE) > 0)
@@ -38,16 +254,411 @@ namespace script
 			TranslateMessage(&msg);
 			DispatchMessage(&msg);
 		}
+#elif defined(__linux__)
+		if (!Open())
+			return;
+
+		epoll_event events[64];
+		int count = epoll_wait((int)m_Poller, events, 64, timeoutMs);
+
+		// A signal just means going round again
+		if (count < 0 && errno == EINTR)
+			count = 0;
+
+		for (int i = 0; i < count; i++)
+		{
+			int fd = events[i].data.fd;
+
+			if (fd == (int)m_Wakeup)
+			{
+				uint64_t value;
+				ssize_t read = ::read(fd, &value, sizeof(value));
+				(void)read;
+				continue;
+			}
+
+			// An earlier callback could have unwatched it
+			auto it = m_Watches.find(fd);
+			if (it == m_Watches.end())
+				continue;
+
+			std::shared_ptr<WatchEntry> entry = it->second;
+			entry->callback(events[i].events);
+		}
 #endif
-	}
 
+		if (m_PostedCount.load(std::memory_order_acquire) != 0)
+			RunPosted();
+	}
 
+	Timer::Timer(EventManager& events) : m_Events(events)
+	{
+		for (auto& level : m_Slots)
+		{
+			for (uint32_t& head : level)
+				head = Nil;
+		}
+	}
 
-	void Timer::StartTimer(uint64_t durationMs, std::function<void()> callback)
+	Timer::~Timer()
 	{
 #ifdef _WIN32
-		m_Callbacks[SetTimer(NULL, 0, durationMs, TimerCallback)] = callback;
+		if (m_OSTimer != 0)
+		{
+			KillTimer(NULL, m_OSTimer);
+			threadTimers.erase(m_OSTimer);
+		}
+#elif defined(__linux__)
+		if (m_Descriptor != -1)
+		{
+			m_Events.Unwatch(m_Descriptor);
+			close(m_Descriptor);
+		}
+#endif
+	}
+
+	TimerID Timer::StartTimer(uint64_t durationMs, std::function<void()> callback)
+	{
+		return Add(durationMs, nullptr, std::move(callback));
+	}
+
+	TimerID Timer::QueueFiber(uint64_t durationMs, ObjFunction* function)
+	{
+		return Add(durationMs, function, nullptr);
+	}
+
+	TimerID Timer::Add(uint64_t durationMs, ObjFunction* function, std::function<void()> callback)
+	{
+#ifdef __linux__
+		// Made with the first timer, most VMs never start one
+		if (m_Descriptor == -1)
+		{
+			m_Descriptor = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+			if (m_Descriptor == -1)
+				return 0;
+
+			// Only the timers themselves keep the loop going
+			m_Events.Watch(m_Descriptor, EPOLLIN, [this](uint32_t) { Tick(); }, false);
+		}
 #endif
+
+		// Nothing to cascade in an empty wheel so it can jump straight to now
+		if (m_Count == 0)
+			m_Current = NowTick();
+
+		uint32_t index;
+
+		if (!m_Free.empty())
+		{
+			index = m_Free.back();
+			m_Free.pop_back();
+		}
+		else
+		{
+			index = (uint32_t)m_Nodes.size();
+			m_Nodes.emplace_back();
+		}
+
+		TimerNode& node = m_Nodes[index];
+		node.expires = ExpiryTick(durationMs);
+		node.sequence = m_Sequence++;
+		node.active = true;
+		node.function = function;
+		node.callback = std::move(callback);
+
+		Insert(index);
 		m_Count++;
+
+		if (m_Armed == 0 || node.expires < m_Armed)
+			Arm();
+
+		return ((TimerID)node.generation << 32) | index;
+	}
+
+	bool Timer::CancelTimer(TimerID id)
+	{
+		uint32_t index = (uint32_t)id;
+		uint32_t generation = (uint32_t)(id >> 32);
+
+		if (index >= m_Nodes.size() || !m_Nodes[index].active || m_Nodes[index].generation != generation)
+			return false;
+
+		Unlink(index);
+		Free(index);
+		m_Count--;
+
+		// Left set, going off with nothing due just sets it again
+		return true;
+	}
+
+	void Timer::Insert(uint32_t index)
+	{
+		TimerNode& node = m_Nodes[index];
+
+		uint64_t tick = node.expires > m_Current ? node.expires : m_Current;
+		uint64_t delta = tick - m_Current;
+
+		uint32_t level = 0;
+		while (level + 1 < WheelLevels && delta >= (1ull << (WheelBits * (level + 1))))
+			level++;
+
+		// Too far out for the wheel, it waits in the furthest slot and gets placed again when that one comes round
+		const uint64_t span = 1ull << (WheelBits * WheelLevels);
+		if (delta >= span)
+			tick = m_Current + span - 1;
+
+		uint32_t slot = (uint32_t)(tick >> (WheelBits * level)) & (WheelSlots - 1);
+		uint32_t& head = m_Slots[level][slot];
+
+		node.level = (uint8_t)level;
+		node.slot = (uint8_t)slot;
+		node.prev = Nil;
+		node.next = head;
+
+		if (head != Nil)
+			m_Nodes[head].prev = index;
+
+		head = index;
+		m_Occupied[level] |= 1ull << slot;
+	}
+
+	void Timer::Unlink(uint32_t index)
+	{
+		TimerNode& node = m_Nodes[index];
+
+		if (node.prev != Nil)
+			m_Nodes[node.prev].next = node.next;
+		else
+			m_Slots[node.level][node.slot] = node.next;
+
+		if (node.next != Nil)
+			m_Nodes[node.next].prev = node.prev;
+
+		if (m_Slots[node.level][node.slot] == Nil)
+			m_Occupied[node.level] &= ~(1ull << node.slot);
+
+		node.prev = Nil;
+		node.next = Nil;
+	}
+
+	void Timer::Free(uint32_t index)
+	{
+		TimerNode& node = m_Nodes[index];
+
+		node.active = false;
+		node.function = nullptr;
+		node.callback = nullptr;
+		node.generation++;
+
+		m_Free.push_back(index);
+	}
+
+	void Timer::Tick()
+	{
+#ifdef __linux__
+		uint64_t expirations;
+		ssize_t read = ::read(m_Descriptor, &expirations, sizeof(expirations));
+		(void)read;
+#endif
+
+		// The OS timer went off so nothing is set anymore
+		m_Armed = 0;
+
+		Advance(NowTick());
+
+		Arm();
+	}
+
+	void Timer::Advance(uint64_t now)
+	{
+		if (m_Count == 0)
+		{
+			m_Current = now + 1;
+			return;
+		}
+
+		while (m_Current <= now)
+		{
+			uint32_t slot = (uint32_t)m_Current & (WheelSlots - 1);
+
+			if (slot == 0)
+				Cascade();
+
+			if (m_Occupied[0] & (1ull << slot))
+				ExpireSlot(slot);
+
+			m_Current++;
+
+			// Skips the empty ticks up to the next timer or the next cascade
+			slot = (uint32_t)m_Current & (WheelSlots - 1);
+
+			if (slot != 0)
+			{
+				uint64_t ahead = m_Occupied[0] >> slot;
+				uint64_t next = ahead ? m_Current + ctz64(ahead) : (m_Current | (WheelSlots - 1)) + 1;
+
+				m_Current = next < now + 1 ? next : now + 1;
+			}
+		}
+	}
+
+	void Timer::Cascade()
+	{
+		// Each level below wrapped around, so its next slot comes down
+		for (uint32_t level = 1; level < WheelLevels; level++)
+		{
+			uint32_t slot = (uint32_t)(m_Current >> (WheelBits * level)) & (WheelSlots - 1);
+			uint32_t index = m_Slots[level][slot];
+
+			m_Slots[level][slot] = Nil;
+			m_Occupied[level] &= ~(1ull << slot);
+
+			while (index != Nil)
+			{
+				uint32_t next = m_Nodes[index].next;
+				Insert(index);
+				index = next;
+			}
+
+			if (slot != 0)
+				break;
+		}
+	}
+
+	void Timer::ExpireSlot(uint32_t slot)
+	{
+		m_Batch.clear();
+		m_Callbacks.clear();
+		m_Expired.clear();
+
+		for (uint32_t index = m_Slots[0][slot]; index != Nil; index = m_Nodes[index].next)
+			m_Expired.push_back(index);
+
+		m_Slots[0][slot] = Nil;
+		m_Occupied[0] &= ~(1ull << slot);
+
+		// The slot lists are built at the front, so put them back in deadline order, oldest first when it's a tie
+		std::sort(m_Expired.begin(), m_Expired.end(), [this](uint32_t a, uint32_t b)
+		{
+			const TimerNode& x = m_Nodes[a];
+			const TimerNode& y = m_Nodes[b];
+			return x.expires != y.expires ? x.expires < y.expires : x.sequence < y.sequence;
+		});
+
+		for (uint32_t index : m_Expired)
+		{
+			TimerNode& node = m_Nodes[index];
+
+			if (node.function)
+			{
+				// Allocating can only queue a collection for later, so the fibers are safe until they're pushed
+				ObjFiber* fiber = CreateFiber(node.function);
+
+				if (fiber)
+				{
+					Event evnt{};
+					evnt.type = EVENT_PUSH_FIBER;
+					evnt.fiber = fiber;
+
+					m_Batch.push_back(evnt);
+				}
+			}
+			else if (node.callback)
+			{
+				m_Callbacks.push_back(std::move(node.callback));
+			}
+
+			Free(index);
+			m_Count--;
+		}
+
+		m_Events.Push(m_Batch.data(), m_Batch.size());
+
+		// Callbacks can start and cancel timers, the slot is already off the wheel
+		std::vector<std::function<void()>> callbacks;
+		callbacks.swap(m_Callbacks);
+
+		for (std::function<void()>& callback : callbacks)
+			callback();
+
+		callbacks.clear();
+		if (m_Callbacks.empty())
+			m_Callbacks.swap(callbacks);
+	}
+
+	void Timer::Arm()
+	{
+		uint64_t next = 0;
+
+		if (m_Count != 0)
+		{
+			uint32_t slot = (uint32_t)m_Current & (WheelSlots - 1);
+
+			// Level 0 covers the next 64 ticks, so the first bit from the current slot on (wrapping round) is the soonest
+			if (m_Occupied[0] != 0)
+			{
+				uint64_t rotated = (m_Occupied[0] >> slot) | (slot ? m_Occupied[0] << (WheelSlots - slot) : 0);
+				next = m_Current + ctz64(rotated);
+			}
+
+			// The outer levels only need looking at when level 0 wraps
+			bool outer = false;
+			for (uint32_t level = 1; level < WheelLevels; level++)
+				outer = outer || m_Occupied[level] != 0;
+
+			if (outer)
+			{
+				// Sitting on a boundary means that cascade hasn't run yet
+				uint64_t boundary = slot == 0 ? m_Current : (m_Current | (WheelSlots - 1)) + 1;
+
+				if (next == 0 || boundary < next)
+					next = boundary;
+			}
+		}
+
+		// Thread timers on Windows keep going off until they're killed, so clearing it always goes through
+		if (next != 0 && next == m_Armed)
+			return;
+
+		m_Armed = next;
+
+#ifdef _WIN32
+		if (next == 0)
+		{
+			if (m_OSTimer != 0)
+			{
+				KillTimer(NULL, m_OSTimer);
+				threadTimers.erase(m_OSTimer);
+				m_OSTimer = 0;
+			}
+
+			return;
+		}
+
+		uint64_t now = NowTick();
+		UINT delay = next > now ? (UINT)(next - now) : 0;
+
+		// Setting it again with the same id just moves it
+		UINT_PTR id = SetTimer(NULL, m_OSTimer, delay, TimerCallback);
+
+		if (id != m_OSTimer)
+		{
+			threadTimers.erase(m_OSTimer);
+			m_OSTimer = id;
+			threadTimers[id] = this;
+		}
+#elif defined(__linux__)
+		itimerspec spec{};
+
+		// Zero disarms it
+		if (next != 0)
+		{
+			spec.it_value.tv_sec = (time_t)(next / 1000);
+			spec.it_value.tv_nsec = (long)(next % 1000) * 1000000l;
+		}
+
+		timerfd_settime(m_Descriptor, TFD_TIMER_ABSTIME, &spec, nullptr);
+#endif
 	}
-}
\ No newline at end of file
+}
@@ -1,8 +1,14 @@
 
 #pragma once
 
-#include <queue>
+#include <atomic>
+#include <cstdint>
+#include <deque>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 #include <functional>
 
 namespace script
@@ -32,12 +38,50 @@ namespace script
 		};
 	};
 
+	// How many safepoints go by between looking for timers and descriptors that are ready
+	constexpr int32_t SafepointsPerPoll = 1024;
+
+	// Gets the epoll events (EPOLLIN, EPOLLOUT...) a watched file descriptor is ready for
+	using WatchCallback = std::function<void(uint32_t events)>;
+
+	// The events the VM handles at its safepoints, and what it sleeps on once there's nothing left to run
+	// On Linux everything goes through one epoll descriptor, opened the first time it's needed so VMs that never wait don't pay for it.
+	// Timers and watched file descriptors call back into the VM from Wait on the VM's own thread,
+	// an eventfd lets other threads post callbacks and wake it up.
 	class EventManager
 	{
 	public:
 
+		EventManager() = default;
+		~EventManager();
+
+		EventManager(const EventManager&) = delete;
+		void operator=(const EventManager&) = delete;
+
+		// Runs the callbacks of anything that's ready without waiting
 		void TranslateMessages();
 
+		// TranslateMessages for the safepoints once the countdown runs out, at most once a millisecond since it's a system call
+		// Anything that has nothing to watch skips it
+		void Poll();
+
+		// Sleeps until something is ready and runs its callbacks, -1 waits for as long as it takes
+		void Wait(int timeoutMs = -1);
+
+		// Runs the callback on the VM's thread the next time it waits or translates messages, safe from any thread
+		void Post(std::function<void()> callback);
+
+		// Makes Wait return, safe from any thread
+		void Wake();
+
+		// Calls back from Wait whenever the descriptor is ready, Linux only
+		// The loop keeps running while there's a watch that keeps it alive, the timers' own descriptor doesn't
+		bool Watch(int fd, uint32_t events, WatchCallback callback, bool keepAlive = true);
+		void Unwatch(int fd);
+
+		// True while there's a watch keeping the loop alive or a posted callback that hasn't run
+		bool HasWork() const { return m_KeepAlive != 0 || m_PostedCount.load(std::memory_order_acquire) != 0; }
+
 		bool IsEmpty()
 		{
 			return m_EventQueue.empty();
@@ -46,7 +90,7 @@ namespace script
 		Event Pop()
 		{
 			Event evnt = m_EventQueue.front();
-			m_EventQueue.pop();
+			m_EventQueue.pop_front();
 			size--;
 
 			return evnt;
@@ -54,47 +98,176 @@ namespace script
 
 		void Push(Event evnt)
 		{
-			m_EventQueue.push(evnt);
+			m_EventQueue.push_back(evnt);
 			size++;
 		}
 
+		void Push(const Event* events, size_t count)
+		{
+			m_EventQueue.insert(m_EventQueue.end(), events, events + count);
+			size += count;
+		}
+
 
-		std::queue<Event> m_EventQueue;
+		// A deque so the collector can see the fibers waiting in it
+		std::deque<Event> m_EventQueue;
 		size_t size = 0;
 
+		// Counts down at the safepoints, the VM polls once it gets to 0
+		// Without it a timer that came due while a script was busy would wait for the script to finish
+		int32_t pollCountdown = SafepointsPerPoll;
+
+	private:
+
+		struct WatchEntry
+		{
+			WatchCallback callback;
+			bool keepAlive = true;
+		};
+
+		// Opens the descriptors, posting can get here from another thread
+		bool Open();
+
+		// Waits at most the timeout and runs the callbacks of whatever is ready
+		void Dispatch(int timeoutMs);
+
+		void RunPosted();
+
+		std::once_flag m_Opened;
+
+		uint64_t m_NextPoll = 0;
+
+		// Event handle on Windows
+		intptr_t m_Poller = -1;
+		intptr_t m_Wakeup = -1;
+
+		// Shared so a callback can unwatch its own descriptor
+		std::unordered_map<int, std::shared_ptr<WatchEntry>> m_Watches;
+		size_t m_KeepAlive = 0;
+
+		std::mutex m_PostMutex;
+		std::vector<std::function<void()>> m_Posted;
+		std::atomic<size_t> m_PostedCount{ 0 };
 	};
 
-	extern EventManager eventManager;
+	class ObjFunction;
 
+	// The slot in the timer's pool and a generation that starts at 1, so 0 never names a timer
+	using TimerID = uint64_t;
 
+	// Every VM has its own timers, the callbacks run on the thread that started them
+	// They live in a hierarchical timing wheel with a 1ms tick: 4 levels of 64 slots, each slot a list of timers due in it.
+	// Starting and cancelling a timer is O(1) however many there are, and everything due in a tick comes out together.
+	// Timers on the outer levels move down a level each time the one below wraps around, the way the Linux kernel's do.
+	// One OS timer (a timerfd on Linux) drives the whole wheel, it's only ever set for the next tick with anything to do.
 	class Timer
 	{
 	public:
 
-		static Timer& GetInstance()
-		{
-			static Timer timer;
+		explicit Timer(EventManager& events);
 
-			return timer;
-		}
+		~Timer();
 
-		void StartTimer(uint64_t durationMs, std::function<void()> callback);
+		TimerID StartTimer(uint64_t durationMs, std::function<void()> callback);
 
-		std::function<void()> GetCallbackForID(size_t id) { return m_Callbacks[id]; }
+		// Pushes a fiber running the function once the timer goes off
+		// Every fiber from the same tick goes into the event queue in one batch, ahead of the callbacks
+		TimerID QueueFiber(uint64_t durationMs, ObjFunction* function);
+
+		// False if it already went off or was cancelled
+		bool CancelTimer(TimerID id);
 
 		size_t GetActiveTimerCount() { return m_Count; }
 
-		void Remove(size_t id) { m_Callbacks.erase(id); m_Count--; }
+		// Runs everything that's due, the OS timer calls this but it's safe to call whenever
+		void Tick();
 
-	private:
+		// The functions of the fibers still waiting, so the collector keeps them
+		template<typename Fn>
+		void ForEachFunction(Fn fn)
+		{
+			for (TimerNode& node : m_Nodes)
+			{
+				if (node.active && node.function)
+					fn(node.function);
+			}
+		}
 
-		Timer() { }
+	private:
 
 		Timer(Timer const&) = delete;
 		void operator=(Timer const&) = delete;
 
+		static constexpr uint32_t WheelBits = 6;
+		static constexpr uint32_t WheelSlots = 1u << WheelBits;
+		static constexpr uint32_t WheelLevels = 4;
+		static constexpr uint32_t Nil = UINT32_MAX;
+
+		struct TimerNode
+		{
+			// In ticks, never earlier than asked for
+			uint64_t expires = 0;
+
+			// Orders timers due in the same tick by when they were started
+			uint64_t sequence = 0;
+
+			// The slot list it's in
+			uint32_t prev = Nil;
+			uint32_t next = Nil;
+			uint8_t level = 0;
+			uint8_t slot = 0;
+
+			// Bumped every time the node is freed so old ids stop matching
+			uint32_t generation = 1;
+			bool active = false;
+
+			ObjFunction* function = nullptr;
+			std::function<void()> callback;
+		};
+
+		TimerID Add(uint64_t durationMs, ObjFunction* function, std::function<void()> callback);
+
+		// Puts the node in the slot for its expiry relative to the current tick
+		void Insert(uint32_t index);
+		void Unlink(uint32_t index);
+		void Free(uint32_t index);
+
+		// Runs up to and including the tick
+		void Advance(uint64_t now);
+		void Cascade();
+		void ExpireSlot(uint32_t slot);
+
+		// Sets the OS timer for the next tick there's something to do in
+		void Arm();
+
+		EventManager& m_Events;
+
+		std::vector<TimerNode> m_Nodes;
+		std::vector<uint32_t> m_Free;
+
+		uint32_t m_Slots[WheelLevels][WheelSlots];
+
+		// A bit for every slot with something in it, finds the next one without looking through the empty ones
+		uint64_t m_Occupied[WheelLevels] = {};
+
+		// The next tick that hasn't been run
+		uint64_t m_Current = 0;
+
 		size_t m_Count = 0;
+		uint64_t m_Sequence = 0;
+
+		// Kept around between ticks so expiring doesn't allocate
+		std::vector<Event> m_Batch;
+		std::vector<std::function<void()>> m_Callbacks;
+		std::vector<uint32_t> m_Expired;
+
+		// The tick the OS timer is set for, 0 when it isn't
+		uint64_t m_Armed = 0;
 
-		std::map<size_t, std::function<void()>> m_Callbacks;
+#ifdef _WIN32
+		uintptr_t m_OSTimer = 0;
+#elif defined(__linux__)
+		int m_Descriptor = -1;
+#endif
 	};
-}
\ No newline at end of file
+}
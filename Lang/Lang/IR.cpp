@@ -0,0 +1,1459 @@
+#include "IR.h"
+#include "Stack.h"
+#include "VM.h"
+
+#include <algorithm>
+
+namespace script
+{
+	namespace
+	{
+		// Temporaries sit in the frame next to the locals, past this it isn't worth the stack
+		constexpr int MaxTemporaries = 32;
+
+		int ReadShort(const DecodedInstruction& instruction, int offset = 0)
+		{
+			return (instruction.operands[offset] << 8) | instruction.operands[offset + 1];
+		}
+
+		bool IsLoad(uint8_t op)
+		{
+			switch (op)
+			{
+			case OP_GET_LOCAL:
+			case OP_GET_LOCAL_0:
+			case OP_GET_LOCAL_1:
+			case OP_GET_LOCAL_2:
+			case OP_GET_LOCAL_3:
+				return true;
+			default:
+				return false;
+			}
+		}
+
+		bool IsConstantLoad(uint8_t op)
+		{
+			switch (op)
+			{
+			case OP_CONSTANT:
+			case OP_CONSTANT_LONG:
+			case OP_TRUE:
+			case OP_FALSE:
+			case OP_NIL:
+				return true;
+			default:
+				return false;
+			}
+		}
+
+		// Only looks at the stack, running it twice or not at all makes no difference apart from an error
+		bool IsPure(uint8_t op)
+		{
+			switch (op)
+			{
+			case OP_NEGATE:
+			case OP_NOT:
+			case OP_ADD:
+			case OP_SUBTRACT:
+			case OP_MULTIPLY:
+			case OP_DIVIDE:
+			case OP_POWER:
+			case OP_MODULO:
+			case OP_EQUAL:
+			case OP_NOT_EQUAL:
+			case OP_LESS:
+			case OP_GREATER:
+			case OP_LESS_EQUAL:
+			case OP_GREATER_EQUAL:
+			case OP_ADD_CONSTANT:
+			case OP_SUBTRACT_CONSTANT:
+				return true;
+			default:
+				return IsLoad(op) || IsConstantLoad(op);
+			}
+		}
+
+		// Pure instructions that report an error unless they are given numbers, ADD takes two strings as well
+		bool CanFail(uint8_t op)
+		{
+			switch (op)
+			{
+			case OP_ADD:
+			case OP_SUBTRACT:
+			case OP_MULTIPLY:
+			case OP_DIVIDE:
+			case OP_LESS:
+			case OP_GREATER:
+			case OP_LESS_EQUAL:
+			case OP_GREATER_EQUAL:
+			case OP_ADD_CONSTANT:
+			case OP_SUBTRACT_CONSTANT:
+				return true;
+			default:
+				return false;
+			}
+		}
+
+		// Once one of these has run everything it popped is known to be a number
+		bool ChecksNumbers(uint8_t op)
+		{
+			switch (op)
+			{
+			case OP_JUMP_IF_NOT_LESS:
+			case OP_JUMP_IF_NOT_GREATER:
+			case OP_JUMP_IF_NOT_LESS_EQUAL:
+			case OP_JUMP_IF_NOT_GREATER_EQUAL:
+				return true;
+			default:
+				return op != OP_ADD && CanFail(op);
+			}
+		}
+
+		// Could run script code or write to an object, property reads from before can't be reused after
+		bool ClobbersProperties(uint8_t op)
+		{
+			if (op >= OP_CALL_0 && op <= OP_CALL_16)
+				return true;
+
+			if (op >= OP_MATH_SQRT && op <= OP_MATH_ATAN2)
+				return true;
+
+			switch (op)
+			{
+			case OP_TAIL_CALL:
+			case OP_INVOKE:
+			case OP_SET_PROPERTY:
+			case OP_SUBSCRIPT_WRITE:
+			case OP_METHOD:
+			case OP_ITER:
+			case OP_SET_GLOBAL:
+			case OP_DEFINE_GLOBAL:
+			case OP_EXPORT_GLOBAL:
+				return true;
+			default:
+				return false;
+			}
+		}
+
+		void SetLoad(DecodedInstruction& instruction, int slot)
+		{
+			if (slot <= 3)
+			{
+				instruction.op = (uint8_t)(OP_GET_LOCAL_0 + slot);
+				return;
+			}
+
+			instruction.op = OP_GET_LOCAL;
+			instruction.operands[0] = (uint8_t)(slot >> 8);
+			instruction.operands[1] = (uint8_t)(slot & 0xFF);
+		}
+
+		DecodedInstruction MakeStore(int slot)
+		{
+			DecodedInstruction instruction;
+			instruction.op = OP_SET_LOCAL;
+			instruction.operands[0] = (uint8_t)(slot >> 8);
+			instruction.operands[1] = (uint8_t)(slot & 0xFF);
+			return instruction;
+		}
+
+		DecodedInstruction MakeInstruction(uint8_t op)
+		{
+			DecodedInstruction instruction;
+			instruction.op = op;
+			return instruction;
+		}
+	}
+
+	IRFunction::IRFunction(ObjFunction* function) : m_Function(function)
+	{
+	}
+
+	bool IRFunction::Build()
+	{
+		if (!DecodeInstructions(m_Function->chunk.code, m_Code) || m_Code.empty())
+			return false;
+
+		m_Instructions.assign(m_Code.size(), IRInstruction());
+
+		if (!BuildBlocks())
+			return false;
+
+		FindDominators();
+
+		if (!Lift())
+			return false;
+
+		SimplifyPhis();
+		FindLoops();
+		InferNumbers();
+
+		m_Replaced.assign(m_Code.size(), -1);
+		m_ReplacedStart.assign(m_Code.size(), -1);
+		m_SavedTo.assign(m_Code.size(), -1);
+		m_DeadStores.assign(m_Code.size(), false);
+
+		return true;
+	}
+
+	bool IRFunction::BuildBlocks()
+	{
+		int count = (int)m_Code.size();
+
+		std::vector<bool> leaders(count, false);
+		leaders[0] = true;
+
+		for (int i = 0; i < count; i++)
+		{
+			const DecodedInstruction& instruction = m_Code[i];
+
+			if (IsJump(instruction.op))
+			{
+				if (instruction.target >= count)
+					return false;
+
+				leaders[instruction.target] = true;
+			}
+
+			if ((IsJump(instruction.op) || instruction.op == OP_RETURN) && i + 1 < count)
+				leaders[i + 1] = true;
+		}
+
+		for (int i = 0; i < count; i++)
+		{
+			if (leaders[i])
+			{
+				IRBlock block;
+				block.start = i;
+				m_Blocks.push_back(block);
+			}
+
+			m_Instructions[i].block = (int)m_Blocks.size() - 1;
+			m_Blocks.back().end = i + 1;
+		}
+
+		for (IRBlock& block : m_Blocks)
+		{
+			const DecodedInstruction& last = m_Code[block.end - 1];
+
+			if (last.op == OP_RETURN)
+				continue;
+
+			if (last.op != OP_JUMP && last.op != OP_LOOP)
+			{
+				// Running off the end of the code
+				if (block.end >= count)
+					return false;
+
+				block.successors.push_back(m_Instructions[block.end].block);
+			}
+
+			if (IsJump(last.op))
+			{
+				int target = m_Instructions[last.target].block;
+
+				if (std::find(block.successors.begin(), block.successors.end(), target) == block.successors.end())
+					block.successors.push_back(target);
+			}
+		}
+
+		// Depth first for the post order, an edge back to a block that is still being walked closes a cycle
+		std::vector<int> postOrder;
+		std::vector<int> next(m_Blocks.size(), 0);
+		std::vector<bool> walking(m_Blocks.size(), false);
+		std::vector<int> work = { 0 };
+
+		m_Blocks[0].reachable = true;
+		walking[0] = true;
+
+		while (!work.empty())
+		{
+			int b = work.back();
+			IRBlock& block = m_Blocks[b];
+
+			if (next[b] < (int)block.successors.size())
+			{
+				int successor = block.successors[next[b]++];
+
+				if (walking[successor])
+					m_Retreating.push_back({ b, successor });
+
+				if (!m_Blocks[successor].reachable)
+				{
+					m_Blocks[successor].reachable = true;
+					walking[successor] = true;
+					work.push_back(successor);
+				}
+
+				continue;
+			}
+
+			walking[b] = false;
+			postOrder.push_back(b);
+			work.pop_back();
+		}
+
+		m_Order.assign(postOrder.rbegin(), postOrder.rend());
+
+		for (int b : m_Order)
+		{
+			for (int successor : m_Blocks[b].successors)
+				m_Blocks[successor].predecessors.push_back(b);
+		}
+
+		return true;
+	}
+
+	void IRFunction::FindDominators()
+	{
+		std::vector<int> position(m_Blocks.size(), -1);
+
+		for (size_t i = 0; i < m_Order.size(); i++)
+			position[m_Order[i]] = (int)i;
+
+		m_Blocks[0].dominator = 0;
+
+		bool changed = true;
+
+		while (changed)
+		{
+			changed = false;
+
+			for (int b : m_Order)
+			{
+				if (b == 0)
+					continue;
+
+				int dominator = -1;
+
+				for (int predecessor : m_Blocks[b].predecessors)
+				{
+					if (m_Blocks[predecessor].dominator < 0)
+						continue;
+
+					if (dominator < 0)
+					{
+						dominator = predecessor;
+						continue;
+					}
+
+					int a = predecessor;
+
+					while (a != dominator)
+					{
+						while (position[a] > position[dominator])
+							a = m_Blocks[a].dominator;
+
+						while (position[dominator] > position[a])
+							dominator = m_Blocks[dominator].dominator;
+					}
+				}
+
+				if (dominator != m_Blocks[b].dominator)
+				{
+					m_Blocks[b].dominator = dominator;
+					changed = true;
+				}
+			}
+		}
+	}
+
+	bool IRFunction::Dominates(int a, int b) const
+	{
+		if (!m_Blocks[b].reachable)
+			return false;
+
+		while (b != a)
+		{
+			if (b == 0)
+				return false;
+
+			b = m_Blocks[b].dominator;
+		}
+
+		return true;
+	}
+
+	int IRFunction::NewValue(IRValueKind kind, int block, int instruction)
+	{
+		IRValue value;
+		value.kind = kind;
+		value.block = block;
+		value.instruction = instruction;
+
+		m_Values.push_back(value);
+		m_Replacements.push_back(-1);
+
+		return (int)m_Values.size() - 1;
+	}
+
+	int IRFunction::Find(int value)
+	{
+		int root = value;
+
+		while (m_Replacements[root] >= 0)
+			root = m_Replacements[root];
+
+		while (m_Replacements[value] >= 0)
+		{
+			int next = m_Replacements[value];
+			m_Replacements[value] = root;
+			value = next;
+		}
+
+		return root;
+	}
+
+	bool IRFunction::Lift()
+	{
+		std::vector<bool> lifted(m_Blocks.size(), false);
+
+		// The caller pushes the callee or receiver and then the arguments
+		std::vector<int> parameters;
+
+		for (int i = 0; i <= m_Function->arity; i++)
+			parameters.push_back(NewValue(IR_PARAMETER, 0, -1));
+
+		for (int b : m_Order)
+		{
+			IRBlock& block = m_Blocks[b];
+
+			// A predecessor that hasn't been lifted yet comes round a loop, every slot gets a phi and the ones that turn out the same are dropped after
+			bool loops = false;
+			int from = -1;
+
+			for (int predecessor : block.predecessors)
+			{
+				if (!lifted[predecessor])
+					loops = true;
+				else if (from < 0)
+					from = predecessor;
+			}
+
+			if (b == 0)
+			{
+				if (!loops)
+					block.entry = parameters;
+				else
+				{
+					for (int parameter : parameters)
+					{
+						int phi = NewValue(IR_PHI, 0, -1);
+						m_Values[phi].operands.push_back(parameter);
+						block.entry.push_back(phi);
+					}
+				}
+			}
+			else
+			{
+				if (from < 0)
+					return false;
+
+				const std::vector<int>& incoming = m_Blocks[from].exit;
+
+				for (int predecessor : block.predecessors)
+				{
+					if (lifted[predecessor] && m_Blocks[predecessor].exit.size() != incoming.size())
+						return false;
+				}
+
+				for (size_t slot = 0; slot < incoming.size(); slot++)
+				{
+					bool same = !loops;
+
+					for (int predecessor : block.predecessors)
+					{
+						if (lifted[predecessor] && m_Blocks[predecessor].exit[slot] != incoming[slot])
+							same = false;
+					}
+
+					block.entry.push_back(same ? incoming[slot] : NewValue(IR_PHI, b, -1));
+				}
+			}
+
+			std::vector<int> stack = block.entry;
+
+			for (int i = block.start; i < block.end; i++)
+			{
+				const DecodedInstruction& code = m_Code[i];
+				IRInstruction& instruction = m_Instructions[i];
+
+				int height = (int)stack.size();
+				instruction.height = height;
+
+				if (IsLoad(code.op))
+				{
+					int slot = code.op == OP_GET_LOCAL ? ReadShort(code) : code.op - OP_GET_LOCAL_0;
+
+					if (slot >= height)
+						return false;
+
+					instruction.slot = slot;
+					instruction.output = stack[slot];
+					stack.push_back(stack[slot]);
+				}
+				else if (code.op == OP_SET_LOCAL)
+				{
+					int slot = ReadShort(code);
+
+					if (height == 0 || slot >= height)
+						return false;
+
+					instruction.slot = slot;
+					stack[slot] = stack.back();
+				}
+				else if (code.op == OP_ITER)
+				{
+					// Writes the next item into the loop variable and moves the iterator along
+					if (height < 3)
+						return false;
+
+					instruction.itemValue = NewValue(IR_INSTRUCTION, b, i);
+					instruction.iteratorValue = NewValue(IR_INSTRUCTION, b, i);
+
+					stack[height - 3] = instruction.itemValue;
+					stack[height - 1] = instruction.iteratorValue;
+				}
+				else
+				{
+					int pops, pushes;
+
+					if (!GetStackEffect(code, &pops, &pushes) || pops > height)
+						return false;
+
+					// Not modelled, a module can change anything while it runs
+					if (code.op == OP_IMPORT_MODULE || code.op == OP_IMPORT_MODULE_AS || code.op == OP_THROW)
+						return false;
+
+					// These look at the top without popping it
+					if ((code.op == OP_JUMP_IF_FALSE || code.op == OP_SET_GLOBAL) && height == 0)
+						return false;
+
+					instruction.inputs.assign(stack.end() - pops, stack.end());
+					stack.resize(height - pops);
+
+					if (pushes)
+					{
+						// These leave what they stored on the stack
+						if (code.op == OP_SET_PROPERTY)
+							instruction.output = instruction.inputs[1];
+						else if (code.op == OP_SUBSCRIPT_WRITE)
+							instruction.output = instruction.inputs[2];
+						else
+							instruction.output = NewValue(IR_INSTRUCTION, b, i);
+
+						stack.push_back(instruction.output);
+					}
+				}
+
+				m_MaxHeight = std::max(m_MaxHeight, (int)stack.size());
+			}
+
+			block.exit = std::move(stack);
+			lifted[b] = true;
+		}
+
+		// Every predecessor has an exit now so the phis can be filled in
+		for (int b : m_Order)
+		{
+			IRBlock& block = m_Blocks[b];
+
+			for (size_t slot = 0; slot < block.entry.size(); slot++)
+			{
+				IRValue& phi = m_Values[block.entry[slot]];
+
+				if (phi.kind != IR_PHI || phi.block != b)
+					continue;
+
+				for (int predecessor : block.predecessors)
+				{
+					if (m_Blocks[predecessor].exit.size() != block.entry.size())
+						return false;
+
+					m_Values[block.entry[slot]].operands.push_back(m_Blocks[predecessor].exit[slot]);
+				}
+			}
+		}
+
+		return true;
+	}
+
+	void IRFunction::SimplifyPhis()
+	{
+		// A phi that only ever sees one other value is that value
+		bool changed = true;
+
+		while (changed)
+		{
+			changed = false;
+
+			for (int v = 0; v < (int)m_Values.size(); v++)
+			{
+				if (m_Values[v].kind != IR_PHI || Find(v) != v)
+					continue;
+
+				int same = -1;
+				bool trivial = true;
+
+				for (int operand : m_Values[v].operands)
+				{
+					int value = Find(operand);
+
+					if (value == v || value == same)
+						continue;
+
+					if (same >= 0)
+					{
+						trivial = false;
+						break;
+					}
+
+					same = value;
+				}
+
+				if (trivial && same >= 0)
+				{
+					m_Replacements[v] = same;
+					changed = true;
+				}
+			}
+		}
+	}
+
+	void IRFunction::FindLoops()
+	{
+		for (const std::pair<int, int>& edge : m_Retreating)
+		{
+			int latch = edge.first;
+			int header = edge.second;
+
+			// Going back somewhere that doesn't dominate the jump means the loop has more than one way in
+			if (!Dominates(header, latch))
+			{
+				m_Irreducible = true;
+				continue;
+			}
+
+			int loop = -1;
+
+			for (size_t i = 0; i < m_Loops.size(); i++)
+			{
+				if (m_Loops[i].header == header)
+					loop = (int)i;
+			}
+
+			if (loop < 0)
+			{
+				IRLoop newLoop;
+				newLoop.header = header;
+				newLoop.blocks.assign(m_Blocks.size(), false);
+				newLoop.blocks[header] = true;
+
+				m_Loops.push_back(newLoop);
+				loop = (int)m_Loops.size() - 1;
+			}
+
+			std::vector<bool>& blocks = m_Loops[loop].blocks;
+			std::vector<int> work;
+
+			if (!blocks[latch])
+			{
+				blocks[latch] = true;
+				work.push_back(latch);
+			}
+
+			while (!work.empty())
+			{
+				int b = work.back();
+				work.pop_back();
+
+				for (int predecessor : m_Blocks[b].predecessors)
+				{
+					if (!blocks[predecessor])
+					{
+						blocks[predecessor] = true;
+						work.push_back(predecessor);
+					}
+				}
+			}
+		}
+	}
+
+	bool IRFunction::InLoop(int loop, int block) const
+	{
+		return m_Loops[loop].blocks[block];
+	}
+
+	int IRFunction::InnermostLoop(int block) const
+	{
+		int innermost = -1;
+		size_t smallest = 0;
+
+		for (size_t i = 0; i < m_Loops.size(); i++)
+		{
+			if (!m_Loops[i].blocks[block])
+				continue;
+
+			size_t size = std::count(m_Loops[i].blocks.begin(), m_Loops[i].blocks.end(), true);
+
+			if (innermost < 0 || size < smallest)
+			{
+				innermost = (int)i;
+				smallest = size;
+			}
+		}
+
+		return innermost;
+	}
+
+	void IRFunction::InferNumbers()
+	{
+		// Starts out assuming everything that could be a number is one and takes it back until nothing changes
+		for (IRValue& value : m_Values)
+			value.number = value.kind != IR_PARAMETER;
+
+		bool changed = true;
+
+		while (changed)
+		{
+			changed = false;
+
+			for (int v = 0; v < (int)m_Values.size(); v++)
+			{
+				IRValue& value = m_Values[v];
+
+				if (!value.number || Find(v) != v)
+					continue;
+
+				bool number = true;
+
+				if (value.kind == IR_PHI)
+				{
+					for (int operand : value.operands)
+						number = number && m_Values[Find(operand)].number;
+				}
+				else if (value.kind == IR_INSTRUCTION)
+				{
+					const DecodedInstruction& code = m_Code[value.instruction];
+					const IRInstruction& instruction = m_Instructions[value.instruction];
+
+					switch (code.op)
+					{
+					case OP_CONSTANT:
+						number = m_Function->chunk.constants[code.operands[0]].IsNumber();
+						break;
+					case OP_CONSTANT_LONG:
+						number = m_Function->chunk.constants[ReadShort(code)].IsNumber();
+						break;
+					case OP_NEGATE:
+					case OP_SUBTRACT:
+					case OP_MULTIPLY:
+					case OP_DIVIDE:
+					case OP_POWER:
+					case OP_MODULO:
+					case OP_ADD_CONSTANT:
+					case OP_SUBTRACT_CONSTANT:
+						break;
+					case OP_ADD:
+						number = m_Values[Find(instruction.inputs[0])].number && m_Values[Find(instruction.inputs[1])].number;
+						break;
+					default:
+						number = false;
+						break;
+					}
+				}
+
+				if (!number)
+				{
+					value.number = false;
+					changed = true;
+				}
+			}
+		}
+	}
+
+	template<typename Function>
+	void IRFunction::Replay(int b, Function function)
+	{
+		const IRBlock& block = m_Blocks[b];
+
+		std::vector<int> stack;
+
+		for (int value : block.entry)
+			stack.push_back(Find(value));
+
+		for (int i = block.start; i < block.end; i++)
+		{
+			function(i, (const std::vector<int>&)stack);
+
+			const IRInstruction& instruction = m_Instructions[i];
+			uint8_t op = m_Code[i].op;
+
+			if (IsLoad(op))
+			{
+				stack.push_back(stack[instruction.slot]);
+			}
+			else if (op == OP_SET_LOCAL)
+			{
+				stack[instruction.slot] = stack.back();
+			}
+			else if (op == OP_ITER)
+			{
+				stack[instruction.height - 3] = Find(instruction.itemValue);
+				stack[instruction.height - 1] = Find(instruction.iteratorValue);
+			}
+			else
+			{
+				stack.resize(stack.size() - instruction.inputs.size());
+
+				if (instruction.output >= 0)
+					stack.push_back(Find(instruction.output));
+			}
+		}
+	}
+
+	bool IRFunction::Optimize()
+	{
+		m_Changed = PropagateCopies();
+		m_Changed |= EliminateLoads();
+		m_Changed |= HoistInvariants();
+
+		// Last, the hoisted loads and the copies decide which stores are still read
+		m_Changed |= RemoveDeadStores();
+
+		return m_Changed;
+	}
+
+	bool IRFunction::PropagateCopies()
+	{
+		// var b = a; makes b another name for a, reading the lowest slot with the value leaves the store to b dead
+		// when nothing else needs it and gets the short GET_LOCAL_n forms more often
+		bool changed = false;
+
+		for (int b : m_Order)
+		{
+			Replay(b, [&](int i, const std::vector<int>& stack) {
+
+				IRInstruction& instruction = m_Instructions[i];
+
+				if (!IsLoad(m_Code[i].op))
+					return;
+
+				for (int slot = 0; slot < instruction.slot; slot++)
+				{
+					if (stack[slot] == stack[instruction.slot])
+					{
+						instruction.slot = slot;
+						changed = true;
+						break;
+					}
+				}
+			});
+		}
+
+		return changed;
+	}
+
+	int IRFunction::NewTemporary(int root)
+	{
+		Temporary temporary;
+		temporary.root = root;
+
+		m_Temporaries.push_back(temporary);
+		return (int)m_Temporaries.size() - 1;
+	}
+
+	bool IRFunction::EliminateLoads()
+	{
+		// A property read the same as one before it with nothing in between that could have changed it, eg. self.x twice
+		// in one expression. The first read is saved in a temporary and the rest load that instead.
+		// Reads are only reused down a chain of blocks where each one has a single way in, a loop header always starts over
+		// so a field another fiber sets while the loop waits is still seen
+		struct Available
+		{
+			int object;
+			Object* name;
+			int value;
+			int temporary;
+		};
+
+		// Every read emits its own name constant, the strings are interned though
+		auto nameOf = [&](const DecodedInstruction& code) {
+			return m_Function->chunk.constants[ReadShort(code)].ToObject();
+		};
+
+		std::vector<std::vector<Available>> exits(m_Blocks.size());
+		std::vector<int> roots(m_Blocks.size(), -1);
+
+		bool changed = false;
+
+		for (int b : m_Order)
+		{
+			const IRBlock& block = m_Blocks[b];
+
+			std::vector<Available> available;
+			int root = b;
+
+			if (b != 0 && block.predecessors.size() == 1 && roots[block.predecessors[0]] >= 0)
+			{
+				available = exits[block.predecessors[0]];
+				root = roots[block.predecessors[0]];
+			}
+
+			roots[b] = root;
+
+			Replay(b, [&](int i, const std::vector<int>& stack) {
+
+				const DecodedInstruction& code = m_Code[i];
+				IRInstruction& instruction = m_Instructions[i];
+
+				if (code.op == OP_GET_PROPERTY)
+				{
+					int object = Find(instruction.inputs[0]);
+					Object* name = nameOf(code);
+
+					for (const Available& entry : available)
+					{
+						if (entry.object != object || entry.name != name)
+							continue;
+
+						// The object has to have been pushed by the instruction right before so the two can go together
+						int previous = i - 1;
+						int start = -1;
+
+						if (previous >= block.start)
+						{
+							if (m_Replaced[previous] >= 0)
+								start = m_ReplacedStart[previous];
+							else if (IsLoad(m_Code[previous].op))
+								start = previous;
+						}
+
+						if (start < 0)
+							return;
+
+						// a.b.c read twice, the second a.b gets folded into loading a.b.c
+						if (m_Replaced[previous] >= 0)
+						{
+							m_Temporaries[m_Replaced[previous]].uses--;
+							m_Replaced[previous] = -1;
+						}
+
+						m_Replaced[i] = entry.temporary;
+						m_ReplacedStart[i] = start;
+						m_Temporaries[entry.temporary].uses++;
+
+						m_Replacements[instruction.output] = entry.value;
+						changed = true;
+						return;
+					}
+
+					Available entry = { object, name, Find(instruction.output), NewTemporary(root) };
+					available.push_back(entry);
+
+					m_SavedTo[i] = entry.temporary;
+					return;
+				}
+
+				if (ClobbersProperties(code.op))
+					available.clear();
+
+				// After setting it the field is whatever was stored
+				if (code.op == OP_SET_PROPERTY)
+				{
+					Available entry = { Find(instruction.inputs[0]), nameOf(code), Find(instruction.inputs[1]), NewTemporary(root) };
+					available.push_back(entry);
+
+					m_SavedTo[i] = entry.temporary;
+				}
+			});
+
+			exits[b] = std::move(available);
+		}
+
+		return changed;
+	}
+
+	int IRFunction::ExpressionStart(int end) const
+	{
+		int start = end;
+		int needed = (int)m_Instructions[end].inputs.size();
+
+		while (needed > 0)
+		{
+			start--;
+
+			if (start < m_Blocks[m_Instructions[end].block].start || !IsPure(m_Code[start].op))
+				return -1;
+
+			needed += (int)m_Instructions[start].inputs.size() - 1;
+		}
+
+		return start;
+	}
+
+	bool IRFunction::IsInvariant(int v, int loop)
+	{
+		const IRValue& value = m_Values[v];
+
+		if (value.kind == IR_PARAMETER)
+			return true;
+
+		if (!InLoop(loop, value.block))
+			return true;
+
+		if (value.kind == IR_PHI)
+			return false;
+
+		uint8_t op = m_Code[value.instruction].op;
+
+		if (IsConstantLoad(op))
+			return true;
+
+		if (!IsPure(op))
+			return false;
+
+		for (int input : m_Instructions[value.instruction].inputs)
+		{
+			if (!IsInvariant(Find(input), loop))
+				return false;
+		}
+
+		return true;
+	}
+
+	bool IRFunction::IsNumberBefore(int v, int loop)
+	{
+		if (m_Values[v].number)
+			return true;
+
+		// Something before the loop that would have stopped with an error if it wasn't a number
+		int header = m_Loops[loop].header;
+
+		for (size_t i = 0; i < m_Code.size(); i++)
+		{
+			const IRInstruction& instruction = m_Instructions[i];
+
+			if (!ChecksNumbers(m_Code[i].op) || instruction.block == header || !Dominates(instruction.block, header))
+				continue;
+
+			for (int input : instruction.inputs)
+			{
+				if (Find(input) == v)
+					return true;
+			}
+		}
+
+		return false;
+	}
+
+	bool IRFunction::CanHoist(int start, int end, int loop, std::vector<int>& slots)
+	{
+		const IRBlock& header = m_Blocks[m_Loops[loop].header];
+
+		// The header runs first every time the loop is entered. If nothing before the expression can go wrong
+		// then working it out just before the loop goes wrong in the same place if it's going to
+		bool first = m_Instructions[start].block == m_Loops[loop].header;
+
+		for (int i = header.start; first && i < start; i++)
+			first = IsPure(m_Code[i].op) && !CanFail(m_Code[i].op);
+
+		slots.assign(end - start + 1, -1);
+
+		for (int i = start; i <= end; i++)
+		{
+			const DecodedInstruction& code = m_Code[i];
+			const IRInstruction& instruction = m_Instructions[i];
+
+			if (m_Replaced[i] >= 0 || m_SavedTo[i] >= 0)
+				return false;
+
+			if (IsLoad(code.op))
+			{
+				// Read from whichever slot has the value coming into the loop
+				int value = Find(instruction.output);
+
+				if (!IsInvariant(value, loop))
+					return false;
+
+				for (size_t slot = 0; slot < header.entry.size() && slots[i - start] < 0; slot++)
+				{
+					if (Find(header.entry[slot]) == value)
+						slots[i - start] = (int)slot;
+				}
+
+				if (slots[i - start] < 0)
+					return false;
+
+				continue;
+			}
+
+			if (first || !CanFail(code.op))
+				continue;
+
+			// Otherwise it can only move if it can't fail
+			for (int input : instruction.inputs)
+			{
+				if (!IsNumberBefore(Find(input), loop))
+					return false;
+			}
+		}
+
+		return true;
+	}
+
+	bool IRFunction::HoistInvariants()
+	{
+		// Only loads of locals, constants and arithmetic on them move, properties and globals can be changed by
+		// another fiber while the loop runs
+		if (m_Irreducible || m_Loops.empty())
+			return false;
+
+		bool changed = false;
+
+		for (int b : m_Order)
+		{
+			int loop = InnermostLoop(b);
+
+			if (loop < 0)
+				continue;
+
+			const IRBlock& block = m_Blocks[b];
+
+			// Backwards so the biggest expression that can move is found first
+			for (int i = block.end - 1; i >= block.start; i--)
+			{
+				uint8_t op = m_Code[i].op;
+
+				if (!IsPure(op) || IsLoad(op) || IsConstantLoad(op))
+					continue;
+
+				if (!IsInvariant(Find(m_Instructions[i].output), loop))
+					continue;
+
+				int start = ExpressionStart(i);
+
+				Hoist hoist;
+
+				if (start < 0 || !CanHoist(start, i, loop, hoist.slots))
+					continue;
+
+				hoist.loop = loop;
+				hoist.start = start;
+				hoist.end = i;
+				hoist.temporary = NewTemporary(-1);
+
+				m_Temporaries[hoist.temporary].uses = 1;
+				m_Hoists.push_back(hoist);
+
+				i = start;
+				changed = true;
+			}
+		}
+
+		return changed;
+	}
+
+	bool IRFunction::RemoveDeadStores()
+	{
+		// Live slots going backwards, a SET_LOCAL to a slot nothing reads before it's written again can go
+		int size = m_MaxHeight + 1;
+
+		std::vector<std::vector<bool>> liveIn(m_Blocks.size(), std::vector<bool>(size, false));
+
+		// Hoisted expressions read their slots just before the header
+		std::vector<std::vector<int>> headerReads(m_Blocks.size());
+
+		for (const Hoist& hoist : m_Hoists)
+		{
+			for (int slot : hoist.slots)
+			{
+				if (slot >= 0)
+					headerReads[m_Loops[hoist.loop].header].push_back(slot);
+			}
+		}
+
+		auto transfer = [&](int b, std::vector<bool>& live, bool mark) {
+
+			const IRBlock& block = m_Blocks[b];
+
+			for (int i = block.end - 1; i >= block.start; i--)
+			{
+				const IRInstruction& instruction = m_Instructions[i];
+				uint8_t op = m_Code[i].op;
+				int height = instruction.height;
+
+				if (IsLoad(op))
+				{
+					live[height] = false;
+					live[instruction.slot] = true;
+				}
+				else if (op == OP_SET_LOCAL)
+				{
+					if (mark && !live[instruction.slot] && instruction.slot != height - 1)
+						m_DeadStores[i] = true;
+
+					live[instruction.slot] = false;
+					live[height - 1] = true;
+				}
+				else if (op == OP_ITER)
+				{
+					live[height - 3] = false;
+					live[height - 2] = true;
+					live[height - 1] = true;
+				}
+				else if (op == OP_INLINE_GUARD)
+				{
+					// Looks at the callee under the arguments
+					live[height - m_Code[i].operands[4] - 1] = true;
+				}
+				else if (op == OP_POP || op == OP_POP_N)
+				{
+					for (int slot = height - (int)instruction.inputs.size(); slot < height; slot++)
+						live[slot] = false;
+				}
+				else if (op == OP_JUMP_IF_FALSE || op == OP_SET_GLOBAL)
+				{
+					live[height - 1] = true;
+				}
+				else
+				{
+					int pops = (int)instruction.inputs.size();
+
+					if (instruction.output >= 0)
+						live[height - pops] = false;
+
+					for (int slot = height - pops; slot < height; slot++)
+						live[slot] = true;
+				}
+			}
+
+			for (int slot : headerReads[b])
+				live[slot] = true;
+		};
+
+		bool changed = true;
+
+		while (changed)
+		{
+			changed = false;
+
+			for (auto it = m_Order.rbegin(); it != m_Order.rend(); ++it)
+			{
+				std::vector<bool> live(size, false);
+
+				for (int successor : m_Blocks[*it].successors)
+				{
+					for (int slot = 0; slot < size; slot++)
+						live[slot] = live[slot] || liveIn[successor][slot];
+				}
+
+				transfer(*it, live, false);
+
+				if (live != liveIn[*it])
+				{
+					liveIn[*it] = std::move(live);
+					changed = true;
+				}
+			}
+		}
+
+		bool removed = false;
+
+		for (int b : m_Order)
+		{
+			std::vector<bool> live(size, false);
+
+			for (int successor : m_Blocks[b].successors)
+			{
+				for (int slot = 0; slot < size; slot++)
+					live[slot] = live[slot] || liveIn[successor][slot];
+			}
+
+			transfer(b, live, true);
+		}
+
+		for (bool dead : m_DeadStores)
+			removed = removed || dead;
+
+		return removed;
+	}
+
+	bool IRFunction::Lower()
+	{
+		if (!m_Changed)
+			return false;
+
+		// Hoisted values live for the whole loop and get their own slots, the temporaries of
+		// each tree of blocks only live in that tree so the trees share theirs
+		int count = 0;
+
+		for (const Hoist& hoist : m_Hoists)
+			m_Temporaries[hoist.temporary].slot = count++;
+
+		int hoisted = count;
+		std::vector<int> used(m_Blocks.size(), 0);
+
+		for (Temporary& temporary : m_Temporaries)
+		{
+			if (temporary.root < 0 || temporary.uses <= 0)
+				continue;
+
+			temporary.slot = hoisted + used[temporary.root]++;
+			count = std::max(count, temporary.slot + 1);
+		}
+
+		if (count > MaxTemporaries || m_MaxHeight + count >= (int)FrameStackSize)
+			return false;
+
+		// The temporaries go in right after the arguments, everything above moves up to make room
+		int parameters = m_Function->arity + 1;
+
+		auto shift = [&](int slot) {
+			return slot >= parameters ? slot + count : slot;
+		};
+
+		auto temporarySlot = [&](int temporary) {
+			return parameters + m_Temporaries[temporary].slot;
+		};
+
+		int size = (int)m_Code.size();
+
+		// Where anything that jumped to the old instruction goes now, a loop's own jumps to its header skip the hoisted code
+		std::vector<int> before(size + 1, 0);
+		std::vector<int> after(size + 1, 0);
+
+		std::vector<std::vector<int>> hoistsAt(size);
+		std::vector<int> hoistEnds(size, -1);
+
+		for (size_t i = 0; i < m_Hoists.size(); i++)
+		{
+			const Hoist& hoist = m_Hoists[i];
+			hoistsAt[m_Blocks[m_Loops[hoist.loop].header].start].push_back((int)i);
+			hoistEnds[hoist.start] = (int)i;
+		}
+
+		// Worked out before the loop in the order they came in
+		for (std::vector<int>& hoists : hoistsAt)
+		{
+			std::sort(hoists.begin(), hoists.end(), [&](int a, int b) {
+				return m_Hoists[a].start < m_Hoists[b].start;
+			});
+		}
+
+		std::vector<int> replacedEnds(size, -1);
+
+		for (int i = 0; i < size; i++)
+		{
+			if (m_Replaced[i] >= 0)
+				replacedEnds[m_ReplacedStart[i]] = i;
+		}
+
+		std::vector<DecodedInstruction> code;
+		std::vector<int> origins;
+
+		auto emit = [&](const DecodedInstruction& instruction, int origin) {
+			code.push_back(instruction);
+			origins.push_back(origin);
+		};
+
+		for (int i = 0; i < count; i++)
+			emit(MakeInstruction(OP_NIL), -1);
+
+		for (int i = 0; i < size; i++)
+		{
+			before[i] = (int)code.size();
+
+			for (int index : hoistsAt[i])
+			{
+				const Hoist& hoist = m_Hoists[index];
+
+				for (int j = hoist.start; j <= hoist.end; j++)
+				{
+					DecodedInstruction instruction = m_Code[j];
+
+					if (IsLoad(instruction.op))
+						SetLoad(instruction, shift(hoist.slots[j - hoist.start]));
+
+					emit(instruction, -1);
+				}
+
+				emit(MakeStore(temporarySlot(hoist.temporary)), -1);
+				emit(MakeInstruction(OP_POP), -1);
+			}
+
+			after[i] = (int)code.size();
+
+			int end = -1;
+			int temporary = -1;
+
+			if (hoistEnds[i] >= 0)
+			{
+				end = m_Hoists[hoistEnds[i]].end;
+				temporary = m_Hoists[hoistEnds[i]].temporary;
+			}
+			else if (replacedEnds[i] >= 0)
+			{
+				end = replacedEnds[i];
+				temporary = m_Replaced[end];
+			}
+
+			if (end >= 0)
+			{
+				// Nothing jumps into the middle of an expression, it's all one block
+				DecodedInstruction load;
+				SetLoad(load, temporarySlot(temporary));
+				emit(load, -1);
+
+				for (int j = i + 1; j <= end; j++)
+					before[j] = after[j] = (int)code.size();
+
+				i = end;
+				continue;
+			}
+
+			if (m_DeadStores[i])
+				continue;
+
+			DecodedInstruction instruction = m_Code[i];
+
+			if (IsLoad(instruction.op))
+				SetLoad(instruction, shift(m_Instructions[i].slot));
+			else if (instruction.op == OP_SET_LOCAL)
+				instruction = MakeStore(shift(m_Instructions[i].slot));
+
+			emit(instruction, i);
+
+			int saved = m_SavedTo[i];
+
+			if (saved >= 0 && m_Temporaries[saved].uses > 0)
+				emit(MakeStore(temporarySlot(saved)), -1);
+		}
+
+		before[size] = after[size] = (int)code.size();
+
+		for (size_t i = 0; i < code.size(); i++)
+		{
+			if (origins[i] < 0 || !IsJump(code[i].op))
+				continue;
+
+			int origin = origins[i];
+			int target = m_Code[origin].target;
+
+			bool inside = false;
+
+			for (int index : hoistsAt[target])
+				inside = inside || InLoop(m_Hoists[index].loop, m_Instructions[origin].block);
+
+			code[i].target = inside ? after[target] : before[target];
+		}
+
+		std::vector<uint8_t> bytes;
+
+		if (!EncodeInstructions(code, bytes))
+			return false;
+
+		m_Function->chunk.code = std::move(bytes);
+		return true;
+	}
+}
@@ -0,0 +1,192 @@
+#pragma once
+#include "Chunk.h"
+#include "Object.h"
+
+#include <utility>
+#include <vector>
+
+// SSA form of a function, lifted from its bytecode once the compiler is done with it
+// The compiler emits as it parses so it only ever sees one expression at a time. Here every value that gets pushed,
+// every local and every join gets a name, which lets passes look across statements and out of loops.
+// The passes only decide what to change, lowering makes the edits to the original instructions and
+// writes them back into the same chunk, so the VM, the JIT and tracing never see anything new.
+
+namespace script
+{
+	enum IRValueKind
+	{
+		// Slot 0 and the arguments, whatever the caller passed in
+		IR_PARAMETER,
+		// Pushed or written in place by an instruction
+		IR_INSTRUCTION,
+		// The values a slot has coming into a block from each predecessor
+		IR_PHI
+	};
+
+	struct IRValue
+	{
+		IRValueKind kind = IR_INSTRUCTION;
+
+		// The instruction that made it, -1 for parameters and phis
+		int instruction = -1;
+
+		// Where it is defined, phis belong to the block they join in
+		int block = 0;
+
+		// Phi inputs, one for each predecessor of the block
+		std::vector<int> operands;
+
+		// Always a number if it has a value at all
+		bool number = false;
+	};
+
+	struct IRInstruction
+	{
+		int block = -1;
+
+		// Stack height before the instruction runs
+		int height = 0;
+
+		// The values it pops, the one pushed first comes first
+		std::vector<int> inputs;
+
+		// The value it leaves on top, GET_LOCAL pushes the value already in the slot rather than a new one
+		int output = -1;
+
+		// ITER writes the loop variable and the iterator in place
+		int itemValue = -1;
+		int iteratorValue = -1;
+
+		// The slot GET_LOCAL and SET_LOCAL use
+		int slot = -1;
+	};
+
+	struct IRBlock
+	{
+		// Instructions [start, end)
+		int start = 0;
+		int end = 0;
+
+		std::vector<int> predecessors;
+		std::vector<int> successors;
+
+		// Value in each stack slot coming in and going out
+		std::vector<int> entry;
+		std::vector<int> exit;
+
+		int dominator = -1;
+		bool reachable = false;
+	};
+
+	struct IRLoop
+	{
+		int header = -1;
+
+		// Indexed by block
+		std::vector<bool> blocks;
+	};
+
+	class IRFunction
+	{
+	public:
+
+		IRFunction(ObjFunction* function);
+
+		// Lifts the bytecode, fails on anything the IR doesn't model, eg. imports
+		bool Build();
+
+		// Runs the passes, true if any of them found something to change
+		bool Optimize();
+
+		// Writes the changes back into the chunk, if anything doesn't fit the chunk is left alone
+		bool Lower();
+
+	private:
+
+		struct Temporary
+		{
+			// CSE temporaries only live inside the tree of blocks they were made in so those trees share slots
+			int root = -1;
+			int uses = 0;
+			int slot = -1;
+		};
+
+		// A loop invariant expression that gets worked out before the loop instead
+		struct Hoist
+		{
+			int loop = -1;
+			int start = 0;
+			int end = 0;
+			int temporary = -1;
+
+			// The slots the loads read from before the loop, by instruction
+			std::vector<int> slots;
+		};
+
+		bool BuildBlocks();
+		void FindDominators();
+		void FindLoops();
+		bool Lift();
+		void SimplifyPhis();
+		void InferNumbers();
+
+		// Walks the block handing over the stack before each instruction
+		template<typename Function>
+		void Replay(int block, Function function);
+
+		int NewValue(IRValueKind kind, int block, int instruction);
+		int Find(int value);
+
+		bool Dominates(int a, int b) const;
+		bool InLoop(int loop, int block) const;
+		int InnermostLoop(int block) const;
+
+		// First instruction of the expression that leaves the value of the instruction on the stack
+		int ExpressionStart(int instruction) const;
+
+		bool PropagateCopies();
+		bool EliminateLoads();
+		bool HoistInvariants();
+		bool RemoveDeadStores();
+
+		bool IsInvariant(int value, int loop);
+		bool IsNumberBefore(int value, int loop);
+		bool CanHoist(int start, int end, int loop, std::vector<int>& slots);
+
+		int NewTemporary(int root);
+
+		ObjFunction* m_Function;
+
+		std::vector<DecodedInstruction> m_Code;
+		std::vector<IRInstruction> m_Instructions;
+		std::vector<IRBlock> m_Blocks;
+		std::vector<IRValue> m_Values;
+		std::vector<IRLoop> m_Loops;
+
+		// Blocks in reverse post order
+		std::vector<int> m_Order;
+
+		// Edges back to a block that was still being walked, each one closes a cycle
+		std::vector<std::pair<int, int>> m_Retreating;
+
+		// Values that turned out to be another value, trivial phis and loads that got reused
+		std::vector<int> m_Replacements;
+
+		int m_MaxHeight = 0;
+		bool m_Irreducible = false;
+
+		// What the passes decided
+		std::vector<Temporary> m_Temporaries;
+		std::vector<Hoist> m_Hoists;
+
+		// By instruction, the temporary that replaces the expression ending there and where that expression starts
+		std::vector<int> m_Replaced;
+		std::vector<int> m_ReplacedStart;
+
+		// By instruction, the temporary its result gets saved in
+		std::vector<int> m_SavedTo;
+
+		std::vector<bool> m_DeadStores;
+		bool m_Changed = false;
+	};
+}
@@ -0,0 +1,496 @@
+#include "Inliner.h"
+#include "Stack.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace script
+{
+	namespace
+	{
+		// Past this the call is a small part of what the function costs anyway
+		constexpr size_t MaxInlineBytes = 32;
+
+		int ReadShort(const DecodedInstruction& instruction, int offset = 0)
+		{
+			return (instruction.operands[offset] << 8) | instruction.operands[offset + 1];
+		}
+
+		void WriteShort(DecodedInstruction& instruction, int offset, int value)
+		{
+			instruction.operands[offset] = (uint8_t)(value >> 8);
+			instruction.operands[offset + 1] = (uint8_t)(value & 0xFF);
+		}
+
+		// -1 if it isn't a GET_LOCAL
+		int LoadSlot(const DecodedInstruction& instruction)
+		{
+			if (instruction.op == OP_GET_LOCAL)
+				return ReadShort(instruction);
+
+			if (instruction.op >= OP_GET_LOCAL_0 && instruction.op <= OP_GET_LOCAL_3)
+				return instruction.op - OP_GET_LOCAL_0;
+
+			return -1;
+		}
+
+		void SetLoad(DecodedInstruction& instruction, int slot)
+		{
+			if (slot <= 3)
+			{
+				instruction.op = (uint8_t)(OP_GET_LOCAL_0 + slot);
+				return;
+			}
+
+			instruction.op = OP_GET_LOCAL;
+			WriteShort(instruction, 0, slot);
+		}
+
+		DecodedInstruction MakeInstruction(uint8_t op)
+		{
+			DecodedInstruction instruction;
+			instruction.op = op;
+			return instruction;
+		}
+
+		// Stack height before each instruction, -1 for the ones that can't be reached
+		// Fails if two paths disagree on the height or something reads below the bottom of the frame
+		bool FindHeights(const std::vector<DecodedInstruction>& code, int entry, std::vector<int>& heights, int* maxHeight)
+		{
+			heights.assign(code.size(), -1);
+			*maxHeight = entry;
+
+			if (code.empty())
+				return true;
+
+			heights[0] = entry;
+			std::vector<int> work = { 0 };
+
+			while (!work.empty())
+			{
+				int i = work.back();
+				work.pop_back();
+
+				const DecodedInstruction& instruction = code[i];
+				int height = heights[i];
+				int pops, pushes;
+
+				if (!GetStackEffect(instruction, &pops, &pushes) || pops > height)
+					return false;
+
+				int slot = instruction.op == OP_SET_LOCAL ? ReadShort(instruction) : LoadSlot(instruction);
+
+				if (slot >= height)
+					return false;
+
+				// These look at values without popping them
+				switch (instruction.op)
+				{
+				case OP_SET_LOCAL:
+				case OP_SET_GLOBAL:
+				case OP_JUMP_IF_FALSE:
+					if (height < 1)
+						return false;
+					break;
+				case OP_ITER:
+					if (height < 3)
+						return false;
+					break;
+				case OP_INLINE_GUARD:
+					if (height < instruction.operands[4] + 1)
+						return false;
+					break;
+				default:
+					break;
+				}
+
+				height += pushes - pops;
+				*maxHeight = std::max(*maxHeight, height);
+
+				auto flow = [&](int target) {
+
+					// Running off the end of the code
+					if (target >= (int)code.size())
+						return false;
+
+					if (heights[target] < 0)
+					{
+						heights[target] = height;
+						work.push_back(target);
+						return true;
+					}
+
+					return heights[target] == height;
+				};
+
+				if (IsJump(instruction.op) && !flow(instruction.target))
+					return false;
+
+				if (instruction.op != OP_JUMP && instruction.op != OP_LOOP && instruction.op != OP_RETURN && !flow(i + 1))
+					return false;
+			}
+
+			return true;
+		}
+
+		// The bits have to match, 0 and -0 aren't the same constant
+		bool SameConstant(Value a, Value b)
+		{
+			if (a.IsNumber() && b.IsNumber())
+			{
+				double x = a.ToNumber();
+				double y = b.ToNumber();
+				return memcmp(&x, &y, sizeof(double)) == 0;
+			}
+
+			return a.IsObject() && b.IsObject() && a.ToObject() == b.ToObject();
+		}
+
+		// Finds the value in the chunk's constants or adds it, -1 if there is no room left
+		int CopyConstant(Chunk& chunk, Value value)
+		{
+			for (size_t i = 0; i < chunk.constants.size(); i++)
+			{
+				if (SameConstant(chunk.constants[i], value))
+					return (int)i;
+			}
+
+			if (chunk.constants.size() > UINT16_MAX)
+				return -1;
+
+			chunk.constants.push_back(value);
+			return (int)chunk.constants.size() - 1;
+		}
+
+		// Copies the code of the callee so it runs in the caller's frame with the callee's slot 0 at base
+		// A return leaves the result where the callee was, drops everything above it and jumps past the end of the copy
+		// Jump targets in the copy are indices into it, the end of the copy is body.size()
+		bool CopyBody(ObjFunction* callee, int base, Chunk& chunk, std::vector<DecodedInstruction>& body)
+		{
+			const Chunk& source = callee->chunk;
+
+			std::vector<DecodedInstruction> code;
+			std::vector<int> heights;
+			int maxHeight = 0;
+
+			if (!DecodeInstructions(source.code, code) || !FindHeights(code, callee->arity + 1, heights, &maxHeight))
+				return false;
+
+			if (base + maxHeight >= (int)FrameStackSize)
+				return false;
+
+			std::vector<int> moved(code.size() + 1, 0);
+
+			for (size_t i = 0; i < code.size(); i++)
+			{
+				moved[i] = (int)body.size();
+
+				DecodedInstruction instruction = code[i];
+				uint8_t op = instruction.op;
+
+				if (heights[i] < 0)
+					continue;
+
+				// The CALL after it is just a call in here
+				if (op == OP_TAIL_CALL)
+					continue;
+
+				if (op == OP_RETURN)
+				{
+					int drop = heights[i] - 1;
+
+					if (drop > UINT8_MAX)
+						return false;
+
+					DecodedInstruction store = MakeInstruction(OP_SET_LOCAL);
+					WriteShort(store, 0, base);
+					body.push_back(store);
+
+					DecodedInstruction pop = MakeInstruction(drop == 1 ? OP_POP : OP_POP_N);
+					pop.operands[0] = (uint8_t)drop;
+					body.push_back(pop);
+
+					if (i + 1 < code.size())
+					{
+						DecodedInstruction jump = MakeInstruction(OP_JUMP);
+						jump.target = (int)code.size();
+						body.push_back(jump);
+					}
+
+					continue;
+				}
+
+				int slot = LoadSlot(instruction);
+
+				if (slot >= 0)
+				{
+					SetLoad(instruction, base + slot);
+					body.push_back(instruction);
+					continue;
+				}
+
+				switch (op)
+				{
+				case OP_SET_LOCAL:
+					WriteShort(instruction, 0, base + ReadShort(instruction));
+					break;
+				case OP_CONSTANT:
+				case OP_CONSTANT_LONG:
+				{
+					int constant = CopyConstant(chunk, source.constants[op == OP_CONSTANT ? instruction.operands[0] : ReadShort(instruction)]);
+
+					if (constant < 0)
+						return false;
+
+					if (constant <= UINT8_MAX)
+					{
+						instruction.op = OP_CONSTANT;
+						instruction.operands[0] = (uint8_t)constant;
+					}
+					else
+					{
+						instruction.op = OP_CONSTANT_LONG;
+						WriteShort(instruction, 0, constant);
+					}
+					break;
+				}
+				case OP_ADD_CONSTANT:
+				case OP_SUBTRACT_CONSTANT:
+				{
+					int constant = CopyConstant(chunk, source.constants[instruction.operands[0]]);
+
+					if (constant < 0 || constant > UINT8_MAX)
+						return false;
+
+					instruction.operands[0] = (uint8_t)constant;
+					break;
+				}
+				case OP_GET_GLOBAL:
+				case OP_SET_GLOBAL:
+				case OP_GET_PROPERTY:
+				case OP_SET_PROPERTY:
+				case OP_INVOKE:
+				case OP_MATH_SQRT: case OP_MATH_SIN: case OP_MATH_COS: case OP_MATH_ABS:
+				case OP_MATH_FLOOR: case OP_MATH_MIN: case OP_MATH_MAX: case OP_MATH_ATAN2:
+				{
+					int name = CopyConstant(chunk, source.constants[ReadShort(instruction)]);
+
+					if (name < 0)
+						return false;
+
+					WriteShort(instruction, 0, name);
+
+					// Every site gets its own cache
+					if (op != OP_GET_GLOBAL && op != OP_SET_GLOBAL)
+						WriteShort(instruction, op == OP_INVOKE ? 3 : 2, (int)chunk.AddPropertyCache());
+					break;
+				}
+				case OP_INLINE_GUARD:
+				{
+					int function = CopyConstant(chunk, source.constants[ReadShort(instruction, 2)]);
+
+					if (function < 0)
+						return false;
+
+					WriteShort(instruction, 2, function);
+					break;
+				}
+				default:
+					break;
+				}
+
+				body.push_back(instruction);
+			}
+
+			moved[code.size()] = (int)body.size();
+
+			for (DecodedInstruction& instruction : body)
+			{
+				if (IsJump(instruction.op))
+					instruction.target = moved[instruction.target];
+			}
+
+			return true;
+		}
+
+		// The function called by the CALL at the index if it came straight from a global that names one of the functions
+		ObjFunction* FindCallee(const Chunk& chunk, const std::vector<DecodedInstruction>& code, const std::vector<int>& heights,
+			int call, const std::vector<ObjFunction*>& functions)
+		{
+			int argCount = code[call].op - OP_CALL_0;
+			int slot = heights[call] - argCount - 1;
+
+			// The arguments all sit above the callee so the first thing going back that starts at its height pushed it
+			int i = call - 1;
+
+			while (i >= 0 && heights[i] > slot)
+				i--;
+
+			if (i < 0 || heights[i] != slot || code[i].op != OP_GET_GLOBAL)
+				return nullptr;
+
+			Object* name = chunk.constants[ReadShort(code[i])].ToObject();
+
+			// A function declared again later replaces the earlier one
+			for (auto it = functions.rbegin(); it != functions.rend(); ++it)
+			{
+				if ((Object*)(*it)->name == name)
+					return (*it)->arity == argCount ? *it : nullptr;
+			}
+
+			return nullptr;
+		}
+	}
+
+	bool CanInline(ObjFunction* function)
+	{
+		const Chunk& chunk = function->chunk;
+
+		if (!function->name || chunk.code.size() > MaxInlineBytes)
+			return false;
+
+		std::vector<DecodedInstruction> code;
+		std::vector<int> heights;
+		int maxHeight = 0;
+
+		if (!DecodeInstructions(chunk.code, code) || !FindHeights(code, function->arity + 1, heights, &maxHeight))
+			return false;
+
+		for (const DecodedInstruction& instruction : code)
+		{
+			// Inlining a function that calls itself would only unroll it once
+			if (instruction.op == OP_GET_GLOBAL && chunk.constants[ReadShort(instruction)].ToObject() == (Object*)function->name)
+				return false;
+
+			switch (instruction.op)
+			{
+			case OP_DEFINE_GLOBAL:
+			case OP_EXPORT_GLOBAL:
+			case OP_CLASS:
+			case OP_METHOD:
+			case OP_IMPORT_MODULE:
+			case OP_IMPORT_MODULE_AS:
+				return false;
+			default:
+				break;
+			}
+		}
+
+		return true;
+	}
+
+	void InlineCalls(ObjFunction* function, const std::vector<ObjFunction*>& functions, std::vector<ObjFunction*>& inlined)
+	{
+		if (functions.empty())
+			return;
+
+		Chunk& chunk = function->chunk;
+
+		std::vector<DecodedInstruction> code;
+		std::vector<int> heights;
+		int maxHeight = 0;
+
+		if (!DecodeInstructions(chunk.code, code) || !FindHeights(code, function->arity + 1, heights, &maxHeight))
+			return;
+
+		// Where each instruction ends up, jumps in the function get pointed at these once everything is in place
+		std::vector<int> moved(code.size() + 1, 0);
+		std::vector<bool> remap;
+
+		std::vector<DecodedInstruction> output;
+		std::vector<ObjFunction*> calls;
+
+		// Constants and caches a copy added are left behind if the copy doesn't work out, that's harmless
+		for (size_t i = 0; i < code.size(); i++)
+		{
+			const DecodedInstruction& instruction = code[i];
+
+			// A CALL after a TAIL_CALL was already looked at along with it
+			bool isCall = instruction.op >= OP_CALL_0 && instruction.op <= OP_CALL_16 && !(i > 0 && code[i - 1].op == OP_TAIL_CALL);
+			bool tail = i + 1 < code.size() && instruction.op == OP_TAIL_CALL;
+
+			// return f(x) has the TAIL_CALL in front of the CALL, the guard goes in front of both
+			int call = tail ? (int)i + 1 : (int)i;
+			ObjFunction* callee = nullptr;
+			std::vector<DecodedInstruction> body;
+
+			if ((isCall || tail) && heights[call] >= 0 && code[call].op >= OP_CALL_0 && code[call].op <= OP_CALL_16)
+			{
+				callee = FindCallee(chunk, code, heights, call, functions);
+
+				int base = heights[call] - (code[call].op - OP_CALL_0) - 1;
+
+				if (callee && !CopyBody(callee, base, chunk, body))
+					callee = nullptr;
+			}
+
+			int constant = callee ? CopyConstant(chunk, Value(callee)) : -1;
+
+			if (constant < 0)
+			{
+				moved[i] = (int)output.size();
+				output.push_back(instruction);
+				remap.push_back(IsJump(instruction.op));
+				continue;
+			}
+
+			// Falls through to the call if the global has changed
+			int guard = (int)output.size();
+
+			DecodedInstruction check = MakeInstruction(OP_INLINE_GUARD);
+			WriteShort(check, 2, constant);
+			check.operands[4] = (uint8_t)(code[call].op - OP_CALL_0);
+
+			moved[i] = guard;
+			output.push_back(check);
+			remap.push_back(false);
+
+			for (int k = (int)i; k <= call; k++)
+			{
+				moved[k] = k == (int)i ? guard : (int)output.size();
+				output.push_back(code[k]);
+				remap.push_back(false);
+			}
+
+			int skip = (int)output.size();
+			output.push_back(MakeInstruction(OP_JUMP));
+			remap.push_back(false);
+
+			int start = (int)output.size();
+			output[guard].target = start;
+
+			for (DecodedInstruction& copy : body)
+			{
+				if (IsJump(copy.op))
+					copy.target += start;
+
+				output.push_back(copy);
+				remap.push_back(false);
+			}
+
+			output[skip].target = (int)output.size();
+			calls.push_back(callee);
+
+			i = call;
+		}
+
+		if (calls.empty())
+			return;
+
+		moved[code.size()] = (int)output.size();
+
+		for (size_t i = 0; i < output.size(); i++)
+		{
+			if (remap[i])
+				output[i].target = moved[output[i].target];
+		}
+
+		std::vector<uint8_t> encoded;
+
+		if (!EncodeInstructions(output, encoded))
+			return;
+
+		chunk.code = std::move(encoded);
+		inlined.insert(inlined.end(), calls.begin(), calls.end());
+	}
+}
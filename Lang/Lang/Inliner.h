@@ -0,0 +1,18 @@
+#pragma once
+#include "Object.h"
+
+#include <vector>
+
+// Copies the bodies of small functions into the code that calls them
+// Only functions declared at the top of a script are considered and only calls that get the function straight from
+// its global. The copy sits behind an INLINE_GUARD which falls back to the call if the global has been given something else
+
+namespace script
+{
+	// Small enough, doesn't call itself and only uses instructions the inliner can move
+	bool CanInline(ObjFunction* function);
+
+	// Inlines the calls in the function to any of the given functions
+	// Adds the function each inlined call went to, in the order they are in the code
+	void InlineCalls(ObjFunction* function, const std::vector<ObjFunction*>& functions, std::vector<ObjFunction*>& inlined);
+}
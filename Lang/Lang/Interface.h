@@ -4,12 +4,41 @@
 #include "Object.h"
 #include "Value.h"
 
+#include <cstdio>
+#include <filesystem>
 #include <fstream>
+#include <memory>
+#include <random>
 #include <sstream>
 
 namespace script
 {
 
+	// A file mapped into memory, it stays mapped for as long as this is around
+	// The mapping is read only, so its pages stay shared with every other process that maps the same file
+	class MappedFile
+	{
+	public:
+
+		// nullptr if the file can't be mapped
+		static std::shared_ptr<MappedFile> Map(const std::string& filepath);
+
+		~MappedFile();
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		const uint8_t* Data() const { return m_Data; }
+		size_t Size() const { return m_Size; }
+
+	private:
+
+		MappedFile() = default;
+
+		uint8_t* m_Data = nullptr;
+		size_t m_Size = 0;
+	};
+
 	// This interface determines how the VM can access the hardware
 	class IOInterface
 	{
@@ -17,6 +46,13 @@ namespace script
 
 		virtual std::string ReadFile(const std::string& filepath) = 0;
 
+		// Used for the compiled script cache, an interface that can't store files just never has a cache
+		virtual std::string ReadBinaryFile(const std::string& filepath) { return ""; }
+		virtual bool WriteBinaryFile(const std::string& filepath, const std::string& data) { return false; }
+
+		// Compiled scripts run straight out of a mapping when they can, nullptr reads them in instead
+		virtual std::shared_ptr<MappedFile> MapFile(const std::string& filepath) { return nullptr; }
+
 		virtual void Print(const std::string& str) = 0;
 
 	private:
@@ -40,7 +76,63 @@ namespace script
 
 			return buffer.str();
 		}
+
+		std::string ReadBinaryFile(const std::string& filepath) override
+		{
+			std::ifstream t(filepath, std::ios::binary);
+
+			if (!t.is_open())
+			{
+				return "";
+			}
+
+			std::stringstream buffer;
+			buffer << t.rdbuf();
+
+			return buffer.str();
+		}
+
+		bool WriteBinaryFile(const std::string& filepath, const std::string& data) override
+		{
+			// Written to the side and moved over the old one, lots of VMs can be starting on the same script
+			// and none of them should ever see half a file
+			std::string temp = filepath + "." + std::to_string(std::random_device{}()) + ".tmp";
+
+			{
+				std::ofstream t(temp, std::ios::binary | std::ios::trunc);
+
+				if (!t.is_open())
+				{
+					return false;
+				}
+
+				t.write(data.data(), data.size());
+
+				if (!t)
+				{
+					t.close();
+					std::remove(temp.c_str());
+					return false;
+				}
+			}
+
+			std::error_code error;
+			std::filesystem::rename(temp, filepath, error);
+
+			if (error)
+			{
+				std::remove(temp.c_str());
+				return false;
+			}
+
+			return true;
+		}
 		
+		std::shared_ptr<MappedFile> MapFile(const std::string& filepath) override
+		{
+			return MappedFile::Map(filepath);
+		}
+
 		void Print(const std::string& str) override
 		{
 			// Just a simple call to printf 
@@ -55,18 +147,32 @@ namespace script
 		
 		// Add a constructor to the class
 		// This called on class instance creation
+		void AddConstructor(NativeFn func, int arity, void* context = nullptr)
+		{
+			assert(m_Ptr);
+
+			m_Ptr->methods["construct"] = Value(NewNativeFunction(func, arity, context));
+		}
+
 		void AddConstructor(NativeFunc func, int arity)
 		{
 			assert(m_Ptr);
 
-			m_Ptr->methods["construct"] = Value(NewNativeFunction(func, arity));
+			m_Ptr->methods["construct"] = Value(NewNativeFunction(std::move(func), arity));
+		}
+
+		void AddMethod(const std::string& name, NativeFn func, int arity, void* context = nullptr)
+		{
+			assert(m_Ptr);
+
+			m_Ptr->methods[name] = Value(NewNativeFunction(func, arity, context)); 
 		}
 
 		void AddMethod(const std::string& name, NativeFunc func, int arity)
 		{
 			assert(m_Ptr);
 
-			m_Ptr->methods[name] = Value(NewNativeFunction(func, arity)); 
+			m_Ptr->methods[name] = Value(NewNativeFunction(std::move(func), arity)); 
 		}
 
 	private:
@@ -0,0 +1,1484 @@
+#include "JIT.h"
+#include "VM.h"
+#include "Memory.h"
+#include "Assembler.h"
+#include "Trace.h"
+
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+
+#if LANG_JIT
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace script
+{
+#if LANG_JIT
+
+	// The runtime side of the JIT
+	// Native code calls these for anything that isn't worth doing inline
+	// They all take the current stack top and hand back the new one, nullptr means an error has been reported
+	struct JITRuntime
+	{
+		// Returned by helpers that can't handle an instruction, the interpreter runs it instead
+		// Nothing has been changed when this is returned
+		static inline Value* const Bailout = (Value*)1;
+
+		enum IterResult : uint32_t
+		{
+			ITER_NEXT,
+			ITER_DONE,
+			ITER_BAILOUT
+		};
+
+		static Value* RuntimeError(VM* vm, Value* top, const char* message);
+		static Value* Safepoint(VM* vm, Value* top);
+		static Value* Binary(VM* vm, Value* top, uint32_t op);
+		static uint64_t Equal(uint64_t a, uint64_t b);
+		static Value* GetGlobal(VM* vm, Value* top, GlobalTable* globals, uint32_t slot);
+		static Value* Call(VM* vm, Value* top, uint32_t argCount);
+		static Value* Invoke(VM* vm, Value* top, ObjString* name, uint32_t argCount, PropertyCache* cache);
+		static Value* Maths(VM* vm, Value* top, uint32_t instruction, ObjString* name, PropertyCache* cache);
+		static Value* GetProperty(VM* vm, Value* top, ObjString* name, PropertyCache* cache);
+		static Value* SetProperty(VM* vm, Value* top, ObjString* name, PropertyCache* cache);
+		static Value* SubscriptRead(VM* vm, Value* top);
+		static Value* SubscriptWrite(VM* vm, Value* top);
+		static Value* CreateRange(VM* vm, Value* top);
+		static uint32_t Iter(Value* top);
+
+		// Runs any frame a call pushed and then gives the events a chance, like the end of OP_CALL
+		static Value* FinishCall(VM* vm, size_t depth);
+
+		// Finishes off a call made straight from native code that bailed out
+		static Value* ResumeCall(VM* vm);
+
+		static int32_t CurrentFiberOffset() { return x64::MemberOffset(&VM::m_CurrentFiber); }
+	};
+
+	Value* JITRuntime::RuntimeError(VM* vm, Value* top, const char* message)
+	{
+		vm->m_CurrentFiber->stack.m_Top = top;
+		vm->Error(message);
+		return nullptr;
+	}
+
+	Value* JITRuntime::Safepoint(VM* vm, Value* top)
+	{
+		vm->m_CurrentFiber->stack.m_Top = top;
+
+		if (!vm->PollEvents())
+			return nullptr;
+
+		return vm->m_CurrentFiber->stack.m_Top;
+	}
+
+	Value* JITRuntime::Binary(VM* vm, Value* top, uint32_t op)
+	{
+		Value a = top[-2];
+		Value b = top[-1];
+
+		vm->m_CurrentFiber->stack.m_Top = top;
+
+		switch (op)
+		{
+		case OP_EQUAL:
+			top[-2] = Value(a == b);
+			return top - 1;
+		case OP_NOT_EQUAL:
+			top[-2] = Value(!(a == b));
+			return top - 1;
+		case OP_POWER:
+			top[-2] = Value(std::pow(a.ToNumber(), b.ToNumber()));
+			return top - 1;
+		case OP_MODULO:
+			top[-2] = Value(std::remainder(a.ToNumber(), b.ToNumber()));
+			return top - 1;
+		case OP_ADD:
+			if (a.IsObjType(OBJ_STRING) && b.IsObjType(OBJ_STRING))
+			{
+				top[-2] = Value(((ObjString*)a.ToObject())->AppendNew((ObjString*)b.ToObject()));
+				return Safepoint(vm, top - 1);
+			}
+
+			if (!a.IsNumber() || !b.IsNumber())
+			{
+				vm->Error("Operands must be two numbers or two strings.");
+				return nullptr;
+			}
+
+			break;
+		default:
+			if (!a.IsNumber() || !b.IsNumber())
+			{
+				vm->Error("Operands must be numbers.");
+				return nullptr;
+			}
+
+			break;
+		}
+
+		// Only numbers get this far
+		// The inline code handles these, this is just here for completeness
+		double x = a.ToNumber();
+		double y = b.ToNumber();
+
+		switch (op)
+		{
+		case OP_ADD:			top[-2] = Value(x + y); break;
+		case OP_SUBTRACT:		top[-2] = Value(x - y); break;
+		case OP_MULTIPLY:		top[-2] = Value(x * y); break;
+		case OP_DIVIDE:			top[-2] = Value(x / y); break;
+		case OP_LESS:			top[-2] = Value(x < y); break;
+		case OP_GREATER:		top[-2] = Value(x > y); break;
+		case OP_LESS_EQUAL:		top[-2] = Value(x <= y); break;
+		case OP_GREATER_EQUAL:	top[-2] = Value(x >= y); break;
+		default:
+			break;
+		}
+
+		return top - 1;
+	}
+
+	uint64_t JITRuntime::Equal(uint64_t a, uint64_t b)
+	{
+		Value x;
+		Value y;
+		x.value = a;
+		y.value = b;
+
+		return x == y;
+	}
+
+	Value* JITRuntime::GetGlobal(VM* vm, Value* top, GlobalTable* globals, uint32_t slot)
+	{
+		Value* parentValue = globals->FindInParent((uint16_t)slot);
+
+		if (!parentValue)
+			return RuntimeError(vm, top, ("cannot get global variable: \"" + globals->names[slot] + "\" as it does not exist.").c_str());
+
+		*top = *parentValue;
+		return top + 1;
+	}
+
+	Value* JITRuntime::FinishCall(VM* vm, size_t depth)
+	{
+		// Script functions push a frame, run it until it returns
+		if (vm->m_CurrentFiber->framesCount > depth && !vm->RunFrame())
+			return nullptr;
+
+		if (vm->m_Events.size != 0)
+			return Safepoint(vm, vm->m_CurrentFiber->stack.m_Top);
+
+		return vm->m_CurrentFiber->stack.m_Top;
+	}
+
+	Value* JITRuntime::ResumeCall(VM* vm)
+	{
+		return FinishCall(vm, vm->m_CurrentFiber->framesCount - 1);
+	}
+
+	Value* JITRuntime::Call(VM* vm, Value* top, uint32_t argCount)
+	{
+		ObjFiber* fiber = vm->m_CurrentFiber;
+		fiber->stack.m_Top = top;
+
+		Value callee = top[-(int)argCount - 1];
+		size_t depth = fiber->framesCount;
+
+		// Compiled functions calling each other skip straight to the native code
+		if (callee.IsObjType(OBJ_FUNCTION))
+		{
+			ObjFunction* function = (ObjFunction*)callee.ToObject();
+
+			if (function->jit && depth < JITMaxCallDepth && fiber->ReserveCall(function->maxStack))
+			{
+				top = fiber->stack.m_Top;
+
+				CallFrame* frame = &fiber->frames[fiber->framesCount++];
+				frame->function = function;
+				frame->slots = top - argCount - 1;
+
+				JITStatus status = function->jit->Enter(vm, frame, &fiber->stack.m_Top, function->chunk.code.data());
+
+				if (status == JIT_ERROR)
+					return nullptr;
+
+				if (status == JIT_BAILOUT)
+					return FinishCall(vm, depth);
+
+				Value result = fiber->stack.m_Top[-1];
+
+				fiber->framesCount--;
+				frame = &fiber->frames[depth];
+				frame->slots[0] = result;
+
+				top = frame->slots + 1;
+				fiber->stack.m_Top = top;
+
+				if (vm->m_Events.size != 0)
+					return Safepoint(vm, top);
+
+				return top;
+			}
+		}
+
+		if (!callee.IsObject())
+			return RuntimeError(vm, top, "Unknown object cannot be called.");
+
+		if (!vm->CallValue(callee, (int)argCount))
+		{
+			// Natives report their own errors
+			if (!callee.IsObjType(OBJ_NATIVE))
+				vm->Error(callee.IsObjType(OBJ_FUNCTION) ? "Could not call function" : "Unknown object cannot be called.");
+
+			return nullptr;
+		}
+
+		return FinishCall(vm, depth);
+	}
+
+	Value* JITRuntime::Invoke(VM* vm, Value* top, ObjString* name, uint32_t argCount, PropertyCache* cache)
+	{
+		ObjFiber* fiber = vm->m_CurrentFiber;
+		Value* receiverSlot = top - argCount - 1;
+		Value receiver = *receiverSlot;
+		size_t depth = fiber->framesCount;
+
+		fiber->stack.m_Top = top;
+
+		if (receiver.IsObjType(OBJ_MODULE))
+		{
+			Value* function = ((ObjModule*)receiver.ToObject())->globals.Find(name->str);
+			if (!function)
+				return Bailout;
+
+			*receiverSlot = *function;
+
+			if (!vm->CallValue(*function, (int)argCount))
+				return RuntimeError(vm, top, ("Could not call module function: " + std::string(name->str)).c_str());
+
+			return FinishCall(vm, depth);
+		}
+
+		ObjClass* classObj = vm->GetClassInline(receiver);
+		if (classObj == nullptr)
+			return Bailout;
+
+		ObjInstance* instance = nullptr;
+		Shape* shape = nullptr;
+
+		if (receiver.IsObjType(OBJ_INSTANCE))
+		{
+			instance = (ObjInstance*)receiver.ToObject();
+			shape = instance->shape;
+		}
+
+		PropertyCacheEntry scratch;
+		PropertyCacheEntry* entry = vm->LookupProperty(cache, classObj, shape, name, &scratch);
+
+		if (entry == nullptr)
+			return Bailout;
+
+		if (entry->method == nullptr)
+		{
+			Value callee = instance->fields[entry->slot];
+			*receiverSlot = callee;
+
+			if (!vm->CallValue(callee, (int)argCount))
+				return RuntimeError(vm, top, ("Field is not callable: " + std::string(name->str)).c_str());
+
+			return FinishCall(vm, depth);
+		}
+
+		if (entry->method->type == OBJ_FUNCTION)
+		{
+			if (!vm->Call((ObjFunction*)entry->method, (int)argCount))
+				return RuntimeError(vm, top, ("Failed to call method: " + std::string(name->str)).c_str());
+
+			return FinishCall(vm, depth);
+		}
+
+		// Native methods get self as the first argument
+		ObjNative* native = (ObjNative*)entry->method;
+
+		Value result = native->Call((int)argCount + 1, receiverSlot);
+		if (vm->TakeNativeError())
+			return nullptr;
+
+		fiber->stack.m_Top = receiverSlot;
+		*fiber->stack.m_Top++ = result;
+
+		return Safepoint(vm, fiber->stack.m_Top);
+	}
+
+	Value* JITRuntime::Maths(VM* vm, Value* top, uint32_t instruction, ObjString* name, PropertyCache* cache)
+	{
+		int argCount = MathsIntrinsicArity((uint8_t)instruction);
+
+		if (top[-1].IsNumber() && top[-argCount].IsNumber() && vm->IsMathsNative(top[-argCount - 1], (uint8_t)instruction, name, cache))
+		{
+			top[-argCount - 1] = Value(MathsIntrinsicResult((uint8_t)instruction, top[-argCount].ToNumber(), top[-1].ToNumber()));
+			return top - argCount;
+		}
+
+		// The name has been rebound, call whatever it is now
+		ObjFiber* fiber = vm->m_CurrentFiber;
+		Value callee = top[-argCount - 1];
+		size_t depth = fiber->framesCount;
+
+		fiber->stack.m_Top = top;
+
+		if (callee.IsObjType(OBJ_MODULE))
+		{
+			Value* function = ((ObjModule*)callee.ToObject())->globals.Find(name->str);
+			if (!function)
+				return RuntimeError(vm, top, "Module doesn't contain function.");
+
+			callee = *function;
+			top[-argCount - 1] = callee;
+		}
+
+		if (!vm->CallValue(callee, argCount))
+			return RuntimeError(vm, top, ("Could not call function: " + std::string(name->str)).c_str());
+
+		return FinishCall(vm, depth);
+	}
+
+	Value* JITRuntime::GetProperty(VM* vm, Value* top, ObjString* name, PropertyCache* cache)
+	{
+		Value receiver = top[-1];
+
+		if (receiver.IsObjType(OBJ_MODULE))
+		{
+			Value* value = ((ObjModule*)receiver.ToObject())->globals.Find(name->str);
+			if (!value)
+				return Bailout;
+
+			top[-1] = *value;
+			return top;
+		}
+
+		// Only field reads are done here, binding methods is left to the interpreter
+		if (!receiver.IsObjType(OBJ_INSTANCE))
+			return Bailout;
+
+		ObjInstance* instance = (ObjInstance*)receiver.ToObject();
+
+		PropertyCacheEntry scratch;
+		PropertyCacheEntry* entry = vm->LookupProperty(cache, instance->klass, instance->shape, name, &scratch);
+
+		if (entry == nullptr || entry->method)
+			return Bailout;
+
+		top[-1] = instance->fields[entry->slot];
+		return top;
+	}
+
+	Value* JITRuntime::SetProperty(VM* vm, Value* top, ObjString* name, PropertyCache* cache)
+	{
+		if (!top[-2].IsObjType(OBJ_INSTANCE))
+			return Bailout;
+
+		ObjInstance* instance = (ObjInstance*)top[-2].ToObject();
+
+		PropertyCacheEntry* entry = vm->FindPropertyCacheEntry(cache, instance->klass, instance->shape);
+		PropertyCacheEntry resolved;
+
+		if (entry)
+		{
+			vm->m_InlineCacheStats.hits++;
+		}
+		else
+		{
+			vm->m_InlineCacheStats.misses++;
+
+			vm->ResolveSetProperty(instance, name, &resolved);
+
+			vm->AddPropertyCacheEntry(cache, resolved);
+			entry = &resolved;
+		}
+
+		if (entry->transition)
+		{
+			instance->EnsureFieldCapacity(entry->slot + 1);
+			instance->shape = entry->transition;
+		}
+
+		instance->fields[entry->slot] = top[-1];
+
+		top[-2] = top[-1];
+		return top - 1;
+	}
+
+	Value* JITRuntime::SubscriptRead(VM* vm, Value* top)
+	{
+		Value arr = top[-2];
+		Value idx = top[-1];
+
+		// Anything other than an in bounds list index goes back to the interpreter
+		if (!arr.IsObjType(OBJ_ARRAY) || !idx.IsNumber())
+			return Bailout;
+
+		ObjArray* obj = (ObjArray*)arr.ToObject();
+		double index = idx.ToNumber();
+
+		if (index < 0.0 || index >= (double)obj->size)
+			return Bailout;
+
+		top[-2] = obj->values[(size_t)index];
+		return top - 1;
+	}
+
+	Value* JITRuntime::SubscriptWrite(VM* vm, Value* top)
+	{
+		Value arr = top[-3];
+		Value idx = top[-2];
+
+		if (!arr.IsObjType(OBJ_ARRAY) || !idx.IsNumber())
+			return Bailout;
+
+		ObjArray* obj = (ObjArray*)arr.ToObject();
+		double index = idx.ToNumber();
+
+		if (index < 0.0 || index >= (double)obj->size)
+			return Bailout;
+
+		obj->values[(size_t)index] = top[-1];
+
+		top[-3] = top[-1];
+		return top - 2;
+	}
+
+	Value* JITRuntime::CreateRange(VM* vm, Value* top)
+	{
+		ObjRange* range = script::CreateRange();
+		range->from = top[-2].ToNumber();
+		range->to = top[-1].ToNumber();
+
+		top[-2] = Value(range);
+
+		return Safepoint(vm, top - 1);
+	}
+
+	uint32_t JITRuntime::Iter(Value* top)
+	{
+		Value* value = top - 3;
+		Value seq = top[-2];
+		Value* iterator = top - 1;
+
+		if (!seq.IsObject())
+			return ITER_BAILOUT;
+
+		double it = 0.0;
+		if (!iterator->IsNil())
+			it = iterator->ToNumber();
+
+		switch (seq.ToObject()->type)
+		{
+		case OBJ_ARRAY:
+		{
+			ObjArray* arr = (ObjArray*)seq.ToObject();
+			uint32_t idx = (uint32_t)trunc(it);
+
+			if (idx >= arr->size)
+				return ITER_DONE;
+
+			*value = arr->values[idx];
+			iterator->MakeNumber((double)(idx + 1));
+			return ITER_NEXT;
+		}
+		case OBJ_RANGE:
+		{
+			ObjRange* range = (ObjRange*)seq.ToObject();
+
+			if (it < range->from)
+				it = range->from;
+
+			if (it >= range->to)
+				return ITER_DONE;
+
+			*value = it;
+			iterator->MakeNumber(it + range->step);
+			return ITER_NEXT;
+		}
+		default:
+			return ITER_BAILOUT;
+		}
+	}
+
+	namespace
+	{
+		using namespace x64;
+
+		// Registers that stay the same through the whole function
+		// rbx holds the VM, r15 the call frame, r14 where the stack top gets written back to
+		// r12 is the stack top and r13 the frame's first slot, rbp always holds QNAN for the type checks
+		constexpr Register VMReg = RBX;
+		constexpr Register FrameReg = R15;
+		constexpr Register TopPtrReg = R14;
+		constexpr Register TopReg = R12;
+		constexpr Register SlotsReg = R13;
+		constexpr Register QNanReg = RBP;
+
+		constexpr int32_t FrameIp = (int32_t)offsetof(CallFrame, ip);
+		constexpr int32_t FrameSlots = (int32_t)offsetof(CallFrame, slots);
+
+		constexpr uint64_t ObjectMask = QNAN | SIGN_BIT;
+
+		static_assert(sizeof(ObjectType) == 4, "Calls compare the object type as a dword");
+		static_assert(sizeof(CallFrame) <= INT8_MAX, "Calls index the frames with an 8 bit multiply");
+
+		typedef uint32_t(*JITEntry)(VM* vm, CallFrame* frame, Value** top, void* address);
+
+		class JITCompiler
+		{
+		public:
+
+			JITCompiler(ObjFunction* function, bool tracing, const size_t* pendingEvents, int32_t* pollCountdown)
+				: m_Function(function), m_Chunk(function->chunk), m_Tracing(tracing), m_PendingEvents(pendingEvents), m_PollCountdown(pollCountdown)
+			{
+			}
+
+			JITFunction* Compile()
+			{
+				CodeBuffer& code = m_Chunk.code;
+
+				m_Epilogue = m_Asm.NewLabel();
+				m_Bailout = m_Asm.NewLabel();
+				m_Error = m_Asm.NewLabel();
+
+				m_OpLabels.resize(code.size() + 1);
+				for (int& label : m_OpLabels)
+					label = m_Asm.NewLabel();
+
+				// Loop headers can be entered from the interpreter when a loop gets hot
+				std::vector<bool> entries(code.size(), false);
+				if (!code.empty())
+					entries[0] = true;
+
+				for (size_t offset = 0; offset < code.size(); offset += GetInstructionLength(code[offset]))
+				{
+					if (code[offset] == OP_LOOP)
+					{
+						size_t target = offset + 3 - ReadShort(offset + 1);
+						if (target < code.size())
+							entries[target] = true;
+					}
+				}
+
+				EmitPrologue();
+
+				for (size_t offset = 0; offset < code.size(); offset += GetInstructionLength(code[offset]))
+				{
+					m_Asm.Bind(m_OpLabels[offset]);
+
+					if (!EmitInstruction(offset))
+						return nullptr;
+				}
+
+				// Falling off the end shouldn't happen, the compiler always ends with a return
+				m_Asm.Bind(m_OpLabels[code.size()]);
+				EmitBailout(code.size() - 1);
+
+				// Slow paths go at the end so the fast paths stay together
+				for (size_t i = 0; i < m_SlowPaths.size(); i++)
+					m_SlowPaths[i]();
+
+				EmitEpilogue();
+
+				if (!m_Asm.Link())
+					return nullptr;
+
+				size_t size = 0;
+				uint8_t* memory = MapExecutable(m_Asm.code, &size);
+				if (!memory)
+					return nullptr;
+
+				JITFunction* jit = new JITFunction;
+				jit->code = memory;
+				jit->size = size;
+				jit->function = m_Function;
+				jit->entries.resize(code.size(), nullptr);
+				jit->start = jit->code + m_Asm.GetLabel(m_OpLabels[0]);
+
+				for (size_t i = 0; i < code.size(); i++)
+				{
+					if (entries[i])
+						jit->entries[i] = jit->code + m_Asm.GetLabel(m_OpLabels[i]);
+				}
+
+				return jit;
+			}
+
+		private:
+
+			uint16_t ReadShort(size_t offset)
+			{
+				return (uint16_t)((m_Chunk.code[offset] << 8) | m_Chunk.code[offset + 1]);
+			}
+
+			void EmitPrologue()
+			{
+				m_Asm.Push(RBP);
+				m_Asm.Push(RBX);
+				m_Asm.Push(R12);
+				m_Asm.Push(R13);
+				m_Asm.Push(R14);
+				m_Asm.Push(R15);
+
+				// Keeps the stack 16 byte aligned for the helper calls
+				// The slot holds the frame's offset into the frames, they can move whenever something is called
+				m_Asm.AddImm(RSP, -8);
+
+				m_Asm.Mov(VMReg, RDI);
+				m_Asm.Mov(FrameReg, RSI);
+				m_Asm.Mov(TopPtrReg, RDX);
+				m_Asm.Load(TopReg, TopPtrReg, 0);
+				m_Asm.Load(SlotsReg, FrameReg, FrameSlots);
+				m_Asm.MovImm(QNanReg, QNAN);
+
+				m_Asm.Mov(RAX, FrameReg);
+				m_Asm.Load(RDX, TopPtrReg, m_TopToFrames);
+				m_Asm.Sub(RAX, RDX);
+				m_Asm.Store(RSP, 0, RAX);
+
+				m_Asm.JmpReg(RCX);
+			}
+
+			void EmitEpilogue()
+			{
+				// rax has the bytecode to resume from
+				m_Asm.Bind(m_Bailout);
+				m_Asm.Store(FrameReg, FrameIp, RAX);
+				m_Asm.MovImm(RAX, JIT_BAILOUT);
+				m_Asm.Jmp(m_Epilogue);
+
+				m_Asm.Bind(m_Error);
+				m_Asm.MovImm(RAX, JIT_ERROR);
+
+				m_Asm.Bind(m_Epilogue);
+				m_Asm.Store(TopPtrReg, 0, TopReg);
+
+				m_Asm.AddImm(RSP, 8);
+				m_Asm.Pop(R15);
+				m_Asm.Pop(R14);
+				m_Asm.Pop(R13);
+				m_Asm.Pop(R12);
+				m_Asm.Pop(RBX);
+				m_Asm.Pop(RBP);
+				m_Asm.Ret();
+			}
+
+			// Leaves the native code, the interpreter carries on from this instruction
+			void EmitBailout(size_t offset)
+			{
+				m_Asm.MovImm(RAX, (uint64_t)(m_Chunk.code.data() + offset));
+				m_Asm.Jmp(m_Bailout);
+			}
+
+			void CallHelper(const void* helper)
+			{
+				m_Asm.MovImm(RAX, (uint64_t)helper);
+				m_Asm.CallReg(RAX);
+			}
+
+			// Helpers that return the stack top
+			// On a bailout nothing has been done yet, so it leaves at the start of the instruction
+			void CheckHelperResult(size_t offset, bool canBailout)
+			{
+				m_Asm.Test(RAX, RAX);
+				m_Asm.Jcc(CC_E, m_Error);
+
+				if (canBailout)
+				{
+					int bailout = m_Asm.NewLabel();
+
+					m_Asm.CmpEaxImm8(1);
+					m_Asm.Jcc(CC_E, bailout);
+
+					m_SlowPaths.push_back([this, bailout, offset]() {
+						m_Asm.Bind(bailout);
+						EmitBailout(offset);
+					});
+				}
+
+				m_Asm.Mov(TopReg, RAX);
+				ReloadFrame();
+			}
+
+			// The frames and the stack might have been moved by a call
+			void ReloadFrame()
+			{
+				m_Asm.Load(FrameReg, TopPtrReg, m_TopToFrames);
+				m_Asm.AddMem(FrameReg, RSP, 0);
+				m_Asm.Load(SlotsReg, FrameReg, FrameSlots);
+			}
+
+			// Jumps to the label if the register isn't a number, clobbers rdx
+			void GuardNumber(Register reg, int label)
+			{
+				m_Asm.Mov(RDX, reg);
+				m_Asm.And(RDX, QNanReg);
+				m_Asm.Cmp(RDX, QNanReg);
+				m_Asm.Jcc(CC_E, label);
+			}
+
+			// Loads the top two values into rax and rcx
+			// Goes to the returned label if either isn't a number
+			int LoadNumberOperands()
+			{
+				int slow = m_Asm.NewLabel();
+
+				m_Asm.Load(RAX, TopReg, -16);
+				m_Asm.Load(RCX, TopReg, -8);
+				GuardNumber(RAX, slow);
+				GuardNumber(RCX, slow);
+
+				m_Asm.MovqToXmm(0, RAX);
+				m_Asm.MovqToXmm(1, RCX);
+
+				return slow;
+			}
+
+			void Push(Register reg)
+			{
+				m_Asm.Store(TopReg, 0, reg);
+				m_Asm.AddImm(TopReg, 8);
+			}
+
+			void PushValue(Value value)
+			{
+				m_Asm.MovImm(RAX, value.value);
+				Push(RAX);
+			}
+
+			// Turns the flag in al into a bool value in rax
+			void BoolFromAl()
+			{
+				m_Asm.Movzx8(RAX, RAX);
+				m_Asm.MovImm(RCX, FALSE_VAL);
+				m_Asm.Add(RAX, RCX);
+			}
+
+			// The slow path for the binary ops is always the generic helper
+			void BinarySlowPath(int slow, int done, uint8_t op)
+			{
+				m_SlowPaths.push_back([this, slow, done, op]() {
+					m_Asm.Bind(slow);
+					m_Asm.Mov(RDI, VMReg);
+					m_Asm.Mov(RSI, TopReg);
+					m_Asm.MovImm(RDX, op);
+					CallHelper((const void*)&JITRuntime::Binary);
+					m_Asm.Test(RAX, RAX);
+					m_Asm.Jcc(CC_E, m_Error);
+					m_Asm.Mov(TopReg, RAX);
+					m_Asm.Jmp(done);
+				});
+			}
+
+			void EmitArithmetic(uint8_t op, uint8_t sseOp)
+			{
+				int slow = LoadNumberOperands();
+				int done = m_Asm.NewLabel();
+
+				m_Asm.Sse(sseOp, 0, 1);
+				m_Asm.MovqFromXmm(RAX, 0);
+				m_Asm.Store(TopReg, -16, RAX);
+				m_Asm.AddImm(TopReg, -8);
+				m_Asm.Bind(done);
+
+				BinarySlowPath(slow, done, op);
+			}
+
+			// a < b is done as b > a so that unordered (NaN) compares come out false
+			void EmitComparison(uint8_t op, bool swap, Condition cc)
+			{
+				int slow = LoadNumberOperands();
+				int done = m_Asm.NewLabel();
+
+				if (swap)
+					m_Asm.Ucomisd(1, 0);
+				else
+					m_Asm.Ucomisd(0, 1);
+
+				m_Asm.Setcc(cc, RAX);
+				BoolFromAl();
+				m_Asm.Store(TopReg, -16, RAX);
+				m_Asm.AddImm(TopReg, -8);
+				m_Asm.Bind(done);
+
+				BinarySlowPath(slow, done, op);
+			}
+
+			// Values that aren't objects are equal if their bits are
+			// Objects need the full comparison for strings and lists
+			void EmitEquality(uint8_t op, bool notEqual)
+			{
+				int slow = m_Asm.NewLabel();
+				int done = m_Asm.NewLabel();
+
+				m_Asm.Load(RAX, TopReg, -16);
+				m_Asm.Load(RCX, TopReg, -8);
+				GuardNotObject(RAX, slow);
+				GuardNotObject(RCX, slow);
+
+				m_Asm.Cmp(RAX, RCX);
+				m_Asm.Setcc(notEqual ? CC_NE : CC_E, RAX);
+				BoolFromAl();
+				m_Asm.Store(TopReg, -16, RAX);
+				m_Asm.AddImm(TopReg, -8);
+				m_Asm.Bind(done);
+
+				BinarySlowPath(slow, done, op);
+			}
+
+			// Jumps to the label if the register isn't an object, clobbers rdx and r8
+			void GuardObject(Register reg, int label)
+			{
+				m_Asm.MovImm(R8, ObjectMask);
+				m_Asm.Mov(RDX, reg);
+				m_Asm.And(RDX, R8);
+				m_Asm.Cmp(RDX, R8);
+				m_Asm.Jcc(CC_NE, label);
+			}
+
+			// Jumps to the label if the register holds an object, clobbers rdx and r8
+			void GuardNotObject(Register reg, int label)
+			{
+				m_Asm.MovImm(R8, ObjectMask);
+				m_Asm.Mov(RDX, reg);
+				m_Asm.And(RDX, R8);
+				m_Asm.Cmp(RDX, R8);
+				m_Asm.Jcc(CC_E, label);
+			}
+
+			// Compare and branch, jumps to the target when the comparison is false
+			void EmitCompareJump(size_t target, bool swap, Condition jumpIf)
+			{
+				int slow = LoadNumberOperands();
+
+				m_Asm.AddImm(TopReg, -16);
+
+				if (swap)
+					m_Asm.Ucomisd(1, 0);
+				else
+					m_Asm.Ucomisd(0, 1);
+
+				m_Asm.Jcc(jumpIf, m_OpLabels[target]);
+
+				EmitErrorPath(slow, "Operands must be numbers.");
+			}
+
+			void EmitEqualJump(size_t target, bool jumpIfEqual)
+			{
+				int slow = m_Asm.NewLabel();
+				int next = m_Asm.NewLabel();
+
+				m_Asm.Load(RAX, TopReg, -16);
+				m_Asm.Load(RCX, TopReg, -8);
+				m_Asm.AddImm(TopReg, -16);
+				GuardNotObject(RAX, slow);
+				GuardNotObject(RCX, slow);
+
+				m_Asm.Cmp(RAX, RCX);
+				m_Asm.Jcc(jumpIfEqual ? CC_E : CC_NE, m_OpLabels[target]);
+				m_Asm.Bind(next);
+
+				m_SlowPaths.push_back([this, slow, next, target, jumpIfEqual]() {
+					m_Asm.Bind(slow);
+					m_Asm.Mov(RDI, RAX);
+					m_Asm.Mov(RSI, RCX);
+					CallHelper((const void*)&JITRuntime::Equal);
+					m_Asm.Test(RAX, RAX);
+					m_Asm.Jcc(jumpIfEqual ? CC_NE : CC_E, m_OpLabels[target]);
+					m_Asm.Jmp(next);
+				});
+			}
+
+			void EmitErrorPath(int label, const char* message)
+			{
+				m_SlowPaths.push_back([this, label, message]() {
+					m_Asm.Bind(label);
+					m_Asm.Mov(RDI, VMReg);
+					m_Asm.Mov(RSI, TopReg);
+					m_Asm.MovImm(RDX, (uint64_t)message);
+					CallHelper((const void*)&JITRuntime::RuntimeError);
+					m_Asm.Jmp(m_Error);
+				});
+			}
+
+			void EmitConstantArithmetic(Value constant, uint8_t sseOp, const char* message)
+			{
+				int slow = m_Asm.NewLabel();
+
+				m_Asm.Load(RAX, TopReg, -8);
+				GuardNumber(RAX, slow);
+
+				m_Asm.MovqToXmm(0, RAX);
+				m_Asm.MovImm(RCX, constant.value);
+				m_Asm.MovqToXmm(1, RCX);
+				m_Asm.Sse(sseOp, 0, 1);
+				m_Asm.MovqFromXmm(RAX, 0);
+				m_Asm.Store(TopReg, -8, RAX);
+
+				EmitErrorPath(slow, message);
+			}
+
+			// Backward jumps give the events a chance to run like the interpreter does
+			void EmitSafepoint()
+			{
+				int slow = m_Asm.NewLabel();
+				int done = m_Asm.NewLabel();
+
+				m_Asm.MovImm(RAX, (uint64_t)m_PendingEvents);
+				m_Asm.CmpMemImm8(RAX, 0, 0);
+				m_Asm.Jcc(CC_NE, slow);
+				m_Asm.MovImm(RAX, (uint64_t)m_PollCountdown);
+				m_Asm.AddMem32Imm8(RAX, 0, -1);
+				m_Asm.Jcc(CC_LE, slow);
+				m_Asm.Bind(done);
+
+				m_SlowPaths.push_back([this, slow, done]() {
+					m_Asm.Bind(slow);
+					m_Asm.Mov(RDI, VMReg);
+					m_Asm.Mov(RSI, TopReg);
+					CallHelper((const void*)&JITRuntime::Safepoint);
+					CheckHelperResult(0, false);
+					m_Asm.Jmp(done);
+				});
+			}
+
+			// Calls a helper with the VM and stack top followed by up to three arguments
+			void EmitHelper(size_t offset, const void* helper, bool canBailout, uint64_t arg0 = 0, uint64_t arg1 = 0, uint64_t arg2 = 0)
+			{
+				m_Asm.Mov(RDI, VMReg);
+				m_Asm.Mov(RSI, TopReg);
+				m_Asm.MovImm(RDX, arg0);
+				m_Asm.MovImm(RCX, arg1);
+				m_Asm.MovImm(R8, arg2);
+				CallHelper(helper);
+				CheckHelperResult(offset, canBailout);
+			}
+
+			// Anything that can end up back in the interpreter needs the frame to point past the instruction
+			void StoreIp(size_t offset)
+			{
+				m_Asm.MovImm(RAX, (uint64_t)(m_Chunk.code.data() + offset));
+				m_Asm.Store(FrameReg, FrameIp, RAX);
+			}
+
+			// Calls between compiled functions go straight from native code to native code
+			// Anything else, or a full call stack, goes through the runtime
+			void EmitCall(size_t offset, size_t next, uint8_t argCount)
+			{
+				int slow = m_Asm.NewLabel();
+				int bailout = m_Asm.NewLabel();
+				int done = m_Asm.NewLabel();
+
+				int32_t callee = -8 * (argCount + 1);
+
+				// Callee has to be an object
+				m_Asm.Load(RAX, TopReg, callee);
+				GuardObject(RAX, slow);
+				m_Asm.MovImm(RDX, ~ObjectMask);
+				m_Asm.And(RAX, RDX);
+
+				// A function with native code
+				m_Asm.CmpMem32Imm8(RAX, MemberOffset(&Object::type), OBJ_FUNCTION);
+				m_Asm.Jcc(CC_NE, slow);
+				m_Asm.Load(RSI, RAX, MemberOffset(&ObjFunction::jit));
+				m_Asm.Test(RSI, RSI);
+				m_Asm.Jcc(CC_E, slow);
+
+				// Push the frame, if either array is full the runtime grows it
+				m_Asm.Lea(RDX, TopReg, (int32_t)(FrameStackSize * sizeof(Value)));
+				m_Asm.CmpMem(RDX, TopPtrReg, m_TopToEnd);
+				m_Asm.Jcc(CC_A, slow);
+				m_Asm.Load(RCX, VMReg, JITRuntime::CurrentFiberOffset());
+				m_Asm.Load(RDX, RCX, m_FramesCountOffset);
+				m_Asm.CmpMem(RDX, RCX, m_FramesCapacityOffset);
+				m_Asm.Jcc(CC_AE, slow);
+				m_Asm.CmpImm(RDX, JITMaxCallDepth);
+				m_Asm.Jcc(CC_AE, slow);
+				m_Asm.Lea(RDI, RDX, 1);
+				m_Asm.Store(RCX, m_FramesCountOffset, RDI);
+				m_Asm.ImulImm8(RDX, RDX, (int8_t)sizeof(CallFrame));
+				m_Asm.AddMem(RDX, RCX, m_FramesOffset);
+				m_Asm.Store(RDX, (int32_t)offsetof(CallFrame, function), RAX);
+				m_Asm.Lea(RAX, TopReg, callee);
+				m_Asm.Store(RDX, FrameSlots, RAX);
+
+				// jit->code(vm, frame, &top, jit->start)
+				m_Asm.Store(TopPtrReg, 0, TopReg);
+				m_Asm.Mov(RDI, VMReg);
+				m_Asm.Mov(RAX, RSI);
+				m_Asm.Mov(RSI, RDX);
+				m_Asm.Mov(RDX, TopPtrReg);
+				m_Asm.Load(RCX, RAX, MemberOffset(&JITFunction::start));
+				m_Asm.Load(RAX, RAX, MemberOffset(&JITFunction::code));
+				m_Asm.CallReg(RAX);
+				m_Asm.CmpEaxImm8(JIT_RETURNED);
+				m_Asm.Jcc(CC_NE, bailout);
+
+				// Pop the frame and put the result where the callee was
+				// The callee's slots are used rather than the old top in case the stack moved
+				m_Asm.Load(RAX, TopPtrReg, 0);
+				m_Asm.Load(RAX, RAX, -8);
+				m_Asm.Load(RCX, VMReg, JITRuntime::CurrentFiberOffset());
+				m_Asm.Load(RDX, RCX, m_FramesCountOffset);
+				m_Asm.Lea(RDX, RDX, -1);
+				m_Asm.Store(RCX, m_FramesCountOffset, RDX);
+				m_Asm.ImulImm8(RDX, RDX, (int8_t)sizeof(CallFrame));
+				m_Asm.AddMem(RDX, RCX, m_FramesOffset);
+				m_Asm.Load(TopReg, RDX, FrameSlots);
+				m_Asm.Store(TopReg, 0, RAX);
+				m_Asm.AddImm(TopReg, 8);
+				ReloadFrame();
+				EmitSafepoint();
+				m_Asm.Bind(done);
+
+				m_SlowPaths.push_back([this, slow, bailout, done, offset, next, argCount]() {
+					m_Asm.Bind(slow);
+					StoreIp(next);
+					EmitHelper(offset, (const void*)&JITRuntime::Call, false, argCount);
+					m_Asm.Jmp(done);
+
+					// The callee went back to the interpreter, let it finish there
+					m_Asm.Bind(bailout);
+					m_Asm.CmpEaxImm8(JIT_ERROR);
+					m_Asm.Jcc(CC_E, m_Error);
+					ReloadFrame();
+					StoreIp(next);
+					m_Asm.Mov(RDI, VMReg);
+					CallHelper((const void*)&JITRuntime::ResumeCall);
+					CheckHelperResult(offset, false);
+					m_Asm.Jmp(done);
+				});
+			}
+
+			bool EmitInstruction(size_t offset)
+			{
+				CodeBuffer& code = m_Chunk.code;
+				uint8_t instruction = code[offset];
+				size_t next = offset + GetInstructionLength(instruction);
+
+				switch (instruction)
+				{
+				case OP_CONSTANT:
+					PushValue(m_Chunk.constants[code[offset + 1]]);
+					break;
+				case OP_CONSTANT_LONG:
+					PushValue(m_Chunk.constants[ReadShort(offset + 1)]);
+					break;
+				case OP_NIL:
+					PushValue(Value());
+					break;
+				case OP_TRUE:
+					PushValue(Value(true));
+					break;
+				case OP_FALSE:
+					PushValue(Value(false));
+					break;
+				case OP_POP:
+					m_Asm.AddImm(TopReg, -8);
+					break;
+				case OP_POP_N:
+					m_Asm.AddImm(TopReg, -8 * (int32_t)code[offset + 1]);
+					break;
+
+				case OP_GET_LOCAL_0:
+				case OP_GET_LOCAL_1:
+				case OP_GET_LOCAL_2:
+				case OP_GET_LOCAL_3:
+					m_Asm.Load(RAX, SlotsReg, 8 * (instruction - OP_GET_LOCAL_0));
+					Push(RAX);
+					break;
+				case OP_GET_LOCAL:
+					m_Asm.Load(RAX, SlotsReg, 8 * ReadShort(offset + 1));
+					Push(RAX);
+					break;
+				case OP_SET_LOCAL:
+					m_Asm.Load(RAX, TopReg, -8);
+					m_Asm.Store(SlotsReg, 8 * ReadShort(offset + 1), RAX);
+					break;
+
+				case OP_GET_GLOBAL:
+				{
+					// The table can grow so the values pointer is loaded every time
+					uint16_t slot = m_Function->GlobalSlot(ReadShort(offset + 1));
+					int undefined = m_Asm.NewLabel();
+					int done = m_Asm.NewLabel();
+
+					m_Asm.MovImm(RAX, (uint64_t)&m_Function->globals->values);
+					m_Asm.Load(RAX, RAX, 0);
+					m_Asm.Load(RAX, RAX, 8 * slot);
+					m_Asm.MovImm(RCX, UNDEFINED_VAL);
+					m_Asm.Cmp(RAX, RCX);
+					m_Asm.Jcc(CC_E, undefined);
+					Push(RAX);
+					m_Asm.Bind(done);
+
+					m_SlowPaths.push_back([this, undefined, done, slot, offset]() {
+						m_Asm.Bind(undefined);
+						m_Asm.Mov(RDI, VMReg);
+						m_Asm.Mov(RSI, TopReg);
+						m_Asm.MovImm(RDX, (uint64_t)m_Function->globals);
+						m_Asm.MovImm(RCX, slot);
+						CallHelper((const void*)&JITRuntime::GetGlobal);
+						CheckHelperResult(offset, false);
+						m_Asm.Jmp(done);
+					});
+					break;
+				}
+				case OP_SET_GLOBAL:
+				case OP_DEFINE_GLOBAL:
+				{
+					m_Asm.MovImm(RCX, (uint64_t)&m_Function->globals->values);
+					m_Asm.Load(RCX, RCX, 0);
+					m_Asm.Load(RAX, TopReg, -8);
+					m_Asm.Store(RCX, 8 * m_Function->GlobalSlot(ReadShort(offset + 1)), RAX);
+
+					if (instruction == OP_DEFINE_GLOBAL)
+						m_Asm.AddImm(TopReg, -8);
+					break;
+				}
+
+				case OP_ADD:
+				case OP_ADD_NUM_NUM:
+				case OP_ADD_STR:			EmitArithmetic(OP_ADD, 0x58); break;
+				case OP_SUBTRACT:
+				case OP_SUBTRACT_NUM_NUM:	EmitArithmetic(OP_SUBTRACT, 0x5C); break;
+				case OP_MULTIPLY:
+				case OP_MULTIPLY_NUM_NUM:	EmitArithmetic(OP_MULTIPLY, 0x59); break;
+				case OP_DIVIDE:
+				case OP_DIVIDE_NUM_NUM:		EmitArithmetic(OP_DIVIDE, 0x5E); break;
+
+				case OP_POWER:
+				case OP_MODULO:
+				{
+					int slow = m_Asm.NewLabel();
+					int done = m_Asm.NewLabel();
+
+					m_Asm.Jmp(slow);
+					m_Asm.Bind(done);
+					BinarySlowPath(slow, done, instruction);
+					break;
+				}
+
+				case OP_ADD_CONSTANT:
+					EmitConstantArithmetic(m_Chunk.constants[code[offset + 1]], 0x58, "Operands must be two numbers or two strings.");
+					break;
+				case OP_SUBTRACT_CONSTANT:
+					EmitConstantArithmetic(m_Chunk.constants[code[offset + 1]], 0x5C, "Operands must be numbers.");
+					break;
+
+				case OP_LESS:
+				case OP_LESS_NUM:			EmitComparison(OP_LESS, true, CC_A); break;
+				case OP_GREATER:
+				case OP_GREATER_NUM:		EmitComparison(OP_GREATER, false, CC_A); break;
+				case OP_LESS_EQUAL:			EmitComparison(OP_LESS_EQUAL, true, CC_AE); break;
+				case OP_GREATER_EQUAL:		EmitComparison(OP_GREATER_EQUAL, false, CC_AE); break;
+				case OP_EQUAL:				EmitEquality(OP_EQUAL, false); break;
+				case OP_NOT_EQUAL:			EmitEquality(OP_NOT_EQUAL, true); break;
+
+				case OP_NOT:
+					m_Asm.Load(RCX, TopReg, -8);
+					m_Asm.MovImm(RAX, TRUE_VAL);
+					m_Asm.Cmp(RCX, RAX);
+					m_Asm.Setcc(CC_NE, RAX);
+					BoolFromAl();
+					m_Asm.Store(TopReg, -8, RAX);
+					break;
+				case OP_NEGATE:
+					m_Asm.Load(RAX, TopReg, -8);
+					m_Asm.BtcImm(RAX, 63);
+					m_Asm.Store(TopReg, -8, RAX);
+					break;
+
+				case OP_JUMP:
+					m_Asm.Jmp(m_OpLabels[next + ReadShort(offset + 1)]);
+					break;
+				case OP_JUMP_IF_FALSE:
+				{
+					int target = m_OpLabels[next + ReadShort(offset + 1)];
+
+					m_Asm.Load(RAX, TopReg, -8);
+					m_Asm.MovImm(RCX, NIL_VAL);
+					m_Asm.Cmp(RAX, RCX);
+					m_Asm.Jcc(CC_E, target);
+					m_Asm.MovImm(RCX, FALSE_VAL);
+					m_Asm.Cmp(RAX, RCX);
+					m_Asm.Jcc(CC_E, target);
+					break;
+				}
+				case OP_JUMP_IF_NOT_LESS:			EmitCompareJump(next + ReadShort(offset + 1), true, CC_BE); break;
+				case OP_JUMP_IF_NOT_GREATER:		EmitCompareJump(next + ReadShort(offset + 1), false, CC_BE); break;
+				case OP_JUMP_IF_NOT_LESS_EQUAL:		EmitCompareJump(next + ReadShort(offset + 1), true, CC_B); break;
+				case OP_JUMP_IF_NOT_GREATER_EQUAL:	EmitCompareJump(next + ReadShort(offset + 1), false, CC_B); break;
+				case OP_JUMP_IF_NOT_EQUAL:			EmitEqualJump(next + ReadShort(offset + 1), false); break;
+				case OP_JUMP_IF_EQUAL:				EmitEqualJump(next + ReadShort(offset + 1), true); break;
+
+				case OP_LOOP:
+				{
+					size_t target = next - ReadShort(offset + 1);
+
+					EmitSafepoint();
+
+					// Loops get counted here as well, once one is hot enough to record or already has a trace
+					// go back to the interpreter and it takes over from the next back edge
+					TraceLoop* loop = m_Tracing ? FindTraceLoop(m_Function, m_Chunk.code.data() + target) : nullptr;
+					if (loop)
+					{
+						int traced = m_Asm.NewLabel();
+						int skip = m_Asm.NewLabel();
+
+						m_Asm.MovImm(RAX, (uint64_t)loop);
+						m_Asm.CmpMemImm8(RAX, MemberOffset(&TraceLoop::trace), 0);
+						m_Asm.Jcc(CC_NE, traced);
+						m_Asm.CmpMem32Imm8(RAX, MemberOffset(&TraceLoop::aborts), TraceMaxAborts);
+						m_Asm.Jcc(CC_AE, skip);
+						m_Asm.AddMem32Imm8(RAX, MemberOffset(&TraceLoop::hotness), 1);
+						m_Asm.CmpMem32Imm8(RAX, MemberOffset(&TraceLoop::hotness), TraceThreshold - 1);
+						m_Asm.Jcc(CC_AE, traced);
+						m_Asm.Bind(skip);
+
+						m_SlowPaths.push_back([this, traced, target]() {
+							m_Asm.Bind(traced);
+							EmitBailout(target);
+						});
+					}
+
+					m_Asm.Jmp(m_OpLabels[target]);
+					break;
+				}
+
+				case OP_ITER:
+				{
+					int bailout = m_Asm.NewLabel();
+
+					m_Asm.Mov(RDI, TopReg);
+					CallHelper((const void*)&JITRuntime::Iter);
+					m_Asm.CmpEaxImm8(JITRuntime::ITER_DONE);
+					m_Asm.Jcc(CC_E, m_OpLabels[next + ReadShort(offset + 1)]);
+					m_Asm.CmpEaxImm8(JITRuntime::ITER_BAILOUT);
+					m_Asm.Jcc(CC_E, bailout);
+
+					m_SlowPaths.push_back([this, bailout, offset]() {
+						m_Asm.Bind(bailout);
+						EmitBailout(offset);
+					});
+					break;
+				}
+
+				case OP_INLINE_GUARD:
+				{
+					Value function = m_Chunk.constants[ReadShort(offset + 3)];
+
+					m_Asm.Load(RAX, TopReg, -8 * (code[offset + 5] + 1));
+					m_Asm.MovImm(RCX, function.value);
+					m_Asm.Cmp(RAX, RCX);
+					m_Asm.Jcc(CC_E, m_OpLabels[next + ReadShort(offset + 1)]);
+					break;
+				}
+				case OP_TAIL_CALL:
+				{
+					// The interpreter reuses the frame for script functions
+					// Anything else carries on into the CALL after this
+					int bailout = m_Asm.NewLabel();
+
+					m_Asm.Load(RAX, TopReg, -8 * (code[next] - OP_CALL_0 + 1));
+					GuardObject(RAX, m_OpLabels[next]);
+					m_Asm.MovImm(RDX, ~ObjectMask);
+					m_Asm.And(RAX, RDX);
+					m_Asm.CmpMem32Imm8(RAX, MemberOffset(&Object::type), OBJ_FUNCTION);
+					m_Asm.Jcc(CC_E, bailout);
+
+					m_SlowPaths.push_back([this, bailout, offset]() {
+						m_Asm.Bind(bailout);
+						EmitBailout(offset);
+					});
+					break;
+				}
+				case OP_CALL_0: case OP_CALL_1: case OP_CALL_2: case OP_CALL_3:
+				case OP_CALL_4: case OP_CALL_5: case OP_CALL_6: case OP_CALL_7:
+				case OP_CALL_8: case OP_CALL_9: case OP_CALL_10: case OP_CALL_11:
+				case OP_CALL_12: case OP_CALL_13: case OP_CALL_14: case OP_CALL_15:
+				case OP_CALL_16:
+					EmitCall(offset, next, instruction - OP_CALL_0);
+					break;
+				case OP_INVOKE:
+				{
+					ObjString* name = (ObjString*)m_Chunk.constants[ReadShort(offset + 1)].ToObject();
+					uint8_t argCount = code[offset + 3];
+					PropertyCache* cache = &m_Chunk.propertyCaches[ReadShort(offset + 4)];
+
+					StoreIp(next);
+					EmitHelper(offset, (const void*)&JITRuntime::Invoke, true, (uint64_t)name, argCount, (uint64_t)cache);
+					break;
+				}
+				case OP_MATH_SQRT: case OP_MATH_SIN: case OP_MATH_COS: case OP_MATH_ABS:
+				case OP_MATH_FLOOR: case OP_MATH_MIN: case OP_MATH_MAX: case OP_MATH_ATAN2:
+				{
+					ObjString* name = (ObjString*)m_Chunk.constants[ReadShort(offset + 1)].ToObject();
+					PropertyCache* cache = &m_Chunk.propertyCaches[ReadShort(offset + 3)];
+
+					StoreIp(next);
+					EmitHelper(offset, (const void*)&JITRuntime::Maths, true, instruction, (uint64_t)name, (uint64_t)cache);
+					break;
+				}
+				case OP_GET_PROPERTY:
+				case OP_SET_PROPERTY:
+				{
+					ObjString* name = (ObjString*)m_Chunk.constants[ReadShort(offset + 1)].ToObject();
+					PropertyCache* cache = &m_Chunk.propertyCaches[ReadShort(offset + 3)];
+
+					const void* helper = instruction == OP_GET_PROPERTY ? (const void*)&JITRuntime::GetProperty : (const void*)&JITRuntime::SetProperty;
+					EmitHelper(offset, helper, true, (uint64_t)name, (uint64_t)cache);
+					break;
+				}
+				case OP_SUBSCRIPT_READ:
+					EmitHelper(offset, (const void*)&JITRuntime::SubscriptRead, true);
+					break;
+				case OP_SUBSCRIPT_WRITE:
+					EmitHelper(offset, (const void*)&JITRuntime::SubscriptWrite, true);
+					break;
+				case OP_CREATE_RANGE:
+					EmitHelper(offset, (const void*)&JITRuntime::CreateRange, false);
+					break;
+
+				case OP_RETURN:
+					// The VM pops the frame, that way the last frame of a fiber can still be handed back to the interpreter
+					StoreIp(offset);
+					m_Asm.MovImm(RAX, JIT_RETURNED);
+					m_Asm.Jmp(m_Epilogue);
+					break;
+
+				default:
+					// Classes, imports, string interpolation and the rest are left to the interpreter
+					EmitBailout(offset);
+					break;
+				}
+
+				return true;
+			}
+
+			Assembler m_Asm;
+
+			ObjFunction* m_Function;
+			bool m_Tracing;
+			Chunk& m_Chunk;
+
+			// The VM's count of pending events and countdown to the next poll, the safepoints check both
+			const size_t* m_PendingEvents;
+			int32_t* m_PollCountdown;
+
+			// One label per bytecode offset for the jumps
+			std::vector<int> m_OpLabels;
+			std::vector<std::function<void()>> m_SlowPaths;
+
+			int32_t m_FramesOffset = MemberOffset(&ObjFiber::frames);
+			int32_t m_FramesCountOffset = MemberOffset(&ObjFiber::framesCount);
+			int32_t m_FramesCapacityOffset = MemberOffset(&ObjFiber::framesCapacity);
+
+			// The fiber's frames and stack end from the stack top pointer in r14
+			int32_t m_TopToFrames = m_FramesOffset - MemberOffset(&ObjFiber::stack) - (int32_t)offsetof(Stack, m_Top);
+			int32_t m_TopToEnd = (int32_t)offsetof(Stack, m_End) - (int32_t)offsetof(Stack, m_Top);
+
+			int m_Epilogue = -1;
+			int m_Bailout = -1;
+			int m_Error = -1;
+		};
+	}
+
+	uint8_t* x64::MapExecutable(const std::vector<uint8_t>& code, size_t* size)
+	{
+		size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+		*size = (code.size() + pageSize - 1) & ~(pageSize - 1);
+
+		void* memory = mmap(nullptr, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (memory == MAP_FAILED)
+			return nullptr;
+
+		memcpy(memory, code.data(), code.size());
+
+		// Never writable and executable at the same time
+		if (mprotect(memory, *size, PROT_READ | PROT_EXEC) != 0)
+		{
+			munmap(memory, *size);
+			return nullptr;
+		}
+
+		return (uint8_t*)memory;
+	}
+
+	void x64::UnmapExecutable(uint8_t* code, size_t size)
+	{
+		munmap(code, size);
+	}
+
+	JITFunction::~JITFunction()
+	{
+		if (code)
+			x64::UnmapExecutable(code, size);
+	}
+
+	JITStatus JITFunction::Enter(VM* vm, CallFrame* frame, Value** top, uint8_t* ip)
+	{
+		void* address = GetEntry(ip);
+
+		if (!address)
+		{
+			frame->ip = ip;
+			return JIT_BAILOUT;
+		}
+
+		return (JITStatus)((JITEntry)code)(vm, frame, top, address);
+	}
+
+	JITFunction* CompileJIT(VM* vm, ObjFunction* function)
+	{
+		// Functions that haven't been linked yet don't know where their globals are
+		if (function->globals == nullptr || function->chunk.code.empty())
+			return nullptr;
+
+		// Compiled code calling compiled code only checks for FrameStackSize slots
+		if (function->maxStack > FrameStackSize)
+			return nullptr;
+
+		EventManager& events = vm->GetEventManager();
+		JITCompiler compiler(function, vm->IsTracingEnabled(), &events.size, &events.pollCountdown);
+		return compiler.Compile();
+	}
+
+#else
+
+	JITFunction::~JITFunction()
+	{
+	}
+
+	JITStatus JITFunction::Enter(VM* vm, CallFrame* frame, Value** top, uint8_t* ip)
+	{
+		frame->ip = ip;
+		return JIT_BAILOUT;
+	}
+
+	JITFunction* CompileJIT(VM* vm, ObjFunction* function)
+	{
+		return nullptr;
+	}
+
+#endif
+
+	void* JITFunction::GetEntry(uint8_t* ip)
+	{
+		size_t offset = (size_t)(ip - function->chunk.code.data());
+
+		if (offset >= entries.size())
+			return nullptr;
+
+		return entries[offset];
+	}
+}
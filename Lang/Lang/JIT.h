@@ -0,0 +1,65 @@
+#pragma once
+#include "Value.h"
+#include "Object.h"
+
+#include <vector>
+
+// The baseline JIT turns the bytecode of hot functions straight into machine code
+// Each instruction gets copied out as a small template, anything complicated calls back into the VM
+// Only x86-64 Linux is supported, everywhere else functions stay in the interpreter
+#if defined(NAN_BOXING) && defined(__x86_64__) && defined(__linux__)
+#define LANG_JIT 1
+#else
+#define LANG_JIT 0
+#endif
+
+namespace script
+{
+	class VM;
+
+	// Number of calls and loop back edges before a function gets compiled
+	constexpr uint32_t JITDefaultThreshold = 1000;
+
+	// Compiled functions call each other on the C stack, frames deeper than this stay in the interpreter
+	constexpr uint32_t JITMaxCallDepth = 512;
+
+	enum JITStatus
+	{
+		// The function returned, its result is on top of the stack
+		JIT_RETURNED,
+		// Hit something the JIT doesn't handle, the interpreter carries on from frame->ip
+		JIT_BAILOUT,
+		// A runtime error has already been reported
+		JIT_ERROR
+	};
+
+	// The native code for one function
+	class JITFunction
+	{
+	public:
+
+		~JITFunction();
+
+		// Runs the code from the given instruction, ip has to be the start of the function or a loop header
+		JITStatus Enter(VM* vm, CallFrame* frame, Value** top, uint8_t* ip);
+
+		// Returns nullptr if there is no native code for the instruction
+		void* GetEntry(uint8_t* ip);
+
+		uint8_t* code = nullptr;
+		size_t size = 0;
+
+		// Native address of the first instruction
+		void* start = nullptr;
+
+		// Native address for every instruction that can be entered, indexed by bytecode offset
+		// Everything else is nullptr
+		std::vector<void*> entries;
+
+		ObjFunction* function = nullptr;
+
+	};
+
+	// Returns nullptr if the function can't be compiled
+	JITFunction* CompileJIT(VM* vm, ObjFunction* function);
+}
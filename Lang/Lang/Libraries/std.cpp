@@ -1,6 +1,7 @@
 
 #include "std.h"
 #include "../VM.h"
+#include "../Bind.h"
 
 #include <cstdio>
 #include <iostream>
@@ -16,208 +17,116 @@
 namespace script
 {
 
-    auto nativePrintLn = [](int argCount, Value* args) 
+    static void PrintLn(Value value)
     {
-        args[0].Print();
+        value.Print();
         printf("\n");
-        return Value();
-    };
+    }
 
-    auto nativePrint = [](int argCount, Value* args) 
+    static void Print(Value value)
     {
-        args[0].Print();
-        return Value();
-    };
+        value.Print();
+    }
 
-    auto nativeInput = [](int argCount, Value* args)
+    // The prompt is optional, it's printed first when there is one
+    static Value Input(void* context, int argCount, Value* args)
     {
-        std::string str; 
-        std::getline(std::cin, str);
+        VM* vm = (VM*)context;
 
-        return Value(memoryManager.AllocateString(str));
-    };
-
-    void LoadStdIO(VM* vm, ObjModule* mdl)
-    {
-        if (mdl == nullptr)
+        if (argCount > 1)
         {
-            // We load into global
-
-            vm->AddNativeFunction("println", nativePrintLn, 1);
-            vm->AddNativeFunction("print", nativePrint, 1);
-            vm->AddNativeFunction("input", nativeInput, 1);
+            vm->NativeError("Expected at most 1 argument but got " + std::to_string(argCount));
+            return Value();
+        }
 
-            return;   
+        if (argCount == 1)
+        {
+            args[0].Print();
+            fflush(stdout);
         }
 
-        mdl->AddNativeFunction("println", nativePrintLn, 1);
-        mdl->AddNativeFunction("print", nativePrint, 1);
-        mdl->AddNativeFunction("input", nativeInput, 1);
+        std::string str; 
+        std::getline(std::cin, str);
 
-        // Load into module 
+        return NativeTypeOf<std::string>::Box(str);
     }
 
-    auto cosNative = [](int argc, Value* args) {
-
-        return Value(cos(args[0].ToNumber()));
-    };
-
-    auto sinNative = [](int argc, Value* args) {
-
-        return Value(sin(args[0].ToNumber()));
-    };
-
-    auto tanNative = [](int argc, Value* args) {
-
-        return Value(tan(args[0].ToNumber()));
-    };
-
-    auto acosNative = [](int argc, Value* args) {
-
-        return Value(acos(args[0].ToNumber()));
-    };
-
-    auto asinNative = [](int argc, Value* args) {
-
-        return Value(asin(args[0].ToNumber()));
-    };
-
-    auto atanNative = [](int argc, Value* args) {
-
-        return Value(atan(args[0].ToNumber()));
-    };
-
-    auto atan2Native = [](int argc, Value* args) {
-
-        return Value(atan2(args[0].ToNumber(), args[1].ToNumber()));
-    };
-
-    auto sinhNative = [](int argc, Value* args) {
-        return Value(sinh(args[0].ToNumber()));
-    };
-
-    auto coshNative = [](int argc, Value* args) {
-        return Value(cosh(args[0].ToNumber()));
-    };
-
-    auto tanhNative = [](int argc, Value* args) {
-        return Value(tanh(args[0].ToNumber()));
-    };
-
-    auto asinhNative = [](int argc, Value* args) {
-        return Value(asinh(args[0].ToNumber()));
-    };
-
-    auto acoshNative = [](int argc, Value* args) {
-        return Value(acosh(args[0].ToNumber()));
-    };
-
-    auto atanhNative = [](int argc, Value* args) {
-        return Value(atanh(args[0].ToNumber()));
-    };
-
-    auto logNative = [](int argc, Value* args) {
-        return Value(log(args[0].ToNumber()));
-    };
-
-    auto log2Native = [](int argc, Value* args) {
-        return Value(log2(args[0].ToNumber()));
-    };
-
-    auto log10Native = [](int argc, Value* args) {
-        return Value(log10(args[0].ToNumber()));
-    };
-
-    auto expNative = [](int argc, Value* args) {
-        return Value(exp(args[0].ToNumber()));
-    };
+    void LoadStdIO(VM* vm, ObjModule* mdl)
+    {
+        NativeBinder(vm, mdl)
+            .Bind<&PrintLn>("println")
+            .Bind<&Print>("print")
+            .Add("input", &Input, 1, vm);
+    }
 
-    auto exp2Native = [](int argc, Value* args) {
-        return Value(exp2(args[0].ToNumber()));
-    };
+    // The C maths functions are overloaded for float and long double so the double ones are picked out
+    using UnaryMaths = double(*)(double);
+    using BinaryMaths = double(*)(double, double);
 
-    auto expm1Native = [](int argc, Value* args) {
-        return Value(expm1(args[0].ToNumber()));
-    };
+    static double Min(double a, double b)
+    {
+        return a < b ? a : b;
+    }
 
-    auto sqrtNative = [](int argc, Value* args) {
-        return Value(sqrt(args[0].ToNumber()));
-    };
+    static double Max(double a, double b)
+    {
+        return a > b ? a : b;
+    }
 
-    auto cbrtNative = [](int argc, Value* args) {
-        return Value(cbrt(args[0].ToNumber()));
+    const NativeFn mathsIntrinsics[MathsIntrinsicCount] = {
+        &NativeThunk<(UnaryMaths)std::sqrt>::Call,
+        &NativeThunk<(UnaryMaths)std::sin>::Call,
+        &NativeThunk<(UnaryMaths)std::cos>::Call,
+        &NativeThunk<(UnaryMaths)std::fabs>::Call,
+        &NativeThunk<(UnaryMaths)std::floor>::Call,
+        &NativeThunk<&Min>::Call,
+        &NativeThunk<&Max>::Call,
+        &NativeThunk<(BinaryMaths)std::atan2>::Call
     };
 
     void LoadStdMaths(VM* vm, ObjModule* mdl)
     {
-        
-        if (mdl == nullptr)
-        {
-            vm->AddNativeFunction("cos", cosNative, 1);
-            vm->AddNativeFunction("sin", sinNative, 1);
-            vm->AddNativeFunction("tan", tanNative, 1);
-            vm->AddNativeFunction("acos", acosNative, 1);
-            vm->AddNativeFunction("asin", asinNative, 1);
-            vm->AddNativeFunction("atan", atanNative, 1);
-            vm->AddNativeFunction("atan2", atan2Native, 1);
-
-            vm->AddNativeFunction("sinh", sinhNative, 1);
-            vm->AddNativeFunction("cosh", coshNative, 1);
-            vm->AddNativeFunction("tanh", tanhNative, 1);
-            vm->AddNativeFunction("asinh", asinhNative, 1);
-            vm->AddNativeFunction("acosh", acoshNative, 1);
-            vm->AddNativeFunction("atanh", atanhNative, 1);
-
-            vm->AddNativeFunction("log", logNative, 1);
-            vm->AddNativeFunction("log2", log2Native, 1);
-            vm->AddNativeFunction("log10", log10Native, 1);
-            vm->AddNativeFunction("exp", expNative, 1);
-            vm->AddNativeFunction("exp2", exp2Native, 1);
-            vm->AddNativeFunction("expm1", expm1Native, 1);
-
-            vm->AddNativeFunction("sqrt", sqrtNative, 1);
-            vm->AddNativeFunction("cbrt", cbrtNative, 1);
-
-            return;
-        }
-
-        mdl->AddNativeFunction("cos", cosNative, 1);
-        mdl->AddNativeFunction("sin", sinNative, 1);
-        mdl->AddNativeFunction("tan", tanNative, 1);
-        mdl->AddNativeFunction("acos", acosNative, 1);
-        mdl->AddNativeFunction("asin", asinNative, 1);
-        mdl->AddNativeFunction("atan", atanNative, 1);
-        mdl->AddNativeFunction("atan2", atan2Native, 1);
-
-        mdl->AddNativeFunction("sinh", sinhNative, 1);
-        mdl->AddNativeFunction("cosh", coshNative, 1);
-        mdl->AddNativeFunction("tanh", tanhNative, 1);
-        mdl->AddNativeFunction("asinh", asinhNative, 1);
-        mdl->AddNativeFunction("acosh", acoshNative, 1);
-        mdl->AddNativeFunction("atanh", atanhNative, 1);
-
-        mdl->AddNativeFunction("log", logNative, 1);
-        mdl->AddNativeFunction("log2", log2Native, 1);
-        mdl->AddNativeFunction("log10", log10Native, 1);
-        mdl->AddNativeFunction("exp", expNative, 1);
-        mdl->AddNativeFunction("exp2", exp2Native, 1);
-        mdl->AddNativeFunction("expm1", expm1Native, 1);
-
-        mdl->AddNativeFunction("sqrt", sqrtNative, 1);
-        mdl->AddNativeFunction("cbrt", cbrtNative, 1);
+        NativeBinder(vm, mdl)
+            .Bind<(UnaryMaths)std::cos>("cos")
+            .Bind<(UnaryMaths)std::sin>("sin")
+            .Bind<(UnaryMaths)std::tan>("tan")
+            .Bind<(UnaryMaths)std::acos>("acos")
+            .Bind<(UnaryMaths)std::asin>("asin")
+            .Bind<(UnaryMaths)std::atan>("atan")
+            .Bind<(BinaryMaths)std::atan2>("atan2")
+
+            .Bind<(UnaryMaths)std::sinh>("sinh")
+            .Bind<(UnaryMaths)std::cosh>("cosh")
+            .Bind<(UnaryMaths)std::tanh>("tanh")
+            .Bind<(UnaryMaths)std::asinh>("asinh")
+            .Bind<(UnaryMaths)std::acosh>("acosh")
+            .Bind<(UnaryMaths)std::atanh>("atanh")
+
+            .Bind<(UnaryMaths)std::log>("log")
+            .Bind<(UnaryMaths)std::log2>("log2")
+            .Bind<(UnaryMaths)std::log10>("log10")
+            .Bind<(UnaryMaths)std::exp>("exp")
+            .Bind<(UnaryMaths)std::exp2>("exp2")
+            .Bind<(UnaryMaths)std::expm1>("expm1")
+
+            .Bind<(UnaryMaths)std::sqrt>("sqrt")
+            .Bind<(UnaryMaths)std::cbrt>("cbrt")
+
+            .Bind<(UnaryMaths)std::fabs>("abs")
+            .Bind<(UnaryMaths)std::floor>("floor")
+            .Bind<(UnaryMaths)std::ceil>("ceil")
+            .Bind<&Min>("min")
+            .Bind<&Max>("max");
     }
 
-    auto doesFileExistNative = [](int argc, Value* args) {
-
-        bool exists = std::filesystem::exists(((ObjString*)args[0].ToObject())->str);
-
-        return Value(exists);
-    };
-
-    auto readFileNative = [](int argc, Value* args) {
-    
+    static bool FileExists(const char* path)
+    {
+        return std::filesystem::exists(path);
+    }
 
-        std::ifstream file(((ObjString*)args[0].ToObject())->str);
+    static Value ReadFile(const char* path)
+    {
+        std::ifstream file(path);
 
         if (!file.is_open())
         {
@@ -231,89 +140,93 @@ namespace script
 
         std::string filebuf = stream.str(); 
 
-        return Value(memoryManager.AllocateString(filebuf));
-
-    };
+        return Value(CurrentHeap().AllocateString(filebuf));
+    }
 
     void LoadStdFilesystem(VM* vm, ObjModule* mdl)
     {
-        if (mdl == nullptr)
-        {
-            vm->AddNativeFunction("fileExists", doesFileExistNative, 1);
-            vm->AddNativeFunction("readFile", readFileNative, 1);
-        }
-
-        mdl->AddNativeFunction("fileExists", doesFileExistNative, 1);
-        mdl->AddNativeFunction("readFile", readFileNative, 1);
+        NativeBinder(vm, mdl)
+            .Bind<&FileExists>("fileExists")
+            .Bind<&ReadFile>("readFile");
     }
 
 
-    auto dictionaryFunc = [](int argc, Value* args) {
+    auto dictionaryFunc = [](void* context, int argc, Value* args) {
         return script::Value(script::AllocateDictionary());
     };
 
-    auto listFunc = [](int argc, Value* args) {
+    auto listFunc = [](void* context, int argc, Value* args) {
         return script::Value(script::AllocateArray({}));
     };
 
+    // Methods on the built in types get self as the first argument 
+
+    auto listLength = [](void* context, int argc, Value* args) {
+        ObjArray* arr = (ObjArray*)args[0].ToObject();
+        return Value((double)arr->size);
+    };
+
+    auto listAppend = [](void* context, int argc, Value* args) {
+        ObjArray* arr = (ObjArray*)args[0].ToObject();
+        arr->PushBack(args[1]);
+        return Value();
+    };
+
+    auto stringLength = [](void* context, int argc, Value* args) {
+        ObjString* str = (ObjString*)args[0].ToObject();
+
+        // Length includes the null terminator
+        return Value((double)(str->length - 1));
+    };
+
     void LoadStdPrimitives(VM* vm)
     {
         vm->AddNativeFunction("Dictionary", dictionaryFunc, 0);
         vm->AddNativeFunction("List", listFunc, 0);
-    }
 
-    auto nowFunc = [](int argc, Value* args) {
+        ClassInterface list = vm->GetListClass();
+        list.AddMethod("length", listLength, 0);
+        list.AddMethod("append", listAppend, 1);
+
+        ClassInterface string = vm->GetStringClass();
+        string.AddMethod("length", stringLength, 0);
+    }
 
+    static double Now()
+    {
         auto now = std::chrono::high_resolution_clock::now();
 
         auto duration = now.time_since_epoch();
 
-        double seconds = std::chrono::duration<double>(duration).count();
-            
-        return Value(seconds);
-    };
+        return std::chrono::duration<double>(duration).count();
+    }
 
     void LoadStdTime(VM* vm, ObjModule* mdl)
     {
-        if (mdl == nullptr)
-        {
-            vm->AddNativeFunction("now", nowFunc, 0);
-            return;
-        }
-
-        mdl->AddNativeFunction("now", nowFunc, 0);
+        NativeBinder(vm, mdl).Bind<&Now>("now");
     }
 
-    auto osQueueTimer = [](int argc, Value* args) {
-
-        double duration = args[0].ToNumber();
-        ObjFunction* callback = (ObjFunction*)args[1].ToObject();
-
-        Timer::GetInstance().StartTimer((uint64_t)duration, [callback]() {
-
-            // Create a fiber
-            ObjFiber* fiber = CreateFiber(callback);
+    // Takes the raw arguments so it knows which VM's timers and events to use
+    static Value QueueTimer(void* context, int argCount, Value* args)
+    {
+        VM* vm = (VM*)context;
 
-            Event evnt{};
-            evnt.type = EVENT_PUSH_FIBER;
-            evnt.fiber = fiber;
+        if (argCount != 2 || !args[0].IsNumber() || !args[1].IsObjType(OBJ_FUNCTION))
+        {
+            vm->NativeError("Expected a duration and a function");
+            return Value();
+        }
 
-            eventManager.Push(evnt);
+        ObjFunction* callback = (ObjFunction*)args[1].ToObject();
 
-        });
+        // The timer makes the fiber when it goes off
+        vm->GetTimer().QueueFiber((uint64_t)args[0].ToNumber(), callback);
 
         return Value();
-    };
+    }
 
     void LoadStdOs(VM* vm, ObjModule* mdl)
     {
-        if (mdl == nullptr)
-        {
-            vm->AddNativeFunction("queue_timer", osQueueTimer, 2);
-
-            return;
-        }
-
-        mdl->AddNativeFunction("queue_timer", osQueueTimer, 2);
+        NativeBinder(vm, mdl).Add("queue_timer", &QueueTimer, 2, vm);
     }
-}
\ No newline at end of file
+}
@@ -2,6 +2,7 @@
 #pragma once
 
 #include "web.h"
+#include "../Object.h"
 
 namespace script
 {
@@ -14,6 +15,11 @@ namespace script
     // Loaded by std:maths
     void LoadStdMaths(VM* vm, ObjModule* mdl);
 
+    // The natives std:maths binds for the OP_MATH_ instructions, in the same order as the opcodes
+    // The VM checks a callee is still one of these before running the instruction inline
+    constexpr int MathsIntrinsicCount = 8;
+    extern const NativeFn mathsIntrinsics[MathsIntrinsicCount];
+
     void LoadStdFilesystem(VM* vm, ObjModule* mdl);
 
     void LoadStdTime(VM* vm, ObjModule* mdl);
@@ -1,6 +1,7 @@
 
 #include "web.h"
 #include "../VM.h"
+#include "../Bind.h"
 
 #include <nlohmann/json.hpp>
 
@@ -16,19 +17,19 @@ namespace script
             {
                 double dnum = (double)value.get<double>();
 
-                d->map[Value(memoryManager.AllocateString(key)).Hash()] = Value(dnum);
+                d->map[Value(CurrentHeap().AllocateString(key)).Hash()] = Value(dnum);
             }
             else if (value.is_string())
             {
                 std::string str = value.get<std::string>();
 
-                d->map[Value(memoryManager.AllocateString(key)).Hash()] = Value(memoryManager.AllocateString(str));
+                d->map[Value(CurrentHeap().AllocateString(key)).Hash()] = Value(CurrentHeap().AllocateString(str));
             }
             else if (value.is_boolean())
             {
                 bool b = value.get<bool>();
 
-                d->map[Value(memoryManager.AllocateString(key)).Hash()] = Value(b);
+                d->map[Value(CurrentHeap().AllocateString(key)).Hash()] = Value(b);
             }
             else if (value.is_object())
             {
@@ -38,7 +39,7 @@ namespace script
 
                 parseJson(obj, newDict);
 
-                d->map[Value(memoryManager.AllocateString(key)).Hash()] = newDict; 
+                d->map[Value(CurrentHeap().AllocateString(key)).Hash()] = newDict; 
             }
             else if (value.is_array())
             {
@@ -46,40 +47,25 @@ namespace script
             }
             else 
             {
-                d->map[Value(memoryManager.AllocateString(key)).Hash()] = Value();
+                d->map[Value(CurrentHeap().AllocateString(key)).Hash()] = Value();
             }
         }
     }
 
-    auto jsonParseNative = [](int argc, Value* args) 
+    static Value JsonParse(const char* source)
     {
-
-        assert(argc == 1);
-
-        // We expect one arg a string
-        // This is the source
-
-        ObjString* str = (ObjString*)args[0].ToObject();
-
         ObjDictionary* dict = AllocateDictionary();
 
-        json data = json::parse(str->str);
+        json data = json::parse(source);
 
         parseJson(data, dict);
 
         return Value(dict);
-    };
+    }
 
     void LoadJsonModule(VM* vm, ObjModule* mdl)
     {
-        if (mdl == nullptr)
-        {
-            vm->AddNativeFunction("parse", jsonParseNative, 1);
-
-
-        }
-
-        mdl->AddNativeFunction("parse", jsonParseNative, 1);
+        NativeBinder(vm, mdl).Bind<&JsonParse>("parse");
     }
 
     void LoadHttpModule(VM* vm, ObjModule* mdl)
@@ -4,18 +4,50 @@
 
 namespace script
 {
-	MemoryManager memoryManager;
+	static thread_local MemoryManager* currentHeap = nullptr;
+
+	MemoryManager& CurrentHeap()
+	{
+		return *currentHeap;
+	}
+
+	MemoryManager* SetCurrentHeap(MemoryManager* heap)
+	{
+		MemoryManager* previous = currentHeap;
+		currentHeap = heap;
+		return previous;
+	}
+
+	bool MemoryManager::IsCurrent() const
+	{
+		return currentHeap == this;
+	}
+
+	MemoryManager::~MemoryManager()
+	{
+		// Freeing gets counted against the current heap so this has to be it until everything is gone
+		MemoryManager* previous = SetCurrentHeap(this);
+
+		for (auto i : m_Allocations)
+		{
+			FreeObject(i);
+		}
+
+		SetCurrentHeap(previous == this ? nullptr : previous);
+	}
 
 	void* Allocate(void* ptr, size_t oldSize, size_t newSize)
 	{
-		memoryManager.m_BytesAllocated += newSize - oldSize;
+		// Raw memory used with no heap current isn't counted
+		MemoryManager* heap = currentHeap;
 
-		if (newSize > oldSize)
+		if (heap)
 		{
+			heap->m_BytesAllocated += newSize - oldSize;
 
-			if (memoryManager.m_BytesAllocated > memoryManager.m_NextGC)
+			if (newSize > oldSize && heap->m_BytesAllocated > heap->m_NextGC && heap->m_Events)
 			{
-				eventManager.Push({ EVENT_TRIGGER_GC });
+				heap->m_Events->Push({ EVENT_TRIGGER_GC });
 			}
 		}
 
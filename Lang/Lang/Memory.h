@@ -9,29 +9,43 @@
 
 namespace script
 {
+	class EventManager;
+	class MemoryManager;
+
+	// Counted against the heap current on this thread
 	void* Allocate(void* ptr, size_t oldSize, size_t newSize);
 
+	// Objects get allocated in the heap that is current on the thread, every VM has its own and makes it current when it runs
+	// Compiling or loading an image outside of a VM needs a heap to be made current first
+	MemoryManager& CurrentHeap();
+
+	// Returns the heap that was current before
+	MemoryManager* SetCurrentHeap(MemoryManager* heap);
+
 	class MemoryManager
 	{
 	public:
 
-		~MemoryManager()
-		{
-			for (auto i : m_Allocations)
-			{
-				FreeObject(i);
-			}
-		}
+		MemoryManager() = default;
+
+		MemoryManager(const MemoryManager&) = delete;
+		void operator=(const MemoryManager&) = delete;
+
+		~MemoryManager();
+
+		void MakeCurrent() { SetCurrentHeap(this); }
+		bool IsCurrent() const;
 
 		ObjString* AllocateString(const std::string& str);
 
 		ObjString* AllocateString(ObjString* str);
 
 
+		// Extra bytes can be requested for objects that store data inline after themselves
 		template<typename _Ty>
-		_Ty* AllocateObject()
+		_Ty* AllocateObject(size_t extraBytes = 0)
 		{
-			_Ty* ptr = (_Ty*)Allocate(nullptr, 0, sizeof(_Ty));
+			_Ty* ptr = (_Ty*)Allocate(nullptr, 0, sizeof(_Ty) + extraBytes);
 #ifdef VM_DEBUG_ALLOCS
 			// printf("%p Allocated of size %zu bytes of type: %s\n", (void*)ptr, sizeof(_Ty), typeid(_Ty).name());
 #endif
@@ -65,7 +79,8 @@ namespace script
 
 		bool shouldCollectGarbage = false;
 
-	};
+		// Where the garbage collection event goes once the heap grows past m_NextGC
+		EventManager* m_Events = nullptr;
 
-	extern MemoryManager memoryManager;
+	};
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include "Value.h"
 
 #include "Memory.h"
+#include "Bytecode.h"
 
 #include "Stack.h"
 
@@ -42,7 +43,7 @@ namespace script
 		//// We don't have to worry about freeing this
 		//// The GC will collect it and free on its next run 
 		//// That was a lot of debugging...
-		//ObjString* newStr = memoryManager.AllocateObject<ObjString>();
+		//ObjString* newStr = CurrentHeap().AllocateObject<ObjString>();
 		//newStr->type = OBJ_STRING;
 		//newStr->str = (char*)Allocate(nullptr, 0, newLength * sizeof(char));
 		//newStr->length = newLength;
@@ -52,9 +53,9 @@ namespace script
 
 		// TODO: This probably isn't the best way of doing it
 		// Granted the two strings are destroyed after leeaving this scope
-		ObjString* interned = memoryManager.AllocateString(std::string(str) + std::string(str2->str));
+		ObjString* interned = CurrentHeap().AllocateString(std::string(str) + std::string(str2->str));
 
-		// memoryManager.FreeObject(newStr);
+		// CurrentHeap().FreeObject(newStr);
 
 		return interned;
 	}
@@ -62,7 +63,7 @@ namespace script
 
 	ObjArray* AllocateArray(const std::vector<Value>& a)
 	{
-		ObjArray* arr = memoryManager.AllocateObject<ObjArray>();
+		ObjArray* arr = CurrentHeap().AllocateObject<ObjArray>();
 		arr->type = OBJ_ARRAY;
 
 		if (a.size() > 0)
@@ -157,7 +158,7 @@ namespace script
 
 	ObjRange* CreateRange()
 	{
-		ObjRange* range = memoryManager.AllocateObject<ObjRange>();
+		ObjRange* range = CurrentHeap().AllocateObject<ObjRange>();
 		range->type = OBJ_RANGE;
 
 		range->from = 0.0;
@@ -189,7 +190,7 @@ namespace script
 
 	ObjDictionary* AllocateDictionary()
 	{
-		ObjDictionary* dict = memoryManager.AllocateObject<ObjDictionary>();
+		ObjDictionary* dict = CurrentHeap().AllocateObject<ObjDictionary>();
 		dict->type = OBJ_DICTIONARY;
 
 		//dict->methods["put"] = Value(NewNativeFunction([&](int argCount, Value* args) {
@@ -219,44 +220,129 @@ namespace script
 		return dict;
 	}
 
+	ObjNative* NewNativeFunction(NativeFunc func, int arity)
+	{
+		ObjNative* native = NewNativeFunction([](void* context, int argCount, Value* args) {
+			return (*(NativeFunc*)context)(argCount, args);
+		}, arity);
+
+		native->adapted = std::move(func);
+		native->context = &native->adapted;
+		return native;
+	}
+
 	ObjFunction* NewFunction()
 	{
-		ObjFunction* func = memoryManager.AllocateObject<ObjFunction>();
+		ObjFunction* func = CurrentHeap().AllocateObject<ObjFunction>();
 		func->arity = 0;
 		func->type = OBJ_FUNCTION;
-		func->name = memoryManager.AllocateString("placeholder");
+		func->name = CurrentHeap().AllocateString("placeholder");
 
 		return func;
 	}
 
+	Shape* Shape::AddField(ObjString* name)
+	{
+		auto it = transitions.find(name);
+		if (it != transitions.end())
+			return it->second;
+
+		Shape* shape = new Shape();
+		shape->klass = klass;
+		shape->parent = this;
+		shape->slots = slots;
+		shape->slots[name] = fieldCount;
+		shape->fieldCount = fieldCount + 1;
+
+		transitions[name] = shape;
+
+		if (shape->fieldCount > klass->expectedFieldCount)
+			klass->expectedFieldCount = shape->fieldCount;
+
+		return shape;
+	}
+
+	void Shape::Destroy()
+	{
+		for (auto& [name, shape] : transitions)
+			shape->Destroy();
+
+		delete this;
+	}
+
 	ObjClass* NewClass(const std::string& name)
 	{
-		ObjClass* klass = memoryManager.AllocateObject<ObjClass>();
+		ObjClass* klass = CurrentHeap().AllocateObject<ObjClass>();
 
 		klass->type = OBJ_CLASS;
-		klass->name = memoryManager.AllocateString(name);
+		klass->name = CurrentHeap().AllocateString(name);
+
+		klass->rootShape = new Shape();
+		klass->rootShape->klass = klass;
 
 		return klass;
 	}
 
+	void ObjClass::Delete()
+	{
+		if (rootShape)
+			rootShape->Destroy();
+
+		rootShape = nullptr;
+	}
+
 	ObjInstance* NewInstance(ObjClass* klass)
 	{
-		ObjInstance* instance = memoryManager.AllocateObject<ObjInstance>();
+		// Reserve the fields inline based on what previous instances of the class ended up with
+		uint32_t capacity = klass->expectedFieldCount;
+
+		ObjInstance* instance = CurrentHeap().AllocateObject<ObjInstance>(sizeof(Value) * capacity);
 
 		instance->type = OBJ_INSTANCE;
 		instance->klass = klass;
-		// instance->methods = klass->methods;
+		instance->shape = klass->rootShape;
+		instance->fields = instance->InlineFields();
+		instance->fieldCapacity = capacity;
 
 		return instance;
 	}
 
+	void ObjInstance::EnsureFieldCapacity(uint32_t count)
+	{
+		if (count <= fieldCapacity)
+			return;
+
+		uint32_t newCapacity = fieldCapacity < 4 ? 4 : fieldCapacity * 2;
+		while (newCapacity < count)
+			newCapacity *= 2;
+
+		if (fields == InlineFields())
+		{
+			// Move out of the inline storage, it can't be resized
+			Value* newFields = (Value*)Allocate(nullptr, 0, sizeof(Value) * newCapacity);
+			memcpy(newFields, fields, sizeof(Value) * fieldCapacity);
+			fields = newFields;
+		}
+		else
+		{
+			fields = (Value*)Allocate(fields, sizeof(Value) * fieldCapacity, sizeof(Value) * newCapacity);
+		}
+
+		fieldCapacity = newCapacity;
+	}
+
 	void ObjInstance::Delete()
 	{
+		if (fields != InlineFields())
+			Allocate(fields, sizeof(Value) * fieldCapacity, 0);
+
+		fields = nullptr;
+		fieldCapacity = 0;
 	}
 
 	ObjModule* CreateModule(ObjString* name)
 	{
-		ObjModule* mdl = memoryManager.AllocateObject<ObjModule>();
+		ObjModule* mdl = CurrentHeap().AllocateObject<ObjModule>();
 
 		mdl->type = OBJ_MODULE;
 		mdl->name = name;
@@ -266,9 +352,145 @@ namespace script
 		
 	}
 
+	void ObjModule::AddNativeFunction(const std::string& name, NativeFn func, int arity, void* context)
+	{
+		globals[name] = Value(NewNativeFunction(func, arity, context));
+	}
+
 	void ObjModule::AddNativeFunction(const std::string& name, NativeFunc func, int arity)
 	{
-		methods[name] = Value(NewNativeFunction(func, arity));
+		globals[name] = Value(NewNativeFunction(std::move(func), arity));
+	}
+
+	void ObjFunction::Delete()
+	{
+		if (image)
+			image->Forget(this);
+
+		image.reset();
+	}
+
+	uint16_t GlobalTable::Resolve(const std::string& name)
+	{
+		auto it = slots.find(name);
+		if (it != slots.end())
+			return it->second;
+
+		assert(count <= UINT16_MAX && "Too many global variables");
+
+		if (count == capacity)
+		{
+			capacity = capacity < 16 ? 16 : capacity * 2;
+			values = (Value*)realloc(values, sizeof(Value) * capacity);
+		}
+
+		uint16_t slot = (uint16_t)count++;
+		slots[name] = slot;
+		names.push_back(name);
+		values[slot] = Value::Undefined();
+
+		// The parent gets an undefined slot too if it doesn't have one, it might define it later
+		if (parent)
+			parentSlots.push_back(parent->Resolve(name));
+
+		return slot;
+	}
+
+	GlobalTable::~GlobalTable()
+	{
+		free(values);
+	}
+
+	Value* GlobalTable::Find(const std::string& name)
+	{
+		auto it = slots.find(name);
+		if (it == slots.end() || values[it->second].IsUndefined())
+			return nullptr;
+
+		return &values[it->second];
+	}
+
+	Value* GlobalTable::FindInParent(uint16_t slot)
+	{
+		for (GlobalTable* table = this; table->parent; table = table->parent)
+		{
+			assert(slot < table->parentSlots.size() && "Parent set after slots were resolved");
+
+			slot = table->parentSlots[slot];
+
+			Value* value = &table->parent->values[slot];
+			if (!value->IsUndefined())
+				return value;
+		}
+
+		return nullptr;
+	}
+
+	Value& GlobalTable::operator[](const std::string& name)
+	{
+		// Resolve can grow the array so it has to happen before indexing
+		uint16_t slot = Resolve(name);
+		Value& value = values[slot];
+
+		if (value.IsUndefined())
+			value.MakeNil();
+
+		return value;
+	}
+
+	void LinkFunction(ObjFunction* function, GlobalTable* globals)
+	{
+		// Functions only get linked once
+		if (function->globals)
+			return;
+
+		function->globals = globals;
+
+		// The names are still in the image, it gets linked once they're loaded on the first call
+		if (function->lazy)
+			return;
+
+		// The compiler emits the name constant as the operand
+		// Swap that for the slot in the table so the VM never has to hash the name
+		Chunk& chunk = function->chunk;
+
+		for (size_t offset = 0; offset < chunk.code.size(); offset += GetInstructionLength(chunk.code[offset]))
+		{
+			switch (chunk.code[offset])
+			{
+			case OP_DEFINE_GLOBAL:
+			case OP_EXPORT_GLOBAL:
+			case OP_GET_GLOBAL:
+			case OP_SET_GLOBAL:
+			{
+				uint16_t constant = (uint16_t)((chunk.code[offset + 1] << 8) | chunk.code[offset + 2]);
+				ObjString* name = (ObjString*)chunk.constants[constant].ToObject();
+
+				uint16_t slot = globals->Resolve(name->str);
+
+				// Writing to a view would fault, those get the side table instead
+				if (chunk.code.IsView())
+				{
+					function->globalSlots.resize(chunk.constants.size());
+					function->globalSlots[constant] = slot;
+					break;
+				}
+
+				chunk.code[offset + 1] = (uint8_t)(slot >> 8);
+				chunk.code[offset + 2] = (uint8_t)(slot & 0xFF);
+				break;
+			}
+			default:
+				break;
+			}
+		}
+
+		// Nested functions and methods share the same globals
+		for (Value& constant : chunk.constants)
+		{
+			if (constant.IsObjType(OBJ_FUNCTION))
+				LinkFunction((ObjFunction*)constant.ToObject(), globals);
+		}
 	}
 
 }
\ No newline at end of file
@@ -4,6 +4,7 @@
 
 #include "Chunk.h"
 #include <functional>
+#include <memory>
 #include "Vendor/unordered_dense.h"
 
 namespace script
@@ -144,6 +145,21 @@ namespace script
 		
 	};
 	 
+	class GlobalTable;
+	class JITFunction;
+	class LoadedImage;
+	class Trace;
+
+	// A loop header the tracing JIT keeps count of
+	struct TraceLoop
+	{
+		// Bytecode offset of the first instruction in the loop
+		uint32_t header = 0;
+		uint32_t hotness = 0;
+		uint32_t aborts = 0;
+		Trace* trace = nullptr;
+	};
+
 	class ObjFunction : public Object
 	{
 	public:
@@ -152,9 +168,46 @@ namespace script
 		int arity = 0;
 		ObjString* name;
 
+		// Most values the function can have on the stack including its arguments, calls make room for this much
+		// Set once the code is final, see FindMaxStack
+		uint32_t maxStack = 0;
+
+		// The globals this function was linked against
+		// Global instructions in the chunk index straight into this table
+		GlobalTable* globals = nullptr;
+
+		// Code running straight out of a mapped image can't have its operands swapped for slots,
+		// so its global instructions keep the name constant and look the slot up in here instead. Empty otherwise
+		std::vector<uint16_t> globalSlots;
+
+		// The slot a global instruction's operand refers to
+		uint16_t GlobalSlot(uint16_t operand) const { return globalSlots.empty() ? operand : globalSlots[operand]; }
+		const uint16_t* GlobalSlots() const { return globalSlots.empty() ? nullptr : globalSlots.data(); }
+
+		// Native code from the JIT, nullptr until the function gets hot
+		JITFunction* jit = nullptr;
+		uint32_t hotness = 0;
+
+		// Every loop in the function, filled in the first time one of them jumps back
+		std::vector<TraceLoop> loops;
+
+		// Functions made from an image keep it alive, their code might be running straight out of it
+		// Until the first call the constants are still in the image too, see Bytecode.h
+		std::shared_ptr<LoadedImage> image;
+		uint32_t imageIndex = 0;
+		bool lazy = false;
+
+		void Delete() override;
+
 		std::string ToString() override { return "function"; }
 	};
 
+	// Natives are plain function pointers so a call is just one indirect call
+	// context is whatever was registered along with the function, usually nullptr
+	using NativeFn = Value(*)(void* context, int argCount, Value* args);
+
+	// Anything else callable, mostly lambdas that capture
+	// These get wrapped up and called through a NativeFn
 	using NativeFunc = std::function<Value( int argCount, Value* args)>;
 
 	class ObjNative : public Object
@@ -162,7 +215,14 @@ namespace script
 	public:
 
 		int arity = 0;
-		NativeFunc function;
+		NativeFn function = nullptr;
+		void* context = nullptr;
+
+		// Only set for natives made from a NativeFunc, context points at it
+		NativeFunc adapted;
+
+		// Defined in Value.h, Value isn't complete yet
+		Value Call(int argCount, Value* args);
 
 		std::string ToString() override { return "native function"; }
 
@@ -171,22 +231,71 @@ namespace script
 
 	ObjFunction* NewFunction();
 
-	inline ObjNative* NewNativeFunction(NativeFunc func, int arity)
+	inline ObjNative* NewNativeFunction(NativeFn func, int arity, void* context = nullptr)
 	{
 		ObjNative* native = new ObjNative();
 		native->function = func;
+		native->context = context;
 		native->arity = arity;
 		native->type = OBJ_NATIVE;
 		return native;
 	}
 
+	ObjNative* NewNativeFunction(NativeFunc func, int arity);
+
+	class ObjClass;
+
+	// A shape (or hidden class) describes the layout of the fields in an instance
+	// Instances that had the same fields added in the same order share a shape
+	// so the name to slot mapping only exists once instead of once per instance
+	class Shape
+	{
+	public:
+
+		ObjClass* klass = nullptr;
+		Shape* parent = nullptr;
+
+		uint32_t fieldCount = 0;
+
+		// Field names are interned strings so we can key on the pointer and skip hashing the string
+		ankerl::unordered_dense::map<ObjString*, uint32_t> slots;
+
+		// Adding a field moves an instance to a new shape, these are cached so every instance follows the same path
+		ankerl::unordered_dense::map<ObjString*, Shape*> transitions;
+
+		// Returns -1 if the field doesn't exist in this shape
+		int32_t FindSlot(ObjString* name)
+		{
+			auto it = slots.find(name);
+			if (it == slots.end())
+				return -1;
+
+			return (int32_t)it->second;
+		}
+
+		// Get the shape an instance moves to when this field is added
+		Shape* AddField(ObjString* name);
+
+		// Deletes this shape and every shape transitioned to from it
+		void Destroy();
+	};
+
 	class ObjClass : public Object
 	{
 	public:
 
+		void Delete() override;
+
 		ObjString* name;
 		ankerl::unordered_dense::map<std::string, Value> methods;
 
+		// The empty shape every new instance starts with
+		Shape* rootShape = nullptr;
+
+		// The most fields an instance of this class has ended up with
+		// New instances reserve this many slots up front so they don't need to grow
+		uint32_t expectedFieldCount = 0;
+
 		std::string ToString() override { return std::string(name->str); }
 
 	private:
@@ -201,7 +310,17 @@ namespace script
 		void Delete() override;
 
 		ObjClass* klass;
-		ankerl::unordered_dense::map<std::string, Value> fields;
+		Shape* shape;
+
+		// Field values indexed by the slots in the shape
+		// This points at the inline storage allocated straight after the instance until it needs to grow
+		Value* fields = nullptr;
+		uint32_t fieldCapacity = 0;
+
+		Value* InlineFields() { return (Value*)(this + 1); }
+
+		// Make sure there is room for a field in this slot
+		void EnsureFieldCapacity(uint32_t count);
 
 		// We just return the base class to string
 		std::string ToString() override { return klass->ToString(); }
@@ -211,6 +330,51 @@ namespace script
 	ObjInstance* NewInstance(ObjClass* klass);
 
 
+	// Global variables live in a flat array and are accessed by slot
+	// The name to slot map is only used when linking and for lookups from C++ 
+	class GlobalTable
+	{
+	public:
+
+		GlobalTable() = default;
+		~GlobalTable();
+
+		GlobalTable(const GlobalTable&) = delete;
+		GlobalTable& operator=(const GlobalTable&) = delete;
+
+		// A plain array so generated code can load the base pointer straight out of the table
+		Value* values = nullptr;
+		uint32_t count = 0;
+		uint32_t capacity = 0;
+
+		std::vector<std::string> names;
+
+		ankerl::unordered_dense::map<std::string, uint16_t> slots;
+
+		// If a slot is undefined in this table it gets looked up in here
+		// Modules use this to see the builtins in the root globals, the parent has to be set before anything resolves
+		GlobalTable* parent = nullptr;
+
+		// The slot with the same name in the parent, resolved along with the slot so a miss never hashes the name
+		std::vector<uint16_t> parentSlots;
+
+		// Get the slot for a name, adding an undefined slot if it doesn't exist yet 
+		uint16_t Resolve(const std::string& name);
+
+		// Returns nullptr if the variable doesn't exist or hasn't been defined
+		Value* Find(const std::string& name);
+
+		// Follows a slot up through the parent tables to the first one that defines it
+		Value* FindInParent(uint16_t slot);
+
+		// Gets the variable, defining it as nil if it doesn't exist
+		Value& operator[](const std::string& name);
+	};
+
+	// Rewrites the global instructions in a function and any functions it contains
+	// to index straight into the global table
+	void LinkFunction(ObjFunction* function, GlobalTable* globals);
+
 	class ObjModule : public Object
 	{
 	public:
@@ -219,8 +383,9 @@ namespace script
 
 		ObjModule* caller = nullptr;
 
-		ankerl::unordered_dense::map<std::string, Value> methods;
+		GlobalTable globals;
 
+		void AddNativeFunction(const std::string& name, NativeFn func, int arity, void* context = nullptr);
 		void AddNativeFunction(const std::string& name, NativeFunc func, int arity);
 	};
 
@@ -1,80 +1,141 @@
+// OPCODE(name, operand bytes)
+// The operand bytes are how many bytes follow the opcode in the chunk
 
 
-OPCODE(RETURN)
-OPCODE(CONSTANT)
-OPCODE(CONSTANT_LONG)
+OPCODE(RETURN, 0)
+OPCODE(CONSTANT, 1)
+OPCODE(CONSTANT_LONG, 2)
 
-OPCODE(NEGATE)
-OPCODE(ADD)
-OPCODE(SUBTRACT)
-OPCODE(MULTIPLY)
-OPCODE(DIVIDE)
-OPCODE(POWER)
-OPCODE(MODULO)
+OPCODE(NEGATE, 0)
+OPCODE(ADD, 0)
+OPCODE(SUBTRACT, 0)
+OPCODE(MULTIPLY, 0)
+OPCODE(DIVIDE, 0)
+OPCODE(POWER, 0)
+OPCODE(MODULO, 0)
 
-OPCODE(FALSE)
-OPCODE(TRUE)
-OPCODE(NIL)
+OPCODE(FALSE, 0)
+OPCODE(TRUE, 0)
+OPCODE(NIL, 0)
 
-OPCODE(NOT)
+OPCODE(NOT, 0)
 
-OPCODE(EQUAL)
-OPCODE(GREATER)
-OPCODE(LESS)
+OPCODE(EQUAL, 0)
+OPCODE(GREATER, 0)
+OPCODE(LESS, 0)
 
-OPCODE(POP)
-OPCODE(DEFINE_GLOBAL)
-OPCODE(GET_GLOBAL)
-OPCODE(EXPORT_GLOBAL)
+OPCODE(POP, 0)
+OPCODE(DEFINE_GLOBAL, 2)
+OPCODE(GET_GLOBAL, 2)
+OPCODE(EXPORT_GLOBAL, 2)
 
-OPCODE(SET_GLOBAL)
-OPCODE(GET_LOCAL)
-OPCODE(SET_LOCAL)
-
-OPCODE(JUMP_IF_FALSE)
-OPCODE(JUMP)
-
-OPCODE(LOOP)
-
-OPCODE(CALL_0)
-
-OPCODE(CALL_1)
-OPCODE(CALL_2)
-OPCODE(CALL_3)
-OPCODE(CALL_4)
-OPCODE(CALL_5)
-OPCODE(CALL_6)
-OPCODE(CALL_7)
-OPCODE(CALL_8)
-OPCODE(CALL_9)
-OPCODE(CALL_10)
-OPCODE(CALL_11)
-OPCODE(CALL_12)
-OPCODE(CALL_13)
-OPCODE(CALL_14)
-OPCODE(CALL_15)
-OPCODE(CALL_16)
-
-OPCODE(CREATE_LIST)
-OPCODE(SUBSCRIPT_READ)
-OPCODE(SUBSCRIPT_WRITE)
-
-OPCODE(SLICE_ARRAY)
-
-OPCODE(CLASS)
-
-OPCODE(GET_PROPERTY)
-OPCODE(SET_PROPERTY)
-
-OPCODE(METHOD)
-
-OPCODE(THROW)
-
-OPCODE(STRING_INTERP)
-
-OPCODE(IMPORT_MODULE)
-OPCODE(IMPORT_MODULE_AS)
-
-OPCODE(ITER)
-
-OPCODE(CREATE_RANGE)
\ No newline at end of file
+OPCODE(SET_GLOBAL, 2)
+OPCODE(GET_LOCAL, 2)
+OPCODE(SET_LOCAL, 2)
+
+OPCODE(JUMP_IF_FALSE, 2)
+OPCODE(JUMP, 2)
+
+OPCODE(LOOP, 2)
+
+OPCODE(CALL_0, 0)
+
+OPCODE(CALL_1, 0)
+OPCODE(CALL_2, 0)
+OPCODE(CALL_3, 0)
+OPCODE(CALL_4, 0)
+OPCODE(CALL_5, 0)
+OPCODE(CALL_6, 0)
+OPCODE(CALL_7, 0)
+OPCODE(CALL_8, 0)
+OPCODE(CALL_9, 0)
+OPCODE(CALL_10, 0)
+OPCODE(CALL_11, 0)
+OPCODE(CALL_12, 0)
+OPCODE(CALL_13, 0)
+OPCODE(CALL_14, 0)
+OPCODE(CALL_15, 0)
+OPCODE(CALL_16, 0)
+
+// Comes right before the CALL in return f(x)
+// Script functions take over the current frame, anything else falls through to the CALL and the RETURN after it
+OPCODE(TAIL_CALL, 0)
+
+// Comes after the arguments of a call the compiler inlined
+// Jumps to the copy of the function's body if the callee is still that function, otherwise carries on into the CALL
+// Operands are the jump, the function's constant and the argument count
+OPCODE(INLINE_GUARD, 5)
+
+OPCODE(CREATE_LIST, 2)
+OPCODE(SUBSCRIPT_READ, 0)
+OPCODE(SUBSCRIPT_WRITE, 0)
+
+OPCODE(SLICE_ARRAY, 0)
+
+OPCODE(CLASS, 2)
+
+OPCODE(GET_PROPERTY, 4)
+OPCODE(SET_PROPERTY, 4)
+
+OPCODE(INVOKE, 5)
+
+OPCODE(METHOD, 2)
+
+OPCODE(THROW, 0)
+
+OPCODE(STRING_INTERP, 1)
+
+OPCODE(IMPORT_MODULE, 2)
+OPCODE(IMPORT_MODULE_AS, 4)
+
+OPCODE(ITER, 2)
+
+OPCODE(CREATE_RANGE, 0)
+
+// Superinstructions
+// Common sequences fused into one instruction to save trips through the dispatch loop
+OPCODE(NOT_EQUAL, 0)
+OPCODE(LESS_EQUAL, 0)
+OPCODE(GREATER_EQUAL, 0)
+
+OPCODE(GET_LOCAL_0, 0)
+OPCODE(GET_LOCAL_1, 0)
+OPCODE(GET_LOCAL_2, 0)
+OPCODE(GET_LOCAL_3, 0)
+
+// Right hand side is a number constant
+OPCODE(ADD_CONSTANT, 1)
+OPCODE(SUBTRACT_CONSTANT, 1)
+
+OPCODE(POP_N, 1)
+
+// Compare and branch, jumps if the comparison is false and leaves nothing on the stack
+OPCODE(JUMP_IF_NOT_LESS, 2)
+OPCODE(JUMP_IF_NOT_GREATER, 2)
+OPCODE(JUMP_IF_NOT_LESS_EQUAL, 2)
+OPCODE(JUMP_IF_NOT_GREATER_EQUAL, 2)
+OPCODE(JUMP_IF_NOT_EQUAL, 2)
+OPCODE(JUMP_IF_EQUAL, 2)
+
+// std:maths functions the compiler turns into instructions when it can see the import
+// The callee or module is still pushed so the VM can check the binding hasn't changed and fall back to a normal call
+// Operands are the name of the function and a cache for finding it in the module
+OPCODE(MATH_SQRT, 4)
+OPCODE(MATH_SIN, 4)
+OPCODE(MATH_COS, 4)
+OPCODE(MATH_ABS, 4)
+OPCODE(MATH_FLOOR, 4)
+OPCODE(MATH_MIN, 4)
+OPCODE(MATH_MAX, 4)
+OPCODE(MATH_ATAN2, 4)
+
+// Quickened instructions
+// The compiler never emits these. The VM rewrites a generic instruction into one of these
+// once it has seen the operand types and rewrites it back if the types change
+OPCODE(ADD_NUM_NUM, 0)
+OPCODE(ADD_STR, 0)
+OPCODE(SUBTRACT_NUM_NUM, 0)
+OPCODE(MULTIPLY_NUM_NUM, 0)
+OPCODE(DIVIDE_NUM_NUM, 0)
+OPCODE(LESS_NUM, 0)
+OPCODE(GREATER_NUM, 0)
\ No newline at end of file
@@ -0,0 +1,643 @@
+#include "Optimizer.h"
+#include "IR.h"
+#include "Value.h"
+#include "Memory.h"
+
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace script
+{
+	namespace
+	{
+		// Each pass can open things up for the others, eg. a folded condition makes a branch dead
+		constexpr int MaxPasses = 8;
+
+		// Lifting again after lowering lets something hoisted out of an inner loop move out of the one around it
+		constexpr int MaxIRRounds = 3;
+
+		using Instruction = DecodedInstruction;
+
+		// Pushes a value and does nothing else, so pushing and popping it straight away does nothing
+		bool IsPurePush(uint8_t op)
+		{
+			switch (op)
+			{
+			case OP_CONSTANT:
+			case OP_CONSTANT_LONG:
+			case OP_TRUE:
+			case OP_FALSE:
+			case OP_NIL:
+			case OP_GET_LOCAL:
+			case OP_GET_LOCAL_0:
+			case OP_GET_LOCAL_1:
+			case OP_GET_LOCAL_2:
+			case OP_GET_LOCAL_3:
+				return true;
+			default:
+				return false;
+			}
+		}
+
+		bool IsFalsy(Value value)
+		{
+			return value.IsNil() || (value.IsBool() && !value.AsBool());
+		}
+
+		// These work the values out the same way the VM does, anything the VM would report an error for is left alone
+		bool FoldUnary(uint8_t op, Value value, Value* result)
+		{
+			switch (op)
+			{
+			case OP_NEGATE:
+				if (!value.IsNumber())
+					return false;
+
+				*result = Value(-value.ToNumber());
+				return true;
+			case OP_NOT:
+				*result = Value(!value.AsBool());
+				return true;
+			default:
+				return false;
+			}
+		}
+
+		bool FoldBinary(uint8_t op, Value a, Value b, Value* result)
+		{
+			// a is the left hand side, b was pushed last
+			if (op == OP_EQUAL || op == OP_NOT_EQUAL)
+			{
+				bool equal = b == a;
+				*result = Value(op == OP_EQUAL ? equal : !equal);
+				return true;
+			}
+
+			if (op == OP_ADD && a.IsObjType(OBJ_STRING) && b.IsObjType(OBJ_STRING))
+			{
+				std::string str = std::string(((ObjString*)a.ToObject())->str) + ((ObjString*)b.ToObject())->str;
+				*result = Value(CurrentHeap().AllocateString(str));
+				return true;
+			}
+
+			if (!a.IsNumber() || !b.IsNumber())
+				return false;
+
+			double x = a.ToNumber();
+			double y = b.ToNumber();
+
+			switch (op)
+			{
+			case OP_ADD:			*result = Value(x + y); break;
+			case OP_SUBTRACT:		*result = Value(x - y); break;
+			case OP_MULTIPLY:		*result = Value(x * y); break;
+			case OP_DIVIDE:			*result = Value(x / y); break;
+			case OP_POWER:			*result = Value(std::pow(x, y)); break;
+			case OP_MODULO:			*result = Value(std::remainder(x, y)); break;
+			case OP_LESS:			*result = Value(x < y); break;
+			case OP_GREATER:		*result = Value(x > y); break;
+			case OP_LESS_EQUAL:		*result = Value(x <= y); break;
+			case OP_GREATER_EQUAL:	*result = Value(x >= y); break;
+			default:
+				return false;
+			}
+
+			return true;
+		}
+
+		// The comparison a compare and branch does, it jumps when this comes out false
+		uint8_t ComparisonOf(uint8_t jump)
+		{
+			switch (jump)
+			{
+			case OP_JUMP_IF_NOT_LESS:			return OP_LESS;
+			case OP_JUMP_IF_NOT_GREATER:		return OP_GREATER;
+			case OP_JUMP_IF_NOT_LESS_EQUAL:		return OP_LESS_EQUAL;
+			case OP_JUMP_IF_NOT_GREATER_EQUAL:	return OP_GREATER_EQUAL;
+			case OP_JUMP_IF_NOT_EQUAL:			return OP_EQUAL;
+			case OP_JUMP_IF_EQUAL:				return OP_NOT_EQUAL;
+			default:
+				return 0;
+			}
+		}
+
+		class ChunkOptimizer
+		{
+		public:
+
+			ChunkOptimizer(Chunk& chunk) : m_Chunk(chunk)
+			{
+			}
+
+			void Run(OptimizationLevel level)
+			{
+				if (!Decode())
+					return;
+
+				bool changed = true;
+
+				for (int pass = 0; changed && pass < MaxPasses; pass++)
+				{
+					FindJumpTargets();
+
+					changed = FoldConstants();
+					changed |= FoldBranches();
+					changed |= RemovePushPop();
+					changed |= MergePops();
+
+					if (level >= OPT_FULL)
+					{
+						changed |= ThreadJumps();
+						changed |= RemoveUnreachable();
+					}
+				}
+
+				Encode();
+			}
+
+		private:
+
+			bool Decode()
+			{
+				return DecodeInstructions(m_Chunk.code, m_Code);
+			}
+
+			// Removed instructions count as the first one after them that is still there
+			int Resolve(int index)
+			{
+				while (index < (int)m_Code.size() && m_Code[index].removed)
+					index++;
+
+				return index;
+			}
+
+			int Next(int index)
+			{
+				return Resolve(index + 1);
+			}
+
+			int Previous(int index)
+			{
+				do
+				{
+					index--;
+				} while (index >= 0 && m_Code[index].removed);
+
+				return index;
+			}
+
+			void MarkTarget(int index)
+			{
+				if (index < (int)m_Code.size())
+					m_Code[index].jumpTarget = true;
+			}
+
+			// Anything that jumped to the instruction now lands on the one after it
+			void Remove(int index)
+			{
+				if (m_Code[index].jumpTarget)
+					MarkTarget(Next(index));
+
+				m_Code[index].removed = true;
+			}
+
+			void FindJumpTargets()
+			{
+				for (Instruction& instruction : m_Code)
+					instruction.jumpTarget = false;
+
+				for (Instruction& instruction : m_Code)
+				{
+					if (!instruction.removed && IsJump(instruction.op))
+						MarkTarget(Resolve(instruction.target));
+				}
+			}
+
+			// The value the instruction pushes if it does nothing but push a constant
+			// Only plain values count, functions are constants too
+			bool GetConstant(int index, Value* value)
+			{
+				Instruction& instruction = m_Code[index];
+
+				switch (instruction.op)
+				{
+				case OP_CONSTANT:
+					*value = m_Chunk.constants[instruction.operands[0]];
+					break;
+				case OP_CONSTANT_LONG:
+					*value = m_Chunk.constants[(instruction.operands[0] << 8) | instruction.operands[1]];
+					break;
+				case OP_TRUE:
+					*value = Value(true);
+					return true;
+				case OP_FALSE:
+					*value = Value(false);
+					return true;
+				case OP_NIL:
+					*value = Value();
+					return true;
+				default:
+					return false;
+				}
+
+				return value->IsNumber() || value->IsObjType(OBJ_STRING);
+			}
+
+			// Turns the instruction into one that pushes the value
+			bool SetConstant(int index, Value value)
+			{
+				Instruction& instruction = m_Code[index];
+
+				if (value.IsBool())
+				{
+					instruction.op = value.AsBool() ? OP_TRUE : OP_FALSE;
+					return true;
+				}
+
+				if (value.IsNil())
+				{
+					instruction.op = OP_NIL;
+					return true;
+				}
+
+				size_t constant = FindConstant(value);
+
+				if (constant > UINT16_MAX)
+					return false;
+
+				if (constant <= UINT8_MAX)
+				{
+					instruction.op = OP_CONSTANT;
+					instruction.operands[0] = (uint8_t)constant;
+				}
+				else
+				{
+					instruction.op = OP_CONSTANT_LONG;
+					instruction.operands[0] = (uint8_t)(constant >> 8);
+					instruction.operands[1] = (uint8_t)(constant & 0xFF);
+				}
+
+				return true;
+			}
+
+			// Reuses a constant that is already in the table if there is one
+			size_t FindConstant(Value value)
+			{
+				std::vector<Value>& constants = m_Chunk.constants;
+
+				for (size_t i = 0; i < constants.size(); i++)
+				{
+					if (value.IsNumber() && constants[i].IsNumber())
+					{
+						double a = value.ToNumber();
+						double b = constants[i].ToNumber();
+
+						if (memcmp(&a, &b, sizeof(double)) == 0)
+							return i;
+					}
+					else if (value.IsObjType(OBJ_STRING) && constants[i].IsObjType(OBJ_STRING))
+					{
+						if (strcmp(((ObjString*)value.ToObject())->str, ((ObjString*)constants[i].ToObject())->str) == 0)
+							return i;
+					}
+				}
+
+				constants.push_back(value);
+				return constants.size() - 1;
+			}
+
+			bool FoldConstants()
+			{
+				bool changed = false;
+
+				for (int i = 0; i < (int)m_Code.size(); i++)
+				{
+					Instruction& instruction = m_Code[i];
+
+					if (instruction.removed || instruction.jumpTarget)
+						continue;
+
+					uint8_t op = instruction.op;
+
+					int right = Previous(i);
+					Value b;
+
+					if (right < 0 || !GetConstant(right, &b))
+						continue;
+
+					Value result;
+
+					if (op == OP_NEGATE || op == OP_NOT)
+					{
+						if (!FoldUnary(op, b, &result) || !SetConstant(right, result))
+							continue;
+
+						Remove(i);
+						changed = true;
+						continue;
+					}
+
+					if (op == OP_ADD_CONSTANT || op == OP_SUBTRACT_CONSTANT)
+					{
+						Value constant = m_Chunk.constants[instruction.operands[0]];
+
+						if (!FoldBinary(op == OP_ADD_CONSTANT ? OP_ADD : OP_SUBTRACT, b, constant, &result) || !SetConstant(right, result))
+							continue;
+
+						Remove(i);
+						changed = true;
+						continue;
+					}
+
+					if (m_Code[right].jumpTarget)
+						continue;
+
+					int left = Previous(right);
+					Value a;
+
+					if (left < 0 || !GetConstant(left, &a))
+					{
+						// Only the right hand side is constant, it can still be an operand of the instruction
+						if ((op == OP_ADD || op == OP_SUBTRACT) && m_Code[right].op == OP_CONSTANT && b.IsNumber())
+						{
+							m_Code[right].op = op == OP_ADD ? OP_ADD_CONSTANT : OP_SUBTRACT_CONSTANT;
+							Remove(i);
+							changed = true;
+						}
+
+						continue;
+					}
+
+					if (uint8_t comparison = ComparisonOf(op))
+					{
+						if (!FoldBinary(comparison, a, b, &result) || !result.IsBool())
+							continue;
+
+						// Both operands get popped either way
+						if (!result.AsBool())
+						{
+							m_Code[left].op = OP_JUMP;
+							m_Code[left].target = instruction.target;
+						}
+						else
+						{
+							Remove(left);
+						}
+
+						Remove(right);
+						Remove(i);
+						changed = true;
+						continue;
+					}
+
+					if (!FoldBinary(op, a, b, &result) || !SetConstant(left, result))
+						continue;
+
+					Remove(right);
+					Remove(i);
+					changed = true;
+				}
+
+				return changed;
+			}
+
+			// JUMP_IF_FALSE leaves the condition on the stack, both sides pop it afterwards
+			bool FoldBranches()
+			{
+				bool changed = false;
+
+				for (int i = 0; i < (int)m_Code.size(); i++)
+				{
+					Instruction& instruction = m_Code[i];
+
+					if (instruction.removed || instruction.jumpTarget || instruction.op != OP_JUMP_IF_FALSE)
+						continue;
+
+					int condition = Previous(i);
+					Value value;
+
+					if (condition < 0 || !GetConstant(condition, &value))
+						continue;
+
+					changed = true;
+
+					if (!IsFalsy(value))
+					{
+						Remove(i);
+						continue;
+					}
+
+					int target = Resolve(instruction.target);
+
+					if (target < (int)m_Code.size() && m_Code[target].op == OP_POP)
+					{
+						// The condition is only pushed so the other side can pop it, jump past the pop instead
+						m_Code[condition].op = OP_JUMP;
+						m_Code[condition].target = Next(target);
+						MarkTarget(Next(target));
+						Remove(i);
+					}
+					else
+					{
+						instruction.op = OP_JUMP;
+					}
+				}
+
+				return changed;
+			}
+
+			bool RemovePushPop()
+			{
+				bool changed = false;
+
+				for (int i = 0; i < (int)m_Code.size(); i++)
+				{
+					Instruction& instruction = m_Code[i];
+
+					if (instruction.removed || instruction.jumpTarget)
+						continue;
+
+					if (instruction.op != OP_POP && instruction.op != OP_POP_N)
+						continue;
+
+					int push = Previous(i);
+
+					if (push < 0 || !IsPurePush(m_Code[push].op))
+						continue;
+
+					Remove(push);
+					changed = true;
+
+					if (instruction.op == OP_POP || instruction.operands[0] <= 1)
+					{
+						Remove(i);
+						continue;
+					}
+
+					if (--instruction.operands[0] == 1)
+						instruction.op = OP_POP;
+
+					// There might be another push before this one, look at the pop again
+					if (!instruction.jumpTarget)
+						i--;
+				}
+
+				return changed;
+			}
+
+			bool MergePops()
+			{
+				bool changed = false;
+
+				for (int i = 0; i < (int)m_Code.size(); i++)
+				{
+					Instruction& instruction = m_Code[i];
+
+					if (instruction.removed || instruction.jumpTarget)
+						continue;
+
+					if (instruction.op != OP_POP && instruction.op != OP_POP_N)
+						continue;
+
+					int previous = Previous(i);
+
+					if (previous < 0 || (m_Code[previous].op != OP_POP && m_Code[previous].op != OP_POP_N))
+						continue;
+
+					int count = PopCount(m_Code[previous]) + PopCount(instruction);
+
+					if (count > UINT8_MAX)
+						continue;
+
+					m_Code[previous].op = OP_POP_N;
+					m_Code[previous].operands[0] = (uint8_t)count;
+					Remove(i);
+					changed = true;
+				}
+
+				return changed;
+			}
+
+			static int PopCount(const Instruction& instruction)
+			{
+				return instruction.op == OP_POP ? 1 : instruction.operands[0];
+			}
+
+			// A jump that lands on a JUMP can go straight to where that one goes
+			bool ThreadJumps()
+			{
+				bool changed = false;
+
+				for (int i = 0; i < (int)m_Code.size(); i++)
+				{
+					Instruction& instruction = m_Code[i];
+
+					// Loops keep their targets, those are the loop headers the JIT and tracing look for
+					if (instruction.removed || !IsForwardJump(instruction.op) || instruction.op == OP_ITER)
+						continue;
+
+					int target = Resolve(instruction.target);
+					int start = target;
+
+					for (int hops = 0; hops < MaxPasses && target < (int)m_Code.size() && m_Code[target].op == OP_JUMP && target != i; hops++)
+						target = Resolve(m_Code[target].target);
+
+					if (target != start)
+					{
+						instruction.target = target;
+						MarkTarget(target);
+						changed = true;
+					}
+
+					// Neither JUMP nor JUMP_IF_FALSE touch the stack so one that goes to the next instruction does nothing
+					if ((instruction.op == OP_JUMP || instruction.op == OP_JUMP_IF_FALSE) && target == Next(i))
+					{
+						Remove(i);
+						changed = true;
+					}
+				}
+
+				return changed;
+			}
+
+			bool RemoveUnreachable()
+			{
+				std::vector<bool> reached(m_Code.size(), false);
+				std::vector<int> work = { Resolve(0) };
+
+				while (!work.empty())
+				{
+					int i = work.back();
+					work.pop_back();
+
+					if (i >= (int)m_Code.size() || reached[i])
+						continue;
+
+					reached[i] = true;
+
+					Instruction& instruction = m_Code[i];
+
+					if (IsJump(instruction.op))
+						work.push_back(Resolve(instruction.target));
+
+					if (instruction.op != OP_JUMP && instruction.op != OP_LOOP && instruction.op != OP_RETURN)
+						work.push_back(Next(i));
+				}
+
+				bool changed = false;
+
+				for (size_t i = 0; i < m_Code.size(); i++)
+				{
+					if (!m_Code[i].removed && !reached[i])
+					{
+						m_Code[i].removed = true;
+						changed = true;
+					}
+				}
+
+				return changed;
+			}
+
+			// Threading can make a jump longer, if it doesn't fit anymore the old code is kept
+			void Encode()
+			{
+				std::vector<uint8_t> code;
+
+				if (EncodeInstructions(m_Code, code))
+					m_Chunk.code = std::move(code);
+			}
+
+			Chunk& m_Chunk;
+			std::vector<Instruction> m_Code;
+		};
+	}
+
+	void OptimizeChunk(Chunk& chunk, OptimizationLevel level)
+	{
+		if (level == OPT_NONE || chunk.code.empty())
+			return;
+
+		ChunkOptimizer(chunk).Run(level);
+	}
+
+	void OptimizeFunction(ObjFunction* function, FunctionType type, OptimizationLevel level)
+	{
+		OptimizeChunk(function->chunk, level);
+
+		// The script's locals are globals, there isn't much to find
+		if (level < OPT_SSA || type == TYPE_SCRIPT)
+			return;
+
+		for (int round = 0; round < MaxIRRounds; round++)
+		{
+			IRFunction ir(function);
+
+			if (!ir.Build() || !ir.Optimize() || !ir.Lower())
+				break;
+
+			OptimizeChunk(function->chunk, level);
+		}
+	}
+}
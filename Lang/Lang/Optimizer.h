@@ -0,0 +1,32 @@
+#pragma once
+#include "Chunk.h"
+#include "Object.h"
+
+// Clean up pass over the bytecode of a finished function
+// The compiler emits as it parses so it never sees that 2 * 3 is a constant or that if (false) can't run,
+// this goes back over the chunk once the function is done and tidies that up
+
+namespace script
+{
+	enum OptimizationLevel
+	{
+		// Bytecode is left exactly as the compiler emitted it
+		OPT_NONE,
+		// Folds constant expressions and branches on constants, drops values that are pushed and popped straight away
+		OPT_FOLD,
+		// Also removes code that can't be reached and threads jumps that land on other jumps
+		// The compiler inlines small functions from this level up as well, see Inliner.h
+		OPT_FULL,
+		// Also lifts functions into SSA form to reuse property reads, move invariant work out of loops and propagate copies, see IR.h
+		OPT_SSA
+	};
+
+	constexpr OptimizationLevel DefaultOptimizationLevel = OPT_SSA;
+
+	// Rewrites the chunk in place, jump offsets are worked out again for the new layout
+	// If anything doesn't fit back into the bytecode the chunk is left as it was
+	void OptimizeChunk(Chunk& chunk, OptimizationLevel level);
+
+	// Cleans up the chunk and then runs the SSA passes over it, scripts only get the clean up
+	void OptimizeFunction(ObjFunction* function, FunctionType type, OptimizationLevel level);
+}
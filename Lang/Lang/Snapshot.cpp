@@ -0,0 +1,839 @@
+#include "Snapshot.h"
+#include "VM.h"
+
+#include <array>
+#include <cstring>
+#include <unordered_set>
+
+namespace script
+{
+	enum ValueTag : uint8_t
+	{
+		VALUE_TAG_NIL,
+		VALUE_TAG_FALSE,
+		VALUE_TAG_TRUE,
+		VALUE_TAG_UNDEFINED,
+		VALUE_TAG_NUMBER,
+		VALUE_TAG_OBJECT
+	};
+
+	// Functions say which globals they were linked against, modules are the index of the module plus this
+	enum GlobalsRef : uint32_t
+	{
+		GLOBALS_NONE,
+		GLOBALS_ROOT,
+		GLOBALS_MODULE
+	};
+
+	// Optional references are one more than the index so nullptr can be 0
+	constexpr uint32_t NoObject = 0;
+
+	class SnapshotWriter
+	{
+	public:
+
+		explicit SnapshotWriter(VM& vm) : m_VM(vm) {}
+
+		static std::array<ObjClass**, 6> BuiltinClasses(VM& vm)
+		{
+			return { &vm.m_NumericClass, &vm.m_StringClass, &vm.m_BoolClass, &vm.m_ListClass, &vm.m_RangeClass, &vm.m_DictionaryClass };
+		}
+
+		std::shared_ptr<const HeapSnapshot> Write()
+		{
+			m_Snapshot = std::make_shared<HeapSnapshot>();
+
+			for (ObjClass** klass : BuiltinClasses(m_VM))
+				Add(*klass);
+
+			AddTable(m_VM.m_GlobalVariables);
+
+			for (auto& [name, value] : m_VM.m_Modules)
+				AddValue(value);
+
+			// Anything reachable from what's been added so far goes on the end as we go
+			for (size_t i = 0; i < m_Objects.size(); i++)
+			{
+				if (!AddReferences(m_Objects[i]))
+					return nullptr;
+			}
+
+			for (Object* obj : m_Objects)
+			{
+				if (obj->type == OBJ_MODULE)
+					m_Tables[&((ObjModule*)obj)->globals] = GLOBALS_MODULE + m_Indices[obj];
+			}
+
+			Write<uint32_t>((uint32_t)m_Objects.size());
+
+			for (Object* obj : m_Objects)
+				WriteShell(obj);
+
+			for (Object* obj : m_Objects)
+			{
+				if (!WriteBody(obj))
+					return nullptr;
+			}
+
+			WriteTable(m_VM.m_GlobalVariables);
+
+			for (ObjClass** klass : BuiltinClasses(m_VM))
+				WriteRef(*klass);
+
+			Write<uint32_t>((uint32_t)m_VM.m_ExportedVariables.size());
+
+			for (const std::string& name : m_VM.m_ExportedVariables)
+				WriteString(name);
+
+			Write<uint32_t>((uint32_t)m_VM.m_Modules.size());
+
+			for (auto& [name, value] : m_VM.m_Modules)
+			{
+				WriteString(name);
+				WriteValue(value);
+			}
+
+			m_Snapshot->m_Bytes.shrink_to_fit();
+			m_Snapshot->m_ObjectCount = (uint32_t)m_Objects.size();
+
+			return m_Snapshot;
+		}
+
+	private:
+
+		void Add(Object* obj)
+		{
+			if (!obj || m_Indices.find(obj) != m_Indices.end())
+				return;
+
+			m_Indices[obj] = (uint32_t)m_Objects.size();
+			m_Objects.push_back(obj);
+		}
+
+		void AddValue(Value value)
+		{
+			if (value.IsObject())
+				Add(value.ToObject());
+		}
+
+		void AddTable(GlobalTable& table)
+		{
+			for (uint32_t i = 0; i < table.count; i++)
+				AddValue(table.values[i]);
+		}
+
+		// False for anything that can't go in a snapshot
+		bool AddReferences(Object* obj)
+		{
+			switch (obj->type)
+			{
+			case OBJ_STRING:
+			case OBJ_NATIVE:
+			case OBJ_RANGE:
+				return true;
+			case OBJ_FUNCTION:
+			{
+				ObjFunction* function = (ObjFunction*)obj;
+
+				// The snapshot has its own copy of the code, anything still in an image gets loaded now
+				if (!LoadFunction(function))
+					return false;
+
+				Add(function->name);
+
+				for (Value& constant : function->chunk.constants)
+					AddValue(constant);
+
+				return true;
+			}
+			case OBJ_ARRAY:
+			{
+				ObjArray* arr = (ObjArray*)obj;
+
+				for (size_t i = 0; i < arr->size; i++)
+					AddValue(arr->values[i]);
+
+				return true;
+			}
+			case OBJ_CLASS:
+			{
+				ObjClass* klass = (ObjClass*)obj;
+				Add(klass->name);
+
+				for (auto& [name, method] : klass->methods)
+					AddValue(method);
+
+				return true;
+			}
+			case OBJ_INSTANCE:
+			{
+				ObjInstance* instance = (ObjInstance*)obj;
+				Add(instance->klass);
+
+				for (auto& [name, slot] : instance->shape->slots)
+				{
+					Add(name);
+					AddValue(instance->fields[slot]);
+				}
+
+				return true;
+			}
+			case OBJ_BOUND_METHOD:
+			{
+				ObjBoundMethod* method = (ObjBoundMethod*)obj;
+
+				if (method->isNative)
+					Add(method->native);
+				else
+					Add(method->function);
+
+				AddValue(method->reciever);
+				return true;
+			}
+			case OBJ_DICTIONARY:
+			{
+				ObjDictionary* dict = (ObjDictionary*)obj;
+
+				for (auto& [key, value] : dict->map)
+				{
+					AddValue(value);
+
+#ifdef NAN_BOXING
+					// Keys are the bits of the value, string keys are pointers that have to be swapped for the new ones
+					// Nothing keeps a key alive though, one that's been collected can't be looked up anymore and gets left out
+					if (IS_OBJ(key) && IsLive(AS_OBJ(key)))
+						Add(AS_OBJ(key));
+#endif
+				}
+
+				return true;
+			}
+			case OBJ_MODULE:
+			{
+				ObjModule* mdl = (ObjModule*)obj;
+				Add(mdl->name);
+				Add(mdl->caller);
+				AddTable(mdl->globals);
+				return true;
+			}
+			default:
+				// Fibers are running code and user data belongs to the host
+				return false;
+			}
+		}
+
+		bool IsLive(Object* obj)
+		{
+			if (m_Live.empty())
+				m_Live.insert(m_VM.m_Heap.m_Allocations.begin(), m_VM.m_Heap.m_Allocations.end());
+
+			return m_Live.find(obj) != m_Live.end();
+		}
+
+		template<typename T>
+		void Write(T value)
+		{
+			m_Snapshot->m_Bytes.append((const char*)&value, sizeof(T));
+		}
+
+		void WriteString(const std::string& str)
+		{
+			Write<uint32_t>((uint32_t)str.size());
+			m_Snapshot->m_Bytes.append(str);
+		}
+
+		void WriteRef(Object* obj)
+		{
+			Write<uint32_t>(m_Indices[obj]);
+		}
+
+		void WriteOptionalRef(Object* obj)
+		{
+			Write<uint32_t>(obj ? m_Indices[obj] + 1 : NoObject);
+		}
+
+		void WriteValue(Value value)
+		{
+			if (value.IsObject())
+			{
+				Write<uint8_t>(VALUE_TAG_OBJECT);
+				WriteRef(value.ToObject());
+			}
+			else if (value.IsNumber())
+			{
+				Write<uint8_t>(VALUE_TAG_NUMBER);
+				Write<double>(value.ToNumber());
+			}
+			else if (value.IsBool())
+			{
+				Write<uint8_t>(value.AsBool() ? VALUE_TAG_TRUE : VALUE_TAG_FALSE);
+			}
+			else if (value.IsUndefined())
+			{
+				Write<uint8_t>(VALUE_TAG_UNDEFINED);
+			}
+			else
+			{
+				Write<uint8_t>(VALUE_TAG_NIL);
+			}
+		}
+
+		// Slots are given out in order so the same names in the same order get the same slots back
+		void WriteTable(GlobalTable& table)
+		{
+			Write<uint8_t>(table.parent != nullptr);
+			Write<uint32_t>(table.count);
+
+			for (uint32_t i = 0; i < table.count; i++)
+			{
+				WriteString(table.names[i]);
+				WriteValue(table.values[i]);
+			}
+		}
+
+		void WriteShell(Object* obj)
+		{
+			Write<uint8_t>((uint8_t)obj->type);
+
+			switch (obj->type)
+			{
+			case OBJ_STRING:
+			{
+				// Length includes the null terminator
+				ObjString* str = (ObjString*)obj;
+				Write<uint32_t>((uint32_t)(str->length - 1));
+				m_Snapshot->m_Bytes.append(str->str, str->length - 1);
+				break;
+			}
+			case OBJ_NATIVE:
+			{
+				ObjNative* native = (ObjNative*)obj;
+
+				HeapSnapshot::Native entry;
+				entry.function = native->function;
+				entry.arity = native->arity;
+				entry.context = native->context;
+
+				if (native->context == &m_VM)
+				{
+					entry.contextType = HeapSnapshot::CONTEXT_VM;
+				}
+				else if (native->context == &native->adapted)
+				{
+					entry.contextType = HeapSnapshot::CONTEXT_ADAPTED;
+					entry.adapted = native->adapted;
+				}
+
+				Write<uint32_t>((uint32_t)m_Snapshot->m_Natives.size());
+				m_Snapshot->m_Natives.push_back(std::move(entry));
+				break;
+			}
+			case OBJ_INSTANCE:
+				Write<uint32_t>(((ObjInstance*)obj)->shape->fieldCount);
+				break;
+			default:
+				break;
+			}
+		}
+
+		bool WriteBody(Object* obj)
+		{
+			switch (obj->type)
+			{
+			case OBJ_FUNCTION:
+			{
+				ObjFunction* function = (ObjFunction*)obj;
+				Chunk& chunk = function->chunk;
+
+				uint32_t globals = GLOBALS_NONE;
+
+				if (function->globals)
+				{
+					auto it = m_Tables.find(function->globals);
+
+					// Linked against a module nothing can reach anymore
+					if (it == m_Tables.end())
+						return false;
+
+					globals = it->second;
+				}
+
+				WriteOptionalRef(function->name);
+				Write<int32_t>(function->arity);
+				Write<uint32_t>(globals);
+
+				// Already linked and quickened, the slots are the same in the new tables
+				// Code still in a mapped image has its slots on the side, they get put in the copy
+				std::vector<uint8_t> code(chunk.code.data(), chunk.code.data() + chunk.code.size());
+
+				if (!function->globalSlots.empty())
+				{
+					for (size_t offset = 0; offset < code.size(); offset += GetInstructionLength(code[offset]))
+					{
+						switch (code[offset])
+						{
+						case OP_DEFINE_GLOBAL:
+						case OP_EXPORT_GLOBAL:
+						case OP_GET_GLOBAL:
+						case OP_SET_GLOBAL:
+						{
+							uint16_t slot = function->GlobalSlot((uint16_t)((code[offset + 1] << 8) | code[offset + 2]));
+							code[offset + 1] = (uint8_t)(slot >> 8);
+							code[offset + 2] = (uint8_t)(slot & 0xFF);
+							break;
+						}
+						default:
+							break;
+						}
+					}
+				}
+
+				Write<uint32_t>((uint32_t)code.size());
+				m_Snapshot->m_Bytes.append((const char*)code.data(), code.size());
+
+				// The caches point at this VM's shapes so every VM fills its own in again
+				Write<uint32_t>((uint32_t)chunk.propertyCaches.size());
+
+				Write<uint32_t>((uint32_t)chunk.constants.size());
+
+				for (Value& constant : chunk.constants)
+					WriteValue(constant);
+
+				break;
+			}
+			case OBJ_ARRAY:
+			{
+				ObjArray* arr = (ObjArray*)obj;
+				Write<uint32_t>((uint32_t)arr->size);
+
+				for (size_t i = 0; i < arr->size; i++)
+					WriteValue(arr->values[i]);
+
+				break;
+			}
+			case OBJ_CLASS:
+			{
+				ObjClass* klass = (ObjClass*)obj;
+				WriteRef(klass->name);
+				Write<uint32_t>(klass->expectedFieldCount);
+				Write<uint32_t>((uint32_t)klass->methods.size());
+
+				for (auto& [name, method] : klass->methods)
+				{
+					WriteString(name);
+					WriteValue(method);
+				}
+
+				break;
+			}
+			case OBJ_INSTANCE:
+			{
+				// Fields go in slot order, adding them again in that order gives the same shape
+				ObjInstance* instance = (ObjInstance*)obj;
+				std::vector<ObjString*> names(instance->shape->fieldCount);
+
+				for (auto& [name, slot] : instance->shape->slots)
+					names[slot] = name;
+
+				WriteRef(instance->klass);
+
+				for (uint32_t slot = 0; slot < names.size(); slot++)
+				{
+					WriteRef(names[slot]);
+					WriteValue(instance->fields[slot]);
+				}
+
+				break;
+			}
+			case OBJ_BOUND_METHOD:
+			{
+				ObjBoundMethod* method = (ObjBoundMethod*)obj;
+				Write<uint8_t>(method->isNative);
+				WriteRef(method->isNative ? (Object*)method->native : (Object*)method->function);
+				WriteValue(method->reciever);
+				break;
+			}
+			case OBJ_DICTIONARY:
+			{
+				ObjDictionary* dict = (ObjDictionary*)obj;
+				std::vector<std::pair<uint64_t, Value>> entries;
+
+				for (auto& [key, value] : dict->map)
+				{
+#ifdef NAN_BOXING
+					if (IS_OBJ(key) && m_Indices.find(AS_OBJ(key)) == m_Indices.end())
+						continue;
+#endif
+					entries.push_back({ key, value });
+				}
+
+				Write<uint32_t>((uint32_t)entries.size());
+
+				for (auto& [key, value] : entries)
+				{
+#ifdef NAN_BOXING
+					Write<uint8_t>(IS_OBJ(key));
+
+					if (IS_OBJ(key))
+						WriteRef(AS_OBJ(key));
+					else
+						Write<uint64_t>(key);
+#else
+					// Keys are hashes of the contents so they stay the same
+					Write<uint64_t>(key);
+#endif
+					WriteValue(value);
+				}
+
+				break;
+			}
+			case OBJ_MODULE:
+			{
+				ObjModule* mdl = (ObjModule*)obj;
+				WriteRef(mdl->name);
+				WriteOptionalRef(mdl->caller);
+				WriteTable(mdl->globals);
+				break;
+			}
+			case OBJ_RANGE:
+			{
+				ObjRange* range = (ObjRange*)obj;
+				Write<double>(range->from);
+				Write<double>(range->to);
+				Write<double>(range->step);
+				break;
+			}
+			default:
+				break;
+			}
+
+			return true;
+		}
+
+		VM& m_VM;
+		std::shared_ptr<HeapSnapshot> m_Snapshot;
+
+		std::vector<Object*> m_Objects;
+		ankerl::unordered_dense::map<Object*, uint32_t> m_Indices;
+		ankerl::unordered_dense::map<GlobalTable*, uint32_t> m_Tables{ { &m_VM.m_GlobalVariables, GLOBALS_ROOT } };
+		std::unordered_set<Object*> m_Live;
+	};
+
+	class SnapshotReader
+	{
+	public:
+
+		SnapshotReader(VM& vm, const HeapSnapshot& snapshot)
+			: m_VM(vm), m_Snapshot(snapshot), m_Data((const uint8_t*)snapshot.m_Bytes.data())
+		{
+		}
+
+		void Read()
+		{
+			// Every object is made before any of them get filled in, they can refer to each other in any order
+			m_Objects.resize(Read<uint32_t>());
+
+			for (Object*& obj : m_Objects)
+				obj = ReadShell();
+
+			for (Object* obj : m_Objects)
+				ReadBody(obj);
+
+			ReadTable(m_VM.m_GlobalVariables);
+
+			for (ObjClass** klass : SnapshotWriter::BuiltinClasses(m_VM))
+				*klass = (ObjClass*)ReadRef();
+
+			uint32_t exportedCount = Read<uint32_t>();
+			m_VM.m_ExportedVariables.reserve(exportedCount);
+
+			for (uint32_t i = 0; i < exportedCount; i++)
+				m_VM.m_ExportedVariables.push_back(ReadString());
+
+			uint32_t moduleCount = Read<uint32_t>();
+
+			for (uint32_t i = 0; i < moduleCount; i++)
+			{
+				std::string name = ReadString();
+				m_VM.m_Modules[name] = ReadValue();
+			}
+		}
+
+	private:
+
+		template<typename T>
+		T Read()
+		{
+			T value;
+			memcpy(&value, m_Data, sizeof(T));
+			m_Data += sizeof(T);
+			return value;
+		}
+
+		std::string ReadString()
+		{
+			uint32_t length = Read<uint32_t>();
+			std::string str((const char*)m_Data, length);
+			m_Data += length;
+			return str;
+		}
+
+		Object* ReadRef()
+		{
+			return m_Objects[Read<uint32_t>()];
+		}
+
+		Object* ReadOptionalRef()
+		{
+			uint32_t ref = Read<uint32_t>();
+			return ref == NoObject ? nullptr : m_Objects[ref - 1];
+		}
+
+		Value ReadValue()
+		{
+			switch (Read<uint8_t>())
+			{
+			case VALUE_TAG_FALSE:		return Value(false);
+			case VALUE_TAG_TRUE:		return Value(true);
+			case VALUE_TAG_UNDEFINED:	return Value::Undefined();
+			case VALUE_TAG_NUMBER:		return Value(Read<double>());
+			case VALUE_TAG_OBJECT:		return Value(ReadRef());
+			default:					return Value();
+			}
+		}
+
+		void ReadTable(GlobalTable& table)
+		{
+			if (Read<uint8_t>())
+				table.parent = &m_VM.m_GlobalVariables;
+
+			uint32_t count = Read<uint32_t>();
+			table.slots.reserve(count);
+			table.names.reserve(count);
+
+			for (uint32_t i = 0; i < count; i++)
+			{
+				uint16_t slot = table.Resolve(ReadString());
+				table.values[slot] = ReadValue();
+			}
+		}
+
+		template<typename T>
+		T* New(ObjectType type, size_t extraBytes = 0)
+		{
+			T* obj = m_VM.m_Heap.AllocateObject<T>(extraBytes);
+			obj->type = type;
+			return obj;
+		}
+
+		Object* ReadShell()
+		{
+			ObjectType type = (ObjectType)Read<uint8_t>();
+
+			switch (type)
+			{
+			case OBJ_STRING:
+			{
+				uint32_t length = Read<uint32_t>();
+				ObjString* str = m_VM.m_Heap.AllocateString(std::string((const char*)m_Data, length));
+				m_Data += length;
+				return str;
+			}
+			case OBJ_NATIVE:
+			{
+				const HeapSnapshot::Native& entry = m_Snapshot.m_Natives[Read<uint32_t>()];
+				ObjNative* native = NewNativeFunction(entry.function, entry.arity, entry.context);
+
+				if (entry.contextType == HeapSnapshot::CONTEXT_VM)
+				{
+					native->context = &m_VM;
+				}
+				else if (entry.contextType == HeapSnapshot::CONTEXT_ADAPTED)
+				{
+					native->adapted = entry.adapted;
+					native->context = &native->adapted;
+				}
+
+				return native;
+			}
+			case OBJ_FUNCTION:
+				return New<ObjFunction>(type);
+			case OBJ_ARRAY:
+				return New<ObjArray>(type);
+			case OBJ_CLASS:
+			{
+				ObjClass* klass = New<ObjClass>(type);
+				klass->rootShape = new Shape();
+				klass->rootShape->klass = klass;
+				return klass;
+			}
+			case OBJ_INSTANCE:
+			{
+				// Same as NewInstance, the fields go inline
+				uint32_t fieldCount = Read<uint32_t>();
+
+				ObjInstance* instance = New<ObjInstance>(type, sizeof(Value) * fieldCount);
+				instance->fields = instance->InlineFields();
+				instance->fieldCapacity = fieldCount;
+				return instance;
+			}
+			case OBJ_BOUND_METHOD:
+				return New<ObjBoundMethod>(type);
+			case OBJ_DICTIONARY:
+				return New<ObjDictionary>(type);
+			case OBJ_MODULE:
+				return New<ObjModule>(type);
+			default:
+				return New<ObjRange>(type);
+			}
+		}
+
+		void ReadBody(Object* obj)
+		{
+			switch (obj->type)
+			{
+			case OBJ_FUNCTION:
+			{
+				ObjFunction* function = (ObjFunction*)obj;
+				Chunk& chunk = function->chunk;
+
+				function->name = (ObjString*)ReadOptionalRef();
+				function->arity = Read<int32_t>();
+
+				uint32_t globals = Read<uint32_t>();
+
+				if (globals == GLOBALS_ROOT)
+					function->globals = &m_VM.m_GlobalVariables;
+				else if (globals >= GLOBALS_MODULE)
+					function->globals = &((ObjModule*)m_Objects[globals - GLOBALS_MODULE])->globals;
+
+				uint32_t codeLength = Read<uint32_t>();
+				chunk.code = std::vector<uint8_t>(m_Data, m_Data + codeLength);
+				m_Data += codeLength;
+				function->maxStack = (uint32_t)FindMaxStack(chunk.code, function->arity + 1);
+
+				chunk.propertyCaches.resize(Read<uint32_t>());
+
+				uint32_t constantCount = Read<uint32_t>();
+				chunk.constants.reserve(constantCount);
+
+				for (uint32_t i = 0; i < constantCount; i++)
+					chunk.constants.push_back(ReadValue());
+
+				break;
+			}
+			case OBJ_ARRAY:
+			{
+				ObjArray* arr = (ObjArray*)obj;
+				arr->size = Read<uint32_t>();
+
+				if (arr->size > 0)
+					arr->values = (Value*)Allocate(nullptr, 0, sizeof(Value) * arr->size);
+
+				for (size_t i = 0; i < arr->size; i++)
+					arr->values[i] = ReadValue();
+
+				break;
+			}
+			case OBJ_CLASS:
+			{
+				ObjClass* klass = (ObjClass*)obj;
+				klass->name = (ObjString*)ReadRef();
+
+				// Instances read before this could have raised it already
+				klass->expectedFieldCount = std::max(klass->expectedFieldCount, Read<uint32_t>());
+
+				uint32_t methodCount = Read<uint32_t>();
+				klass->methods.reserve(methodCount);
+
+				for (uint32_t i = 0; i < methodCount; i++)
+				{
+					std::string name = ReadString();
+					klass->methods[name] = ReadValue();
+				}
+
+				break;
+			}
+			case OBJ_INSTANCE:
+			{
+				ObjInstance* instance = (ObjInstance*)obj;
+				instance->klass = (ObjClass*)ReadRef();
+				instance->shape = instance->klass->rootShape;
+
+				for (uint32_t slot = 0; slot < instance->fieldCapacity; slot++)
+				{
+					instance->shape = instance->shape->AddField((ObjString*)ReadRef());
+					instance->fields[slot] = ReadValue();
+				}
+
+				break;
+			}
+			case OBJ_BOUND_METHOD:
+			{
+				ObjBoundMethod* method = (ObjBoundMethod*)obj;
+				method->isNative = Read<uint8_t>() != 0;
+
+				if (method->isNative)
+					method->native = (ObjNative*)ReadRef();
+				else
+					method->function = (ObjFunction*)ReadRef();
+
+				method->reciever = ReadValue();
+				break;
+			}
+			case OBJ_DICTIONARY:
+			{
+				ObjDictionary* dict = (ObjDictionary*)obj;
+				uint32_t count = Read<uint32_t>();
+				dict->map.reserve(count);
+
+				for (uint32_t i = 0; i < count; i++)
+				{
+#ifdef NAN_BOXING
+					uint64_t key = Read<uint8_t>() ? OBJ_VAL(ReadRef()) : Read<uint64_t>();
+#else
+					uint64_t key = Read<uint64_t>();
+#endif
+					dict->map[key] = ReadValue();
+				}
+
+				break;
+			}
+			case OBJ_MODULE:
+			{
+				ObjModule* mdl = (ObjModule*)obj;
+				mdl->name = (ObjString*)ReadRef();
+				mdl->caller = (ObjModule*)ReadOptionalRef();
+				ReadTable(mdl->globals);
+				break;
+			}
+			case OBJ_RANGE:
+			{
+				ObjRange* range = (ObjRange*)obj;
+				range->from = Read<double>();
+				range->to = Read<double>();
+				range->step = Read<double>();
+				break;
+			}
+			default:
+				break;
+			}
+		}
+
+		VM& m_VM;
+		const HeapSnapshot& m_Snapshot;
+		const uint8_t* m_Data;
+
+		std::vector<Object*> m_Objects;
+	};
+
+	std::shared_ptr<const HeapSnapshot> WriteHeapSnapshot(VM& vm)
+	{
+		return SnapshotWriter(vm).Write();
+	}
+
+	void ReadHeapSnapshot(VM& vm, const HeapSnapshot& snapshot)
+	{
+		SnapshotReader(vm, snapshot).Read();
+	}
+}
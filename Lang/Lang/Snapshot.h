@@ -0,0 +1,73 @@
+#pragma once
+#include "Object.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// A VM's heap written out once its startup scripts have run, so more VMs can start from it without running them again
+// It holds everything reachable from the globals and modules: the builtin classes, classes, instances, strings and
+// functions with their code already linked. A VM made from one is in the same state the VM that took it was in,
+// with a heap of its own, and only has to allocate and fill in the objects.
+//
+//     VM prelude;
+//     prelude.Interpret(LoadOrCompileScript(io, "prelude.langc", source));
+//
+//     VMCreateInfo info{};
+//     info.snapshot = prelude.TakeSnapshot();
+//     VM vm(info);
+//
+// Natives are function pointers and can hold pointers to anything, so a snapshot only works in the process that took it.
+// Natives made with the VM as their context get the new VM instead, any other context is shared by every VM made
+// from the snapshot.
+//
+// Everything is native endian, objects refer to each other by their index in the object table
+//   shells     object count u32, then the type u8 of every object followed by what it needs to be allocated:
+//              the length u32 and bytes of a string, the index u32 of a native and the field count u32 of an instance
+//   bodies     the rest of every object in the same order
+//   globals    the root globals, the builtin classes, the exported names and the modules
+
+namespace script
+{
+	class VM;
+
+	class HeapSnapshot
+	{
+	public:
+
+		size_t Size() const { return m_Bytes.size(); }
+		uint32_t ObjectCount() const { return m_ObjectCount; }
+
+	private:
+
+		friend class SnapshotWriter;
+		friend class SnapshotReader;
+
+		enum NativeContext : uint8_t
+		{
+			CONTEXT_RAW,
+			CONTEXT_VM,
+			CONTEXT_ADAPTED
+		};
+
+		struct Native
+		{
+			NativeFn function = nullptr;
+			int arity = 0;
+			NativeContext contextType = CONTEXT_RAW;
+			void* context = nullptr;
+			NativeFunc adapted;
+		};
+
+		std::string m_Bytes;
+		std::vector<Native> m_Natives;
+		uint32_t m_ObjectCount = 0;
+	};
+
+	// Use VM::TakeSnapshot and VMCreateInfo::snapshot rather than these
+	// nullptr if there's anything in the heap a snapshot can't hold
+	std::shared_ptr<const HeapSnapshot> WriteHeapSnapshot(VM& vm);
+
+	// Fills in a VM that hasn't loaded anything yet
+	void ReadHeapSnapshot(VM& vm, const HeapSnapshot& snapshot);
+}
@@ -7,9 +7,15 @@ namespace script
 
 	constexpr uint32_t UINT8_COUNT = UINT8_MAX + 1;
 
-	constexpr uint32_t MaxCallFrames = 64;
+	// Stops runaway recursion, the frames and the stack grow as they are needed up to this
+	constexpr uint32_t MaxCallFrames = 1 << 20;
 
-	constexpr size_t StackMax = (MaxCallFrames * UINT8_COUNT);
+	// Slots every frame gets without having to check, a function can't have more locals than this
+	constexpr size_t FrameStackSize = UINT8_COUNT;
+
+	// Fibers start out with room for a single frame
+	constexpr size_t StackInitialCapacity = FrameStackSize;
+	constexpr size_t FramesInitialCapacity = 4;
 
 
 	class Stack
@@ -18,13 +24,23 @@ namespace script
 
 		Stack()
 		{
-			m_Stack = new Value[StackMax];
+			m_Stack = new Value[StackInitialCapacity];
 			m_Top = m_Stack;
+			m_End = m_Stack + StackInitialCapacity;
 		}
 
 		~Stack()
+		{
+			Release();
+		}
+
+		void Release()
 		{
 			delete[] m_Stack;
+
+			m_Stack = nullptr;
+			m_Top = nullptr;
+			m_End = nullptr;
 		}
 
 		void Push(Value value)
@@ -62,11 +78,40 @@ namespace script
 			return m_Stack[idx];
 		}
 
+		// True if count more values fit above the top
+		bool HasRoom(size_t count) const
+		{
+			return count <= (size_t)(m_End - m_Top);
+		}
+
+		// Moves the values into a bigger block with room for count more above the top
+		// Returns the old block, anything that pointed into it has to be moved over before it gets freed
+		Value* Grow(size_t count)
+		{
+			size_t used = (size_t)(m_Top - m_Stack);
+
+			size_t capacity = (size_t)(m_End - m_Stack) * 2;
+			while (capacity < used + count)
+				capacity *= 2;
+
+			Value* old = m_Stack;
+
+			m_Stack = new Value[capacity];
+			m_End = m_Stack + capacity;
+
+			for (size_t i = 0; i < used; i++)
+				m_Stack[i] = old[i];
+
+			m_Top = m_Stack + used;
+
+			return old;
+		}
+
 		Value* m_Stack;
 		Value* m_Top;
 
-
-		size_t m_StackCapacity = 0;
+		// One past the last slot
+		Value* m_End;
 
 	};
-}
\ No newline at end of file
+}
@@ -0,0 +1,1290 @@
+#include "Trace.h"
+#include "VM.h"
+#include "EventSystem.h"
+#include "Assembler.h"
+
+#include <cmath>
+
+namespace script
+{
+	namespace
+	{
+		uint16_t ReadShort(uint8_t* ip)
+		{
+			return (uint16_t)((ip[1] << 8) | ip[2]);
+		}
+	}
+
+	TraceLoop* FindTraceLoop(ObjFunction* function, uint8_t* ip)
+	{
+		CodeBuffer& code = function->chunk.code;
+
+		if (function->loops.empty())
+		{
+			for (size_t offset = 0; offset < code.size(); offset += GetInstructionLength(code[offset]))
+			{
+				if (code[offset] != OP_LOOP)
+					continue;
+
+				TraceLoop loop;
+				loop.header = (uint32_t)(offset + 3 - ReadShort(&code[offset]));
+				function->loops.push_back(loop);
+			}
+		}
+
+		uint32_t header = (uint32_t)(ip - code.data());
+
+		for (TraceLoop& loop : function->loops)
+		{
+			if (loop.header == header)
+				return &loop;
+		}
+
+		return nullptr;
+	}
+
+#if LANG_JIT
+
+	namespace
+	{
+		// xmm0 and xmm1 are left as scratch for the code generator and calls
+		constexpr uint8_t FirstTraceRegister = 2;
+		constexpr uint8_t TraceRegisterCount = 16;
+
+		constexpr uint64_t ObjectMask = QNAN | SIGN_BIT;
+
+		bool TypeOf(Value value, TraceType* type)
+		{
+			if (value.IsNumber())
+				*type = TRACE_NUMBER;
+			else if (value.IsBool())
+				*type = TRACE_BOOL;
+			else if (value.IsObjType(OBJ_ARRAY))
+				*type = TRACE_ARRAY;
+			else if (value.IsObjType(OBJ_RANGE))
+				*type = TRACE_RANGE;
+			else
+				return false;
+
+			return true;
+		}
+
+		double Remainder(double a, double b) { return std::remainder(a, b); }
+		double Power(double a, double b) { return std::pow(a, b); }
+
+		using namespace x64;
+
+		// Turns the IR into machine code
+		// rbp holds QNAN, r13 the frame's slots and xmm2 to xmm15 hold the trace's values
+		class TraceCompiler
+		{
+		public:
+
+			TraceCompiler(Trace* trace, const size_t* pendingEvents, int32_t* pollCountdown)
+				: m_Trace(trace), m_PendingEvents(pendingEvents), m_PollCountdown(pollCountdown) {}
+
+			bool Compile()
+			{
+				for (size_t i = 0; i < m_Trace->exits.size(); i++)
+					m_Exits.push_back(m_Asm.NewLabel());
+
+				m_Epilogue = m_Asm.NewLabel();
+
+				EmitPrologue();
+				EmitEntry();
+
+				int loop = m_Asm.NewLabel();
+				m_Asm.Bind(loop);
+
+				for (const TraceIns& ins : m_Trace->ir)
+					EmitInstruction(ins, loop);
+
+				for (size_t i = 0; i < m_Trace->exits.size(); i++)
+					EmitExit(i);
+
+				EmitEpilogue();
+
+				if (!m_Asm.Link())
+					return false;
+
+				m_Trace->code = MapExecutable(m_Asm.code, &m_Trace->size);
+				return m_Trace->code != nullptr;
+			}
+
+		private:
+
+			// Room to spill the registers around calls, also keeps the stack aligned
+			static constexpr int32_t SpillSize = 136;
+
+			void EmitPrologue()
+			{
+				m_Asm.Push(RBP);
+				m_Asm.Push(R13);
+				m_Asm.AddImm(RSP, -SpillSize);
+
+				m_Asm.Load(R13, RDI, MemberOffset(&CallFrame::slots));
+				m_Asm.MovImm(RBP, QNAN);
+			}
+
+			void EmitEpilogue()
+			{
+				// eax has the index of the exit
+				m_Asm.Bind(m_Epilogue);
+				m_Asm.AddImm(RSP, SpillSize);
+				m_Asm.Pop(R13);
+				m_Asm.Pop(RBP);
+				m_Asm.Ret();
+			}
+
+			// Loads every variable into its register, the ones the trace reads first get their type checked
+			void EmitEntry()
+			{
+				for (const TraceVar& var : m_Trace->vars)
+				{
+					Register base = VarBase(var, RCX);
+					m_Asm.Load(RAX, base, var.index * 8);
+
+					if (var.readFirst)
+						GuardType(RAX, var.entryType, m_Exits[0]);
+
+					m_Asm.MovqToXmm(var.reg, RAX);
+				}
+			}
+
+			// Puts the stack back and writes the variables out before going back to the interpreter
+			void EmitExit(size_t index)
+			{
+				const TraceExit& exit = m_Trace->exits[index];
+
+				m_Asm.Bind(m_Exits[index]);
+
+				for (size_t i = 0; i < exit.stack.size(); i++)
+				{
+					const TraceValue& value = exit.stack[i];
+
+					if (value.constant)
+						m_Asm.MovImm(RAX, value.bits);
+					else
+						m_Asm.MovqFromXmm(RAX, value.reg);
+
+					m_Asm.Store(R13, (int32_t)(m_Trace->stackDepth + i) * 8, RAX);
+				}
+
+				if (exit.writeBack)
+				{
+					for (const TraceVar& var : m_Trace->vars)
+					{
+						if (!var.written)
+							continue;
+
+						m_Asm.MovqFromXmm(RAX, var.reg);
+						Register base = VarBase(var, RCX);
+						m_Asm.Store(base, var.index * 8, RAX);
+					}
+				}
+
+				m_Asm.MovImm(RAX, index);
+				m_Asm.Jmp(m_Epilogue);
+			}
+
+			// Locals are off the slots, globals need the table's current array
+			Register VarBase(const TraceVar& var, Register scratch)
+			{
+				if (!var.globals)
+					return R13;
+
+				m_Asm.MovImm(scratch, (uint64_t)&var.globals->values);
+				m_Asm.Load(scratch, scratch, 0);
+				return scratch;
+			}
+
+			// Jumps to the label unless the value in reg has the type, clobbers rcx and rdx
+			void GuardType(Register reg, TraceType type, int label)
+			{
+				switch (type)
+				{
+				case TRACE_NUMBER:
+					m_Asm.Mov(RDX, reg);
+					m_Asm.And(RDX, RBP);
+					m_Asm.Cmp(RDX, RBP);
+					m_Asm.Jcc(CC_E, label);
+					break;
+
+				case TRACE_BOOL:
+					m_Asm.Mov(RDX, reg);
+					m_Asm.OrImm8(RDX, 1);
+					m_Asm.MovImm(RCX, TRUE_VAL);
+					m_Asm.Cmp(RDX, RCX);
+					m_Asm.Jcc(CC_NE, label);
+					break;
+
+				case TRACE_ARRAY:
+				case TRACE_RANGE:
+					m_Asm.MovImm(RCX, ObjectMask);
+					m_Asm.Mov(RDX, reg);
+					m_Asm.And(RDX, RCX);
+					m_Asm.Cmp(RDX, RCX);
+					m_Asm.Jcc(CC_NE, label);
+
+					m_Asm.MovImm(RCX, ~ObjectMask);
+					m_Asm.Mov(RDX, reg);
+					m_Asm.And(RDX, RCX);
+					m_Asm.CmpMem32Imm8(RDX, MemberOffset(&Object::type), type == TRACE_ARRAY ? OBJ_ARRAY : OBJ_RANGE);
+					m_Asm.Jcc(CC_NE, label);
+					break;
+				}
+			}
+
+			// rax = the array's values and rcx = the index, leaves through the exit if it is out of bounds
+			void ArrayElement(const TraceIns& ins)
+			{
+				m_Asm.MovqFromXmm(RAX, ins.a);
+				m_Asm.MovImm(RCX, ~ObjectMask);
+				m_Asm.And(RAX, RCX);
+
+				// Negative indices wrap around and fail the unsigned compare too
+				m_Asm.Cvttsd2si(RCX, ins.b);
+				m_Asm.CmpMem(RCX, RAX, MemberOffset(&ObjArray::size));
+				m_Asm.Jcc(CC_AE, m_Exits[ins.exit]);
+
+				m_Asm.Load(RAX, RAX, MemberOffset(&ObjArray::values));
+			}
+
+			// al = 0 or 1 into a boxed bool
+			void BoolFromAl(uint8_t dst)
+			{
+				m_Asm.Movzx8(RAX, RAX);
+				m_Asm.MovImm(RCX, FALSE_VAL);
+				m_Asm.Add(RAX, RCX);
+				m_Asm.MovqToXmm(dst, RAX);
+			}
+
+			void Arithmetic(uint8_t op, const TraceIns& ins)
+			{
+				if (ins.dst == ins.a)
+				{
+					m_Asm.Sse(op, ins.dst, ins.b);
+				}
+				else if (ins.dst == ins.b)
+				{
+					m_Asm.Movaps(0, ins.a);
+					m_Asm.Sse(op, 0, ins.b);
+					m_Asm.Movaps(ins.dst, 0);
+				}
+				else
+				{
+					m_Asm.Movaps(ins.dst, ins.a);
+					m_Asm.Sse(op, ins.dst, ins.b);
+				}
+			}
+
+			void EmitInstruction(const TraceIns& ins, int loop)
+			{
+				int exit = m_Exits[ins.exit];
+
+				switch (ins.op)
+				{
+				case TRACE_CONSTANT:
+					m_Asm.MovImm(RAX, ins.imm);
+					m_Asm.MovqToXmm(ins.dst, RAX);
+					break;
+
+				case TRACE_MOVE:
+					if (ins.dst != ins.a)
+						m_Asm.Movaps(ins.dst, ins.a);
+					break;
+
+				case TRACE_ADD:      Arithmetic(0x58, ins); break;
+				case TRACE_SUBTRACT: Arithmetic(0x5C, ins); break;
+				case TRACE_MULTIPLY: Arithmetic(0x59, ins); break;
+				case TRACE_DIVIDE:   Arithmetic(0x5E, ins); break;
+
+				case TRACE_NEGATE:
+					m_Asm.MovqFromXmm(RAX, ins.a);
+					m_Asm.BtcImm(RAX, 63);
+					m_Asm.MovqToXmm(ins.dst, RAX);
+					break;
+
+				case TRACE_NOT:
+					m_Asm.MovqFromXmm(RAX, ins.a);
+					m_Asm.XorImm8(RAX, 1);
+					m_Asm.MovqToXmm(ins.dst, RAX);
+					break;
+
+				case TRACE_CALL:
+				{
+					// Every xmm register is caller saved
+					for (uint8_t reg = FirstTraceRegister; reg < TraceRegisterCount; reg++)
+						m_Asm.StoreXmm(RSP, reg * 8, reg);
+
+					m_Asm.Movaps(0, ins.a);
+					m_Asm.Movaps(1, ins.b);
+					m_Asm.MovImm(RAX, ins.imm);
+					m_Asm.CallReg(RAX);
+
+					for (uint8_t reg = FirstTraceRegister; reg < TraceRegisterCount; reg++)
+					{
+						if (reg != ins.dst)
+							m_Asm.LoadXmm(reg, RSP, reg * 8);
+					}
+
+					m_Asm.Movaps(ins.dst, 0);
+					break;
+				}
+
+				// ucomisd b, a sets the flags for b compared to a, unordered always comes out as false
+				case TRACE_LESS:
+					m_Asm.Ucomisd(ins.b, ins.a);
+					m_Asm.Setcc(CC_A, RAX);
+					BoolFromAl(ins.dst);
+					break;
+
+				case TRACE_LESS_EQUAL:
+					m_Asm.Ucomisd(ins.b, ins.a);
+					m_Asm.Setcc(CC_AE, RAX);
+					BoolFromAl(ins.dst);
+					break;
+
+				case TRACE_EQUAL:
+					m_Asm.MovqFromXmm(RAX, ins.a);
+					m_Asm.MovqFromXmm(RCX, ins.b);
+					m_Asm.Cmp(RAX, RCX);
+					m_Asm.Setcc(ins.flag ? CC_E : CC_NE, RAX);
+					BoolFromAl(ins.dst);
+					break;
+
+				case TRACE_RANGE_FIELD:
+					m_Asm.MovqFromXmm(RAX, ins.a);
+					m_Asm.MovImm(RCX, ~ObjectMask);
+					m_Asm.And(RAX, RCX);
+					m_Asm.LoadXmm(ins.dst, RAX, (int32_t)ins.imm);
+					break;
+
+				case TRACE_ARRAY_GET:
+					ArrayElement(ins);
+					m_Asm.LoadIndexed(RDX, RAX, RCX);
+					m_Asm.MovqToXmm(ins.dst, RDX);
+					break;
+
+				case TRACE_ARRAY_SET:
+					ArrayElement(ins);
+					m_Asm.MovqFromXmm(RDX, ins.dst);
+					m_Asm.StoreIndexed(RAX, RCX, RDX);
+					break;
+
+				case TRACE_GUARD_LESS:
+					m_Asm.Ucomisd(ins.b, ins.a);
+					m_Asm.Jcc(ins.flag ? CC_BE : CC_A, exit);
+					break;
+
+				case TRACE_GUARD_LESS_EQUAL:
+					m_Asm.Ucomisd(ins.b, ins.a);
+					m_Asm.Jcc(ins.flag ? CC_B : CC_AE, exit);
+					break;
+
+				case TRACE_GUARD_EQUAL:
+					m_Asm.MovqFromXmm(RAX, ins.a);
+					m_Asm.MovqFromXmm(RCX, ins.b);
+					m_Asm.Cmp(RAX, RCX);
+					m_Asm.Jcc(ins.flag ? CC_NE : CC_E, exit);
+					break;
+
+				case TRACE_GUARD_VALUE:
+					m_Asm.MovqFromXmm(RAX, ins.a);
+					m_Asm.MovImm(RCX, ins.imm);
+					m_Asm.Cmp(RAX, RCX);
+					m_Asm.Jcc(CC_NE, exit);
+					break;
+
+				case TRACE_GUARD_TYPE:
+					m_Asm.MovqFromXmm(RAX, ins.a);
+					GuardType(RAX, (TraceType)ins.flag, exit);
+					break;
+
+				case TRACE_LOOP:
+					// Events and polls get handled by the interpreter
+					m_Asm.MovImm(RAX, (uint64_t)m_PendingEvents);
+					m_Asm.CmpMemImm8(RAX, 0, 0);
+					m_Asm.Jcc(CC_NE, exit);
+					m_Asm.MovImm(RAX, (uint64_t)m_PollCountdown);
+					m_Asm.AddMem32Imm8(RAX, 0, -1);
+					m_Asm.Jcc(CC_LE, exit);
+					m_Asm.Jmp(loop);
+					break;
+				}
+			}
+
+			Trace* m_Trace;
+			const size_t* m_PendingEvents;
+			int32_t* m_PollCountdown;
+			Assembler m_Asm;
+
+			std::vector<int> m_Exits;
+			int m_Epilogue = -1;
+		};
+	}
+
+	Trace::~Trace()
+	{
+		if (code)
+			x64::UnmapExecutable(code, size);
+	}
+
+	void Trace::Enter(CallFrame* frame, Value** top)
+	{
+		using TraceEntry = uint32_t(*)(CallFrame*);
+
+		uint32_t index = ((TraceEntry)code)(frame);
+		const TraceExit& exit = exits[index];
+
+		frame->ip = exit.ip;
+		*top = frame->slots + stackDepth + exit.stack.size();
+
+		// Something the trace depends on keeps changing type, leave the loop to the other tiers
+		if (index == 0 && ++entryFailures == TraceMaxEntryFailures)
+		{
+			loop->trace = nullptr;
+			loop->aborts = TraceMaxAborts;
+		}
+	}
+
+	TraceRecorder::~TraceRecorder()
+	{
+		for (Trace* trace : m_Traces)
+			delete trace;
+	}
+
+	bool TraceRecorder::ShouldRecord(TraceLoop* loop)
+	{
+		if (loop->trace || loop->aborts >= TraceMaxAborts)
+			return false;
+
+		return ++loop->hotness >= TraceThreshold;
+	}
+
+	void TraceRecorder::Start(CallFrame* frame, TraceLoop* loop, Value* top)
+	{
+		m_Recording = true;
+		m_Failed = false;
+		m_Length = 0;
+
+		m_Frame = frame;
+		m_Function = frame->function;
+		m_Loop = loop;
+		m_Header = m_Function->chunk.code.data() + loop->header;
+		m_Depth = (uint32_t)(top - frame->slots);
+
+		m_Stack.clear();
+		m_Vars.clear();
+		m_IR.clear();
+		m_Exits.clear();
+
+		m_FreeRegisters = 0;
+		m_PendingFree = 0;
+		m_TempRegisters = 0;
+
+		for (uint8_t reg = FirstTraceRegister; reg < TraceRegisterCount; reg++)
+			m_FreeRegisters |= 1u << reg;
+
+		// Exit 0 is for the entry guards, nothing has been loaded yet
+		TraceExit entry;
+		entry.ip = m_Header;
+		entry.writeBack = false;
+		m_Exits.push_back(entry);
+	}
+
+	bool TraceRecorder::Record(CallFrame* frame, uint8_t* ip, Value* top)
+	{
+		if (!m_Recording)
+			return false;
+
+		// Switched fiber or the stack did something the recording didn't see
+		if (frame != m_Frame || top - frame->slots != (ptrdiff_t)(m_Depth + m_Stack.size()) || ++m_Length > TraceMaxLength)
+			return Abort();
+
+		m_FreeRegisters |= m_PendingFree;
+		m_PendingFree = 0;
+
+		m_Ip = ip;
+		m_Exit = -1;
+		m_StackBefore = m_Stack;
+
+		if (!RecordInstruction(ip, top) || m_Failed)
+			return Abort();
+
+		return m_Recording;
+	}
+
+	bool TraceRecorder::Abort()
+	{
+		m_Recording = false;
+
+		m_Loop->aborts++;
+		m_Loop->hotness = 0;
+
+		return false;
+	}
+
+	bool TraceRecorder::Finish()
+	{
+		if (!m_Stack.empty())
+			return false;
+
+		// The registers have to hold the same types they were entered with
+		for (const TraceVar& var : m_Vars)
+		{
+			if (var.readFirst && var.type != var.entryType)
+				return false;
+		}
+
+		// The safepoint leaves at the loop instruction so the interpreter jumps back and handles the events
+		EmitGuard(TRACE_LOOP, 0);
+
+		Trace* trace = new Trace;
+		trace->loop = m_Loop;
+		trace->stackDepth = m_Depth;
+		trace->ir = std::move(m_IR);
+		trace->vars = std::move(m_Vars);
+		trace->exits = std::move(m_Exits);
+
+		TraceCompiler compiler(trace, m_PendingEvents, m_PollCountdown);
+		if (!compiler.Compile())
+		{
+			delete trace;
+			return false;
+		}
+
+		m_Traces.push_back(trace);
+		m_Loop->trace = trace;
+		m_Recording = false;
+
+		return true;
+	}
+
+	bool TraceRecorder::RecordInstruction(uint8_t* ip, Value* top)
+	{
+		GlobalTable* globals = m_Function->globals;
+		Value* constants = m_Function->chunk.constants.data();
+
+		switch (*ip)
+		{
+		case OP_CONSTANT:      return PushConstant(constants[ip[1]]);
+		case OP_CONSTANT_LONG: return PushConstant(constants[ReadShort(ip)]);
+		case OP_TRUE:          return PushConstant(Value(true));
+		case OP_FALSE:         return PushConstant(Value(false));
+
+		case OP_POP:
+		case OP_POP_N:
+		{
+			size_t count = *ip == OP_POP ? 1 : ip[1];
+			if (count > m_Stack.size())
+				return false;
+
+			for (size_t i = 0; i < count; i++)
+				Release(Pop());
+
+			return true;
+		}
+
+		case OP_GET_LOCAL:   return GetLocal(ReadShort(ip));
+		case OP_GET_LOCAL_0: return GetLocal(0);
+		case OP_GET_LOCAL_1: return GetLocal(1);
+		case OP_GET_LOCAL_2: return GetLocal(2);
+		case OP_GET_LOCAL_3: return GetLocal(3);
+		case OP_SET_LOCAL:   return SetLocal(ReadShort(ip));
+
+		case OP_GET_GLOBAL:
+		{
+			uint16_t slot = m_Function->GlobalSlot(ReadShort(ip));
+			return ReadVar(globals, slot, globals->values[slot]);
+		}
+		case OP_SET_GLOBAL:
+			return !m_Stack.empty() && WriteVar(globals, m_Function->GlobalSlot(ReadShort(ip)), m_Stack.back());
+
+		case OP_DEFINE_GLOBAL:
+		{
+			if (m_Stack.empty() || !WriteVar(globals, m_Function->GlobalSlot(ReadShort(ip)), m_Stack.back()))
+				return false;
+
+			Release(Pop());
+			return true;
+		}
+
+		case OP_ADD:
+		case OP_ADD_NUM_NUM:      return Arithmetic(TRACE_ADD);
+		case OP_SUBTRACT:
+		case OP_SUBTRACT_NUM_NUM: return Arithmetic(TRACE_SUBTRACT);
+		case OP_MULTIPLY:
+		case OP_MULTIPLY_NUM_NUM: return Arithmetic(TRACE_MULTIPLY);
+		case OP_DIVIDE:
+		case OP_DIVIDE_NUM_NUM:   return Arithmetic(TRACE_DIVIDE);
+		case OP_MODULO:           return Arithmetic(TRACE_CALL, (uint64_t)&Remainder);
+		case OP_POWER:            return Arithmetic(TRACE_CALL, (uint64_t)&Power);
+
+		case OP_ADD_CONSTANT:      return PushConstant(constants[ip[1]]) && Arithmetic(TRACE_ADD);
+		case OP_SUBTRACT_CONSTANT: return PushConstant(constants[ip[1]]) && Arithmetic(TRACE_SUBTRACT);
+
+		case OP_NEGATE: return Negate();
+		case OP_NOT:    return Not();
+
+		// a > b is b < a
+		case OP_LESS:
+		case OP_LESS_NUM:      return Compare(TRACE_LESS, false);
+		case OP_GREATER:
+		case OP_GREATER_NUM:   return Compare(TRACE_LESS, true);
+		case OP_LESS_EQUAL:    return Compare(TRACE_LESS_EQUAL, false);
+		case OP_GREATER_EQUAL: return Compare(TRACE_LESS_EQUAL, true);
+		case OP_EQUAL:         return Equality(true);
+		case OP_NOT_EQUAL:     return Equality(false);
+
+		case OP_JUMP_IF_FALSE:             return JumpIfFalse(top);
+		case OP_JUMP_IF_NOT_LESS:          return CompareJump(TRACE_GUARD_LESS, false, top);
+		case OP_JUMP_IF_NOT_GREATER:       return CompareJump(TRACE_GUARD_LESS, true, top);
+		case OP_JUMP_IF_NOT_LESS_EQUAL:    return CompareJump(TRACE_GUARD_LESS_EQUAL, false, top);
+		case OP_JUMP_IF_NOT_GREATER_EQUAL: return CompareJump(TRACE_GUARD_LESS_EQUAL, true, top);
+		case OP_JUMP_IF_NOT_EQUAL:
+		case OP_JUMP_IF_EQUAL:             return EqualJump(top);
+
+		// The recording just follows the jump
+		case OP_JUMP:
+			return true;
+
+		case OP_LOOP:
+			// Only the loop being recorded, inner loops abort
+			return ip + 3 - ReadShort(ip) == m_Header && Finish();
+
+		case OP_ITER:
+			return ip == m_Header && Iter(top);
+
+		case OP_SUBSCRIPT_READ:  return SubscriptRead(top);
+		case OP_SUBSCRIPT_WRITE: return SubscriptWrite(top);
+
+		default:
+			return false;
+		}
+	}
+
+	int TraceRecorder::AllocateRegister(bool variable)
+	{
+		// Temps come from the bottom and variables from the top so they mostly stay out of each other's way
+		for (int i = FirstTraceRegister; i < TraceRegisterCount; i++)
+		{
+			int reg = variable ? TraceRegisterCount - 1 - (i - FirstTraceRegister) : i;
+			uint32_t bit = 1u << reg;
+
+			if (!(m_FreeRegisters & bit) || (variable && (m_TempRegisters & bit)))
+				continue;
+
+			m_FreeRegisters &= ~bit;
+
+			if (!variable)
+				m_TempRegisters |= bit;
+
+			return reg;
+		}
+
+		m_Failed = true;
+		return -1;
+	}
+
+	TraceValue TraceRecorder::Temp(TraceType type)
+	{
+		TraceValue value;
+		value.type = type;
+		value.temp = true;
+
+		int reg = AllocateRegister(false);
+		value.reg = reg < 0 ? 0 : (uint8_t)reg;
+
+		return value;
+	}
+
+	uint8_t TraceRecorder::InRegister(const TraceValue& value)
+	{
+		if (!value.constant)
+			return value.reg;
+
+		TraceValue temp = Temp(value.type);
+		Emit(TRACE_CONSTANT, temp.reg, 0, 0, 0, value.bits);
+		Release(temp);
+
+		return temp.reg;
+	}
+
+	void TraceRecorder::Release(const TraceValue& value)
+	{
+		if (value.temp)
+			m_PendingFree |= 1u << value.reg;
+	}
+
+	TraceValue TraceRecorder::Pop()
+	{
+		TraceValue value = m_Stack.back();
+		m_Stack.pop_back();
+
+		return value;
+	}
+
+	TraceValue TraceRecorder::Constant(Value value)
+	{
+		TraceValue constant;
+		constant.constant = true;
+		constant.bits = value.value;
+		TypeOf(value, &constant.type);
+
+		return constant;
+	}
+
+	void TraceRecorder::Emit(TraceOp op, uint8_t dst, uint8_t a, uint8_t b, uint8_t flag, uint64_t imm)
+	{
+		TraceIns ins;
+		ins.op = op;
+		ins.dst = dst;
+		ins.a = a;
+		ins.b = b;
+		ins.flag = flag;
+		ins.imm = imm;
+
+		m_IR.push_back(ins);
+	}
+
+	void TraceRecorder::EmitGuard(TraceOp op, uint8_t dst, uint8_t a, uint8_t b, uint8_t flag, uint64_t imm)
+	{
+		Emit(op, dst, a, b, flag, imm);
+		m_IR.back().exit = CurrentExit();
+	}
+
+	uint16_t TraceRecorder::CurrentExit()
+	{
+		if (m_Exit < 0)
+		{
+			TraceExit exit;
+			exit.ip = m_Ip;
+			exit.stack = m_StackBefore;
+
+			m_Exits.push_back(exit);
+			m_Exit = (int32_t)m_Exits.size() - 1;
+		}
+
+		return (uint16_t)m_Exit;
+	}
+
+	int TraceRecorder::FindVar(GlobalTable* globals, uint16_t index)
+	{
+		for (size_t i = 0; i < m_Vars.size(); i++)
+		{
+			if (m_Vars[i].globals == globals && m_Vars[i].index == index)
+				return (int)i;
+		}
+
+		return -1;
+	}
+
+	int TraceRecorder::AddVar(GlobalTable* globals, uint16_t index)
+	{
+		int reg = AllocateRegister(true);
+		if (reg < 0)
+			return -1;
+
+		TraceVar var;
+		var.globals = globals;
+		var.index = index;
+		var.reg = (uint8_t)reg;
+
+		m_Vars.push_back(var);
+		return (int)m_Vars.size() - 1;
+	}
+
+	bool TraceRecorder::ReadVar(GlobalTable* globals, uint16_t index, Value current)
+	{
+		int var = FindVar(globals, index);
+
+		if (var < 0)
+		{
+			TraceType type;
+			if (!TypeOf(current, &type))
+				return false;
+
+			var = AddVar(globals, index);
+			if (var < 0)
+				return false;
+
+			m_Vars[var].readFirst = true;
+			m_Vars[var].entryType = type;
+			m_Vars[var].type = type;
+		}
+
+		TraceValue value;
+		value.type = m_Vars[var].type;
+		value.reg = m_Vars[var].reg;
+		value.var = var;
+
+		Push(value);
+		return true;
+	}
+
+	bool TraceRecorder::WriteVar(GlobalTable* globals, uint16_t index, TraceValue value)
+	{
+		int var = FindVar(globals, index);
+
+		if (var < 0)
+		{
+			var = AddVar(globals, index);
+			if (var < 0)
+				return false;
+		}
+
+		if (value.var == var)
+			return true;
+
+		// Anything on the stack that was read from the variable keeps the old value
+		for (TraceValue& entry : m_Stack)
+		{
+			if (entry.var != var)
+				continue;
+
+			TraceValue copy = Temp(entry.type);
+			Emit(TRACE_MOVE, copy.reg, entry.reg);
+			entry = copy;
+		}
+
+		TraceVar& target = m_Vars[var];
+
+		if (value.constant)
+			Emit(TRACE_CONSTANT, target.reg, 0, 0, 0, value.bits);
+		else
+			Emit(TRACE_MOVE, target.reg, value.reg);
+
+		target.type = value.type;
+		target.written = true;
+
+		return true;
+	}
+
+	bool TraceRecorder::GetLocal(uint16_t slot)
+	{
+		if (slot < m_Depth)
+			return ReadVar(nullptr, slot, m_Frame->slots[slot]);
+
+		// Locals declared inside the loop are on the recorded stack
+		size_t index = slot - m_Depth;
+		if (index >= m_Stack.size())
+			return false;
+
+		TraceValue value = m_Stack[index];
+
+		if (value.temp)
+		{
+			TraceValue copy = Temp(value.type);
+			Emit(TRACE_MOVE, copy.reg, value.reg);
+			value = copy;
+		}
+
+		Push(value);
+		return true;
+	}
+
+	bool TraceRecorder::SetLocal(uint16_t slot)
+	{
+		if (m_Stack.empty())
+			return false;
+
+		TraceValue value = m_Stack.back();
+
+		if (slot < m_Depth)
+			return WriteVar(nullptr, slot, value);
+
+		size_t index = slot - m_Depth;
+		if (index >= m_Stack.size())
+			return false;
+
+		if (index == m_Stack.size() - 1)
+			return true;
+
+		TraceValue& target = m_Stack[index];
+
+		if (!target.temp)
+			target = Temp(value.type);
+
+		if (value.constant)
+			Emit(TRACE_CONSTANT, target.reg, 0, 0, 0, value.bits);
+		else
+			Emit(TRACE_MOVE, target.reg, value.reg);
+
+		target.type = value.type;
+		return true;
+	}
+
+	bool TraceRecorder::PushConstant(Value value)
+	{
+		// Strings and functions need the interpreter anyway
+		if (!value.IsNumber() && !value.IsBool())
+			return false;
+
+		Push(Constant(value));
+		return true;
+	}
+
+	bool TraceRecorder::Arithmetic(TraceOp op, uint64_t function)
+	{
+		if (m_Stack.size() < 2)
+			return false;
+
+		TraceValue b = Pop();
+		TraceValue a = Pop();
+
+		if (a.type != TRACE_NUMBER || b.type != TRACE_NUMBER)
+			return false;
+
+		uint8_t ra = InRegister(a);
+		uint8_t rb = InRegister(b);
+
+		TraceValue result = Temp(TRACE_NUMBER);
+		Emit(op, result.reg, ra, rb, 0, function);
+
+		Release(a);
+		Release(b);
+		Push(result);
+
+		return true;
+	}
+
+	bool TraceRecorder::Negate()
+	{
+		if (m_Stack.empty() || m_Stack.back().type != TRACE_NUMBER)
+			return false;
+
+		TraceValue value = Pop();
+
+		TraceValue result = Temp(TRACE_NUMBER);
+		Emit(TRACE_NEGATE, result.reg, InRegister(value));
+
+		Release(value);
+		Push(result);
+
+		return true;
+	}
+
+	bool TraceRecorder::Not()
+	{
+		if (m_Stack.empty())
+			return false;
+
+		TraceValue value = Pop();
+		Release(value);
+
+		// Only true is truthy for not, so everything else is just true
+		if (value.type != TRACE_BOOL)
+		{
+			Push(Constant(Value(true)));
+			return true;
+		}
+
+		if (value.constant)
+		{
+			Push(Constant(Value(value.bits != TRUE_VAL)));
+			return true;
+		}
+
+		TraceValue result = Temp(TRACE_BOOL);
+		Emit(TRACE_NOT, result.reg, value.reg);
+		Push(result);
+
+		return true;
+	}
+
+	bool TraceRecorder::Compare(TraceOp op, bool swap)
+	{
+		if (m_Stack.size() < 2)
+			return false;
+
+		TraceValue b = Pop();
+		TraceValue a = Pop();
+
+		if (a.type != TRACE_NUMBER || b.type != TRACE_NUMBER)
+			return false;
+
+		if (swap)
+			std::swap(a, b);
+
+		uint8_t ra = InRegister(a);
+		uint8_t rb = InRegister(b);
+
+		TraceValue result = Temp(TRACE_BOOL);
+		Emit(op, result.reg, ra, rb);
+
+		Release(a);
+		Release(b);
+		Push(result);
+
+		return true;
+	}
+
+	bool TraceRecorder::Equality(bool equal)
+	{
+		if (m_Stack.size() < 2)
+			return false;
+
+		TraceValue b = Pop();
+		TraceValue a = Pop();
+
+		// Objects compare by contents, leave them to the interpreter
+		if (a.type > TRACE_BOOL || b.type > TRACE_BOOL)
+			return false;
+
+		uint8_t ra = InRegister(a);
+		uint8_t rb = InRegister(b);
+
+		TraceValue result = Temp(TRACE_BOOL);
+		Emit(TRACE_EQUAL, result.reg, ra, rb, equal);
+
+		Release(a);
+		Release(b);
+		Push(result);
+
+		return true;
+	}
+
+	bool TraceRecorder::JumpIfFalse(Value* top)
+	{
+		if (m_Stack.empty())
+			return false;
+
+		// Numbers, lists and ranges are always truthy
+		const TraceValue& value = m_Stack.back();
+
+		if (value.type == TRACE_BOOL && !value.constant)
+			EmitGuard(TRACE_GUARD_VALUE, 0, value.reg, 0, 0, top[-1].value);
+
+		return true;
+	}
+
+	bool TraceRecorder::CompareJump(TraceOp op, bool swap, Value* top)
+	{
+		if (m_Stack.size() < 2)
+			return false;
+
+		TraceValue b = Pop();
+		TraceValue a = Pop();
+
+		if (a.type != TRACE_NUMBER || b.type != TRACE_NUMBER)
+			return false;
+
+		double x = top[-2].ToNumber();
+		double y = top[-1].ToNumber();
+
+		if (swap)
+		{
+			std::swap(a, b);
+			std::swap(x, y);
+		}
+
+		// The trace goes the same way the interpreter is about to
+		bool result = op == TRACE_GUARD_LESS ? x < y : x <= y;
+
+		uint8_t ra = InRegister(a);
+		uint8_t rb = InRegister(b);
+		EmitGuard(op, 0, ra, rb, result);
+
+		Release(a);
+		Release(b);
+
+		return true;
+	}
+
+	bool TraceRecorder::EqualJump(Value* top)
+	{
+		if (m_Stack.size() < 2)
+			return false;
+
+		TraceValue b = Pop();
+		TraceValue a = Pop();
+
+		if (a.type > TRACE_BOOL || b.type > TRACE_BOOL)
+			return false;
+
+		bool result = top[-2].value == top[-1].value;
+
+		uint8_t ra = InRegister(a);
+		uint8_t rb = InRegister(b);
+		EmitGuard(TRACE_GUARD_EQUAL, 0, ra, rb, result);
+
+		Release(a);
+		Release(b);
+
+		return true;
+	}
+
+	bool TraceRecorder::Iter(Value* top)
+	{
+		// The loop's value, sequence and iterator are the last three locals before the body
+		if (m_Depth < 3)
+			return false;
+
+		uint16_t valueSlot = (uint16_t)(m_Depth - 3);
+		uint16_t sequenceSlot = (uint16_t)(m_Depth - 2);
+		uint16_t iteratorSlot = (uint16_t)(m_Depth - 1);
+
+		Value seq = top[-2];
+		Value itr = top[-1];
+
+		// The first trip starts with a nil iterator, by the time the loop is hot it is a number
+		if (!itr.IsNumber())
+			return false;
+
+		if (!ReadVar(nullptr, sequenceSlot, seq) || !ReadVar(nullptr, iteratorSlot, itr))
+			return false;
+
+		TraceValue iterator = Pop();
+		TraceValue sequence = Pop();
+		double it = itr.ToNumber();
+
+		if (sequence.type == TRACE_RANGE)
+		{
+			ObjRange* range = (ObjRange*)seq.ToObject();
+
+			// Clamping to the start and leaving the loop are left to the interpreter
+			if (it < range->from || it >= range->to)
+				return false;
+
+			TraceValue from = Temp(TRACE_NUMBER);
+			Emit(TRACE_RANGE_FIELD, from.reg, sequence.reg, 0, 0, x64::MemberOffset(&ObjRange::from));
+			EmitGuard(TRACE_GUARD_LESS_EQUAL, 0, from.reg, iterator.reg, true);
+
+			TraceValue to = Temp(TRACE_NUMBER);
+			Emit(TRACE_RANGE_FIELD, to.reg, sequence.reg, 0, 0, x64::MemberOffset(&ObjRange::to));
+			EmitGuard(TRACE_GUARD_LESS, 0, iterator.reg, to.reg, true);
+
+			TraceValue step = Temp(TRACE_NUMBER);
+			Emit(TRACE_RANGE_FIELD, step.reg, sequence.reg, 0, 0, x64::MemberOffset(&ObjRange::step));
+
+			TraceValue next = Temp(TRACE_NUMBER);
+			Emit(TRACE_ADD, next.reg, iterator.reg, step.reg);
+
+			Release(from);
+			Release(to);
+			Release(step);
+			Release(next);
+
+			return WriteVar(nullptr, valueSlot, iterator) && WriteVar(nullptr, iteratorSlot, next);
+		}
+
+		if (sequence.type == TRACE_ARRAY)
+		{
+			ObjArray* array = (ObjArray*)seq.ToObject();
+			uint32_t index = (uint32_t)trunc(it);
+
+			TraceType type;
+			if (index >= array->size || !TypeOf(array->values[index], &type))
+				return false;
+
+			TraceValue element = Temp(type);
+			EmitGuard(TRACE_ARRAY_GET, element.reg, sequence.reg, iterator.reg);
+			EmitGuard(TRACE_GUARD_TYPE, 0, element.reg, 0, type);
+
+			TraceValue next = Temp(TRACE_NUMBER);
+			Emit(TRACE_ADD, next.reg, iterator.reg, InRegister(Constant(Value(1.0))));
+
+			Release(element);
+			Release(next);
+
+			return WriteVar(nullptr, valueSlot, element) && WriteVar(nullptr, iteratorSlot, next);
+		}
+
+		return false;
+	}
+
+	bool TraceRecorder::SubscriptRead(Value* top)
+	{
+		if (m_Stack.size() < 2)
+			return false;
+
+		TraceValue index = Pop();
+		TraceValue array = Pop();
+
+		if (array.type != TRACE_ARRAY || index.type != TRACE_NUMBER)
+			return false;
+
+		// Negative indices count from the end, the interpreter deals with those
+		ObjArray* obj = (ObjArray*)top[-2].ToObject();
+		double i = top[-1].ToNumber();
+
+		TraceType type;
+		if (!(i >= 0.0) || i >= (double)obj->size || !TypeOf(obj->values[(size_t)i], &type))
+			return false;
+
+		uint8_t ri = InRegister(index);
+
+		TraceValue element = Temp(type);
+		EmitGuard(TRACE_ARRAY_GET, element.reg, array.reg, ri);
+		EmitGuard(TRACE_GUARD_TYPE, 0, element.reg, 0, type);
+
+		Release(array);
+		Release(index);
+		Push(element);
+
+		return true;
+	}
+
+	bool TraceRecorder::SubscriptWrite(Value* top)
+	{
+		if (m_Stack.size() < 3)
+			return false;
+
+		TraceValue item = Pop();
+		TraceValue index = Pop();
+		TraceValue array = Pop();
+
+		if (array.type != TRACE_ARRAY || index.type != TRACE_NUMBER)
+			return false;
+
+		ObjArray* obj = (ObjArray*)top[-3].ToObject();
+		double i = top[-2].ToNumber();
+
+		if (!(i >= 0.0) || i >= (double)obj->size)
+			return false;
+
+		uint8_t ri = InRegister(index);
+		uint8_t rv = InRegister(item);
+		EmitGuard(TRACE_ARRAY_SET, rv, array.reg, ri);
+
+		// The assignment leaves the item on the stack
+		Release(array);
+		Release(index);
+		Push(item);
+
+		return true;
+	}
+
+#else
+
+	// Traces need the JIT, so nothing ever gets recorded
+
+	Trace::~Trace()
+	{
+	}
+
+	void Trace::Enter(CallFrame* frame, Value** top)
+	{
+	}
+
+	TraceRecorder::~TraceRecorder()
+	{
+	}
+
+	bool TraceRecorder::ShouldRecord(TraceLoop* loop)
+	{
+		return false;
+	}
+
+	void TraceRecorder::Start(CallFrame* frame, TraceLoop* loop, Value* top)
+	{
+	}
+
+	bool TraceRecorder::Record(CallFrame* frame, uint8_t* ip, Value* top)
+	{
+		return false;
+	}
+
+#endif
+}
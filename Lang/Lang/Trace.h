@@ -0,0 +1,247 @@
+#pragma once
+#include "Value.h"
+#include "Object.h"
+#include "JIT.h"
+
+#include <vector>
+
+// The tracing JIT
+// When a loop gets hot the interpreter records one trip around it, the recording is turned into a
+// linear IR with guards on everything it assumed and then compiled to native code.
+// The next time the loop jumps back to its header it runs the trace instead, a guard that fails leaves
+// the trace and the interpreter picks up from the instruction that made the assumption.
+// Traces only handle numbers, bools, lists and ranges, anything else aborts the recording.
+
+namespace script
+{
+	class GlobalTable;
+
+	// Back edges before a loop gets recorded
+	constexpr uint32_t TraceThreshold = 50;
+
+	// Loops that keep failing to record are left to the other tiers
+	constexpr uint32_t TraceMaxAborts = 3;
+
+	// Instructions in a single recording
+	constexpr uint32_t TraceMaxLength = 1000;
+
+	// A trace that keeps failing its entry guards gets thrown away
+	constexpr uint32_t TraceMaxEntryFailures = 100;
+
+	enum TraceType : uint8_t
+	{
+		TRACE_NUMBER,
+		TRACE_BOOL,
+		TRACE_ARRAY,
+		TRACE_RANGE
+	};
+
+	// Every value in a trace lives in an xmm register
+	// Values are kept boxed so numbers are plain doubles and everything else is just the bits
+	enum TraceOp : uint8_t
+	{
+		TRACE_CONSTANT,			// dst = imm
+		TRACE_MOVE,				// dst = a
+		TRACE_ADD,				// dst = a + b
+		TRACE_SUBTRACT,			// dst = a - b
+		TRACE_MULTIPLY,			// dst = a * b
+		TRACE_DIVIDE,			// dst = a / b
+		TRACE_NEGATE,			// dst = -a
+		TRACE_NOT,				// dst = !a, a is a bool
+		TRACE_CALL,				// dst = imm(a, b), imm is a double(*)(double, double)
+		TRACE_LESS,				// dst = a < b
+		TRACE_LESS_EQUAL,		// dst = a <= b
+		TRACE_EQUAL,			// dst = (a == b) == flag, compares the bits
+		TRACE_RANGE_FIELD,		// dst = the double at offset imm in range a
+		TRACE_ARRAY_GET,		// dst = a[b], exits if b is out of bounds
+		TRACE_ARRAY_SET,		// a[b] = dst, exits if b is out of bounds
+
+		// Guards leave through their exit when they fail
+		TRACE_GUARD_LESS,		// (a < b) == flag
+		TRACE_GUARD_LESS_EQUAL,	// (a <= b) == flag
+		TRACE_GUARD_EQUAL,		// (a == b) == flag
+		TRACE_GUARD_VALUE,		// a == imm
+		TRACE_GUARD_TYPE,		// a has type flag
+
+		TRACE_LOOP				// back to the top of the trace
+	};
+
+	struct TraceIns
+	{
+		TraceOp op;
+		uint8_t dst = 0;
+		uint8_t a = 0;
+		uint8_t b = 0;
+		uint8_t flag = 0;
+		uint16_t exit = 0;
+		uint64_t imm = 0;
+	};
+
+	// A value on the recorded stack, either in a register or a constant
+	struct TraceValue
+	{
+		TraceType type = TRACE_NUMBER;
+		bool constant = false;
+		bool temp = false;
+		uint8_t reg = 0;
+		uint64_t bits = 0;
+
+		// Index of the variable this is a copy of or -1
+		// Writing to the variable has to copy these out first
+		int32_t var = -1;
+	};
+
+	// A local slot below the loop's stack or a global that lives in a register while the trace runs
+	struct TraceVar
+	{
+		// nullptr for locals
+		GlobalTable* globals = nullptr;
+		uint16_t index = 0;
+
+		uint8_t reg = 0;
+		TraceType type = TRACE_NUMBER;
+
+		// If the trace reads it before writing it the type it had gets guarded on entry
+		bool readFirst = false;
+		TraceType entryType = TRACE_NUMBER;
+
+		bool written = false;
+	};
+
+	struct TraceExit
+	{
+		// Where the interpreter carries on
+		uint8_t* ip = nullptr;
+
+		// Values that go back on the stack above the loop's locals
+		std::vector<TraceValue> stack;
+
+		// The entry exit happens before anything has been loaded so it can't write the variables back
+		bool writeBack = true;
+	};
+
+	class Trace
+	{
+	public:
+
+		~Trace();
+
+		// Runs the trace until something exits it
+		// The frame is left with ip and the stack top set up for the interpreter
+		void Enter(CallFrame* frame, Value** top);
+
+		uint8_t* code = nullptr;
+		size_t size = 0;
+
+		TraceLoop* loop = nullptr;
+
+		// Stack depth at the loop header
+		uint32_t stackDepth = 0;
+
+		std::vector<TraceIns> ir;
+		std::vector<TraceVar> vars;
+		std::vector<TraceExit> exits;
+
+		// Times the trace has been left straight away because a variable changed type
+		uint32_t entryFailures = 0;
+	};
+
+	// Returns nullptr if ip isn't the header of a loop in the function
+	TraceLoop* FindTraceLoop(ObjFunction* function, uint8_t* ip);
+
+	class TraceRecorder
+	{
+	public:
+
+		// The traces check the count of pending events and count down to the next poll at the end of every iteration, both are the VM's
+		TraceRecorder(const size_t* pendingEvents, int32_t* pollCountdown) : m_PendingEvents(pendingEvents), m_PollCountdown(pollCountdown) {}
+
+		~TraceRecorder();
+
+		// Counts a back edge, returns true when the loop should be recorded
+		bool ShouldRecord(TraceLoop* loop);
+
+		void Start(CallFrame* frame, TraceLoop* loop, Value* top);
+
+		// Called before every instruction while recording
+		// Returns false once the recording is over, either the trace is done or it was aborted
+		bool Record(CallFrame* frame, uint8_t* ip, Value* top);
+
+	private:
+
+		bool Abort();
+		bool Finish();
+
+		bool RecordInstruction(uint8_t* ip, Value* top);
+
+		// Registers
+		int AllocateRegister(bool variable);
+		TraceValue Temp(TraceType type);
+		uint8_t InRegister(const TraceValue& value);
+		void Release(const TraceValue& value);
+
+		TraceValue Pop();
+		void Push(const TraceValue& value) { m_Stack.push_back(value); }
+		TraceValue Constant(Value value);
+
+		void Emit(TraceOp op, uint8_t dst, uint8_t a = 0, uint8_t b = 0, uint8_t flag = 0, uint64_t imm = 0);
+		// Same as Emit but the instruction can leave the trace
+		void EmitGuard(TraceOp op, uint8_t dst, uint8_t a = 0, uint8_t b = 0, uint8_t flag = 0, uint64_t imm = 0);
+
+		// The exit for the current instruction, the stack as it was before it ran
+		uint16_t CurrentExit();
+
+		int FindVar(GlobalTable* globals, uint16_t index);
+		bool ReadVar(GlobalTable* globals, uint16_t index, Value current);
+		bool WriteVar(GlobalTable* globals, uint16_t index, TraceValue value);
+		int AddVar(GlobalTable* globals, uint16_t index);
+
+		bool GetLocal(uint16_t slot);
+		bool SetLocal(uint16_t slot);
+		bool PushConstant(Value value);
+		bool Arithmetic(TraceOp op, uint64_t function = 0);
+		bool Negate();
+		bool Not();
+		bool JumpIfFalse(Value* top);
+		bool Compare(TraceOp op, bool swap);
+		bool Equality(bool equal);
+		bool CompareJump(TraceOp op, bool swap, Value* top);
+		bool EqualJump(Value* top);
+		bool Iter(Value* top);
+		bool SubscriptRead(Value* top);
+		bool SubscriptWrite(Value* top);
+
+		const size_t* m_PendingEvents;
+		int32_t* m_PollCountdown;
+
+		bool m_Recording = false;
+		uint32_t m_Length = 0;
+
+		// Set when something runs out of room part way through an instruction
+		bool m_Failed = false;
+
+		CallFrame* m_Frame = nullptr;
+		ObjFunction* m_Function = nullptr;
+		TraceLoop* m_Loop = nullptr;
+		uint8_t* m_Header = nullptr;
+		uint32_t m_Depth = 0;
+
+		uint8_t* m_Ip = nullptr;
+		int32_t m_Exit = -1;
+
+		std::vector<TraceValue> m_Stack;
+		std::vector<TraceValue> m_StackBefore;
+		std::vector<TraceVar> m_Vars;
+		std::vector<TraceIns> m_IR;
+		std::vector<TraceExit> m_Exits;
+
+		// Bit masks of xmm registers
+		uint32_t m_FreeRegisters = 0;
+		// Released by the current instruction, an exit might still need them
+		uint32_t m_PendingFree = 0;
+		// The trace runs over and over so a register that held a temp anywhere can't be given to a variable later
+		uint32_t m_TempRegisters = 0;
+
+		std::vector<Trace*> m_Traces;
+	};
+}
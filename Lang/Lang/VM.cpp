@@ -12,8 +12,11 @@ namespace script
 {
 
 
-    VM::VM(const VMCreateInfo& createInfo) : m_CurrentGlobal(&m_GlobalVariables)
+    VM::VM(const VMCreateInfo& createInfo)
     {
+        m_Heap.m_Events = &m_Events;
+        MakeCurrent();
+
         if (!createInfo.ioInterface)
         {
             m_IOInterface = new DefaultIOInterface;
@@ -23,30 +26,133 @@ namespace script
             m_IOInterface = createInfo.ioInterface;
         }
 
+        m_ImageCache = createInfo.imageCache;
+
+        m_JITEnabled = LANG_JIT && createInfo.enableJIT;
+        m_JITThreshold = createInfo.jitThreshold;
+        m_TracingEnabled = m_JITEnabled && createInfo.enableTracing;
+
+        // The builtins are already in the snapshot along with whatever ran after them
+        if (createInfo.snapshot)
+        {
+            ReadHeapSnapshot(*this, *createInfo.snapshot);
+            return;
+        }
+
+        // Classes for the built in types so they can have methods
+        m_NumericClass = NewClass("number");
+        m_StringClass = NewClass("string");
+        m_BoolClass = NewClass("bool");
+        m_ListClass = NewClass("list");
+        m_RangeClass = NewClass("range");
+        m_DictionaryClass = NewClass("dictionary");
+
         // Load the standard stuff that the language needs
         LoadStdPrimitives(this);
     }
 
     VM::~VM()
     {
+        for (JITFunction* jit : m_JITFunctions)
+            delete jit;
+
         delete m_IOInterface;
+
+        if (m_Heap.IsCurrent())
+            SetCurrentHeap(nullptr);
     }
 
     InterpretResult VM::Interpret(ObjFunction* function)
     {
+        MakeCurrent();
+
+        LinkFunction(function, &m_GlobalVariables);
+
         m_CurrentFiber = CreateFiber(function);
+
+        if (!m_CurrentFiber)
+        {
+            Error("Failed to load the script");
+            return INTERPRET_RUNTIME_ERROR;
+        }
+
         m_CurrentFiber->state = FIBER_ROOT;
 
-     
+        InterpretResult result = Run();
 
-        return Run();
+        if (result != INTERPRET_ALL_GOOD)
+            return result;
+
+        // Timers the script started still have to fire
+        return RunEvents();
     }
 
-    InterpretResult VM::Run()
+    InterpretResult VM::CallFunction(const std::string& name, const Value* args, int argCount, Value* result)
     {
+        MakeCurrent();
+
+        Value* callee = m_GlobalVariables.Find(name);
+
+        if (!callee || !callee->IsObjType(OBJ_FUNCTION))
+        {
+            Error("No function called " + name);
+            return INTERPRET_RUNTIME_ERROR;
+        }
+
+        ObjFunction* function = (ObjFunction*)callee->ToObject();
+
+        if (argCount != (int)function->arity)
+        {
+            Error("Expected " + std::to_string(function->arity) + " arguments but got " + std::to_string(argCount));
+            return INTERPRET_RUNTIME_ERROR;
+        }
+
+        ObjFiber* fiber = CreateFiber(function);
+
+        if (!fiber)
+        {
+            Error("Failed to load " + name);
+            return INTERPRET_RUNTIME_ERROR;
+        }
+
+        for (int i = 0; i < argCount; i++)
+            fiber->stack.Push(args[i]);
+
+        ObjFiber* caller = m_CurrentFiber;
+        fiber->caller = caller;
+        m_CurrentFiber = fiber;
+
+        InterpretResult status = Run(1);
+
+        // An error leaves the fiber where it failed
+        m_CurrentFiber = caller;
+
+        if (status == INTERPRET_ALL_GOOD && result)
+            *result = fiber->stack.m_Stack[0];
+
+        return status;
+    }
+
+    std::shared_ptr<const HeapSnapshot> VM::TakeSnapshot()
+    {
+        bool running = (m_CurrentFiber && m_CurrentFiber->framesCount > 0) || m_ExecutingModule;
+
+        if (running || !m_Events.IsEmpty() || !m_WaitingFibers.empty() || m_Events.HasWork() || m_Timer.GetActiveTimerCount() > 0)
+            return nullptr;
+
+        // Functions still in an image get loaded into the heap
+        MakeCurrent();
+
+        return WriteHeapSnapshot(*this);
+    }
+
+    InterpretResult VM::Run(size_t returnDepth)
+    {
+        MakeCurrent();
+
+        ObjFiber* returnFiber = m_CurrentFiber;
 
         CallFrame* frame = &m_CurrentFiber->frames[m_CurrentFiber->framesCount - 1];
-        m_CurrentGlobal = &m_GlobalVariables;
 
         // Store the ptr in a value to avoid the ptr->ptr
         // With how frequent this gets access its important
@@ -55,6 +161,12 @@ namespace script
         // Does this have any benefit? 
        Value* constantTable = frame->function->chunk.constants.data();
        Value* stackStart = frame->slots;
+       GlobalTable* globals = frame->function->globals;
+       const uint16_t* globalSlots = frame->function->GlobalSlots();
+
+       // Set before jumping to the slow path of a maths intrinsic
+       int mathsArgCount = 0;
+       ObjString* mathsName = nullptr;
 
         // Welcome to define hell
 
@@ -69,71 +181,138 @@ namespace script
 #define POP() (*(--(m_CurrentFiber->stack.m_Top)))
 #define PEEK(off) (m_CurrentFiber->stack.m_Top[-1 - off])
 
-#define BINARY_OP(op) \
+        // Quickening
+        // Generic instructions rewrite themselves into a version specialised for the operand types they see.
+        // The specialised version only checks its guard and deoptimizes back to the generic one if it fails.
+        // Only instructions without operands get quickened so the opcode is always at ip[-1]
+        // Code still in a mapped image is read only, it just stays generic
+#define QUICKEN(op) \
     do { \
-      Value b = POP(); \
-      Value a = POP(); \
-      PUSH(a op b); \
+        if (!frame->function->chunk.code.IsView()) \
+            ip[-1] = (uint8_t)(op); \
+    } while (false)
+#define DEOPTIMIZE(op) \
+    do { \
+        ip[-1] = (uint8_t)(op); \
+        ip--; \
+        DISPATCH(); \
     } while (false)
 
-#define STORE_FRAME() frame->ip = ip;
-
-#define LOAD_FRAME()                                                                \
-    do {                                                                            \
-        STORE_FRAME();                                                              \
-        frame = &m_CurrentFiber->frames[m_CurrentFiber->framesCount - 1];           \
-        ip = frame->ip;                                                             \
-        constantTable = frame->function->chunk.constants.data();                    \
-        stackStart = frame->slots;                                                  \
-    } while(false)
+#define BINARY_OP(quickened, type, op) \
+    do { \
+        CHECK_NUMBER_OPERANDS(); \
+        QUICKEN(quickened); \
+        double b = POP().ToNumber(); \
+        double a = POP().ToNumber(); \
+        PUSH(Value((type)(a op b))); \
+    } while (false)
 
-       // Event loop
-       // This gets called if the event loop has an event
-       // TODO: this stuff could probably be extracted out of here to somewhere else 
-       auto eventLoop = [&]() {
+        // A native that was called badly has already reported it
+#define CHECK_NATIVE_ERROR() \
+    do { \
+        if (TakeNativeError()) \
+            return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
 
-           while (!eventManager.IsEmpty())
-           {
-               Event evnt = eventManager.Pop();
+#define CHECK_NUMBER_OPERANDS() \
+    do { \
+        if (!PEEK(0).IsNumber() || !PEEK(1).IsNumber()) \
+        { \
+            Error("Operands must be numbers."); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+    } while (false)
 
-               switch (evnt.type)
-               {
-               case EVENT_PUSH_FIBER:
-               {
-                   ObjFiber* newFiber = evnt.fiber;
+        // Compare and branch, jumps when the comparison is false
+#define COMPARE_JUMP(op) \
+    do { \
+        uint16_t offset = READ_SHORT(); \
+        CHECK_NUMBER_OPERANDS(); \
+        double b = POP().ToNumber(); \
+        double a = POP().ToNumber(); \
+        if (!(a op b)) \
+            ip += offset; \
+    } while (false)
 
-                   newFiber->caller = m_CurrentFiber;
+#define BINARY_OP_NUM(generic, type, op) \
+    do { \
+        Value* top = m_CurrentFiber->stack.m_Top; \
+        if (!top[-1].IsNumber() || !top[-2].IsNumber()) \
+            DEOPTIMIZE(generic); \
+        top[-2] = Value((type)(top[-2].ToNumber() op top[-1].ToNumber())); \
+        m_CurrentFiber->stack.m_Top = top - 1; \
+    } while (false)
 
-                   m_CurrentFiber = newFiber;
+        // Runs a std:maths function inline
+        // If the arguments aren't numbers or the name isn't bound to the std:maths native any more it gets called normally
+#define MATHS_INTRINSIC(op) \
+    do { \
+        constexpr int arity = MathsIntrinsicArity(op); \
+        ObjString* name = (ObjString*)READ_CONSTANT_LONG().ToObject(); \
+        PropertyCache* cache = &frame->function->chunk.propertyCaches[READ_SHORT()]; \
+        Value* top = m_CurrentFiber->stack.m_Top; \
+        if (!top[-1].IsNumber() || !top[-arity].IsNumber() || !IsMathsNative(top[-arity - 1], op, name, cache)) \
+        { \
+            mathsArgCount = arity; \
+            mathsName = name; \
+            goto maths_fallback; \
+        } \
+        top[-arity - 1] = Value(MathsIntrinsicResult(op, top[-arity].ToNumber(), top[-1].ToNumber())); \
+        m_CurrentFiber->stack.m_Top = top - arity; \
+    } while (false)
 
-                   LOAD_FRAME();
-                   break;
-               }
-               case EVENT_POP_FIBER:
-               {
-                   if (m_CurrentFiber == nullptr || m_CurrentFiber->caller == nullptr)
-                       break;
+#define STORE_FRAME() frame->ip = ip;
 
-                   m_CurrentFiber = m_CurrentFiber->caller;
+        // Mapped code keeps the name constant as its operand, see ObjFunction::globalSlots
+#define READ_GLOBAL_SLOT() (globalSlots ? globalSlots[READ_SHORT()] : READ_SHORT())
 
-                   LOAD_FRAME();
-                   break;
-               }
-               case EVENT_TRIGGER_GC:
-               {
-                   // Pretty simple just trigger a garbage collection 
-                   CollectGarbage();
-                   memoryManager.m_NextGC = memoryManager.m_BytesAllocated * GC_HEAP_GROW_FACTOR;
+#define RELOAD_FRAME()                                                              \
+    do {                                                                            \
+        frame = &m_CurrentFiber->frames[m_CurrentFiber->framesCount - 1];           \
+        ip = frame->ip;                                                             \
+        constantTable = frame->function->chunk.constants.data();                    \
+        stackStart = frame->slots;                                                  \
+        globals = frame->function->globals;                                         \
+        globalSlots = frame->function->GlobalSlots();                               \
+    } while(false)
 
-                   break;
-               }
+#define LOAD_FRAME()                                                                \
+    do {                                                                            \
+        STORE_FRAME();                                                              \
+        RELOAD_FRAME();                                                             \
+    } while(false)
 
-               }
-           }
-       };
+        // Switches over to the native code of the top frame
+        // The JIT sets the frame's ip if it bails out so the frame is reloaded without storing ip over it
+        // ip has to be stored before, a call in between can move the frames
+#define ENTER_JIT(address)                                                          \
+    do {                                                                            \
+        JITStatus status = EnterJIT(address);                                       \
+        if (status == JIT_ERROR)                                                    \
+            return INTERPRET_RUNTIME_ERROR;                                         \
+        if (status == JIT_RETURNED && m_CurrentFiber == returnFiber && m_CurrentFiber->framesCount < returnDepth) \
+            return INTERPRET_ALL_GOOD;                                              \
+        RELOAD_FRAME();                                                             \
+    } while(false)
 
         uint8_t instruction = 0;
 
+        // Events (fibers, timers and GC) are only handled at safepoints instead of every instruction
+        // Backward jumps, calls, returns and allocating instructions are safepoints so 
+        // nothing can run for long without giving the events a chance
+        // A fiber an event starts runs to the end in its own Run before this one carries on
+        // Every so often they poll for timers that came due too, so a busy script doesn't hold them up
+#define SAFEPOINT() \
+    do { \
+        if (m_Events.size != 0 || --m_Events.pollCountdown <= 0) \
+        { \
+            STORE_FRAME(); \
+            if (!PollEvents()) \
+                return INTERPRET_RUNTIME_ERROR; \
+            RELOAD_FRAME(); \
+        } \
+    } while (false)
+
 
         // Define the stack trace
 //#define DEBUG_STACK_TRACE
@@ -177,20 +356,27 @@ namespace script
 #if COMPUTED_GOTO 
 
         static void* dispatchTable[] = {
-    #define OPCODE(name) &&code_##name,
+    #define OPCODE(name, operands) &&code_##name,
     #include "OpCodes.h"
     #undef OPCODE
         };
 
+        // While a loop is being recorded for the tracing JIT every instruction goes past the recorder first
+        static void* recordTable[] = {
+    #define OPCODE(name, operands) &&record_instruction,
+    #include "OpCodes.h"
+    #undef OPCODE
+        };
+
+        void** dispatch = dispatchTable;
+
 #define CASE_CODE(name) code_##name
 
 
 #define DISPATCH()  \
     do { \
         STACK_TRACE(); \
-        if (eventManager.size != 0) \
-            eventLoop(); \
-        goto *dispatchTable[instruction = READ_BYTE()]; \
+        goto *dispatch[instruction = READ_BYTE()]; \
     } while (false)
 
 #define INTERPRET_LOOP DISPATCH();
@@ -202,8 +388,6 @@ namespace script
 #define INTERPRET_LOOP  \
         loop:  \
             STACK_TRACE(); \
-            if (!eventManager.IsEmpty()) \
-                eventLoop(); \
             switch(instruction = READ_BYTE())
 
 #define DISPATCH() goto loop
@@ -215,6 +399,15 @@ namespace script
 
         INTERPRET_LOOP
         {
+#if COMPUTED_GOTO
+        record_instruction:
+        {
+            if (!m_Recorder.Record(frame, ip - 1, m_CurrentFiber->stack.m_Top))
+                dispatch = dispatchTable;
+
+            goto *dispatchTable[instruction];
+        }
+#endif
         CASE_CODE(CONSTANT): 
         {
             PUSH(READ_CONSTANT());
@@ -260,69 +453,111 @@ namespace script
 
             DISPATCH();
         }
-        CASE_CODE(LESS):
+        CASE_CODE(NOT_EQUAL):
         {
             Value a = POP();
             Value b = POP();
 
-            PUSH(Value(a > b));
+            PUSH(Value(!(a == b)));
 
             DISPATCH();
         }
-        CASE_CODE(GREATER):
+        CASE_CODE(LESS):        BINARY_OP(OP_LESS_NUM, bool, <); DISPATCH();
+        CASE_CODE(LESS_NUM):    BINARY_OP_NUM(OP_LESS, bool, <); DISPATCH();
+        CASE_CODE(GREATER):     BINARY_OP(OP_GREATER_NUM, bool, >); DISPATCH();
+        CASE_CODE(GREATER_NUM): BINARY_OP_NUM(OP_GREATER, bool, >); DISPATCH();
+        CASE_CODE(LESS_EQUAL):
         {
-            Value a = POP();
-            Value b = POP();
+            CHECK_NUMBER_OPERANDS();
 
-            PUSH(Value(a < b));
+            double b = POP().ToNumber();
+            double a = POP().ToNumber();
 
+            PUSH(Value(a <= b));
+            DISPATCH();
+        }
+        CASE_CODE(GREATER_EQUAL):
+        {
+            CHECK_NUMBER_OPERANDS();
+
+            double b = POP().ToNumber();
+            double a = POP().ToNumber();
+
+            PUSH(Value(a >= b));
             DISPATCH();
         }
         CASE_CODE(ADD):
         {
-            Value b = POP();
-            Value a = POP();
+            Value b = PEEK(0);
+            Value a = PEEK(1);
 
-            if (a.IsObject())
+            if (a.IsObjType(OBJ_STRING) && b.IsObjType(OBJ_STRING))
             {
-                if (a.IsObjType(OBJ_ARRAY))
-                {
-                    assert(false);
-                    DISPATCH();
-                }
-                else if (a.IsObjType(OBJ_STRING) && b.IsObjType(OBJ_STRING))
-                {
+                QUICKEN(OP_ADD_STR);
+                goto addStrings;
+            }
 
-                    ObjString* str1 = (ObjString*)a.ToObject();
-                    ObjString* str2 = (ObjString*)b.ToObject();
+            if (!a.IsNumber() || !b.IsNumber())
+            {
+                Error("Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
 
-                    PUSH(Value(str1->AppendNew(str2)));
+            QUICKEN(OP_ADD_NUM_NUM);
 
-                    DISPATCH();
-                }
-            }
+            POP();
+            m_CurrentFiber->stack.m_Top[-1] = Value(a.ToNumber() + b.ToNumber());
 
-            double anum = a.ToNumber();
-            double bnum = b.ToNumber();
+            DISPATCH();
+        }
+        CASE_CODE(ADD_NUM_NUM): BINARY_OP_NUM(OP_ADD, double, +); DISPATCH();
+        CASE_CODE(ADD_STR):
+        {
+            if (!PEEK(0).IsObjType(OBJ_STRING) || !PEEK(1).IsObjType(OBJ_STRING))
+                DEOPTIMIZE(OP_ADD);
 
-            a.MakeNumber(anum + bnum);
+        addStrings:
 
-            PUSH(a);
+            ObjString* str2 = (ObjString*)POP().ToObject();
+            ObjString* str1 = (ObjString*)PEEK(0).ToObject();
+
+            m_CurrentFiber->stack.m_Top[-1] = Value(str1->AppendNew(str2));
 
+            SAFEPOINT();
             DISPATCH();
         }
-        CASE_CODE(SUBTRACT): 
+        CASE_CODE(ADD_CONSTANT):
         {
+            double constant = READ_CONSTANT().ToNumber();
 
-            double bnum = POP().ToNumber();
-            double anum = POP().ToNumber();
+            if (!PEEK(0).IsNumber())
+            {
+                Error("Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+
+            m_CurrentFiber->stack.m_Top[-1] = Value(PEEK(0).ToNumber() + constant);
+            DISPATCH();
+        }
+        CASE_CODE(SUBTRACT_CONSTANT):
+        {
+            double constant = READ_CONSTANT().ToNumber();
 
-            PUSH(Value(anum - bnum));
+            if (!PEEK(0).IsNumber())
+            {
+                Error("Operands must be numbers.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
 
+            m_CurrentFiber->stack.m_Top[-1] = Value(PEEK(0).ToNumber() - constant);
             DISPATCH();
         }
-        CASE_CODE(MULTIPLY): BINARY_OP(*); DISPATCH();
-        CASE_CODE(DIVIDE):   BINARY_OP(/); DISPATCH();
+        CASE_CODE(SUBTRACT):         BINARY_OP(OP_SUBTRACT_NUM_NUM, double, -); DISPATCH();
+        CASE_CODE(SUBTRACT_NUM_NUM): BINARY_OP_NUM(OP_SUBTRACT, double, -); DISPATCH();
+        CASE_CODE(MULTIPLY):         BINARY_OP(OP_MULTIPLY_NUM_NUM, double, *); DISPATCH();
+        CASE_CODE(MULTIPLY_NUM_NUM): BINARY_OP_NUM(OP_MULTIPLY, double, *); DISPATCH();
+        CASE_CODE(DIVIDE):           BINARY_OP(OP_DIVIDE_NUM_NUM, double, /); DISPATCH();
+        CASE_CODE(DIVIDE_NUM_NUM):   BINARY_OP_NUM(OP_DIVIDE, double, /); DISPATCH();
         CASE_CODE(POWER): 
         {
             Value b = POP();
@@ -350,13 +585,14 @@ namespace script
             POP(); 
             DISPATCH();
         }
+        CASE_CODE(POP_N):
+        {
+            m_CurrentFiber->stack.m_Top -= READ_BYTE();
+            DISPATCH();
+        }
         CASE_CODE(DEFINE_GLOBAL):
         {
-            // uint16_t constant = READ_SHORT();
-
-            ObjString* name = (ObjString*)READ_CONSTANT_LONG().ToObject();
-
-            m_CurrentGlobal->operator[](name->str) = POP();
+            globals->values[READ_GLOBAL_SLOT()] = POP();
 
             DISPATCH();
         }
@@ -366,13 +602,11 @@ namespace script
             // Export is the same as define global 
             // But we add it to a list of exported variables so its easier to get later. 
 
-            // uint16_t constant = READ_SHORT();
+            uint16_t slot = READ_GLOBAL_SLOT();
 
-            ObjString* name = (ObjString*)READ_CONSTANT_LONG().ToObject();
-
-            m_CurrentGlobal->operator[](name->str) = POP();
+            globals->values[slot] = POP();
 
-            m_ExportedVariables.push_back(name->str);
+            m_ExportedVariables.push_back(globals->names[slot]);
 
             DISPATCH();
         }
@@ -392,6 +626,7 @@ namespace script
 
                 PUSH(Value(AllocateArray(value)));
             }
+            SAFEPOINT();
             DISPATCH();
         }
         CASE_CODE(CREATE_RANGE):
@@ -405,6 +640,7 @@ namespace script
 
             PUSH(Value(range));
 
+            SAFEPOINT();
             DISPATCH();
         }
         CASE_CODE(SUBSCRIPT_READ):
@@ -481,7 +717,8 @@ namespace script
                 ObjDictionary* dict = (ObjDictionary*)arr.ToObject();
 
                 dict->map[idx.Hash()] = item;
-                    
+
+                PUSH(item);
 
                 DISPATCH();
             }
@@ -561,39 +798,31 @@ namespace script
         }
         CASE_CODE(GET_GLOBAL):
         {
+            uint16_t slot = READ_GLOBAL_SLOT();
 
-            ObjString* name = (ObjString*)READ_CONSTANT_LONG().ToObject();
+            Value value = globals->values[slot];
 
+            if (value.IsUndefined())
             {
-                auto it = m_CurrentGlobal->find(name->str);
+                // Not defined in this table but it could be a builtin from the root globals
+                Value* parentValue = globals->FindInParent(slot);
 
-                if (it == m_CurrentGlobal->end())
+                if (!parentValue)
                 {
-                    Error("cannot get global variable: \"" + std::string(name->str) + "\" as it does not exist.");
+                    Error("cannot get global variable: \"" + globals->names[slot] + "\" as it does not exist.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
 
-                PUSH(it->second);
+                value = *parentValue;
             }
 
+            PUSH(value);
 
             DISPATCH();
         } 
         CASE_CODE(SET_GLOBAL):
         {
-            ObjString* name = (ObjString*)READ_CONSTANT_LONG().ToObject();
-            m_CurrentGlobal->operator[](name->str) = PEEK(0);
-            /*{
-                auto it = m_CurrentGlobal->find(name->str);
-                if (it == m_CurrentGlobal->end())
-                {
-                    Error("cannot set global variable: " + std::string(name->str) + " as it does not exist.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-
-
-                it->second = PEEK(0);
-            }*/
+            globals->values[READ_GLOBAL_SLOT()] = PEEK(0);
 
             DISPATCH();
         }
@@ -604,6 +833,10 @@ namespace script
 
             DISPATCH();
         }
+        CASE_CODE(GET_LOCAL_0): PUSH(stackStart[0]); DISPATCH();
+        CASE_CODE(GET_LOCAL_1): PUSH(stackStart[1]); DISPATCH();
+        CASE_CODE(GET_LOCAL_2): PUSH(stackStart[2]); DISPATCH();
+        CASE_CODE(GET_LOCAL_3): PUSH(stackStart[3]); DISPATCH();
         CASE_CODE(SET_LOCAL):
         {
             stackStart[READ_SHORT()] = PEEK(0);
@@ -618,6 +851,70 @@ namespace script
 
             DISPATCH();
         }
+        CASE_CODE(JUMP_IF_NOT_LESS):          COMPARE_JUMP(<); DISPATCH();
+        CASE_CODE(JUMP_IF_NOT_GREATER):       COMPARE_JUMP(>); DISPATCH();
+        CASE_CODE(JUMP_IF_NOT_LESS_EQUAL):    COMPARE_JUMP(<=); DISPATCH();
+        CASE_CODE(JUMP_IF_NOT_GREATER_EQUAL): COMPARE_JUMP(>=); DISPATCH();
+        CASE_CODE(JUMP_IF_NOT_EQUAL):
+        {
+            uint16_t offset = READ_SHORT();
+            Value b = POP();
+            Value a = POP();
+
+            if (!(a == b))
+                ip += offset;
+
+            DISPATCH();
+        }
+        CASE_CODE(JUMP_IF_EQUAL):
+        {
+            uint16_t offset = READ_SHORT();
+            Value b = POP();
+            Value a = POP();
+
+            if (a == b)
+                ip += offset;
+
+            DISPATCH();
+        }
+        CASE_CODE(MATH_SQRT): MATHS_INTRINSIC(OP_MATH_SQRT); DISPATCH();
+        CASE_CODE(MATH_SIN): MATHS_INTRINSIC(OP_MATH_SIN); DISPATCH();
+        CASE_CODE(MATH_COS): MATHS_INTRINSIC(OP_MATH_COS); DISPATCH();
+        CASE_CODE(MATH_ABS): MATHS_INTRINSIC(OP_MATH_ABS); DISPATCH();
+        CASE_CODE(MATH_FLOOR): MATHS_INTRINSIC(OP_MATH_FLOOR); DISPATCH();
+        CASE_CODE(MATH_MIN): MATHS_INTRINSIC(OP_MATH_MIN); DISPATCH();
+        CASE_CODE(MATH_MAX): MATHS_INTRINSIC(OP_MATH_MAX); DISPATCH();
+        CASE_CODE(MATH_ATAN2): MATHS_INTRINSIC(OP_MATH_ATAN2); DISPATCH();
+        maths_fallback:
+        {
+            // Whatever the name is bound to now gets called like OP_INVOKE or OP_CALL would
+            Value callee = PEEK(mathsArgCount);
+
+            if (callee.IsObjType(OBJ_MODULE))
+            {
+                Value* function = ((ObjModule*)callee.ToObject())->globals.Find(mathsName->str);
+                if (!function)
+                {
+                    Error("Module doesn't contain function.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                callee = *function;
+                m_CurrentFiber->stack.m_Top[-mathsArgCount - 1] = callee;
+            }
+
+            STORE_FRAME();
+
+            if (!CallValue(callee, mathsArgCount))
+            {
+                Error("Could not call function: " + std::string(mathsName->str));
+                return INTERPRET_RUNTIME_ERROR;
+            }
+
+            RELOAD_FRAME();
+            SAFEPOINT();
+            DISPATCH();
+        }
         CASE_CODE(JUMP):
         {
             uint16_t offset = READ_SHORT();
@@ -629,6 +926,86 @@ namespace script
             uint16_t offset = READ_SHORT();
             ip -= offset;
 
+            SAFEPOINT();
+
+            // Hot loops get recorded, once there is a trace the loop runs in that
+            if (m_TracingEnabled)
+            {
+                TraceLoop* loop = FindTraceLoop(frame->function, ip);
+
+                if (loop && loop->trace)
+                {
+                    STORE_FRAME();
+                    loop->trace->Enter(frame, &m_CurrentFiber->stack.m_Top);
+                    RELOAD_FRAME();
+                    DISPATCH();
+                }
+
+#if COMPUTED_GOTO
+                if (loop && m_Recorder.ShouldRecord(loop))
+                {
+                    m_Recorder.Start(frame, loop, m_CurrentFiber->stack.m_Top);
+                    dispatch = recordTable;
+                    DISPATCH();
+                }
+#endif
+            }
+
+            // Hot loops move over to native code without waiting for the next call
+            CountHotness(frame->function);
+            if (frame->function->jit)
+            {
+                STORE_FRAME();
+                ENTER_JIT(ip);
+            }
+
+            DISPATCH();
+        }
+        CASE_CODE(INLINE_GUARD):
+        {
+            uint16_t offset = READ_SHORT();
+            Value function = READ_CONSTANT_LONG();
+            uint8_t argCount = READ_BYTE();
+
+            Value callee = PEEK(argCount);
+
+            if (callee.IsObjType(OBJ_FUNCTION) && callee.ToObject() == function.ToObject())
+                ip += offset;
+
+            DISPATCH();
+        }
+        CASE_CODE(TAIL_CALL):
+        {
+            // The CALL is the next instruction
+            int argCount = *ip - OP_CALL_0;
+            Value callee = PEEK(argCount);
+
+            if (!callee.IsObjType(OBJ_FUNCTION))
+                DISPATCH();
+
+            ObjFunction* function = (ObjFunction*)callee.ToObject();
+
+            // The CALL loads it first
+            if (function->lazy)
+                DISPATCH();
+
+            // The callee and its arguments slide down over the current frame so the stack doesn't grow either
+            Value* args = m_CurrentFiber->stack.m_Top - argCount - 1;
+            memmove(frame->slots, args, sizeof(Value) * (argCount + 1));
+            m_CurrentFiber->stack.m_Top = frame->slots + argCount + 1;
+
+            frame->function = function;
+            ip = function->chunk.code.data();
+            CountHotness(function);
+
+            STORE_FRAME();
+
+            if (function->jit)
+                ENTER_JIT(ip);
+            else
+                RELOAD_FRAME();
+
+            SAFEPOINT();
             DISPATCH();
         }
         CASE_CODE(CALL_0):
@@ -666,15 +1043,20 @@ namespace script
             {
             case OBJ_FUNCTION:
             {
+                ObjFunction* function = (ObjFunction*)obj.ToObject();
+
                 STORE_FRAME();
 
-                if (!Call((ObjFunction*)obj.ToObject(), argCount))
+                if (!Call(function, argCount))
                 {
                     Error("Could not call function");
                     return INTERPRET_RUNTIME_ERROR;
                 }
 
-                LOAD_FRAME();
+                if (function->jit)
+                    ENTER_JIT(function->chunk.code.data());
+                else
+                    RELOAD_FRAME();
 
                 break;
             }
@@ -682,9 +1064,9 @@ namespace script
             case OBJ_NATIVE:
             {
                 ObjNative* native = (ObjNative*)obj.ToObject();
-                NativeFunc func = native->function;
 
-                Value result = func(argCount, m_CurrentFiber->stack.m_Top - argCount);
+                Value result = native->Call(argCount, m_CurrentFiber->stack.m_Top - argCount);
+                CHECK_NATIVE_ERROR();
 
                 m_CurrentFiber->stack.m_Top -= argCount + 1;
 
@@ -714,7 +1096,7 @@ namespace script
                     return INTERPRET_RUNTIME_ERROR;
                 }
 
-                LOAD_FRAME();
+                RELOAD_FRAME();
                 break;
             }
             case OBJ_BOUND_METHOD:
@@ -725,7 +1107,6 @@ namespace script
                 if (bound->isNative)
                 {
                     ObjNative* native = bound->native;
-                    NativeFunc func = native->function;
 
                     // For native functions we need to do something a bit more
                     // Native functions here always have an argument. self 
@@ -737,10 +1118,11 @@ namespace script
 
                     bool moduleFunc = ((m_CurrentFiber->stack.m_Top) - argCount - 1)->IsObjType(OBJ_MODULE);
 
-                    int totalArgCount = argCount + (int)moduleFunc;
+                    int totalArgCount = argCount + (int)!moduleFunc;
 
                     Value result;
-                    result = func(totalArgCount, (m_CurrentFiber->stack.m_Top) - totalArgCount);
+                    result = native->Call(totalArgCount, (m_CurrentFiber->stack.m_Top) - totalArgCount);
+                    CHECK_NATIVE_ERROR();
 
 
                     m_CurrentFiber->stack.m_Top -= argCount + 1;
@@ -759,7 +1141,7 @@ namespace script
                         return INTERPRET_RUNTIME_ERROR;
                     }
 
-                    LOAD_FRAME();
+                    RELOAD_FRAME();
 
                 }
                 break;
@@ -771,6 +1153,7 @@ namespace script
                 break;
             }
 
+            SAFEPOINT();
             DISPATCH();
 
         }
@@ -780,6 +1163,7 @@ namespace script
             ObjString* name = (ObjString*)READ_CONSTANT_LONG().ToObject();
             PUSH(Value(NewClass(name->str)));
 
+            SAFEPOINT();
             DISPATCH();
         }
         CASE_CODE(GET_PROPERTY):
@@ -789,9 +1173,8 @@ namespace script
             //uint16_t constant = READ_SHORT();
 
             ObjString* name = (ObjString*)READ_CONSTANT_LONG().ToObject();
+            PropertyCache* cache = &frame->function->chunk.propertyCaches[READ_SHORT()];
 
-            // TODO: Make this better
-            // Its quite slow 
             {
                 Value stackObj = PEEK(0);
 
@@ -799,11 +1182,11 @@ namespace script
                 {
                     ObjModule* mdl = (ObjModule*)stackObj.ToObject();
 
-                    auto it = mdl->methods.find(name->str);
-                    if (it != mdl->methods.end())
+                    Value* value = mdl->globals.Find(name->str);
+                    if (value)
                     {
                         POP();
-                        PUSH(it->second);
+                        PUSH(*value);
 
                         DISPATCH();
                     }
@@ -815,34 +1198,47 @@ namespace script
                 }
 
                 ObjClass* classObj = GetClassInline(stackObj);
-                auto it = classObj->methods.find(name->str);
-                if (it != classObj->methods.end())
+
+                if (classObj == nullptr)
+                {
+                    Error("Cannot get property: " + std::string(name->str) + " on a value without properties.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                // Instances are cached by their shape so fields can be read straight from a slot
+                ObjInstance* instance = nullptr;
+                Shape* shape = nullptr;
+
+                if (stackObj.IsObjType(OBJ_INSTANCE))
+                {
+                    instance = (ObjInstance*)stackObj.ToObject();
+                    shape = instance->shape;
+                }
+
+                PropertyCacheEntry scratch;
+                PropertyCacheEntry* entry = LookupProperty(cache, classObj, shape, name, &scratch);
+
+                if (entry == nullptr)
+                {
+                    Error("Field does not exist in instance: " + std::string(name->str));
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                if (entry->method)
                 {
                     ObjBoundMethod* bound = nullptr;
 
-                    if (it->second.IsObjType(OBJ_FUNCTION))
-                        bound = NewBoundMethod(stackObj, (ObjFunction*)it->second.ToObject());
+                    if (entry->method->type == OBJ_FUNCTION)
+                        bound = NewBoundMethod(stackObj, (ObjFunction*)entry->method);
                     else
-                        bound = NewNativeBoundMethod(stackObj, (ObjNative*)it->second.ToObject());
+                        bound = NewNativeBoundMethod(stackObj, (ObjNative*)entry->method);
 
                     POP();
                     PUSH(Value(bound));
                 }
                 else
                 {
-
-                    // Only instances can have fields
-                    ObjInstance* instance = (ObjInstance*)stackObj.ToObject();
-
-
-                    auto itfield = instance->fields.find(name->str);
-                    if (itfield == instance->fields.end())
-                    {
-                        Error("Field does not exist in instance: " + std::string(name->str));
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
-
-                    Value value = itfield->second;
+                    Value value = instance->fields[entry->slot];
                     POP();
                     PUSH(value);
                 }
@@ -863,8 +1259,35 @@ namespace script
             //uint16_t constant = READ_SHORT();
 
             ObjString* name = (ObjString*)READ_CONSTANT_LONG().ToObject();
-                
-            instance->fields[name->str] = PEEK(0);
+            PropertyCache* cache = &frame->function->chunk.propertyCaches[READ_SHORT()];
+
+            PropertyCacheEntry* entry = FindPropertyCacheEntry(cache, instance->klass, instance->shape);
+
+            // Out here since entry still points at it after the miss
+            PropertyCacheEntry resolved;
+
+            if (entry)
+            {
+                m_InlineCacheStats.hits++;
+            }
+            else
+            {
+                m_InlineCacheStats.misses++;
+
+                ResolveSetProperty(instance, name, &resolved);
+
+                AddPropertyCacheEntry(cache, resolved);
+                entry = &resolved;
+            }
+
+            if (entry->transition)
+            {
+                // Adding a new field moves the instance on to the next shape
+                instance->EnsureFieldCapacity(entry->slot + 1);
+                instance->shape = entry->transition;
+            }
+
+            instance->fields[entry->slot] = PEEK(0);
 
             Value value = POP();
             POP();
@@ -872,6 +1295,122 @@ namespace script
 
             DISPATCH();
         }
+        CASE_CODE(INVOKE):
+        {
+            // A fused GET_PROPERTY and CALL
+            // The receiver stays in slot 0 so we don't need a bound method
+
+            ObjString* name = (ObjString*)READ_CONSTANT_LONG().ToObject();
+            int argCount = READ_BYTE();
+            PropertyCache* cache = &frame->function->chunk.propertyCaches[READ_SHORT()];
+
+            Value receiver = PEEK(argCount);
+
+            if (receiver.IsObjType(OBJ_MODULE))
+            {
+                // Module functions don't take the module as an argument
+                // Replace it with the function and call it like a normal function
+                ObjModule* mdl = (ObjModule*)receiver.ToObject();
+
+                Value* function = mdl->globals.Find(name->str);
+                if (!function)
+                {
+                    Error("Module doesn't contain function.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                m_CurrentFiber->stack.m_Top[-argCount - 1] = *function;
+
+                STORE_FRAME();
+
+                if (!CallValue(*function, argCount))
+                {
+                    Error("Could not call module function: " + std::string(name->str));
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                RELOAD_FRAME();
+                SAFEPOINT();
+                DISPATCH();
+            }
+
+            ObjClass* classObj = GetClassInline(receiver);
+
+            if (classObj == nullptr)
+            {
+                Error("Cannot call method: " + std::string(name->str) + " on a value without methods.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+
+            ObjInstance* instance = nullptr;
+            Shape* shape = nullptr;
+
+            if (receiver.IsObjType(OBJ_INSTANCE))
+            {
+                instance = (ObjInstance*)receiver.ToObject();
+                shape = instance->shape;
+            }
+
+            PropertyCacheEntry scratch;
+            PropertyCacheEntry* entry = LookupProperty(cache, classObj, shape, name, &scratch);
+
+            if (entry == nullptr)
+            {
+                Error("Method does not exist: " + std::string(name->str));
+                return INTERPRET_RUNTIME_ERROR;
+            }
+
+            if (entry->method == nullptr)
+            {
+                // A field holding something callable, call it like any other value
+                Value callee = instance->fields[entry->slot];
+                m_CurrentFiber->stack.m_Top[-argCount - 1] = callee;
+
+                STORE_FRAME();
+
+                if (!CallValue(callee, argCount))
+                {
+                    Error("Field is not callable: " + std::string(name->str));
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                RELOAD_FRAME();
+                SAFEPOINT();
+                DISPATCH();
+            }
+
+            if (entry->method->type == OBJ_FUNCTION)
+            {
+                ObjFunction* method = (ObjFunction*)entry->method;
+
+                STORE_FRAME();
+
+                if (!Call(method, argCount))
+                {
+                    Error("Failed to call method: " + std::string(name->str));
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                if (method->jit)
+                    ENTER_JIT(method->chunk.code.data());
+                else
+                    RELOAD_FRAME();
+            }
+            else
+            {
+                // Native methods get self as the first argument
+                ObjNative* native = (ObjNative*)entry->method;
+
+                Value result = native->Call(argCount + 1, m_CurrentFiber->stack.m_Top - argCount - 1);
+                CHECK_NATIVE_ERROR();
+
+                m_CurrentFiber->stack.m_Top -= argCount + 1;
+                PUSH(result);
+            }
+
+            SAFEPOINT();
+            DISPATCH();
+        }
         CASE_CODE(METHOD):
         {
 
@@ -924,8 +1463,9 @@ namespace script
 
                 }
 
-                PUSH(Value(memoryManager.AllocateString(output)));
+                PUSH(Value(m_Heap.AllocateString(output)));
             }
+            SAFEPOINT();
             DISPATCH();
         }
         CASE_CODE(ITER):
@@ -951,8 +1491,12 @@ namespace script
                 ObjArray* arr = (ObjArray*)obj;
                 uint32_t idx = (uint32_t)trunc(it);
 
+                // Past the end there's nothing to read, the loop is done
                 if (idx >= arr->size)
+                {
                     ip += jumpOffset;
+                    break;
+                }
 
                 *value = arr->values[idx];
                 iterator->MakeNumber((double)(idx + 1));
@@ -979,6 +1523,7 @@ namespace script
                 return INTERPRET_RUNTIME_ERROR;
             }
 
+            SAFEPOINT();
             DISPATCH();
         }
         CASE_CODE(IMPORT_MODULE):
@@ -994,10 +1539,8 @@ namespace script
                 // We have a fiber now let's run it
                 // Just make it be the current fiber we execute 
                 m_CurrentFiber = fiber;
-                frame->ip = ip;
-                frame = &m_CurrentFiber->frames[m_CurrentFiber->framesCount - 1];
-                ip = frame->ip;
-                constantTable = frame->function->chunk.constants.data();
+
+                LOAD_FRAME();
             }
 
             DISPATCH();
@@ -1036,18 +1579,6 @@ namespace script
 
                 if (m_ExecutingModule)
                 {
-                    // Add the module to the global variables
-                       
-
-                    // If we are within a module 
-                    // We need to check if when we go up its another module or global
-                    if (m_ExecutingModule->caller)
-                    {
-                        m_CurrentGlobal = &m_ExecutingModule->caller->methods;
-                    }
-                    else 
-                        m_CurrentGlobal = &m_GlobalVariables;
-
                     // Add the executing module to the globals
                     m_GlobalVariables[std::string(m_ExecutingModule->name->str)] = Value(m_ExecutingModule);
 
@@ -1056,6 +1587,16 @@ namespace script
 
                 }
 
+                // A fiber that was run from outside the loop goes back to whoever ran it
+                // Its result is left where the function was so they can pick it up
+                if (m_CurrentFiber == returnFiber && returnDepth != 0)
+                {
+                    m_CurrentFiber->stack.m_Top = frame->slots;
+                    PUSH(result);
+                    m_CurrentFiber = m_CurrentFiber->caller;
+                    return INTERPRET_ALL_GOOD;
+                }
+
                 // Check if we are a fiber
                 // If we aren't this is the main script and its done
                 if (m_CurrentFiber->caller != nullptr)
@@ -1066,6 +1607,7 @@ namespace script
                     
 
                     LOAD_FRAME();
+                    SAFEPOINT();
                     DISPATCH();
                 }
                 else
@@ -1080,9 +1622,13 @@ namespace script
 
             m_CurrentFiber->stack.m_Top = frame->slots;
             PUSH(result);
+
+            if (m_CurrentFiber == returnFiber && m_CurrentFiber->framesCount < returnDepth)
+                return INTERPRET_ALL_GOOD;
             
             LOAD_FRAME();
                
+            SAFEPOINT();
             DISPATCH();
         }
 
@@ -1094,6 +1640,14 @@ namespace script
 
         // Undef everything
 #undef BINARY_OP 
+#undef BINARY_OP_NUM
+#undef MATHS_INTRINSIC
+#undef CHECK_NUMBER_OPERANDS
+#undef CHECK_NATIVE_ERROR
+#undef COMPARE_JUMP
+#undef QUICKEN
+#undef READ_GLOBAL_SLOT
+#undef DEOPTIMIZE
 #undef READ_CONSTANT
 #undef READ_BYTE
 #undef READ_CONSTANT_LONG
@@ -1103,6 +1657,11 @@ namespace script
 #undef CASE_CODE
 #undef PEEK
 #undef INTERPRET_LOOP
+#undef SAFEPOINT
+#undef STORE_FRAME
+#undef RELOAD_FRAME
+#undef LOAD_FRAME
+#undef ENTER_JIT
 	}
 
     bool VM::CallValue(Value value, int argCount)
@@ -1117,9 +1676,11 @@ namespace script
         case OBJ_NATIVE: 
         {
             ObjNative* native = (ObjNative*)value.ToObject();
-            NativeFunc func = native->function;
 
-            Value result = func(argCount, m_CurrentFiber->stack.m_Top - argCount);
+            Value result = native->Call(argCount, m_CurrentFiber->stack.m_Top - argCount);
+
+            if (TakeNativeError())
+                return false;
 
             m_CurrentFiber->stack.m_Top -= argCount + 1; 
 
@@ -1152,7 +1713,6 @@ namespace script
             if (bound->isNative)
             {
                 ObjNative* native = bound->native;
-                NativeFunc func = native->function;
 
                 // For native functions we need to do something a bit more
                 // Native functions here always have an argument. self 
@@ -1167,9 +1727,12 @@ namespace script
 
                 Value result;
                 if (!moduleFunc)
-                    result = func(argCount + 1, (m_CurrentFiber->stack.m_Top) - argCount - 1);
+                    result = native->Call(argCount + 1, (m_CurrentFiber->stack.m_Top) - argCount - 1);
                 else 
-                    result = func(argCount, (m_CurrentFiber->stack.m_Top) - argCount);
+                    result = native->Call(argCount, (m_CurrentFiber->stack.m_Top) - argCount);
+
+                if (TakeNativeError())
+                    return false;
 
                 m_CurrentFiber->stack.m_Top -= argCount + 1;
 
@@ -1191,6 +1754,61 @@ namespace script
 
     }
 
+    bool VM::ResolveGetProperty(ObjClass* klass, Shape* shape, ObjString* name, PropertyCacheEntry* entry)
+    {
+        entry->klass = klass;
+        entry->shape = shape;
+        entry->method = nullptr;
+        entry->slot = 0;
+        entry->transition = nullptr;
+
+        // Methods take priority over fields
+        auto it = klass->methods.find(name->str);
+        if (it != klass->methods.end())
+        {
+            entry->method = it->second.ToObject();
+            return true;
+        }
+
+        // Only instances can have fields
+        if (shape == nullptr)
+            return false;
+
+        int32_t slot = shape->FindSlot(name);
+        if (slot < 0)
+            return false;
+
+        entry->slot = (uint32_t)slot;
+        return true;
+    }
+
+    void VM::ResolveSetProperty(ObjInstance* instance, ObjString* name, PropertyCacheEntry* entry)
+    {
+        entry->klass = instance->klass;
+        entry->shape = instance->shape;
+        entry->method = nullptr;
+        entry->transition = nullptr;
+
+        int32_t slot = instance->shape->FindSlot(name);
+
+        if (slot >= 0)
+        {
+            entry->slot = (uint32_t)slot;
+            return;
+        }
+
+        // A new field goes on the end and moves the instance to a new shape
+        entry->slot = instance->shape->fieldCount;
+        entry->transition = instance->shape->AddField(name);
+    }
+
+    void VM::AddPropertyCacheEntry(PropertyCache* cache, const PropertyCacheEntry& entry)
+    {
+        // Once the cache is full the site is megamorphic and keeps using the slow path
+        if (cache->count < PropertyCacheSize)
+            cache->entries[cache->count++] = entry;
+    }
+
     void VM::DefineMethod(const std::string& name)
     {
         Value method = m_CurrentFiber->stack.Peek(0);
@@ -1201,7 +1819,8 @@ namespace script
 
     bool VM::Call(ObjFunction* function, int argCount)
     {
-        if (m_CurrentFiber->framesCount == MaxCallFrames)
+        // Loading first, a lazy function doesn't know how much stack it needs until then
+        if (!LoadFunction(function) || !m_CurrentFiber->ReserveCall(function->maxStack))
             return false;
 
         CallFrame* frame = &m_CurrentFiber->frames[m_CurrentFiber->framesCount++];
@@ -1210,15 +1829,154 @@ namespace script
 
 
         frame->slots = m_CurrentFiber->stack.m_Top - argCount - 1;
+
+        CountHotness(function);
         return true; 
     }
 
+    bool VM::RunFrame()
+    {
+        ObjFiber* fiber = m_CurrentFiber;
+        size_t depth = fiber->framesCount;
+        CallFrame* frame = &fiber->frames[depth - 1];
+
+        if (frame->function->jit)
+        {
+            JITStatus status = EnterJIT(frame->ip);
+
+            if (status == JIT_RETURNED)
+                return true;
+
+            if (status == JIT_ERROR)
+                return false;
+        }
+
+        // Not compiled or it bailed out, the interpreter finishes it off
+        return Run(depth) == INTERPRET_ALL_GOOD;
+    }
+
+    JITStatus VM::EnterJIT(uint8_t* ip)
+    {
+        ObjFiber* fiber = m_CurrentFiber;
+
+        // Compiled code calls compiled code on the C stack, past this depth the interpreter takes over
+        if (fiber->framesCount > JITMaxCallDepth)
+            return JIT_BAILOUT;
+
+        CallFrame* frame = &fiber->frames[fiber->framesCount - 1];
+
+        JITStatus status = frame->function->jit->Enter(this, frame, &fiber->stack.m_Top, ip);
+
+        if (status != JIT_RETURNED)
+            return status;
+
+        // Calls made from the native code can move the frames
+        frame = &fiber->frames[fiber->framesCount - 1];
+
+        // The last frame of a fiber is left to OP_RETURN, it knows how to finish fibers and modules
+        // The JIT has pointed ip at the return
+        if (fiber->framesCount == 1)
+            return JIT_BAILOUT;
+
+        Value result = fiber->stack.m_Top[-1];
+
+        fiber->framesCount--;
+        fiber->stack.m_Top = frame->slots;
+        fiber->stack.Push(result);
+
+        return JIT_RETURNED;
+    }
+
+    void VM::TierUp(ObjFunction* function)
+    {
+        function->jit = CompileJIT(this, function);
+
+        if (function->jit)
+            m_JITFunctions.push_back(function->jit);
+    }
+
+    bool VM::PollEvents()
+    {
+        if (m_Events.pollCountdown <= 0)
+            m_Events.Poll();
+
+        for (;;)
+        {
+            while (!m_Events.IsEmpty())
+            {
+                Event evnt = m_Events.Pop();
+
+                switch (evnt.type)
+                {
+                case EVENT_PUSH_FIBER:
+                {
+                    m_WaitingFibers.push_back(evnt.fiber);
+                    break;
+                }
+                case EVENT_TRIGGER_GC:
+                {
+                    CollectGarbage();
+                    m_Heap.m_NextGC = m_Heap.m_BytesAllocated * GC_HEAP_GROW_FACTOR;
+                    break;
+                }
+                default:
+                    break;
+                }
+            }
+
+            // The one that's running gets to finish first, whoever started it runs the rest after
+            if (m_RunningFiber || m_WaitingFibers.empty())
+                return true;
+
+            ObjFiber* fiber = m_WaitingFibers.front();
+            m_WaitingFibers.pop_front();
+
+            if (!RunFiber(fiber))
+                return false;
+        }
+    }
+
+    InterpretResult VM::RunEvents()
+    {
+        MakeCurrent();
+
+        for (;;)
+        {
+            if (!PollEvents())
+                return INTERPRET_RUNTIME_ERROR;
+
+            if (m_Timer.GetActiveTimerCount() == 0 && !m_Events.HasWork())
+                return INTERPRET_ALL_GOOD;
+
+            // Timer and descriptor callbacks queue their fibers up as events
+            m_Events.Wait();
+        }
+    }
+
+    bool VM::RunFiber(ObjFiber* fiber)
+    {
+        fiber->caller = m_CurrentFiber;
+        m_CurrentFiber = fiber;
+
+        m_RunningFiber = true;
+        bool ok = Run(1) == INTERPRET_ALL_GOOD;
+        m_RunningFiber = false;
+
+        return ok;
+    }
+
     ObjFiber* VM::ImportModule(const std::string& name, const std::string& asName)
     {
 
        
         std::string importName = asName.empty() ? name : asName;
 
+        // The globals of the code doing the import
+        // Modules imported without a name get loaded straight into these
+        GlobalTable* importer = &m_GlobalVariables;
+        if (m_CurrentFiber && m_CurrentFiber->framesCount > 0)
+            importer = m_CurrentFiber->frames[m_CurrentFiber->framesCount - 1].function->globals;
+
 
         auto it = ModuleLoaders.find(name);
         if (it != ModuleLoaders.end())
@@ -1239,7 +1997,8 @@ namespace script
                     mdl = (ObjModule*)loadedMdl->second.ToObject();
                 else
                 {
-                    mdl = CreateModule(memoryManager.AllocateString(asName));
+                    mdl = CreateModule(m_Heap.AllocateString(asName));
+                    mdl->globals.parent = &m_GlobalVariables;
                     m_Modules[asName] = mdl;
                 }
             }
@@ -1248,7 +2007,7 @@ namespace script
 
             // Make sure to add the new module to global
             if (mdl != nullptr)
-                m_CurrentGlobal->operator[](asName) = mdl;
+                (*importer)[asName] = mdl;
 
             return nullptr;
         }
@@ -1264,12 +2023,13 @@ namespace script
         if (!asName.empty())
         {
             // Create a new module
-            m_Modules[importName] = Value(CreateModule(memoryManager.AllocateString(importName.c_str())));
+            m_Modules[importName] = Value(CreateModule(m_Heap.AllocateString(importName.c_str())));
 
             ObjModule* mdl = (ObjModule*)m_Modules[importName].ToObject();
 
-            // Set the current global to import into this scope of the module
-            m_CurrentGlobal = &mdl->methods;
+            // The module gets its own globals but can still see the builtins
+            mdl->globals.parent = &m_GlobalVariables;
+            importer = &mdl->globals;
             mdl->caller = nullptr;
 
             if (m_ExecutingModule)
@@ -1286,18 +2046,45 @@ namespace script
        
 
         std::string file = m_IOInterface->ReadFile(name + ".lang");
+        ObjFunction* func = nullptr;
 
         if (file.empty())
         {
-            Error("Cannot read file: " + name + ".lang to import as a module");
-            return nullptr; 
+            // Modules can be shipped compiled without their source
+            func = LoadPrecompiledScript(m_IOInterface, name + ".langc");
+
+            if (!func)
+            {
+                Error("Cannot read file: " + name + ".lang to import as a module");
+                return nullptr;
+            }
+        }
+        else
+        {
+            // Compile the module, or load it if it's been compiled before
+            if (m_ImageCache)
+                func = InstantiateImage(m_ImageCache->Get(m_IOInterface, name + ".langc", file));
+            else
+                func = LoadOrCompileScript(m_IOInterface, name + ".langc", file);
+
+            if (!func)
+            {
+                Error("Failed to compile module: " + name + ".lang");
+                return nullptr;
+            }
         }
 
-        // Compile the module 
-        ObjFunction* func = CompileScript(file);
+        LinkFunction(func, importer);
 
         // Create a new fiber to run it
         ObjFiber* fiber = CreateFiber(func);
+
+        if (!fiber)
+        {
+            Error("Failed to load module: " + name);
+            return nullptr;
+        }
+
         fiber->caller = m_CurrentFiber;
 
         return fiber;
@@ -1327,7 +2114,13 @@ namespace script
 
     void VM::MarkRoots()
     {
-        MarkObject(m_CurrentFiber);
+
+        MarkObject(m_NumericClass);
+        MarkObject(m_StringClass);
+        MarkObject(m_BoolClass);
+        MarkObject(m_ListClass);
+        MarkObject(m_RangeClass);
+        MarkObject(m_DictionaryClass);
 
         MarkTable(m_Modules);
 
@@ -1335,18 +2128,40 @@ namespace script
         if (m_ExecutingModule)
             MarkObject(m_ExecutingModule);
 
-        for (Value* slot = m_CurrentFiber->stack.m_Stack; slot < m_CurrentFiber->stack.m_Top; slot++)
+        // Fibers waiting on the current one are still in use
+        for (ObjFiber* fiber = m_CurrentFiber; fiber; fiber = fiber->caller)
+            MarkFiber(fiber);
+
+        // So are the ones timers have queued up that haven't started yet
+        for (const Event& evnt : m_Events.m_EventQueue)
         {
-            MarkValue(*slot);
+            if (evnt.type == EVENT_PUSH_FIBER)
+                MarkFiber(evnt.fiber);
         }
 
-        for (int i = 0; i < m_CurrentFiber->framesCount; i++)
+        for (ObjFiber* fiber : m_WaitingFibers)
+            MarkFiber(fiber);
+
+        // And the functions of the ones the timers haven't made yet
+        m_Timer.ForEachFunction([this](ObjFunction* function) { MarkObject(function); });
+
+        MarkTable(m_GlobalVariables);
+        // MarkStringTable(m_Heap.m_Strings);
+    }
+
+    void VM::MarkFiber(ObjFiber* fiber)
+    {
+        MarkObject(fiber);
+
+        for (Value* slot = fiber->stack.m_Stack; slot < fiber->stack.m_Top; slot++)
         {
-            MarkObject(m_CurrentFiber->frames[i].function);
+            MarkValue(*slot);
         }
 
-        MarkTable(m_GlobalVariables);
-        // MarkStringTable(memoryManager.m_Strings);
+        for (int i = 0; i < fiber->framesCount; i++)
+        {
+            MarkObject(fiber->frames[i].function);
+        }
     }
 
     void VM::MarkValue(Value value)
@@ -1365,6 +2180,11 @@ namespace script
         }
     }
 
+    void VM::MarkTable(GlobalTable& table)
+    {
+        MarkArray(table.values, table.count);
+    }
+
     void VM::MarkTable(ankerl::unordered_dense::map<uint64_t, Value> table)
     {
         for (auto& i : table)
@@ -1383,6 +2203,15 @@ namespace script
         }
     }
 
+    void VM::MarkShape(Shape* shape)
+    {
+        for (auto& [name, child] : shape->transitions)
+        {
+            MarkObject(name);
+            MarkShape(child);
+        }
+    }
+
     void VM::MarkArray(Value* arr, size_t length)
     {
         for (size_t i = 0; i < length; i++)
@@ -1396,6 +2225,13 @@ namespace script
         printf("Error: %s", message.c_str());
     }
 
+    void VM::NativeError(const std::string& message)
+    {
+        // Natives report before the VM adds its own error, this keeps them on separate lines
+        Error(message + "\n");
+        m_NativeError = true;
+    }
+
     void VM::CollectGarbage()
     {
         MarkRoots();
@@ -1405,12 +2241,12 @@ namespace script
 
         // Remove marked strings from string table
 
-        for (auto& i : memoryManager.m_Strings)
+        for (auto it = m_Heap.m_Strings.begin(); it != m_Heap.m_Strings.end();)
         {
-            if (!i.second->isMarked)
-            {
-                memoryManager.m_Strings.erase(i.first);
-            }
+            if (!it->second->isMarked)
+                it = m_Heap.m_Strings.erase(it);
+            else
+                ++it;
         }
 
         Sweep();
@@ -1449,6 +2285,18 @@ namespace script
             MarkArray(func->chunk.constants.data(), func->chunk.constants.size());
             MarkObject(func->name);
 
+            // Keep anything the inline caches point at alive so a cached class can't be reused by a new allocation
+            for (PropertyCache& cache : func->chunk.propertyCaches)
+            {
+                for (uint32_t i = 0; i < cache.count; i++)
+                {
+                    MarkObject(cache.entries[i].klass);
+
+                    if (cache.entries[i].method)
+                        MarkObject(cache.entries[i].method);
+                }
+            }
+
             break;
         }
         case OBJ_CLASS:
@@ -1458,6 +2306,10 @@ namespace script
             MarkObject(instance->name);
             MarkTable(instance->methods);
 
+            // Shapes key on the interned field names so they need to stay alive
+            if (instance->rootShape)
+                MarkShape(instance->rootShape);
+
             break;
         }
         case OBJ_INSTANCE:
@@ -1466,7 +2318,7 @@ namespace script
 
             MarkObject(instance->klass);
 
-            MarkTable(instance->fields);
+            MarkArray(instance->fields, instance->shape->fieldCount);
             
             break;
         }
@@ -1492,7 +2344,7 @@ namespace script
         case OBJ_MODULE: 
         {
             ObjModule* mdl = (ObjModule*)obj;
-            MarkTable(mdl->methods);
+            MarkTable(mdl->globals);
             MarkObject(mdl->name);
 
             /*mdl = mdl->caller;
@@ -1515,17 +2367,14 @@ namespace script
         }
         case OBJ_FIBER:
         {
-            // Go up the caller list and mark them all 
+            // Only the direct caller, it gets blackened in turn so the rest of the list follows
+            // Walking the whole list from every fiber is quadratic once a batch of timer fibers stacks up
 
-            ObjFiber* curr = ((ObjFiber*)obj)->caller;
+            ObjFiber* caller = ((ObjFiber*)obj)->caller;
 
-            while (curr != nullptr)
-            {
-                MarkObject(curr);
+            if (caller != nullptr)
+                MarkObject(caller);
 
-                curr = curr->caller;
-            }
-           
 
             break;
         }
@@ -1534,15 +2383,15 @@ namespace script
 
     void VM::Sweep()
     {
-        for (size_t i = 0; i < memoryManager.m_Allocations.size(); i++)
+        for (size_t i = 0; i < m_Heap.m_Allocations.size(); i++)
         {
-            Object* obj = memoryManager.m_Allocations[i];
+            Object* obj = m_Heap.m_Allocations[i];
 
             if (!obj->isMarked)
             {
 
-                memoryManager.FreeObject(obj);
-                memoryManager.m_Allocations.erase(memoryManager.m_Allocations.begin() + i);
+                m_Heap.FreeObject(obj);
+                m_Heap.m_Allocations.erase(m_Heap.m_Allocations.begin() + i);
                 i--;
             }
             else
@@ -6,9 +6,14 @@
 #include <unordered_map>
 #include <functional>
 #include <tuple>
+#include <cmath>
 #include "Interface.h"
+#include "Bytecode.h"
 #include "Memory.h"
+#include "Snapshot.h"
 #include "Stack.h"
+#include "JIT.h"
+#include "Trace.h"
 
 #include "Vendor/unordered_dense.h"
 #include "EventSystem.h"
@@ -49,7 +54,7 @@ namespace script
 
 	inline ObjBoundMethod* NewBoundMethod(Value reciever, ObjFunction* function)
 	{
-		ObjBoundMethod* instance = memoryManager.AllocateObject<ObjBoundMethod>();
+		ObjBoundMethod* instance = CurrentHeap().AllocateObject<ObjBoundMethod>();
 
 		instance->type = OBJ_BOUND_METHOD;
 		instance->reciever = reciever;
@@ -61,7 +66,7 @@ namespace script
 
 	inline ObjBoundMethod* NewNativeBoundMethod(Value reciever, ObjNative* function)
 	{
-		ObjBoundMethod* instance = memoryManager.AllocateObject<ObjBoundMethod>();
+		ObjBoundMethod* instance = CurrentHeap().AllocateObject<ObjBoundMethod>();
 
 		instance->type = OBJ_BOUND_METHOD;
 		instance->reciever = reciever;
@@ -77,10 +82,41 @@ namespace script
 
 		void Delete() override
 		{
-			// stack.~Stack();
+			stack.Release();
 
 			if (frames)
-				delete[] frames;
+				frames = (CallFrame*)Allocate(frames, sizeof(CallFrame) * framesCapacity, 0);
+		}
+
+		// Makes sure there is room for one more frame and its slots before a call
+		// Every frame gets at least FrameStackSize, functions that need more than that ask for it
+		// Either array can move so anything pointing into them has to be loaded again after this
+		// Returns false once the call would go past MaxCallFrames
+		bool ReserveCall(size_t slots = FrameStackSize)
+		{
+			if (framesCount == framesCapacity)
+			{
+				if (framesCapacity >= MaxCallFrames)
+					return false;
+
+				size_t capacity = framesCapacity * 2;
+				frames = (CallFrame*)Allocate(frames, sizeof(CallFrame) * framesCapacity, sizeof(CallFrame) * capacity);
+				framesCapacity = capacity;
+			}
+
+			slots = std::max(slots, FrameStackSize);
+
+			if (!stack.HasRoom(slots))
+			{
+				Value* old = stack.Grow(slots);
+
+				for (size_t i = 0; i < framesCount; i++)
+					frames[i].slots = stack.m_Stack + (frames[i].slots - old);
+
+				delete[] old;
+			}
+
+			return true;
 		}
 
 		Stack stack;
@@ -97,13 +133,21 @@ namespace script
 		bool awaiting = false;
 	};
 
+	// nullptr if the function comes from a damaged image
 	inline ObjFiber* CreateFiber(ObjFunction* func)
 	{
-		ObjFiber* fiber = memoryManager.AllocateObject<ObjFiber>();
+		if (!LoadFunction(func))
+			return nullptr;
+
+		ObjFiber* fiber = CurrentHeap().AllocateObject<ObjFiber>();
 
 		fiber->type = OBJ_FIBER;
-		fiber->frames = (CallFrame*)Allocate(nullptr, 0, sizeof(CallFrame) * 64);
-		fiber->framesCapacity = 64;
+		fiber->frames = (CallFrame*)Allocate(nullptr, 0, sizeof(CallFrame) * FramesInitialCapacity);
+		fiber->framesCapacity = FramesInitialCapacity;
+
+		// The stack starts out with room for a single frame, big scripts need more
+		if (!fiber->stack.HasRoom(func->maxStack))
+			delete[] fiber->stack.Grow(func->maxStack);
 
 		Value val{};
 		val.MakeObject(func);
@@ -124,10 +168,48 @@ namespace script
 		INTERPRET_RUNTIME_ERROR
 	};
 
+	// Counts how often the property inline caches managed to skip the hash map lookups
+	struct InlineCacheStats
+	{
+		size_t hits = 0;
+		size_t misses = 0;
+	};
+
+	// What the std:maths native behind an OP_MATH_ instruction returns
+	// With a constant instruction this folds down to the one operation
+	inline double MathsIntrinsicResult(uint8_t instruction, double a, double b)
+	{
+		switch (instruction)
+		{
+		case OP_MATH_SQRT:	return std::sqrt(a);
+		case OP_MATH_SIN:	return std::sin(a);
+		case OP_MATH_COS:	return std::cos(a);
+		case OP_MATH_ABS:	return std::fabs(a);
+		case OP_MATH_FLOOR:	return std::floor(a);
+		case OP_MATH_MIN:	return a < b ? a : b;
+		case OP_MATH_MAX:	return a > b ? a : b;
+		default:			return std::atan2(a, b);
+		}
+	}
+
 	struct VMCreateInfo
 	{
 		IOInterface* ioInterface = nullptr;
 		bool sandboxed = false;
+
+		// Compiles hot functions to native code where the JIT is supported
+		bool enableJIT = true;
+		uint32_t jitThreshold = JITDefaultThreshold;
+
+		// Records hot loops and compiles them as traces, needs the JIT
+		bool enableTracing = true;
+
+		// Imported modules come from here when it's set, VMs sharing a cache only compile each module once
+		std::shared_ptr<ImageCache> imageCache;
+
+		// Starts the VM with everything from the snapshot instead of loading the builtins, see Snapshot.h
+		// Any number of VMs on any number of threads can be made from the same one
+		std::shared_ptr<const HeapSnapshot> snapshot;
 	};
 
 	class VM
@@ -138,16 +220,38 @@ namespace script
 
 		~VM();
 
+		// Makes this VM's heap the one objects get allocated in on this thread
+		// Interpret and Run do this themselves, anything compiled or loaded for the VM before it runs needs it first
+		void MakeCurrent() { m_Heap.MakeCurrent(); }
+
+		// Runs the script and then its timers and anything else it's waiting on, see RunEvents
 		InterpretResult Interpret(ObjFunction* function);
 
-		InterpretResult Run();
+		// Runs until the current fiber finishes
+		// With a return depth it stops once the fiber has returned from the frame at that depth instead
+		InterpretResult Run(size_t returnDepth = 0);
+
+		// Runs the fibers timers and watched descriptors queue up until none are left to wait for
+		// The thread sleeps in the kernel whenever nothing is ready
+		InterpretResult RunEvents();
+
+		// Calls a global function from the host once the script has run, on a fiber of its own
+		// The result is only safe to hold on to until the VM runs again, the collector doesn't know about it
+		InterpretResult CallFunction(const std::string& name, const Value* args, int argCount, Value* result = nullptr);
+
+		// Everything in the heap for more VMs to start from, take it once the startup scripts have run
+		// nullptr if the VM is in the middle of running, has timers or events waiting, or holds fibers or user data
+		std::shared_ptr<const HeapSnapshot> TakeSnapshot();
 
 		void DumpGlobalVariables()
 		{
-			for (auto& v : m_GlobalVariables)
+			for (size_t i = 0; i < m_GlobalVariables.count; i++)
 			{
-				printf("Global: %s = ", v.first.c_str());
-				v.second.Print();
+				if (m_GlobalVariables.values[i].IsUndefined())
+					continue;
+
+				printf("Global: %s = ", m_GlobalVariables.names[i].c_str());
+				m_GlobalVariables.values[i].Print();
 				printf("\n");
 			}
 		}
@@ -163,6 +267,19 @@ namespace script
 			}
 		}
 
+		const InlineCacheStats& GetInlineCacheStats() const
+		{
+			return m_InlineCacheStats;
+		}
+
+		void DumpInlineCacheStats()
+		{
+			size_t total = m_InlineCacheStats.hits + m_InlineCacheStats.misses;
+			double ratio = total > 0 ? (double)m_InlineCacheStats.hits / (double)total : 0.0;
+
+			printf("Inline Caches: %zu hits, %zu misses (%.2f%% hit rate)\n", m_InlineCacheStats.hits, m_InlineCacheStats.misses, ratio * 100.0);
+		}
+
 		const std::vector<std::string>& GetExportedVariables()
 		{
 			return m_ExportedVariables;
@@ -170,12 +287,7 @@ namespace script
 
 		Value* GetGlobal(const std::string& name)
 		{
-			if (m_GlobalVariables.find(name) != m_GlobalVariables.end())
-			{
-				return &m_GlobalVariables[name];
-			}
-
-			return nullptr;
+			return m_GlobalVariables.Find(name);
 		}
 
 		
@@ -184,11 +296,21 @@ namespace script
 			return m_GlobalVariables[name];
 		}
 
+		void AddNativeFunction(const std::string& name, NativeFn func, int arity, void* context = nullptr)
+		{
+			m_GlobalVariables[name] = Value(NewNativeFunction(func, arity, context));
+		}
+
 		void AddNativeFunction(const std::string& name, NativeFunc func, int arity)
 		{
-			m_GlobalVariables[name] = Value(NewNativeFunction(func, arity));
+			m_GlobalVariables[name] = Value(NewNativeFunction(std::move(func), arity));
 		}
 
+		// The classes behind the built in types
+		// Natives can be added to these to give the types methods 
+		ClassInterface GetStringClass() { return GetClassInterface(m_StringClass); }
+		ClassInterface GetListClass() { return GetClassInterface(m_ListClass); }
+
 		ClassInterface AddNativeClass(const std::string& name)
 		{
 			ClassInterface classInterface{};
@@ -200,19 +322,78 @@ namespace script
 			return classInterface;
 		}
 
+		// Lets a native fail the call it is in, the error is raised once it returns
+		// Its return value is thrown away
+		void NativeError(const std::string& message);
+
 		// Pauses the current execution of code and calls this fiber
 		// Result of the fiber can be retrieved 
 		void ExecuteFiber(ObjFiber* fiber);
 
+		bool IsTracingEnabled() const { return m_TracingEnabled; }
+
+		MemoryManager& GetHeap() { return m_Heap; }
+		EventManager& GetEventManager() { return m_Events; }
+		Timer& GetTimer() { return m_Timer; }
+
 	private:
 
+		friend struct JITRuntime;
+		friend class SnapshotWriter;
+		friend class SnapshotReader;
+
+		// Everything the VM allocates lives in its own heap, it's declared first so it goes last
+		MemoryManager m_Heap;
+		EventManager m_Events;
+		Timer m_Timer{ m_Events };
+
 		IOInterface* m_IOInterface = nullptr;
+		std::shared_ptr<ImageCache> m_ImageCache;
+
+		ClassInterface GetClassInterface(ObjClass* klass)
+		{
+			ClassInterface classInterface{};
+			classInterface.m_Ptr = klass;
+			return classInterface;
+		}
 
 
 		void Error(const std::string& message);
 
 		bool CallValue(Value value, int argCount);
 
+		// Checks the callee of an OP_MATH_ instruction is still the std:maths native
+		// Module functions are found through the instruction's cache so only the first call looks the name up
+		bool IsMathsNative(Value callee, uint8_t instruction, ObjString* name, PropertyCache* cache)
+		{
+			if (callee.IsObjType(OBJ_MODULE))
+			{
+				ObjModule* mdl = (ObjModule*)callee.ToObject();
+				PropertyCacheEntry& entry = cache->entries[0];
+
+				if (entry.method != mdl)
+				{
+					auto it = mdl->globals.slots.find(name->str);
+					if (it == mdl->globals.slots.end())
+						return false;
+
+					entry.method = mdl;
+					entry.slot = it->second;
+				}
+
+				callee = mdl->globals.values[entry.slot];
+			}
+
+			return callee.IsObjType(OBJ_NATIVE) && ((ObjNative*)callee.ToObject())->function == mathsIntrinsics[instruction - OP_MATH_SQRT];
+		}
+
+		bool TakeNativeError()
+		{
+			bool error = m_NativeError;
+			m_NativeError = false;
+			return error;
+		}
+
 		bool Call(ObjFunction* function, int argCount);
 
 		bool Invoke(const std::string& name, int argCount);
@@ -220,9 +401,45 @@ namespace script
 
 		void DefineMethod(const std::string& name);
 
-		ankerl::unordered_dense::map<std::string, Value> m_GlobalVariables;
+		// JIT
+		// Runs the top frame of the current fiber until it returns, in native code if it has some
+		bool RunFrame();
+
+		// Enters the native code for the top frame at ip
+		// A returned frame is popped and its result pushed like OP_RETURN would
+		JITStatus EnterJIT(uint8_t* ip);
+
+		// Compiles a function that has got hot
+		void TierUp(ObjFunction* function);
+
+		// Counts calls and loop back edges
+		inline void CountHotness(ObjFunction* function)
+		{
+			if (m_JITEnabled && function->hotness < m_JITThreshold && ++function->hotness == m_JITThreshold)
+				TierUp(function);
+		}
 
-		ankerl::unordered_dense::map<std::string, Value>* m_CurrentGlobal;
+		// Handles any pending events, the interpreter's safepoints come here too, returns false if a fiber errored
+		bool PollEvents();
+
+		// Runs a fiber from the event queue to completion and returns to the current one
+		bool RunFiber(ObjFiber* fiber);
+
+		// Fibers from the event queue run one at a time in the order they were queued
+		// Any that come up while one is running wait here until it returns, rather than piling up on top of it
+		std::deque<ObjFiber*> m_WaitingFibers;
+		bool m_RunningFiber = false;
+
+		bool m_JITEnabled = false;
+		uint32_t m_JITThreshold = JITDefaultThreshold;
+		std::vector<JITFunction*> m_JITFunctions;
+
+		bool m_TracingEnabled = false;
+		TraceRecorder m_Recorder{ &m_Events.size, &m_Events.pollCountdown };
+
+		bool m_NativeError = false;
+
+		GlobalTable m_GlobalVariables;
 
 		
 		std::vector<std::string> m_ExportedVariables;
@@ -232,6 +449,48 @@ namespace script
 		ObjFiber* m_CurrentFiber = nullptr;
 		ObjModule* m_ExecutingModule = nullptr;
 
+		InlineCacheStats m_InlineCacheStats;
+
+		// Property inline caches
+		// A miss resolves the property the slow way and fills in the entry, this is only added to the cache if there is room 
+		// Returns false if the property doesn't exist
+		bool ResolveGetProperty(ObjClass* klass, Shape* shape, ObjString* name, PropertyCacheEntry* entry);
+		void ResolveSetProperty(ObjInstance* instance, ObjString* name, PropertyCacheEntry* entry);
+
+		void AddPropertyCacheEntry(PropertyCache* cache, const PropertyCacheEntry& entry);
+
+		inline PropertyCacheEntry* FindPropertyCacheEntry(PropertyCache* cache, ObjClass* klass, Shape* shape)
+		{
+			for (uint32_t i = 0; i < cache->count; i++)
+			{
+				if (cache->entries[i].shape == shape && cache->entries[i].klass == klass)
+					return &cache->entries[i];
+			}
+
+			return nullptr;
+		}
+
+		// Looks up a property on a receiver through the cache, returns nullptr if it doesn't exist
+		// Misses are resolved into the scratch entry 
+		inline PropertyCacheEntry* LookupProperty(PropertyCache* cache, ObjClass* klass, Shape* shape, ObjString* name, PropertyCacheEntry* scratch)
+		{
+			PropertyCacheEntry* entry = FindPropertyCacheEntry(cache, klass, shape);
+
+			if (entry)
+			{
+				m_InlineCacheStats.hits++;
+				return entry;
+			}
+
+			m_InlineCacheStats.misses++;
+
+			if (!ResolveGetProperty(klass, shape, name, scratch))
+				return nullptr;
+
+			AddPropertyCacheEntry(cache, *scratch);
+			return scratch;
+		}
+
 
 		ObjFiber* ImportModule(const std::string& name, const std::string& asName = "");
 
@@ -240,10 +499,13 @@ namespace script
 		void MarkRoots();
 		void MarkObject(Object* obj);
 		void MarkValue(Value value);
+		void MarkFiber(ObjFiber* fiber);
 		void MarkTable(ankerl::unordered_dense::map<std::string, Value> table);
 		void MarkTable(ankerl::unordered_dense::map<uint64_t, Value> table);
+		void MarkTable(GlobalTable& table);
 		void MarkStringTable(ankerl::unordered_dense::map<std::string, ObjString*> strs);
 		void MarkArray(Value* arr, size_t length);
+		void MarkShape(Shape* shape);
 
 		void CollectGarbage();
 
@@ -256,12 +518,12 @@ namespace script
 
 		// These are object classes
 
-		ObjClass* m_NumericClass;
-		ObjClass* m_StringClass;
-		ObjClass* m_BoolClass;
-		ObjClass* m_ListClass;
-		ObjClass* m_RangeClass;
-		ObjClass* m_DictionaryClass;
+		ObjClass* m_NumericClass = nullptr;
+		ObjClass* m_StringClass = nullptr;
+		ObjClass* m_BoolClass = nullptr;
+		ObjClass* m_ListClass = nullptr;
+		ObjClass* m_RangeClass = nullptr;
+		ObjClass* m_DictionaryClass = nullptr;
 
 
 		inline ObjClass* GetClassInline(Value v)
@@ -282,6 +544,14 @@ namespace script
 					return (ObjClass*)v.ToObject();
 				case OBJ_INSTANCE:
 					return ((ObjInstance*)v.ToObject())->klass;
+				case OBJ_STRING:
+					return m_StringClass;
+				case OBJ_ARRAY:
+					return m_ListClass;
+				case OBJ_RANGE:
+					return m_RangeClass;
+				case OBJ_DICTIONARY:
+					return m_DictionaryClass;
 				default:
 					return nullptr;
 					break;
@@ -0,0 +1,417 @@
+#include "VMPool.h"
+#include "Bytecode.h"
+#include "Memory.h"
+
+#include <algorithm>
+#include <cstdio>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace script
+{
+	struct VMPool::Job
+	{
+		std::string function;
+		std::vector<PoolValue> args;
+		std::promise<JobResult> promise;
+		std::chrono::steady_clock::time_point submitted;
+	};
+
+	// Bounded queue any number of threads can push to and pop from without locking
+	// Each cell has a sequence number saying whose turn it is, a pusher waits for it to equal its position
+	// and a popper for it to be one past, so the only thing threads fight over is the two positions
+	class VMPool::JobQueue
+	{
+	public:
+
+		explicit JobQueue(size_t capacity)
+		{
+			size_t size = 2;
+			while (size < capacity)
+				size *= 2;
+
+			m_Cells = std::make_unique<Cell[]>(size);
+			m_Mask = size - 1;
+
+			for (size_t i = 0; i < size; i++)
+				m_Cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+
+		// False when it's full
+		bool Push(Job* value)
+		{
+			size_t position = m_Tail.load(std::memory_order_relaxed);
+			Cell* cell;
+
+			for (;;)
+			{
+				cell = &m_Cells[position & m_Mask];
+				size_t sequence = cell->sequence.load(std::memory_order_acquire);
+				intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+
+				if (difference == 0)
+				{
+					if (m_Tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if (difference < 0)
+					return false;
+				else
+					position = m_Tail.load(std::memory_order_relaxed);
+			}
+
+			cell->value = value;
+			cell->sequence.store(position + 1, std::memory_order_release);
+			return true;
+		}
+
+		// nullptr when it's empty
+		Job* Pop()
+		{
+			size_t position = m_Head.load(std::memory_order_relaxed);
+			Cell* cell;
+
+			for (;;)
+			{
+				cell = &m_Cells[position & m_Mask];
+				size_t sequence = cell->sequence.load(std::memory_order_acquire);
+				intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+
+				if (difference == 0)
+				{
+					if (m_Head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if (difference < 0)
+					return nullptr;
+				else
+					position = m_Head.load(std::memory_order_relaxed);
+			}
+
+			Job* value = cell->value;
+			cell->sequence.store(position + m_Mask + 1, std::memory_order_release);
+			return value;
+		}
+
+	private:
+
+		struct Cell
+		{
+			std::atomic<size_t> sequence;
+			Job* value = nullptr;
+		};
+
+		std::unique_ptr<Cell[]> m_Cells;
+		size_t m_Mask = 0;
+
+		// Apart so pushing and popping don't keep taking the cache line off each other
+		alignas(64) std::atomic<size_t> m_Tail{ 0 };
+		alignas(64) std::atomic<size_t> m_Head{ 0 };
+	};
+
+	// Each on its own cache lines, the counters are written after every job
+	struct alignas(64) VMPool::Worker
+	{
+		explicit Worker(size_t capacity) : queue(capacity) {}
+
+		JobQueue queue;
+
+		std::atomic<uint64_t> completed{ 0 };
+		std::atomic<uint64_t> failed{ 0 };
+		std::atomic<uint64_t> stolen{ 0 };
+
+		// Nanoseconds
+		std::atomic<uint64_t> queueTime{ 0 };
+		std::atomic<uint64_t> maxQueueTime{ 0 };
+		std::atomic<uint64_t> runTime{ 0 };
+	};
+
+	static void PinThread(std::thread& thread, size_t core)
+	{
+#ifdef _WIN32
+		SetThreadAffinityMask(thread.native_handle(), (DWORD_PTR)1 << core);
+#elif defined(__linux__)
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(core, &set);
+		pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#endif
+	}
+
+	static Value ToValue(const PoolValue& value)
+	{
+		switch (value.index())
+		{
+		case 1:		return Value(std::get<bool>(value));
+		case 2:		return Value(std::get<double>(value));
+		case 3:		return Value(CurrentHeap().AllocateString(std::get<std::string>(value)));
+		default:	return Value();
+		}
+	}
+
+	static PoolValue ToPoolValue(Value value)
+	{
+		if (value.IsBool())
+			return value.AsBool();
+
+		if (value.IsNumber())
+			return value.ToNumber();
+
+		if (value.IsObjType(OBJ_STRING))
+		{
+			// Length includes the null terminator
+			ObjString* str = (ObjString*)value.ToObject();
+			return std::string(str->str, str->length - 1);
+		}
+
+		return std::monostate();
+	}
+
+	static uint64_t Nanoseconds(std::chrono::steady_clock::duration duration)
+	{
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+	}
+
+	VMPool::VMPool(const VMPoolCreateInfo& createInfo)
+	{
+		m_Image = CompileImage(createInfo.source, createInfo.level);
+
+		m_VMCreateInfo = createInfo.vmCreateInfo;
+		m_VMCreateInfo.ioInterface = nullptr;
+
+		m_Setup = createInfo.setup;
+		m_PinThreads = createInfo.pinThreads;
+
+		size_t threadCount = createInfo.threadCount;
+		if (threadCount == 0)
+			threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+		for (size_t i = 0; i < threadCount; i++)
+			m_Workers.push_back(std::make_unique<Worker>(createInfo.queueCapacity));
+
+		m_Started = std::chrono::steady_clock::now();
+
+		size_t cores = std::max(1u, std::thread::hardware_concurrency());
+
+		for (size_t i = 0; i < threadCount; i++)
+		{
+			m_Threads.emplace_back(&VMPool::WorkerMain, this, i);
+
+			if (m_PinThreads)
+				PinThread(m_Threads.back(), i % cores);
+		}
+	}
+
+	VMPool::~VMPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_SleepMutex);
+			m_Stopping = true;
+		}
+
+		m_Wake.notify_all();
+
+		for (std::thread& thread : m_Threads)
+			thread.join();
+	}
+
+	std::future<JobResult> VMPool::Submit(std::string function, std::vector<PoolValue> args)
+	{
+		Job* job = new Job;
+		job->function = std::move(function);
+		job->args = std::move(args);
+		job->submitted = std::chrono::steady_clock::now();
+
+		std::future<JobResult> future = job->promise.get_future();
+
+		m_Submitted.fetch_add(1, std::memory_order_relaxed);
+
+		if (!IsReady())
+		{
+			job->promise.set_value({ INTERPRET_COMPILE_ERROR, PoolValue() });
+			delete job;
+			return future;
+		}
+
+		// Counted first so it can't be taken before it's counted
+		m_Pending.fetch_add(1);
+
+		// Round robin to start with, stealing sorts out any imbalance
+		size_t start = m_NextWorker.fetch_add(1, std::memory_order_relaxed);
+		bool pushed = false;
+
+		while (!pushed)
+		{
+			for (size_t i = 0; i < m_Workers.size() && !pushed; i++)
+				pushed = m_Workers[(start + i) % m_Workers.size()]->queue.Push(job);
+
+			if (!pushed)
+				std::this_thread::yield();
+		}
+
+		// The worker counts itself as sleeping before it checks for jobs, so one of the two always sees the other
+		if (m_Sleeping.load() != 0)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_SleepMutex);
+			}
+
+			m_Wake.notify_one();
+		}
+
+		return future;
+	}
+
+	VMPool::Job* VMPool::TakeJob(size_t index)
+	{
+		Worker& worker = *m_Workers[index];
+
+		if (Job* job = worker.queue.Pop())
+		{
+			m_Pending.fetch_sub(1);
+			return job;
+		}
+
+		for (size_t i = 1; i < m_Workers.size(); i++)
+		{
+			if (Job* job = m_Workers[(index + i) % m_Workers.size()]->queue.Pop())
+			{
+				m_Pending.fetch_sub(1);
+				worker.stolen.fetch_add(1, std::memory_order_relaxed);
+				return job;
+			}
+		}
+
+		return nullptr;
+	}
+
+	void VMPool::WorkerMain(size_t index)
+	{
+		Worker& worker = *m_Workers[index];
+
+		// Made here so the VM and everything in its heap stays on this thread
+		VM vm(m_VMCreateInfo);
+
+		if (m_Setup)
+			m_Setup(vm);
+
+		// Without an image the compile error has already been printed, the jobs fail on their own
+		if (m_Image)
+		{
+			ObjFunction* script = InstantiateImage(m_Image);
+
+			if (!script || vm.Interpret(script) != INTERPRET_ALL_GOOD)
+				printf("VM pool worker %zu failed to run the script\n", index);
+		}
+
+		for (;;)
+		{
+			Job* job = TakeJob(index);
+
+			// A job usually turns up soon after the last one, spinning a little saves waking up again
+			for (int spin = 0; spin < 64 && !job; spin++)
+			{
+				std::this_thread::yield();
+				job = TakeJob(index);
+			}
+
+			if (job)
+			{
+				RunJob(worker, vm, job);
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock(m_SleepMutex);
+
+			m_Sleeping.fetch_add(1);
+			m_Wake.wait(lock, [this]() { return m_Pending.load() != 0 || m_Stopping; });
+			m_Sleeping.fetch_sub(1);
+
+			// Everything submitted gets run before the pool goes
+			if (m_Stopping && m_Pending.load() == 0)
+				break;
+		}
+	}
+
+	void VMPool::RunJob(Worker& worker, VM& vm, Job* job)
+	{
+		auto started = std::chrono::steady_clock::now();
+
+		uint64_t queueTime = Nanoseconds(started - job->submitted);
+		worker.queueTime.fetch_add(queueTime, std::memory_order_relaxed);
+
+		// Only this worker writes its max
+		if (queueTime > worker.maxQueueTime.load(std::memory_order_relaxed))
+			worker.maxQueueTime.store(queueTime, std::memory_order_relaxed);
+
+		vm.MakeCurrent();
+
+		std::vector<Value> args;
+		args.reserve(job->args.size());
+
+		for (const PoolValue& arg : job->args)
+			args.push_back(ToValue(arg));
+
+		Value value;
+		JobResult result;
+		result.status = vm.CallFunction(job->function, args.data(), (int)args.size(), &value);
+
+		if (result.status == INTERPRET_ALL_GOOD)
+		{
+			result.value = ToPoolValue(value);
+			worker.completed.fetch_add(1, std::memory_order_relaxed);
+		}
+		else
+		{
+			worker.failed.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		worker.runTime.fetch_add(Nanoseconds(std::chrono::steady_clock::now() - started), std::memory_order_relaxed);
+
+		job->promise.set_value(std::move(result));
+		delete job;
+	}
+
+	VMPoolStats VMPool::GetStats() const
+	{
+		VMPoolStats stats;
+		stats.submitted = m_Submitted.load(std::memory_order_relaxed);
+
+		uint64_t queueTime = 0;
+		uint64_t maxQueueTime = 0;
+		uint64_t runTime = 0;
+
+		for (const std::unique_ptr<Worker>& worker : m_Workers)
+		{
+			stats.completed += worker->completed.load(std::memory_order_relaxed);
+			stats.failed += worker->failed.load(std::memory_order_relaxed);
+			stats.stolen += worker->stolen.load(std::memory_order_relaxed);
+
+			queueTime += worker->queueTime.load(std::memory_order_relaxed);
+			maxQueueTime = std::max(maxQueueTime, worker->maxQueueTime.load(std::memory_order_relaxed));
+			runTime += worker->runTime.load(std::memory_order_relaxed);
+		}
+
+		uint64_t finished = stats.completed + stats.failed;
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_Started).count();
+
+		if (seconds > 0.0)
+			stats.throughput = (double)stats.completed / seconds;
+
+		if (finished > 0)
+		{
+			stats.averageQueueLatency = (double)queueTime / (double)finished * 1e-9;
+			stats.averageRunTime = (double)runTime / (double)finished * 1e-9;
+		}
+
+		stats.maxQueueLatency = (double)maxQueueTime * 1e-9;
+
+		return stats;
+	}
+}
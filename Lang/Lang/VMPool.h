@@ -0,0 +1,136 @@
+#pragma once
+#include "VM.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <variant>
+#include <vector>
+
+// Runs script jobs across a fixed set of worker threads, each with a VM of its own that never leaves it
+// Every VM runs the same script when its worker starts, a job then calls one of the functions it defined by name.
+// Jobs get spread over the workers' queues and a worker that runs out steals from the others,
+// so one slow job only holds up the worker running it.
+//
+//     VMPoolCreateInfo info{};
+//     info.source = "func add(a, b) => a + b;";
+//     VMPool pool(info);
+//     double sum = std::get<double>(pool.Submit("add", { 1.0, 2.0 }).get().value);
+
+namespace script
+{
+	// Values can't cross between VMs so jobs only take and give back these
+	// nil, bool, number and string, anything else a job returns comes back as nil
+	using PoolValue = std::variant<std::monostate, bool, double, std::string>;
+
+	struct JobResult
+	{
+		InterpretResult status = INTERPRET_ALL_GOOD;
+		PoolValue value;
+	};
+
+	struct VMPoolCreateInfo
+	{
+		// Every VM is made with this, the io interface has to be left null as each VM deletes its own
+		VMCreateInfo vmCreateInfo;
+
+		// Zero is one per core
+		uint32_t threadCount = 0;
+
+		// Keeps each worker on a core of its own where the OS lets us
+		bool pinThreads = true;
+
+		// Jobs each worker can have waiting, rounded up to a power of two
+		// Submit waits for room once every queue is full
+		uint32_t queueCapacity = 1024;
+
+		// Run by each worker before the script, eg. to add natives
+		std::function<void(VM&)> setup;
+
+		// The script every VM runs, it's compiled once and shared by all of them
+		std::string source;
+		OptimizationLevel level = DefaultOptimizationLevel;
+	};
+
+	struct VMPoolStats
+	{
+		uint64_t submitted = 0;
+		uint64_t completed = 0;
+		uint64_t failed = 0;
+
+		// Jobs a worker took from another's queue
+		uint64_t stolen = 0;
+
+		// Completed jobs per second since the pool started
+		double throughput = 0.0;
+
+		// Seconds between a job being submitted and a worker starting it
+		double averageQueueLatency = 0.0;
+		double maxQueueLatency = 0.0;
+
+		// Seconds spent running jobs
+		double averageRunTime = 0.0;
+	};
+
+	class VMPool
+	{
+	public:
+
+		explicit VMPool(const VMPoolCreateInfo& createInfo);
+
+		// Finishes every job that has been submitted first
+		~VMPool();
+
+		VMPool(const VMPool&) = delete;
+		void operator=(const VMPool&) = delete;
+
+		// False if the script failed to compile, every job fails straight away
+		bool IsReady() const { return m_Image != nullptr; }
+
+		size_t GetWorkerCount() const { return m_Workers.size(); }
+
+		// Calls a global function of the script on whichever worker gets to it first
+		std::future<JobResult> Submit(std::string function, std::vector<PoolValue> args = {});
+
+		VMPoolStats GetStats() const;
+
+	private:
+
+		struct Job;
+		class JobQueue;
+		struct Worker;
+
+		void WorkerMain(size_t index);
+
+		// From the worker's own queue first, then from the others
+		Job* TakeJob(size_t index);
+
+		void RunJob(Worker& worker, VM& vm, Job* job);
+
+		std::shared_ptr<const BytecodeImage> m_Image;
+		VMCreateInfo m_VMCreateInfo;
+		std::function<void(VM&)> m_Setup;
+		bool m_PinThreads;
+
+		std::vector<std::unique_ptr<Worker>> m_Workers;
+		std::vector<std::thread> m_Threads;
+
+		std::atomic<size_t> m_NextWorker{ 0 };
+		std::atomic<uint64_t> m_Submitted{ 0 };
+
+		// Idle workers sleep here, the queues themselves never lock
+		std::atomic<size_t> m_Pending{ 0 };
+		std::atomic<size_t> m_Sleeping{ 0 };
+		std::atomic<bool> m_Stopping{ false };
+		std::mutex m_SleepMutex;
+		std::condition_variable m_Wake;
+
+		std::chrono::steady_clock::time_point m_Started;
+	};
+}
@@ -18,10 +18,12 @@
 #define TAG_NIL   1
 #define TAG_FALSE 2
 #define TAG_TRUE  3 
+#define TAG_UNDEFINED 4
 
 #define NIL_VAL         ((uint64_t)(QNAN | TAG_NIL))
 #define FALSE_VAL       ((uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL        ((uint64_t)(QNAN | TAG_TRUE))
+#define UNDEFINED_VAL   ((uint64_t)(QNAN | TAG_UNDEFINED))
 
 #define BOOL_VAL(b)     ((b) ? TRUE_VAL : FALSE_VAL)
 
@@ -57,6 +59,9 @@ namespace script
 		VALUE_OBJ,
 		VALUE_TRUE,
 		VALUE_FALSE,
+
+		// Only used internally to mark global slots that haven't been defined yet
+		VALUE_UNDEFINED,
 	};
 
 	class VM;
@@ -146,6 +151,19 @@ namespace script
 #endif
 		}
 
+		// Marks a global slot that has been linked to but not defined
+		// This should never end up on the stack
+		static Value Undefined()
+		{
+			Value value;
+#ifdef NAN_BOXING
+			value.value = UNDEFINED_VAL;
+#else
+			value.type = VALUE_UNDEFINED;
+#endif
+			return value;
+		}
+
 		// Type Checkers
 
 		const bool IsNil() const
@@ -160,6 +178,17 @@ namespace script
 		}
 
 
+		const bool IsUndefined() const
+		{
+#ifdef NAN_BOXING
+
+			return value == UNDEFINED_VAL;
+
+#else
+			return type == VALUE_UNDEFINED;
+#endif
+		}
+
 		const bool IsBool() const
 		{
 #ifdef NAN_BOXING
@@ -633,4 +662,8 @@ namespace script
 	}
 
 
-}
\ No newline at end of file
+	inline Value ObjNative::Call(int argCount, Value* args)
+	{
+		return function(context, argCount, args);
+	}
+}
@@ -81,6 +81,10 @@ test.print(23);
 
 
 
+    script::VMCreateInfo createInfo{};
+
+	script::VM vm(createInfo);
+
 	script::ObjFunction* function = script::CompileScript(benchmark);
 
 	if (function == nullptr)
@@ -89,11 +93,6 @@ test.print(23);
 		return 1;
 	}
 
-    script::VMCreateInfo createInfo{};
-
-	script::VM vm(createInfo);
-
-
 
 	script::InterpretResult result = vm.Interpret(function);
 
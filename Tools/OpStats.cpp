@@ -0,0 +1,124 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include <Lang/Compiler.h>
+#include <Lang/Memory.h>
+#include <Lang/Value.h>
+
+// Compiles scripts and reports the most common pairs of adjacent instructions
+// This is what we look at to decide which sequences are worth a superinstruction
+// Usage: LangOpStats [-n count] file.lang ...
+
+using OpPair = std::pair<uint8_t, uint8_t>;
+
+static void CountFunction(script::ObjFunction* function, std::map<OpPair, size_t>& pairs, std::map<uint8_t, size_t>& singles)
+{
+    script::Chunk& chunk = function->chunk;
+
+    int previous = -1;
+
+    for (size_t offset = 0; offset < chunk.code.size(); offset += script::GetInstructionLength(chunk.code[offset]))
+    {
+        uint8_t instruction = chunk.code[offset];
+
+        singles[instruction]++;
+
+        if (previous != -1)
+            pairs[{ (uint8_t)previous, instruction }]++;
+
+        previous = instruction;
+    }
+
+    // Functions and methods are stored as constants
+    for (script::Value& constant : chunk.constants)
+    {
+        if (constant.IsObjType(script::OBJ_FUNCTION))
+            CountFunction((script::ObjFunction*)constant.ToObject(), pairs, singles);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    size_t count = 20;
+    std::vector<std::string> files;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            count = (size_t)atoi(argv[++i]);
+        else
+            files.push_back(argv[i]);
+    }
+
+    if (files.empty())
+    {
+        printf("Usage: LangOpStats [-n count] file.lang ...\n");
+        return 0;
+    }
+
+    // Nothing runs so the compiled functions just need somewhere to live
+    script::MemoryManager heap;
+    heap.MakeCurrent();
+
+    std::map<OpPair, size_t> pairs;
+    std::map<uint8_t, size_t> singles;
+
+    for (const std::string& filepath : files)
+    {
+        std::ifstream file(filepath);
+
+        if (!file.is_open())
+        {
+            printf("Failed to open file: %s\n", filepath.c_str());
+            return 1;
+        }
+
+        std::stringstream stream;
+        stream << file.rdbuf();
+
+        script::ObjFunction* function = script::CompileScript(stream.str());
+
+        if (function == nullptr)
+        {
+            // Keep going so one broken script doesn't stop the report
+            printf("Compiler Error in %s, skipping\n", filepath.c_str());
+            continue;
+        }
+
+        CountFunction(function, pairs, singles);
+    }
+
+    size_t totalPairs = 0;
+    for (auto& [pair, n] : pairs)
+        totalPairs += n;
+
+    std::vector<std::pair<OpPair, size_t>> sorted(pairs.begin(), pairs.end());
+    std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) { return a.second > b.second; });
+
+    printf("Most frequent opcode pairs (%zu pairs in %zu files):\n", totalPairs, files.size());
+
+    for (size_t i = 0; i < sorted.size() && i < count; i++)
+    {
+        const OpPair& pair = sorted[i].first;
+        double percent = (double)sorted[i].second / (double)totalPairs * 100.0;
+
+        printf("%6zu  %5.2f%%  %s -> %s\n", sorted[i].second, percent, script::GetOpCodeName(pair.first), script::GetOpCodeName(pair.second));
+    }
+
+    std::vector<std::pair<uint8_t, size_t>> sortedSingles(singles.begin(), singles.end());
+    std::sort(sortedSingles.begin(), sortedSingles.end(), [](const auto& a, const auto& b) { return a.second > b.second; });
+
+    printf("\nMost frequent opcodes:\n");
+
+    for (size_t i = 0; i < sortedSingles.size() && i < count; i++)
+        printf("%6zu  %s\n", sortedSingles[i].second, script::GetOpCodeName(sortedSingles[i].first));
+
+    return 0;
+}
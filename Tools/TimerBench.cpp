@@ -0,0 +1,240 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <set>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <Lang/Compiler.h>
+#include <Lang/VM.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+
+// Measures how late timers fire while the VM is busy
+// Thousands of timers go off at random times over the run, each one runs a fiber that does some script work,
+// and a thread keeps writing to a set of pipes the VM is also watching.
+// The timers queue fibers the way queue_timer does, a tenth as many host callbacks go off alongside them and some of
+// the fibers get cancelled straight away.
+// Timer latency is how long after its deadline a callback ran, fiber latency is how long after it a fiber started
+// With -b a script keeps the VM busy for that long before it goes to the event loop, the timers that come due
+// in the meantime only get seen by polling at its safepoints
+// Usage: LangTimerBench [-t timers] [-d max delay ms] [-w work per fiber] [-f busy descriptors] [-c percent cancelled]
+//                       [-b busy script ms]
+
+using Clock = std::chrono::steady_clock;
+
+static const char* source = R"(
+
+import "std:time" as time;
+
+func work(n) {
+    var total = 0;
+    for (var i in 0..n) {
+        total = total + i;
+    }
+    return total;
+}
+
+func tick() {
+    fired();
+    work(load);
+}
+
+func spin(ms) {
+    var until = time.now() + ms / 1000;
+    var spins = 0;
+    while (time.now() < until) {
+        spins = spins + 1;
+    }
+    return spins;
+}
+
+)";
+
+struct BenchState
+{
+    // Fibers run in the order their timers went off, so each one takes the earliest deadline left
+    std::multiset<Clock::time_point> deadlines;
+
+    std::vector<double> timerLatency;
+    std::vector<double> fiberLatency;
+
+    size_t descriptorEvents = 0;
+};
+
+static double Microseconds(Clock::duration duration)
+{
+    return std::chrono::duration<double, std::micro>(duration).count();
+}
+
+static script::Value Fired(void* context, int argCount, script::Value* args)
+{
+    BenchState* state = (BenchState*)context;
+
+    state->fiberLatency.push_back(Microseconds(Clock::now() - *state->deadlines.begin()));
+    state->deadlines.erase(state->deadlines.begin());
+
+    return script::Value();
+}
+
+static void Report(const char* name, std::vector<double>& samples)
+{
+    if (samples.empty())
+    {
+        printf("%-16s no samples\n", name);
+        return;
+    }
+
+    std::sort(samples.begin(), samples.end());
+
+    double total = 0.0;
+    for (double sample : samples)
+        total += sample;
+
+    auto percentile = [&](double p) { return samples[std::min(samples.size() - 1, (size_t)(p * samples.size()))]; };
+
+    printf("%-16s mean %9.1f us   p50 %9.1f us   p99 %9.1f us   max %9.1f us\n", name,
+        total / samples.size(), percentile(0.50), percentile(0.99), samples.back());
+}
+
+int main(int argc, char* argv[])
+{
+    size_t timers = 5000;
+    uint64_t maxDelay = 1000;
+    double work = 200;
+    size_t descriptors = 64;
+    size_t cancelled = 10;
+    double busy = 0;
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        if (strcmp(argv[i], "-t") == 0)
+            timers = (size_t)atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-d") == 0)
+            maxDelay = (uint64_t)atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-w") == 0)
+            work = atof(argv[i + 1]);
+        else if (strcmp(argv[i], "-f") == 0)
+            descriptors = (size_t)atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-c") == 0)
+            cancelled = (size_t)atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-b") == 0)
+            busy = atof(argv[i + 1]);
+    }
+
+    BenchState state;
+    state.timerLatency.reserve(timers);
+    state.fiberLatency.reserve(timers);
+
+    script::VM vm;
+    vm.AddNativeFunction("fired", &Fired, 0, &state);
+    vm["load"] = script::Value(work);
+
+    // Only defines the functions
+    vm.MakeCurrent();
+    if (vm.Interpret(script::CompileScript(source)) != script::INTERPRET_ALL_GOOD)
+        return 1;
+
+    script::ObjFunction* tick = (script::ObjFunction*)vm.GetGlobal("tick")->ToObject();
+
+    // Pipes something else keeps writing to, the loop has to handle these in between the timers
+    std::vector<int> pipes;
+    std::atomic<bool> done{ false };
+    std::thread writer;
+
+#ifdef __linux__
+    for (size_t i = 0; i < descriptors; i++)
+    {
+        int ends[2];
+        if (pipe(ends) != 0)
+            break;
+
+        pipes.push_back(ends[1]);
+
+        int readEnd = ends[0];
+
+        // They don't keep the loop alive, it finishes once the timers have
+        vm.GetEventManager().Watch(readEnd, EPOLLIN, [&state, readEnd](uint32_t events) {
+            char buffer[256];
+            ssize_t read = ::read(readEnd, buffer, sizeof(buffer));
+            (void)read;
+            state.descriptorEvents++;
+        }, false);
+    }
+
+    writer = std::thread([&]() {
+        std::mt19937 random(7);
+        char byte = 1;
+
+        while (!done.load() && !pipes.empty())
+        {
+            ssize_t written = write(pipes[random() % pipes.size()], &byte, 1);
+            (void)written;
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    });
+#endif
+
+    std::mt19937 random(42);
+    std::uniform_int_distribution<uint64_t> delays(1, maxDelay);
+
+    script::Timer& timer = vm.GetTimer();
+    size_t cancels = 0;
+
+    for (size_t i = 0; i < timers; i++)
+    {
+        uint64_t delay = delays(random);
+        Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(delay);
+
+        if (i % 10 == 0)
+        {
+            timer.StartTimer(delay, [&state, deadline]() {
+                state.timerLatency.push_back(Microseconds(Clock::now() - deadline));
+            });
+        }
+
+        script::TimerID id = timer.QueueFiber(delay, tick);
+
+        if (random() % 100 < cancelled && timer.CancelTimer(id))
+            cancels++;
+        else
+            state.deadlines.insert(deadline);
+    }
+
+    Clock::time_point started = Clock::now();
+    script::InterpretResult result = script::INTERPRET_ALL_GOOD;
+
+    if (busy > 0)
+    {
+        script::Value ms(busy);
+        result = vm.CallFunction("spin", &ms, 1);
+    }
+
+    if (result == script::INTERPRET_ALL_GOOD)
+        result = vm.RunEvents();
+    double elapsed = Microseconds(Clock::now() - started) * 1e-6;
+
+    done = true;
+
+    if (writer.joinable())
+        writer.join();
+
+    printf("%zu timers over %llu ms, %g iterations of work per fiber, %zu busy descriptors\n",
+        timers, (unsigned long long)maxDelay, work, pipes.size());
+    printf("Ran for %.3f s, %zu timers cancelled, %zu descriptor events handled\n", elapsed, cancels, state.descriptorEvents);
+
+    if (busy > 0)
+        printf("A script kept the VM busy for the first %g ms\n", busy);
+
+    Report("Timer latency", state.timerLatency);
+    Report("Fiber latency", state.fiberLatency);
+
+    return result == script::INTERPRET_ALL_GOOD ? 0 : 1;
+}